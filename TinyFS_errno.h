@@ -27,4 +27,9 @@
 #define ERR_FS_NAME -17
 #define ERR_BUF -18
 #define ERR_FS_FULL -19
+#define ERR_FILE_TOO_BIG -20
+#define ERR_IS_DIR -21
+#define ERR_NOT_DIR -22
+#define ERR_DIR_NOT_EMPTY -23
+#define ERR_NOT_SUPPORTED -24
 #endif
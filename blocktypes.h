@@ -8,18 +8,56 @@
 #include <stdint.h>
 
 #define INODE_INITIAL_FLAGS 1 //Maybe something like USED
+#define INODE_MAPPED 0x2 //blk_start is the first index block, not an extent chain
+#define INODE_SYSTEM 0x4 //internal file (the refcount table), not listed or opened by name
+#define INODE_DIR 0x8 //directory: blk_start is the root of its entry B-tree, size_B the entry count
 #define SUPERBLOCK_BLOCK 0
 #define ROOT_INODE_BLOCK 1
 #define MAGIC 0x44
-#define SB_E (256 - 1 - 1 - 4 - 4) 
-#define IN_E (256 - 1 - 1 - 9 - 4 - 4 - 1)
-#define EX_E (256 - 1 - 1 - 4)
+#define SB_E (256 - 1 - 1 - 4 - 4 - 4 - 4 - 4 - 4 - 4 - 4 - 4 - 4 - 4)
+#define IN_E (256 - 1 - 1 - 9 - 4 - 4 - 1 - 4)
+//the compiler pads 2 bytes in front of blk_next, data has to fit behind that
+#define EX_E (256 - 1 - 1 - 2 - 4)
 #define FR_E (256 - 1 - 1 - 4)
+//block numbers per index block, after the header and the padding before blk_next
+#define IX_E ((256 - 1 - 1 - 2 - 4 - 4) / 4)
+//uint16 reference counts per block of the refcount table
+#define REF_PER_BLOCK (EX_E / 2)
+//free space bitmap, bits per bitmap block after its 2 byte header
+#define BM_E (256 - 1 - 1)
+#define BM_BITS (BM_E * 8)
+//directory B-tree nodes hold DN_MIN to DN_MAX entries (the root can have fewer)
+#define DN_MAX 15
+#define DN_MIN 7
+//on disk format version, images made before it was recorded have 0. code
+//leaves images with a newer version alone
+#define TFS_VERSION 1
+//superblock feature bits, images made before these existed have 0 here.
+//features holds the incompatible ones: code that doesn't know one of them
+//can't use the image at all. compat_features holds the ones it can safely
+//ignore (none so far)
+#define TFS_FEAT_SIZE64 0x1	//inode size_hi holds the upper 32 bits of the file size
+#define TFS_FEAT_LAZYFREE 0x2	//blocks from free_lazy up were never handed out, all free
+#define TFS_FEAT_BLOCKMAP 0x4	//some inodes are INODE_MAPPED (sparse files)
+#define TFS_FEAT_REFCOUNT 0x8	//blocks can be shared by clones, counts in the refcount_inode file
+#define TFS_FEAT_BITMAP 0x10	//free space is a bitmap instead of a chain, free blocks have no header
+#define TFS_FEAT_DIRS 0x20	//the root is an INODE_DIR, every inode is found through a directory
+#define TFS_FEAT_LOG 0x40	//new blocks are appended at a moving log head (needs BITMAP)
+#define TFS_FEAT_UNWRITTEN 0x80	//block maps can hold reserved, unwritten blocks (see index_disk)
+#define TFS_FEAT_ALL (TFS_FEAT_SIZE64 | TFS_FEAT_LAZYFREE | TFS_FEAT_BLOCKMAP | TFS_FEAT_REFCOUNT | \
+		      TFS_FEAT_BITMAP | TFS_FEAT_DIRS | TFS_FEAT_LOG | TFS_FEAT_UNWRITTEN)
+#define TFS_COMPAT_ALL 0	//compat_features bits, none defined yet
+//1 if this code can use the image with superblock *sb
+#define TFS_SB_SUPPORTED(sb) ((sb)->version <= TFS_VERSION && !((sb)->features & ~TFS_FEAT_ALL))
+
 typedef enum {
 	SUPERBLOCK = 1,
 	INODE = 2,
 	FILEEXTENT = 3,
-	FREE = 4
+	FREE = 4,
+	INDEX = 5,
+	BITMAP = 6,
+	DIRNODE = 7
 } blocktype;
 
 typedef struct superblock_disk {
@@ -27,7 +65,16 @@ typedef struct superblock_disk {
 	uint8_t magic;		// byte 1	: MAGIC (0x44)
 	int32_t root_inode;	// byte 2:5	: root inode of fs
 	int32_t free_block;	// byte 6:9	: block # of first free index
-	uint8_t empty[SB_E];	// byte 10:255 : reserved
+	uint32_t features;	// TFS_FEAT_* bits
+	int32_t nblocks;	// blocks in the fs (0 = whole disk, older images)
+	int32_t free_lazy;	// LAZYFREE: first block never handed out
+	int32_t refcount_inode;	// REFCOUNT: inode of the block reference count table
+	int32_t bitmap_start;	// BITMAP: first block of the free space bitmap
+	int32_t bitmap_blocks;	// BITMAP: its length in blocks
+	int32_t log_head;	// LOG: the log head as of the last checkpoint
+	int32_t version;	// TFS_VERSION of the code that made or upgraded it
+	uint32_t compat_features;// TFS_COMPAT_* bits
+	uint8_t empty[SB_E];	// reserved
 } superblock_disk;
 
 typedef struct inode_disk{
@@ -43,16 +90,60 @@ typedef struct inode_disk{
 	int32_t mtime;
 	int32_t atime;
 
+	int32_t size_hi;	// TFS_FEAT_SIZE64: upper half of the size, size_B is the lower
+
 	uint8_t empty[IN_E];
 } inode_disk; 
 
 typedef struct fileextent_disk {
 	uint8_t blocktype;	//byte 0 	: FILEEXTENT (3)
 	uint8_t magic;		//byte 1	: MAGIC 0x44
-	uint32_t blk_next; 	//byte 2-5	: BLOCK of next data (0 = nothing)
-	uint8_t data[EX_E];	//byte 6-255	: DATA 
+	uint32_t blk_next; 	//byte 4-7	: BLOCK of next data (0 = nothing)
+	uint8_t data[EX_E];	//byte 8-255	: DATA 
 } fileextent_disk;
 
+//block map of an INODE_MAPPED file. the index blocks form a chain sorted by
+//base, index blocks that would only hold holes are left out of it.
+//blk[i] holds file block base + i, 0 is a hole that reads back as zeros.
+//-b is block b reserved by tfs_fallocate but not written yet, it reads back
+//as zeros too and whatever is in it isn't looked at.
+//the data blocks are ordinary extents whose blk_next isn't used
+typedef struct index_disk {
+	uint8_t blocktype;	//byte 0	: INDEX (5)
+	uint8_t magic;		//byte 1	: MAGIC 0x44
+	int32_t blk_next;	//byte 4-7	: BLOCK of the next index block (0 = nothing)
+	int32_t base;		//byte 8-11	: first file block (EX_E bytes each) this covers
+	int32_t blk[IX_E];	//byte 12-255	: data blocks
+} index_disk;
+
+//one block of the free space bitmap (TFS_FEAT_BITMAP images). bit b % BM_BITS
+//of bitmap block b / BM_BITS is set while block b is in use. bitmap blocks
+//that would only hold zero bits can be left unwritten, a block without the
+//header reads as all free. bits from free_lazy up are always clear
+typedef struct bitmap_disk {
+	uint8_t blocktype;	//byte 0	: BITMAP (6)
+	uint8_t magic;		//byte 1	: MAGIC 0x44
+	uint8_t bits[BM_E];	//byte 2-255	: one bit per block, lowest bit first
+} bitmap_disk;
+
+//one node of a directory's B-tree. ent[] is sorted by name, child[i] holds
+//the names between ent[i-1] and ent[i]. leaves have no children
+typedef struct dir_entry {
+	char name[8];		//not terminated when it is 8 chars long
+	int32_t inode;
+} dir_entry;
+
+typedef struct dirnode_disk {
+	uint8_t blocktype;	//byte 0	: DIRNODE (7)
+	uint8_t magic;		//byte 1	: MAGIC 0x44
+	uint8_t leaf;		//byte 2	: 1 if child[] isn't used
+	uint8_t pad;
+	int32_t count;		//byte 4-7	: entries in ent[]
+	dir_entry ent[DN_MAX];	//byte 8-187
+	int32_t child[DN_MAX + 1];//byte 188-251
+	uint8_t empty[4];
+} dirnode_disk;
+
 typedef struct free_disk {
 	uint8_t blocktype; 	//byte 0	: FREE (4)
 	uint8_t magic;		//byte 1 	: MAGIC
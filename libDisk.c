@@ -4,7 +4,10 @@
 *
 */
 
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include "libDisk.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
@@ -12,20 +15,127 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <limits.h>
 
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+//first size of the disk table, it doubles whenever it fills up
 #define ALLOC_DISKS 10
+//most images one volume can be made of
+#define VOL_MAX 16
+//transfers at least this many blocks long run on every member at once
+#define VOL_PARALLEL 256
 
 typedef struct {
 	uint8_t flags; // (literally for now this can just be a 1 if used
-	int nBytes;
+	off_t nBytes;
 	int fd;
 	int nBlocks; //should map cleanly but from what I read good practice 
+	int direct; //opened with O_DIRECT, all I/O goes through direct_io
+	int tailfd; //direct: buffered fd for the part past the last whole aligned unit
+	off_t directEnd; //direct: where that part starts
+	int nMembers; //volume: how many images it spreads over, 0 for a plain image
+	int members[VOL_MAX]; //volume: their disk numbers
+	int unit; //stripe: blocks in a row on one member before the next takes over
+	int mirror; //volume: every member holds every block
+	int failed[VOL_MAX]; //mirror: members left out until diskResync, -1 in members[] if it never opened
+	int inflight[VOL_MAX]; //mirror: reads running on each member right now
+	int64_t latency[VOL_MAX]; //mirror: recent read time of each member in ns, a moving average
+	char *names; //mirror: the descriptor's image names, name[] points into it
+	char *name[VOL_MAX];
+	int openFlags; //mirror: what diskResync reopens a member with
+	uint64_t epoch; //mirror: what the working members' trailers say, see mirror_epoch
+	int stale; //mirror: a member was dropped since the epoch last moved on
+	struct wb_cache *wb; //DISK_WRITEBACK: dirty blocks waiting to go out, NULL without
 } disk_entry;
 
-static disk_entry disks[ALLOC_DISKS] = {0};
+//one contiguous piece of a volume transfer on one member
+typedef struct vol_piece {
+	int bNum;	//on the member
+	int nBlocks;
+	char *buf;
+} vol_piece;
+
+//everything one member does for a volume transfer
+typedef struct vol_job {
+	int disk;
+	int write_io;
+	vol_piece *pieces;
+	int nPieces;
+	int rc;
+} vol_job;
+
+//copies a mirror's blocks in this many at a time when it resyncs a member
+#define RESYNC_CHUNK 1024
+//a mirror member's epoch sits in a trailer just past its last whole block,
+//where nothing that sizes the image in blocks sees it. "TFSM"
+#define MIRROR_MAGIC 0x4d534654
+typedef struct mirror_trailer {
+	uint32_t magic;
+	uint32_t pad;
+	uint64_t epoch;
+} mirror_trailer;
+//mirror_write moves the epoch on under this, once per dropped member
+static pthread_mutex_t epochLock = PTHREAD_MUTEX_INITIALIZER;
+
+//O_DIRECT wants the buffer, offset and length aligned to the device's logical
+//block size. 4096 covers both 512 byte and 4K sector devices
+#define DIRECT_ALIGN 4096
+//size of one pool buffer, the most a single direct transfer moves
+#define DIRECT_BUF (64 * 1024)
+//host page size discardBlocks() works in
+#define DISCARD_ALIGN 4096
+
+//aligned buffers are kept around once allocated, the pool is shared by every
+//direct disk and by the threads fsck runs on one
+typedef struct pool_buf {
+	struct pool_buf *next;
+} pool_buf;
+static pool_buf *poolFree = NULL;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+//DISK_WRITEBACK: writes land in a table of up to WB_BLOCKS dirty blocks and a
+//flusher thread per disk takes them to the image in block order, runs of
+//neighbours in one transfer. it goes when the oldest has been dirty
+//expireMs, or for everything once dirtyPct of the table is used. a writer
+//that finds the table full flushes it itself
+#define WB_BLOCKS 4096
+#define WB_BUCKETS 4096
+#define WB_EXPIRE_MS 3000
+#define WB_DIRTY_PCT 50
+typedef struct wb_entry {
+	int bNum;	//-1 when unused
+	int next;	//hash chain, or the free list
+	uint32_t seq;	//bumped on every write, a flush only retires the entry if it didn't move
+	int64_t dirtied;	//ms, when it went from clean to dirty
+} wb_entry;
+typedef struct wb_cache {
+	pthread_mutex_t lock;	//the table, held across reads that miss it too
+	pthread_mutex_t flushLock;	//one flush at a time, so an older copy never lands after a newer one
+	pthread_cond_t wake;
+	pthread_t thread;
+	int stop;
+	int expireMs;
+	int dirtyPct;
+	int count;
+	int freeList;
+	int err;	//failed background write, the next diskSync/closeDisk returns it
+	int head[WB_BUCKETS];
+	wb_entry ent[WB_BLOCKS];
+	char data[WB_BLOCKS][BLOCKSIZE];
+} wb_cache;
+
+static disk_entry *disks = NULL;
+static int nDisks = 0;
+//the flushers use disks[] on their own threads, growing it moves it
+static pthread_rwlock_t tableLock = PTHREAD_RWLOCK_INITIALIZER;
+//lowest slot that might be free, so opening doesn't rescan the used ones
+static int freeHint = 0;
 
 static int isOpen(int disk) {
-	if(disk >= 0 && disk < ALLOC_DISKS && disks[disk].flags) {
+	if(disk >= 0 && disk < nDisks && disks[disk].flags) {
 		return 1;
 	}else{
 		return 0;
@@ -34,19 +144,182 @@ static int isOpen(int disk) {
 
 // not part of the api, used interally
 static int next_free_disk() {
-	for(int i = 0; i < ALLOC_DISKS; i++) {
-		//loop thru all the structs, its ok that they arent initialized.
+	for(int i = freeHint; i < nDisks; i++) {
 		if( disks[i].flags == 0 ) { 
 			//flags == 0 guarantees not in use, this might change.
 			return i;			
 		}	
 	}
-	//no disk available
-	return DISK_ALLOC_ERROR;
+	//table full, grow it
+	int ncap = nDisks ? nDisks * 2 : ALLOC_DISKS;
+	pthread_rwlock_wrlock(&tableLock);
+	disk_entry *nd = realloc(disks, ncap * sizeof(disk_entry));
+	if(!nd) {
+		pthread_rwlock_unlock(&tableLock);
+		return DISK_ALLOC_ERROR;
+	}
+	memset(nd + nDisks, 0, (ncap - nDisks) * sizeof(disk_entry));
+	disks = nd;
+	int i = nDisks;
+	nDisks = ncap;
+	pthread_rwlock_unlock(&tableLock);
+	return i;
 } 
 
+//loops pread/pwrite until len bytes moved, short reads happen on big requests
+static int full_io(int fd, char *buf, size_t len, off_t offset, int write_io) {
+	while(len > 0) {
+		ssize_t n = write_io ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return DISK_IO_ERR;
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//opens the image, with O_DIRECT when DISK_DIRECT is asked for. filesystems
+//that can't do direct I/O (tmpfs) refuse it, the disk is opened buffered then
+static int open_image(char *filename, int oflags, int flags) {
+	int fd = -1;
+	if(flags & DISK_DIRECT) {
+		fd = open(filename, O_RDWR | O_DIRECT | oflags, 0666);
+		if(fd >= 0 || errno != EINVAL) return fd;
+	}
+	return open(filename, O_RDWR | oflags, 0666); //0 666 octal is default for files
+}
+
+static int is_direct(int fd) {
+	int fl = fcntl(fd, F_GETFL);
+	return fl >= 0 && (fl & O_DIRECT);
+}
+
+static void *pool_get(void) {
+	pthread_mutex_lock(&poolLock);
+	pool_buf *b = poolFree;
+	if(b) poolFree = b->next;
+	pthread_mutex_unlock(&poolLock);
+	if(b) return b;
+	void *p = NULL;
+	if(posix_memalign(&p, DIRECT_ALIGN, DIRECT_BUF) != 0) return NULL;
+	return p;
+}
+
+static void pool_put(void *p) {
+	pool_buf *b = p;
+	pthread_mutex_lock(&poolLock);
+	b->next = poolFree;
+	poolFree = b;
+	pthread_mutex_unlock(&poolLock);
+}
+
+//moves len bytes at offset on a direct disk. requests are widened to whole
+//aligned units and go through a pool buffer, a run of blocks is one transfer
+//per DIRECT_BUF. writes only read back the partial unit at either end.
+//callers that are already aligned skip the copy. the image isn't padded to a
+//whole unit (a later open would see a bigger disk), so whatever is past the
+//last whole unit goes through the buffered tailfd
+static int direct_io(disk_entry *d, char *buf, size_t len, off_t offset, int write_io) {
+	if(offset + (off_t)len > d->directEnd) {
+		size_t over = offset >= d->directEnd ? len : (size_t)(offset + len - d->directEnd);
+		int rc = full_io(d->tailfd, buf + len - over, over, offset + len - over, write_io);
+		if(rc != 0 || over == len) return rc;
+		len -= over;
+	}
+	int fd = d->fd;
+	if((((uintptr_t)buf | (uintptr_t)offset | len) & (DIRECT_ALIGN - 1)) == 0) {
+		return full_io(fd, buf, len, offset, write_io);
+	}
+	char *pb = pool_get();
+	if(!pb) return DISK_IO_ERR;
+	int rc = 0;
+	while(len > 0 && rc == 0) {
+		off_t start = offset - (offset % DIRECT_ALIGN);
+		size_t head = offset - start;
+		size_t take = DIRECT_BUF - head;
+		if(take > len) take = len;
+		size_t span = (head + take + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+		if(!write_io) {
+			rc = full_io(fd, pb, span, start, 0);
+			if(rc == 0) memcpy(buf, pb + head, take);
+		}else{
+			if(head != 0) {
+				rc = full_io(fd, pb, DIRECT_ALIGN, start, 0);
+			}
+			size_t tail = span - DIRECT_ALIGN;
+			if(rc == 0 && (head + take) % DIRECT_ALIGN != 0 && (tail != 0 || head == 0)) {
+				rc = full_io(fd, pb + tail, DIRECT_ALIGN, start + tail, 0);
+			}
+			if(rc == 0) {
+				memcpy(pb + head, buf, take);
+				rc = full_io(fd, pb, span, start, 1);
+			}
+		}
+		buf += take;
+		offset += take;
+		len -= take;
+	}
+	pool_put(pb);
+	return rc;
+}
+
+//a direct disk also gets a buffered fd for its unaligned tail
+static int direct_setup(disk_entry *d, char *filename) {
+	d->direct = is_direct(d->fd);
+	d->tailfd = -1;
+	if(!d->direct) return 0;
+	d->directEnd = d->nBytes - d->nBytes % DIRECT_ALIGN;
+	if(d->directEnd == d->nBytes) return 0;
+	d->tailfd = open(filename, O_RDWR);
+	if(d->tailfd < 0) {
+		d->flags = 0;
+		return -1;
+	}
+	return 0;
+}
+
+//every transfer in here goes through this so direct disks get aligned I/O
+static int disk_io(int disk, void *buf, size_t len, off_t offset, int write_io) {
+	if(disks[disk].direct) return direct_io(&disks[disk], buf, len, offset, write_io);
+	return full_io(disks[disk].fd, buf, len, offset, write_io);
+}
+
+static int vol_io(int disk, int bNum, int nBlocks, char *buf, int write_io);
+static int vol_open(char *spec, int64_t nBytes, int flags);
+static int mirror_open(char *spec, int64_t nBytes, int flags);
+static int mirror_read(int disk, int bNum, int nBlocks, char *buf);
+static int mirror_write(int disk, int bNum, int nBlocks, char *buf);
+static int open_any(char *filename, int64_t nBytes, int flags);
+static int wb_start(int disk);
+static int wb_stop(int disk);
+static int wb_read(int disk, int bNum, int nBlocks, char *buf);
+static int wb_write(int disk, int bNum, int nBlocks, char *buf);
+static void wb_discard(int disk, int bNum, int nBlocks);
+
 int openDisk(char *filename, int nBytes) {
-	int bs = nBytes;
+	return openDisk64(filename, nBytes);
+}
+
+int openDisk64(char *filename, int64_t nBytes) {
+	return openDiskEx(filename, nBytes, 0);
+}
+
+int openDiskEx(char *filename, int64_t nBytes, int flags) {
+	//the members of a volume are written through, the cache is the volume's
+	int disk = open_any(filename, nBytes, flags & ~DISK_WRITEBACK);
+	if(disk >= 0 && (flags & DISK_WRITEBACK) && wb_start(disk) < 0) {
+		closeDisk(disk);
+		return DISK_ALLOC_ERROR;
+	}
+	return disk;
+}
+
+static int open_any(char *filename, int64_t nBytes, int flags) {
+	if(!filename) return OPEN_DISK_PARAM_ERR;
+	if(strncmp(filename, "stripe:", 7) == 0) return vol_open(filename + 7, nBytes, flags);
+	if(strncmp(filename, "mirror:", 7) == 0) return mirror_open(filename + 7, nBytes, flags);
+	off_t bs = nBytes;
 	if(bs < 0) return OPEN_DISK_PARAM_ERR;
 	if(bs == 0) {
 		//open disk (happens after if elif)
@@ -57,6 +330,8 @@ int openDisk(char *filename, int nBytes) {
 	else if(bs > BLOCKSIZE && (bs % BLOCKSIZE) != 0) {
 		bs -= (bs % BLOCKSIZE);
 	}	
+	//block numbers are ints, so that is as far as a disk can go
+	if(bs / BLOCKSIZE > INT_MAX) return OPEN_DISK_PARAM_ERR;
 	//blocksize is now either 0 or a multiple of blocksize 
 	// if 0 : open the disk
 	// if nonzero : overwrite 
@@ -64,7 +339,7 @@ int openDisk(char *filename, int nBytes) {
 	int diskn = next_free_disk();
 	if(diskn < 0) return DISK_ALLOC_ERROR;
 	if(bs == 0) {
-		fd = open(filename, O_RDWR);
+		fd = open_image(filename, 0, flags);
 		struct stat st;
 		if(fd < 0 ) {
 			return OPEN_DISK_FILE_ERR;	
@@ -73,13 +348,20 @@ int openDisk(char *filename, int nBytes) {
 			close(fd);
 			return OPEN_DISK_FILE_ERR;
 		}
+		off_t usable = st.st_size - (st.st_size % BLOCKSIZE);
+		if(usable / BLOCKSIZE > INT_MAX) usable = (off_t)INT_MAX * BLOCKSIZE;
 		disks[diskn].flags = 1;
 		disks[diskn].fd = fd; 
-		disks[diskn].nBytes = st.st_size - (st.st_size % BLOCKSIZE);
-		disks[diskn].nBlocks = disks[diskn].nBytes / BLOCKSIZE;
+		disks[diskn].nBytes = usable;
+		disks[diskn].nBlocks = usable / BLOCKSIZE;
+		if(direct_setup(&disks[diskn], filename) < 0) {
+			close(fd);
+			return OPEN_DISK_FILE_ERR;
+		}
+		freeHint = diskn + 1;
 	}
 	if(bs != 0) {
-		fd = open(filename, O_RDWR | O_CREAT, 0666); //0 666 octal is default for files
+		fd = open_image(filename, O_CREAT, flags);
 	//	struct stat st;
 		if(fd < 0) {
 			return OPEN_DISK_FILE_ERR;
@@ -93,20 +375,42 @@ int openDisk(char *filename, int nBytes) {
 		disks[diskn].fd = fd;
 		disks[diskn].nBytes = bs;
 		disks[diskn].nBlocks = bs / BLOCKSIZE;
+		if(direct_setup(&disks[diskn], filename) < 0) {
+			close(fd);
+			return OPEN_DISK_FILE_ERR;
+		}
+		freeHint = diskn + 1;
 	}
 	return diskn;
 }
 
 int closeDisk(int diskn) {
-	if(disks[diskn].flags) {
+	//what is still dirty goes out first, the disk closes even if it fails
+	int wbrc = isOpen(diskn) && disks[diskn].wb ? wb_stop(diskn) : 0;
+	if(isOpen(diskn) && disks[diskn].nMembers) {
+		int rc = 0;
+		for(int i = 0; i < disks[diskn].nMembers; i++) {
+			if(disks[diskn].members[i] >= 0 && closeDisk(disks[diskn].members[i]) != 0) rc = DISK_CLOSE_ERR;
+		}
+		free(disks[diskn].names);
+		disks[diskn].names = NULL;
+		disks[diskn].flags = 0;
+		disks[diskn].nMembers = 0;
+		if(diskn < freeHint) freeHint = diskn;
+		return rc != 0 ? rc : wbrc;
+	}
+	if(isOpen(diskn)) {
 		//disks[diskn] = {0};
 		//disks[diskn].fd = -1;
+		if(disks[diskn].tailfd >= 0) close(disks[diskn].tailfd);
+		disks[diskn].tailfd = -1;
 		if(close(disks[diskn].fd) != 0) {
 			return DISK_CLOSE_ERR;
 		}
 		disks[diskn].flags = 0;
 		disks[diskn].fd = -1;
-		return 0;
+		if(diskn < freeHint) freeHint = diskn;
+		return wbrc;
 	}else{
 		return DISK_NOT_OPEN;
 	}
@@ -115,11 +419,16 @@ int closeDisk(int diskn) {
 int readBlock(int disk, int bNum, void *block) {
 	if(!isOpen(disk)) return DISK_NOT_OPEN;
 	if(!block) return BUF_NULL;
-	//lseek uses off_t, is this just a uint64? idk
-	off_t offset = bNum * BLOCKSIZE;
-	if(lseek(disks[disk].fd, offset, SEEK_SET) < 0) return DISK_IO_ERR;
+	if(disks[disk].wb) return wb_read(disk, bNum, 1, block);
+	//pread instead of lseek+read so threads sharing a disk don't race on the offset
+	//widen before multiplying, bNum * BLOCKSIZE overflows an int past 2GB
+	if(disks[disk].nMembers) return vol_io(disk, bNum, 1, block, 0);
+	off_t offset = (off_t)bNum * BLOCKSIZE;
+	if(disks[disk].direct) {
+		return direct_io(&disks[disk], block, BLOCKSIZE, offset, 0);
+	}
 	int read_b = 0;
-	if((read_b = read(disks[disk].fd, block, BLOCKSIZE)) != BLOCKSIZE) {
+	if((read_b = pread(disks[disk].fd, block, BLOCKSIZE, offset)) != BLOCKSIZE) {
 		//printf("DEBUG !! Read different number than BLOCKSIZE: %d\n", read_b);
 		return DISK_IO_ERR;
 	}
@@ -130,12 +439,725 @@ int readBlock(int disk, int bNum, void *block) {
 int writeBlock(int disk, int bNum, void *block) {
 	if(!isOpen(disk)) return DISK_NOT_OPEN;
 	if(!block) return BUF_NULL;
-	off_t offset = bNum * BLOCKSIZE;
-	if(lseek(disks[disk].fd, offset, SEEK_SET) < 0) return DISK_IO_ERR;
+	if(disks[disk].wb) return wb_write(disk, bNum, 1, block);
+	if(disks[disk].nMembers) return vol_io(disk, bNum, 1, block, 1);
+	off_t offset = (off_t)bNum * BLOCKSIZE;
 	//can do a repeat write at different offsets, should be good for now
 	// writeBlock only writes 1 block !!
-	int wrote = write(disks[disk].fd, block, BLOCKSIZE);
+	if(disks[disk].direct) {
+		return direct_io(&disks[disk], block, BLOCKSIZE, offset, 1);
+	}
+	int wrote = pwrite(disks[disk].fd, block, BLOCKSIZE, offset);
 	if(wrote < 0) { return DISK_IO_ERR; }
 	//if(wrote != BLOCKSIZE) { printf("DEBUG !! Wrote %d not %d blocksize", wrote, BLOCKSIZE); }
 	return 0; 
 }
+
+int readBlocks(int disk, int bNum, int nBlocks, void *block) {
+	if(!isOpen(disk)) return DISK_NOT_OPEN;
+	if(!block) return BUF_NULL;
+	if(bNum < 0 || nBlocks < 0 || bNum + nBlocks > disks[disk].nBlocks) return DISK_IO_ERR;
+	if(disks[disk].wb) return wb_read(disk, bNum, nBlocks, block);
+	if(disks[disk].nMembers) return vol_io(disk, bNum, nBlocks, block, 0);
+	off_t offset = (off_t)bNum * BLOCKSIZE;
+	return disk_io(disk, block, (size_t)nBlocks * BLOCKSIZE, offset, 0);
+}
+
+int writeBlocks(int disk, int bNum, int nBlocks, void *block) {
+	if(!isOpen(disk)) return DISK_NOT_OPEN;
+	if(!block) return BUF_NULL;
+	if(bNum < 0 || nBlocks < 0 || bNum + nBlocks > disks[disk].nBlocks) return DISK_IO_ERR;
+	if(disks[disk].wb) return wb_write(disk, bNum, nBlocks, block);
+	if(disks[disk].nMembers) return vol_io(disk, bNum, nBlocks, block, 1);
+	off_t offset = (off_t)bNum * BLOCKSIZE;
+	return disk_io(disk, block, (size_t)nBlocks * BLOCKSIZE, offset, 1);
+}
+
+int diskBlocks(int disk) {
+	if(!isOpen(disk)) return DISK_NOT_OPEN;
+	return disks[disk].nBlocks;
+}
+
+int diskIsDirect(int disk) {
+	if(!isOpen(disk)) return DISK_NOT_OPEN;
+	for(int i = 0; i < disks[disk].nMembers; i++) {
+		if(!disks[disk].failed[i]) return diskIsDirect(disks[disk].members[i]);
+	}
+	return disks[disk].direct;
+}
+
+int discardBlocks(int disk, int bNum, int nBlocks) {
+	if(!isOpen(disk)) return DISK_NOT_OPEN;
+	if(bNum < 0 || nBlocks < 0 || bNum + nBlocks > disks[disk].nBlocks) return DISK_IO_ERR;
+	//dirty copies of blocks that hold nothing don't need to go out
+	if(disks[disk].wb) wb_discard(disk, bNum, nBlocks);
+	if(disks[disk].mirror) {
+		for(int i = 0; i < disks[disk].nMembers; i++) {
+			if(disks[disk].failed[i]) continue;
+			int rc = discardBlocks(disks[disk].members[i], bNum, nBlocks);
+			if(rc != 0) return rc;
+		}
+		return 0;
+	}
+	if(disks[disk].nMembers) {
+		//each stripe unit in the range is a piece of one member
+		int unit = disks[disk].unit, n = disks[disk].nMembers;
+		for(int b = bNum; b < bNum + nBlocks; ) {
+			int su = b / unit, off = b % unit;
+			int cnt = unit - off < bNum + nBlocks - b ? unit - off : bNum + nBlocks - b;
+			int rc = discardBlocks(disks[disk].members[su % n], (su / n) * unit + off, cnt);
+			if(rc != 0) return rc;
+			b += cnt;
+		}
+		return 0;
+	}
+	//only whole host pages can be given back, punching part of one would
+	//just write zeros over it
+	off_t lo = ((off_t)bNum * BLOCKSIZE + DISCARD_ALIGN - 1) / DISCARD_ALIGN * DISCARD_ALIGN;
+	off_t hi = (off_t)(bNum + nBlocks) * BLOCKSIZE / DISCARD_ALIGN * DISCARD_ALIGN;
+	if(hi <= lo) return 0;
+	if(fallocate(disks[disk].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, lo, hi - lo) != 0) {
+		//the host filesystem can't do it, which is fine, it is only a hint
+		if(errno == EOPNOTSUPP || errno == ENOSYS) return 0;
+		return DISK_IO_ERR;
+	}
+	return 0;
+}
+
+//striped volumes. "stripe:<unit>:<image>,<image>,..." names one: logical
+//blocks go to the images in turns of unit blocks, so stripe unit u is on
+//image u % n at member block (u / n) * unit. there is no volume header, the
+//descriptor says how it is laid out and has to be the same on every open.
+//every image gets the same size, the volume is a whole number of stripes
+static int vol_open(char *spec, int64_t nBytes, int flags) {
+	char *end;
+	long unit = strtol(spec, &end, 10);
+	if(unit <= 0 || unit > INT_MAX / VOL_MAX || *end != ':') return OPEN_DISK_PARAM_ERR;
+	char *paths = strdup(end + 1);
+	if(!paths) return DISK_ALLOC_ERROR;
+	char *names[VOL_MAX], *save = NULL;
+	int n = 0;
+	for(char *p = strtok_r(paths, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		if(n == VOL_MAX) { free(paths); return OPEN_DISK_PARAM_ERR; }
+		names[n++] = p;
+	}
+	int64_t stripe = (int64_t)unit * n;
+	int64_t stripes = nBytes / BLOCKSIZE / (stripe ? stripe : 1);
+	if(n == 0 || (nBytes > 0 && stripes == 0) || nBytes < 0 || stripes * stripe > INT_MAX) {
+		free(paths);
+		return OPEN_DISK_PARAM_ERR;
+	}
+	int members[VOL_MAX];
+	int64_t least = INT_MAX;
+	int rc = 0, opened = 0;
+	for(; opened < n; opened++) {
+		members[opened] = openDiskEx(names[opened], nBytes ? stripes * unit * BLOCKSIZE : 0, flags);
+		if(members[opened] < 0) { rc = members[opened]; break; }
+		if(disks[members[opened]].nBlocks < least) least = disks[members[opened]].nBlocks;
+	}
+	free(paths);
+	int vol = rc == 0 ? next_free_disk() : rc;
+	int64_t nBlocks = least / unit * stripe;
+	if(rc == 0 && (vol < 0 || nBlocks == 0 || nBlocks > INT_MAX)) rc = vol < 0 ? vol : OPEN_DISK_PARAM_ERR;
+	if(rc != 0) {
+		while(opened-- > 0) closeDisk(members[opened]);
+		return rc;
+	}
+	disk_entry *d = &disks[vol];
+	memset(d, 0, sizeof(*d));
+	d->flags = 1;
+	d->fd = -1;
+	d->tailfd = -1;
+	d->nBlocks = (int)nBlocks;
+	d->nBytes = (off_t)nBlocks * BLOCKSIZE;
+	d->nMembers = n;
+	d->unit = (int)unit;
+	memcpy(d->members, members, n * sizeof(int));
+	freeHint = vol + 1;
+	return vol;
+}
+
+static void *vol_run(void *arg) {
+	vol_job *job = arg;
+	for(int i = 0; i < job->nPieces && job->rc == 0; i++) {
+		vol_piece *p = &job->pieces[i];
+		job->rc = disk_io(job->disk, p->buf, (size_t)p->nBlocks * BLOCKSIZE, (off_t)p->bNum * BLOCKSIZE, job->write_io);
+	}
+	return NULL;
+}
+
+//splits a volume transfer into the stripe units it covers. a long one runs
+//on every member at the same time, one thread each
+static int vol_io(int disk, int bNum, int nBlocks, char *buf, int write_io) {
+	disk_entry *d = &disks[disk];
+	if(bNum < 0 || nBlocks < 0 || bNum + nBlocks > d->nBlocks) return DISK_IO_ERR;
+	if(d->mirror) return write_io ? mirror_write(disk, bNum, nBlocks, buf) : mirror_read(disk, bNum, nBlocks, buf);
+	int unit = d->unit, n = d->nMembers;
+	int su = bNum / unit, off = bNum % unit;
+	if(off + nBlocks <= unit) {
+		//inside one stripe unit, the common case for single blocks
+		int m = d->members[su % n];
+		return disk_io(m, buf, (size_t)nBlocks * BLOCKSIZE, ((off_t)(su / n) * unit + off) * BLOCKSIZE, write_io);
+	}
+	int most = nBlocks / unit + 2;
+	vol_piece *pieces = malloc((size_t)most * n * sizeof(vol_piece));
+	if(!pieces) return DISK_IO_ERR;
+	vol_job jobs[VOL_MAX];
+	for(int i = 0; i < n; i++) {
+		jobs[i].disk = d->members[i];
+		jobs[i].write_io = write_io;
+		jobs[i].pieces = pieces + (size_t)i * most;
+		jobs[i].nPieces = 0;
+		jobs[i].rc = 0;
+	}
+	for(int b = bNum; b < bNum + nBlocks; ) {
+		su = b / unit;
+		off = b % unit;
+		int cnt = unit - off < bNum + nBlocks - b ? unit - off : bNum + nBlocks - b;
+		vol_job *job = &jobs[su % n];
+		job->pieces[job->nPieces++] = (vol_piece){ (su / n) * unit + off, cnt, buf + (size_t)(b - bNum) * BLOCKSIZE };
+		b += cnt;
+	}
+	pthread_t tids[VOL_MAX];
+	int started[VOL_MAX] = {0};
+	for(int i = 1; i < n && nBlocks >= VOL_PARALLEL; i++) {
+		if(jobs[i].nPieces && pthread_create(&tids[i], NULL, vol_run, &jobs[i]) == 0) started[i] = 1;
+	}
+	int rc = 0;
+	for(int i = 0; i < n; i++) {
+		if(!started[i]) vol_run(&jobs[i]);
+	}
+	for(int i = 0; i < n; i++) {
+		if(started[i]) pthread_join(tids[i], NULL);
+		if(jobs[i].rc != 0) rc = jobs[i].rc;
+	}
+	free(pieces);
+	return rc;
+}
+
+//the epoch in member i's trailer, 0 for an image that has none
+static uint64_t mirror_epoch(disk_entry *d, int i) {
+	mirror_trailer t = {0};
+	int fd = open(d->name[i], O_RDONLY);
+	if(fd < 0) return 0;
+	int rc = full_io(fd, (char *)&t, sizeof(t), disks[d->members[i]].nBytes, 0);
+	close(fd);
+	return rc == 0 && t.magic == MIRROR_MAGIC ? t.epoch : 0;
+}
+
+static int mirror_epoch_set(disk_entry *d, int i, uint64_t epoch) {
+	mirror_trailer t = { MIRROR_MAGIC, 0, epoch };
+	//buffered, the trailer isn't a whole aligned unit for O_DIRECT
+	int fd = open(d->name[i], O_WRONLY);
+	if(fd < 0) return DISK_IO_ERR;
+	int rc = full_io(fd, (char *)&t, sizeof(t), disks[d->members[i]].nBytes, 1);
+	close(fd);
+	return rc;
+}
+
+//drops member i, the next write moves the others' epoch past its own
+static void mirror_fail(disk_entry *d, int i) {
+	__atomic_store_n(&d->failed[i], 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->stale, 1, __ATOMIC_RELAXED);
+}
+
+//mirrored volumes. "mirror:<image>,<image>,..." keeps every block on each
+//image. writes go to all of them, a read goes to the one with the fewest
+//reads running and then the lowest recent latency, and long runs are split
+//over all of them. an image that fails (or is missing or too small when
+//the volume opens) is left out from then on, the volume keeps going on the
+//rest until diskResync brings it back. one that missed writes while it was
+//out has an older epoch than the others, so it is left out on the next
+//open too
+static int mirror_open(char *spec, int64_t nBytes, int flags) {
+	char *names = strdup(spec), *save = NULL;
+	if(!names) return DISK_ALLOC_ERROR;
+	char *name[VOL_MAX];
+	int n = 0;
+	for(char *p = strtok_r(names, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		if(n == VOL_MAX) { free(names); return OPEN_DISK_PARAM_ERR; }
+		name[n++] = p;
+	}
+	if(n == 0) { free(names); return OPEN_DISK_PARAM_ERR; }
+	int members[VOL_MAX], most = 0, rc = 0;
+	for(int i = 0; i < n; i++) {
+		members[i] = openDiskEx(name[i], nBytes, flags);
+		//making the volume needs every image, opening one makes do
+		if(members[i] < 0 && nBytes > 0) rc = members[i];
+		if(members[i] >= 0 && disks[members[i]].nBlocks > most) most = disks[members[i]].nBlocks;
+	}
+	int vol = rc == 0 && most > 0 ? next_free_disk() : (rc ? rc : OPEN_DISK_FILE_ERR);
+	if(vol < 0) {
+		for(int i = 0; i < n; i++) {
+			if(members[i] >= 0) closeDisk(members[i]);
+		}
+		free(names);
+		return vol;
+	}
+	disk_entry *d = &disks[vol];
+	memset(d, 0, sizeof(*d));
+	d->flags = 1;
+	d->fd = -1;
+	d->tailfd = -1;
+	d->nBlocks = most;
+	d->nBytes = (off_t)most * BLOCKSIZE;
+	d->nMembers = n;
+	d->mirror = 1;
+	d->names = names;
+	d->openFlags = flags;
+	uint64_t epoch[VOL_MAX] = {0};
+	for(int i = 0; i < n; i++) {
+		d->members[i] = members[i];
+		d->name[i] = name[i];
+		d->failed[i] = members[i] < 0 || disks[members[i]].nBlocks < most;
+		if(!d->failed[i]) epoch[i] = mirror_epoch(d, i);
+		if(!d->failed[i] && epoch[i] > d->epoch) d->epoch = epoch[i];
+	}
+	for(int i = 0; i < n; i++) {
+		if(!d->failed[i] && epoch[i] < d->epoch) d->failed[i] = 1;
+		if(d->failed[i]) d->stale = 1;
+	}
+	freeHint = vol + 1;
+	return vol;
+}
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//the member a read should go to, -1 when none is left
+static int mirror_pick(disk_entry *d) {
+	int best = -1;
+	for(int i = 0; i < d->nMembers; i++) {
+		if(__atomic_load_n(&d->failed[i], __ATOMIC_RELAXED)) continue;
+		if(best < 0) { best = i; continue; }
+		int a = __atomic_load_n(&d->inflight[i], __ATOMIC_RELAXED);
+		int b = __atomic_load_n(&d->inflight[best], __ATOMIC_RELAXED);
+		if(a < b || (a == b && d->latency[i] < d->latency[best])) best = i;
+	}
+	return best;
+}
+
+//reads from the best member, failing over to the next one on an error
+static int mirror_read_one(disk_entry *d, int bNum, int nBlocks, char *buf, int first) {
+	for(int m = first; m >= 0; m = mirror_pick(d)) {
+		__atomic_fetch_add(&d->inflight[m], 1, __ATOMIC_RELAXED);
+		int64_t t = now_ns();
+		int rc = disk_io(d->members[m], buf, (size_t)nBlocks * BLOCKSIZE, (off_t)bNum * BLOCKSIZE, 0);
+		t = now_ns() - t;
+		__atomic_fetch_sub(&d->inflight[m], 1, __ATOMIC_RELAXED);
+		if(rc == 0) {
+			//per block, so long and short reads compare
+			d->latency[m] += (t / nBlocks - d->latency[m]) / 8;
+			return 0;
+		}
+		mirror_fail(d, m);
+	}
+	return DISK_IO_ERR;
+}
+
+typedef struct mirror_job {
+	disk_entry *d;
+	int member;
+	int bNum, nBlocks;
+	char *buf;
+	int write_io;
+	int rc;
+} mirror_job;
+
+static void *mirror_run(void *arg) {
+	mirror_job *job = arg;
+	if(job->write_io) {
+		job->rc = disk_io(job->d->members[job->member], job->buf, (size_t)job->nBlocks * BLOCKSIZE,
+				  (off_t)job->bNum * BLOCKSIZE, 1);
+	}else{
+		job->rc = mirror_read_one(job->d, job->bNum, job->nBlocks, job->buf, job->member);
+	}
+	return NULL;
+}
+
+//runs the jobs, one thread each past the first when the transfer is long
+static void mirror_jobs(mirror_job *jobs, int n, int nBlocks) {
+	pthread_t tids[VOL_MAX];
+	int started[VOL_MAX] = {0};
+	for(int i = 1; i < n && nBlocks >= VOL_PARALLEL; i++) {
+		if(pthread_create(&tids[i], NULL, mirror_run, &jobs[i]) == 0) started[i] = 1;
+	}
+	for(int i = 0; i < n; i++) {
+		if(!started[i]) mirror_run(&jobs[i]);
+	}
+	for(int i = 0; i < n; i++) {
+		if(started[i]) pthread_join(tids[i], NULL);
+	}
+}
+
+//a long run is split in equal parts, one per working member
+static int mirror_read(int disk, int bNum, int nBlocks, char *buf) {
+	disk_entry *d = &disks[disk];
+	mirror_job jobs[VOL_MAX];
+	int n = 0;
+	for(int i = 0; i < d->nMembers && nBlocks >= VOL_PARALLEL; i++) {
+		if(!d->failed[i]) jobs[n++].member = i;
+	}
+	if(n < 2) return mirror_read_one(d, bNum, nBlocks, buf, mirror_pick(d));
+	for(int i = 0, at = 0; i < n; i++) {
+		int cnt = nBlocks / n + (i < nBlocks % n);
+		jobs[i] = (mirror_job){ d, jobs[i].member, bNum + at, cnt, buf + (size_t)at * BLOCKSIZE, 0, 0 };
+		at += cnt;
+	}
+	mirror_jobs(jobs, n, nBlocks);
+	for(int i = 0; i < n; i++) {
+		if(jobs[i].rc != 0) return jobs[i].rc;
+	}
+	return 0;
+}
+
+//every working member gets the write, it only fails if all of them do.
+//the first one since a member was dropped moves the epoch of the others on
+//before it lands, so the dropped one can be told apart from them later
+static int mirror_write(int disk, int bNum, int nBlocks, char *buf) {
+	disk_entry *d = &disks[disk];
+	mirror_job jobs[VOL_MAX];
+	int n = 0, ok = 0;
+	if(__atomic_load_n(&d->stale, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&epochLock);
+		if(d->stale) {
+			d->stale = 0;
+			d->epoch++;
+			for(int i = 0; i < d->nMembers; i++) {
+				if(!d->failed[i] && mirror_epoch_set(d, i, d->epoch) != 0) mirror_fail(d, i);
+			}
+		}
+		pthread_mutex_unlock(&epochLock);
+	}
+	for(int i = 0; i < d->nMembers; i++) {
+		if(!d->failed[i]) jobs[n++] = (mirror_job){ d, i, bNum, nBlocks, buf, 1, 0 };
+	}
+	mirror_jobs(jobs, n, nBlocks);
+	for(int i = 0; i < n; i++) {
+		if(jobs[i].rc == 0) ok++;
+		else mirror_fail(d, jobs[i].member);
+	}
+	return ok ? 0 : DISK_IO_ERR;
+}
+
+int diskReplicaOk(int disk, int replica) {
+	if(!isOpen(disk)) return DISK_NOT_OPEN;
+	if(!disks[disk].mirror || replica < 0 || replica >= disks[disk].nMembers) return OPEN_DISK_PARAM_ERR;
+	return !disks[disk].failed[replica];
+}
+
+int diskResync(int disk, int replica) {
+	if(!isOpen(disk)) return DISK_NOT_OPEN;
+	if(!disks[disk].mirror || replica < 0 || replica >= disks[disk].nMembers) return OPEN_DISK_PARAM_ERR;
+	mirror_fail(&disks[disk], replica);
+	int others = 0;
+	for(int i = 0; i < disks[disk].nMembers; i++) others += !disks[disk].failed[i];
+	if(others == 0) return DISK_IO_ERR;
+	//a new image gets made at the volume's size, an old one sized to it
+	int m = disks[disk].members[replica];
+	if(m >= 0) closeDisk(m);
+	m = openDiskEx(disks[disk].name[replica], disks[disk].nBytes, disks[disk].openFlags);
+	disks[disk].members[replica] = m;
+	if(m < 0) return m;
+	char *good = malloc((size_t)RESYNC_CHUNK * BLOCKSIZE);
+	char *have = malloc((size_t)RESYNC_CHUNK * BLOCKSIZE);
+	int rc = good && have ? 0 : DISK_ALLOC_ERROR;
+	int copied = 0, nBlocks = disks[disk].nBlocks;
+	for(int b = 0; b < nBlocks && rc == 0; b += RESYNC_CHUNK) {
+		int cnt = nBlocks - b < RESYNC_CHUNK ? nBlocks - b : RESYNC_CHUNK;
+		rc = mirror_read(disk, b, cnt, good);
+		if(rc == 0) rc = readBlocks(m, b, cnt, have);
+		//only what differs is written, so a blank sparse image stays sparse
+		//where the volume holds zeros
+		for(int i = 0; i < cnt && rc == 0; ) {
+			if(memcmp(good + (size_t)i * BLOCKSIZE, have + (size_t)i * BLOCKSIZE, BLOCKSIZE) == 0) { i++; continue; }
+			int j = i + 1;
+			while(j < cnt && memcmp(good + (size_t)j * BLOCKSIZE, have + (size_t)j * BLOCKSIZE, BLOCKSIZE) != 0) j++;
+			rc = writeBlocks(m, b + i, j - i, good + (size_t)i * BLOCKSIZE);
+			copied += j - i;
+			i = j;
+		}
+	}
+	free(good);
+	free(have);
+	//caught up, it is as far along as the others
+	if(rc == 0) rc = mirror_epoch_set(&disks[disk], replica, disks[disk].epoch);
+	if(rc != 0) return rc;
+	disks[disk].latency[replica] = 0;
+	disks[disk].failed[replica] = 0;
+	return copied;
+}
+
+static int64_t wb_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//the image or volume under the cache
+static int raw_io(int disk, int bNum, int nBlocks, char *buf, int write_io) {
+	if(disks[disk].nMembers) return vol_io(disk, bNum, nBlocks, buf, write_io);
+	return disk_io(disk, buf, (size_t)nBlocks * BLOCKSIZE, (off_t)bNum * BLOCKSIZE, write_io);
+}
+
+//entry holding bNum, -1 if it isn't dirty. wb->lock held
+static int wb_find(wb_cache *wb, int bNum) {
+	int i = wb->head[bNum & (WB_BUCKETS - 1)];
+	while(i >= 0 && wb->ent[i].bNum != bNum) i = wb->ent[i].next;
+	return i;
+}
+
+static void wb_remove(wb_cache *wb, int i) {
+	int *link = &wb->head[wb->ent[i].bNum & (WB_BUCKETS - 1)];
+	while(*link != i) link = &wb->ent[*link].next;
+	*link = wb->ent[i].next;
+	wb->ent[i].bNum = -1;
+	wb->ent[i].next = wb->freeList;
+	wb->freeList = i;
+	wb->count--;
+}
+
+typedef struct wb_pick {
+	int bNum;
+	int i;
+	uint32_t seq;
+} wb_pick;
+
+static int cmp_pick(const void *a, const void *b) {
+	int x = ((const wb_pick *)a)->bNum, y = ((const wb_pick *)b)->bNum;
+	return (x > y) - (x < y);
+}
+
+//writes the blocks dirty since cutoff (ms) or before, all of them for
+//INT64_MAX. they are copied out and go in block order, a run of neighbours
+//in one transfer, without the table locked; an entry written again
+//meanwhile stays dirty
+static int wb_flush(int disk, int64_t cutoff) {
+	pthread_rwlock_rdlock(&tableLock);
+	wb_cache *wb = disks[disk].wb;
+	pthread_mutex_lock(&wb->flushLock);
+	pthread_mutex_lock(&wb->lock);
+	wb_pick *picks = malloc(sizeof(wb_pick) * (wb->count ? wb->count : 1));
+	int n = 0;
+	for(int i = 0; picks && i < WB_BLOCKS; i++) {
+		if(wb->ent[i].bNum < 0 || wb->ent[i].dirtied > cutoff) continue;
+		picks[n].bNum = wb->ent[i].bNum;
+		picks[n].i = i;
+		picks[n++].seq = wb->ent[i].seq;
+	}
+	char *buf = n ? malloc((size_t)n * BLOCKSIZE) : NULL;
+	int rc = picks && (n == 0 || buf) ? 0 : DISK_ALLOC_ERROR;
+	if(rc == 0) {
+		qsort(picks, n, sizeof(wb_pick), cmp_pick);
+		for(int k = 0; k < n; k++) memcpy(buf + (size_t)k * BLOCKSIZE, wb->data[picks[k].i], BLOCKSIZE);
+	}
+	pthread_mutex_unlock(&wb->lock);
+	int done = 0;
+	for(int k = 0; rc == 0 && k < n; ) {
+		int j = k + 1;
+		while(j < n && picks[j].bNum == picks[j - 1].bNum + 1) j++;
+		rc = raw_io(disk, picks[k].bNum, j - k, buf + (size_t)k * BLOCKSIZE, 1);
+		if(rc == 0) done = j;
+		k = j;
+	}
+	pthread_mutex_lock(&wb->lock);
+	for(int k = 0; k < done; k++) {
+		wb_entry *e = &wb->ent[picks[k].i];
+		if(e->bNum == picks[k].bNum && e->seq == picks[k].seq) wb_remove(wb, picks[k].i);
+	}
+	pthread_mutex_unlock(&wb->lock);
+	pthread_mutex_unlock(&wb->flushLock);
+	pthread_rwlock_unlock(&tableLock);
+	free(picks);
+	free(buf);
+	return rc;
+}
+
+static void *wb_flusher(void *arg) {
+	int disk = (int)(intptr_t)arg;
+	pthread_rwlock_rdlock(&tableLock);
+	wb_cache *wb = disks[disk].wb;
+	pthread_rwlock_unlock(&tableLock);
+	pthread_mutex_lock(&wb->lock);
+	while(!wb->stop) {
+		//looks a few times per expiry, so nothing stays much past it
+		int tick = wb->expireMs / 4 < 10 ? 10 : wb->expireMs / 4 > 1000 ? 1000 : wb->expireMs / 4;
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += tick / 1000;
+		until.tv_nsec += (long)(tick % 1000) * 1000000;
+		if(until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&wb->wake, &wb->lock, &until);
+		if(wb->stop || wb->count == 0) continue;
+		int64_t cutoff = wb->count * 100 >= WB_BLOCKS * wb->dirtyPct ? INT64_MAX : wb_now() - wb->expireMs;
+		pthread_mutex_unlock(&wb->lock);
+		int rc = wb_flush(disk, cutoff);
+		pthread_mutex_lock(&wb->lock);
+		if(rc != 0 && wb->err == 0) wb->err = rc;
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return NULL;
+}
+
+static int wb_start(int disk) {
+	wb_cache *wb = malloc(sizeof(wb_cache));
+	if(!wb) return DISK_ALLOC_ERROR;
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_mutex_init(&wb->flushLock, NULL);
+	pthread_cond_init(&wb->wake, NULL);
+	wb->stop = 0;
+	wb->expireMs = WB_EXPIRE_MS;
+	wb->dirtyPct = WB_DIRTY_PCT;
+	wb->count = 0;
+	wb->err = 0;
+	for(int i = 0; i < WB_BUCKETS; i++) wb->head[i] = -1;
+	for(int i = 0; i < WB_BLOCKS; i++) {
+		wb->ent[i].bNum = -1;
+		wb->ent[i].next = i + 1 < WB_BLOCKS ? i + 1 : -1;
+		wb->ent[i].seq = 0;
+	}
+	wb->freeList = 0;
+	disks[disk].wb = wb;
+	if(pthread_create(&wb->thread, NULL, wb_flusher, (void *)(intptr_t)disk) != 0) {
+		disks[disk].wb = NULL;
+		free(wb);
+		return DISK_ALLOC_ERROR;
+	}
+	return 0;
+}
+
+//stops the flusher and writes what is left, the disk is written through after
+static int wb_stop(int disk) {
+	wb_cache *wb = disks[disk].wb;
+	pthread_mutex_lock(&wb->lock);
+	wb->stop = 1;
+	pthread_cond_signal(&wb->wake);
+	pthread_mutex_unlock(&wb->lock);
+	pthread_join(wb->thread, NULL);
+	int rc = wb_flush(disk, INT64_MAX);
+	if(rc == 0) rc = wb->err;
+	disks[disk].wb = NULL;
+	pthread_mutex_destroy(&wb->lock);
+	pthread_mutex_destroy(&wb->flushLock);
+	pthread_cond_destroy(&wb->wake);
+	free(wb);
+	return rc;
+}
+
+//the image with the dirty blocks laid over it. the table stays locked across
+//the read, so a flush can't retire a block between the two
+static int wb_read(int disk, int bNum, int nBlocks, char *buf) {
+	wb_cache *wb = disks[disk].wb;
+	if(bNum < 0 || bNum + nBlocks > disks[disk].nBlocks) return DISK_IO_ERR;
+	pthread_mutex_lock(&wb->lock);
+	int i = nBlocks == 1 ? wb_find(wb, bNum) : -1;
+	int rc = 0;
+	if(i >= 0) {
+		memcpy(buf, wb->data[i], BLOCKSIZE);
+	}else{
+		rc = raw_io(disk, bNum, nBlocks, buf, 0);
+		if(rc == 0 && wb->count > 0 && nBlocks > WB_BLOCKS) {
+			for(int e = 0; e < WB_BLOCKS; e++) {
+				int b = wb->ent[e].bNum;
+				if(b >= bNum && b < bNum + nBlocks) memcpy(buf + (size_t)(b - bNum) * BLOCKSIZE, wb->data[e], BLOCKSIZE);
+			}
+		}else if(rc == 0 && wb->count > 0) {
+			for(int b = bNum; b < bNum + nBlocks; b++) {
+				if((i = wb_find(wb, b)) >= 0) memcpy(buf + (size_t)(b - bNum) * BLOCKSIZE, wb->data[i], BLOCKSIZE);
+			}
+		}
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return rc;
+}
+
+static int wb_write(int disk, int bNum, int nBlocks, char *buf) {
+	wb_cache *wb = disks[disk].wb;
+	if(bNum < 0 || bNum + nBlocks > disks[disk].nBlocks) return DISK_IO_ERR;
+	pthread_mutex_lock(&wb->lock);
+	for(int b = bNum; b < bNum + nBlocks; b++) {
+		int i = wb_find(wb, b);
+		if(i < 0) {
+			while(wb->freeList < 0) {
+				//full: this writer pays for a flush
+				pthread_mutex_unlock(&wb->lock);
+				int rc = wb_flush(disk, INT64_MAX);
+				if(rc != 0) return rc;
+				pthread_mutex_lock(&wb->lock);
+			}
+			i = wb->freeList;
+			wb->freeList = wb->ent[i].next;
+			wb->ent[i].bNum = b;
+			wb->ent[i].next = wb->head[b & (WB_BUCKETS - 1)];
+			wb->head[b & (WB_BUCKETS - 1)] = i;
+			wb->ent[i].dirtied = wb_now();
+			wb->count++;
+		}
+		memcpy(wb->data[i], buf + (size_t)(b - bNum) * BLOCKSIZE, BLOCKSIZE);
+		wb->ent[i].seq++;
+	}
+	if(wb->count * 100 >= WB_BLOCKS * wb->dirtyPct) pthread_cond_signal(&wb->wake);
+	pthread_mutex_unlock(&wb->lock);
+	return 0;
+}
+
+static void wb_discard(int disk, int bNum, int nBlocks) {
+	wb_cache *wb = disks[disk].wb;
+	pthread_mutex_lock(&wb->lock);
+	for(int e = 0; e < WB_BLOCKS && wb->count > 0; e++) {
+		int b = wb->ent[e].bNum;
+		if(b >= bNum && b < bNum + nBlocks) wb_remove(wb, e);
+	}
+	pthread_mutex_unlock(&wb->lock);
+}
+
+int diskSync(int disk) {
+	if(!isOpen(disk)) return DISK_NOT_OPEN;
+	int rc = 0;
+	if(disks[disk].wb) {
+		wb_cache *wb = disks[disk].wb;
+		rc = wb_flush(disk, INT64_MAX);
+		pthread_mutex_lock(&wb->lock);
+		if(rc == 0) rc = wb->err;
+		wb->err = 0;
+		pthread_mutex_unlock(&wb->lock);
+	}
+	for(int i = 0; i < disks[disk].nMembers; i++) {
+		if(disks[disk].members[i] < 0 || disks[disk].failed[i]) continue;
+		int mrc = diskSync(disks[disk].members[i]);
+		if(rc == 0) rc = mrc;
+	}
+	if(disks[disk].nMembers) return rc;
+	if(fdatasync(disks[disk].fd) != 0 && rc == 0) rc = DISK_IO_ERR;
+	if(disks[disk].tailfd >= 0 && fdatasync(disks[disk].tailfd) != 0 && rc == 0) rc = DISK_IO_ERR;
+	return rc;
+}
+
+int diskWriteback(int disk, int expireMs, int dirtyPct) {
+	if(!isOpen(disk)) return DISK_NOT_OPEN;
+	wb_cache *wb = disks[disk].wb;
+	if(!wb || expireMs < 0 || dirtyPct < 0 || dirtyPct > 100) return OPEN_DISK_PARAM_ERR;
+	pthread_mutex_lock(&wb->lock);
+	if(expireMs) wb->expireMs = expireMs;
+	if(dirtyPct) wb->dirtyPct = dirtyPct;
+	//the flusher may be asleep for the old tick
+	pthread_cond_signal(&wb->wake);
+	pthread_mutex_unlock(&wb->lock);
+	return 0;
+}
+
+int diskDirtyBlocks(int disk) {
+	if(!isOpen(disk)) return DISK_NOT_OPEN;
+	wb_cache *wb = disks[disk].wb;
+	if(!wb) return 0;
+	pthread_mutex_lock(&wb->lock);
+	int n = wb->count;
+	pthread_mutex_unlock(&wb->lock);
+	return n;
+}
@@ -6,6 +6,8 @@
  * also define the error codes here
  */ 
 
+#include <stdint.h>
+
 #define BLOCKSIZE 256
 
 #define GENERIC_ERROR -1
@@ -33,6 +35,54 @@ is negative on failure or a disk number on success. */
 // RETURNS DISK NUMBER.
 int openDisk(char *filename, int nBytes);
 
+/* openDisk64() is openDisk() for disks bigger than an int can describe.
+Block numbers stay ints, so a disk is at most INT_MAX blocks (512GB);
+asking for more fails with OPEN_DISK_PARAM_ERR and bigger existing files
+only have their first INT_MAX blocks used. */
+int openDisk64(char *filename, int64_t nBytes);
+
+/* flags for openDiskEx */
+#define DISK_DIRECT 1	//O_DIRECT, bypass the host page cache
+#define DISK_WRITEBACK 2	//writes are held back and go out in the background
+
+/* openDiskEx() is openDisk64() with flags. With DISK_DIRECT the image is
+opened O_DIRECT: blocks are moved in aligned units through a pool of
+posix_memalign'd buffers (a single block read or write reads the unit around
+it), and readBlocks()/writeBlocks() runs go out as one large transfer per
+pool buffer. A tail that isn't a whole unit uses buffered I/O. Filesystems that
+refuse O_DIRECT get a normal buffered disk, diskIsDirect() tells which.
+With DISK_WRITEBACK writeBlock()/writeBlocks() only copy the blocks into a
+table of up to 4096 dirty blocks (1MB) and return; reads see them. A
+flusher thread started by openDiskEx takes them to the image sorted by
+block number, consecutive blocks in one transfer: those dirty for longer
+than the expiry (3 seconds), or all of them once the table is half full. A
+writer that finds it full flushes it in the foreground. diskSync() and
+closeDisk() write everything; until then other opens of the image don't
+see the writes. */
+int openDiskEx(char *filename, int64_t nBytes, int flags);
+
+/* A filename of the form "stripe:<unit>:<image>,<image>,..." opens a
+striped volume instead (RAID-0, up to 16 images, which can sit on different
+host devices). Its blocks go to the images in turns of unit blocks: stripe
+unit u is on image u % n. With nBytes every image is created at the same
+size and the volume is nBytes rounded down to whole stripes (unit * n
+blocks); opening an existing one uses the smallest image. The descriptor is
+the only record of the layout, so it has to be given the same way on every
+open. readBlocks()/writeBlocks() runs that cover several images move their
+pieces on all of them at once, one thread per image. Everything else works
+on the volume's disk number like on a single image.
+
+"mirror:<image>,<image>,..." opens a mirrored volume (RAID-1, up to 16
+images) instead: every write goes to each image, a read goes to the image
+with the fewest reads in flight and then the best recent latency, and
+readBlocks() runs split over all of them at once. An image that gets an I/O
+error is dropped and the volume carries on with the rest (it only fails
+when none is left); one that is missing or smaller than the others when the
+volume opens starts out dropped. Each image keeps an epoch in a few bytes
+past its last block: the first write after an image was dropped moves the
+epoch of the others on, so an image that missed writes also starts out
+dropped on later opens, until diskResync. With nBytes every image is
+created. */
 int closeDisk(int disk);
 
 /* readBlock() reads an entire block of BLOCKSIZE bytes from the open
@@ -55,4 +105,54 @@ the file. On success, it returns 0. -1 or smaller is returned if disk
 is not available (i.e. hasn’t been opened) or any other failures. You
 must define your own error code system. */
 int writeBlock(int disk, int bNum, void *block);
+
+/* readBlocks()/writeBlocks() move nBlocks consecutive blocks starting at
+bNum in one I/O call, for tools that scan or fill big parts of an image.
+Same return values as readBlock()/writeBlock(); the whole range must be
+inside the disk. */
+int readBlocks(int disk, int bNum, int nBlocks, void *block);
+
+int writeBlocks(int disk, int bNum, int nBlocks, void *block);
+
+/* diskBlocks() returns the number of blocks on an open disk. */
+int diskBlocks(int disk);
+
+/* diskIsDirect() returns 1 if the disk does O_DIRECT I/O, 0 if not. */
+int diskIsDirect(int disk);
+
+/* diskSync() writes every dirty block of a DISK_WRITEBACK disk and then
+fdatasync()s the image files, so what was written is on the host device
+when it returns. Also returns the error of a background write that failed
+since the last call. */
+int diskSync(int disk);
+
+/* diskWriteback() tunes a DISK_WRITEBACK disk: blocks go out once they have
+been dirty expireMs, and everything once dirtyPct percent of the table is
+dirty. 0 leaves a setting as it is. OPEN_DISK_PARAM_ERR on other disks. */
+int diskWriteback(int disk, int expireMs, int dirtyPct);
+
+/* diskDirtyBlocks() returns how many blocks are waiting to be written, 0
+on disks without DISK_WRITEBACK. */
+int diskDirtyBlocks(int disk);
+
+/* discardBlocks() tells the host that blocks bNum..bNum+nBlocks-1 hold
+nothing anymore. The whole 4K host pages inside the range are punched out
+of the image file (fallocate FALLOC_FL_PUNCH_HOLE, the file keeps its size),
+so they read back as zeros and take no space on the host; blocks sharing a
+page with something outside the range are left as they are. Returns 0 when
+the host can't punch holes too, it is only a hint. */
+int discardBlocks(int disk, int bNum, int nBlocks);
+
+/* diskReplicaOk() returns 1 if image replica of a mirrored volume is in
+use, 0 if it was dropped. */
+int diskReplicaOk(int disk, int replica);
+
+/* diskResync() brings image replica of a mirrored volume back: the image
+is created (or resized) to the volume's size, every block that differs from
+the other images is copied onto it, its epoch is brought up to theirs, and
+it is used again. Meant for a
+replaced image or one that missed writes while the volume ran without it;
+the volume shouldn't be written to meanwhile. Returns the number of blocks
+copied. */
+int diskResync(int disk, int replica);
 #endif
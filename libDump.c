@@ -0,0 +1,303 @@
+/*
+*
+* libDump.c : tinyFS image dump and restore
+*
+* stream layout, all fields in host byte order like the image itself:
+*   dump_header
+*   dump_record USED  + count blocks of data
+*   dump_record FREE  (no data)
+*   ...               records cover block 0 .. nblocks-1 in order
+*   dump_record END   + uint32 CRC32 of every record byte before it, if
+*                       the header has DUMP_F_CRC
+*
+*/
+
+#define _GNU_SOURCE
+#include "libDump.h"
+#include "libDisk.h"
+#include "blocktypes.h"
+#include "TinyFS_errno.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DUMP_MAGIC "TFSDUMP1"
+#define DUMP_VERSION 1
+#define DUMP_F_CRC 1
+#define DUMP_CHUNK 1024		//blocks per disk call (256KB)
+
+enum { REC_USED = 1, REC_FREE = 2, REC_END = 3 };
+
+typedef struct dump_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;		//DUMP_F_*
+	int32_t nblocks;
+	int32_t blocksize;
+} dump_header;
+
+typedef struct dump_record {
+	uint8_t kind;		//REC_*
+	uint8_t pad[3];
+	int32_t start;
+	int32_t count;
+} dump_record;
+
+//stream state, the crc runs over every record byte
+typedef struct dump_io {
+	int fd;
+	int crc;
+	uint32_t sum;
+} dump_io;
+
+static uint32_t crcTable[256];
+
+static void crc_init(void) {
+	if(crcTable[1]) return;
+	for(uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for(int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		crcTable[i] = c;
+	}
+}
+
+static uint32_t crc_update(uint32_t sum, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	sum = ~sum;
+	while(len--) sum = crcTable[(sum ^ *p++) & 0xff] ^ (sum >> 8);
+	return ~sum;
+}
+
+static int put(dump_io *io, const void *buf, size_t len) {
+	if(io->crc) io->sum = crc_update(io->sum, buf, len);
+	const char *p = buf;
+	while(len > 0) {
+		ssize_t n = write(io->fd, p, len);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return ERR_DISK_WRITE;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int get(dump_io *io, void *buf, size_t len) {
+	char *p = buf;
+	size_t want = len;
+	while(want > 0) {
+		ssize_t n = read(io->fd, p, want);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return ERR_DISK_READ;
+		//the stream ended early
+		if(n == 0) return ERR_FS_INVALID;
+		p += n;
+		want -= n;
+	}
+	if(io->crc) io->sum = crc_update(io->sum, buf, len);
+	return 0;
+}
+
+static int put_record(dump_io *io, int kind, int start, int count) {
+	dump_record rec = {0};
+	rec.kind = kind;
+	rec.start = start;
+	rec.count = count;
+	return put(io, &rec, sizeof(rec));
+}
+
+//which blocks are free. chain images mark them with a FREE header, on bitmap
+//images their bit is clear and the content is whatever was there before
+typedef struct free_map {
+	int disk;
+	const superblock_disk *sb;
+	bitmap_disk bm;		//bitmap block last read
+	int cached;		//its block number, 0 for none
+} free_map;
+
+static int is_free(free_map *fm, const uint8_t *blk, int b) {
+	const superblock_disk *sb = fm->sb;
+	if(!(sb->features & TFS_FEAT_BITMAP)) return blk[0] == FREE && blk[1] == MAGIC;
+	if(b < 2 || (b >= sb->bitmap_start && b < sb->bitmap_start + sb->bitmap_blocks)) return 0;
+	int want = sb->bitmap_start + b / BM_BITS;
+	if(want != fm->cached) {
+		//a bitmap block that can't be read keeps everything it covers
+		if(readBlock(fm->disk, want, &fm->bm) != 0) return 0;
+		if(fm->bm.blocktype != BITMAP || fm->bm.magic != MAGIC) memset(fm->bm.bits, 0, BM_E);
+		fm->cached = want;
+	}
+	return !(fm->bm.bits[(b % BM_BITS) / 8] & (1 << (b % 8)));
+}
+
+int tfs_dump(char *image, int outfd, int flags) {
+	int disk = openDisk(image, 0);
+	if(disk < 0) return ERR_DISK_OPEN;
+	int n = diskBlocks(disk);
+	superblock_disk sb = {0};
+	if(n < 3 || readBlock(disk, SUPERBLOCK_BLOCK, &sb) != 0) {
+		closeDisk(disk);
+		return ERR_DISK_READ;
+	}
+	if(sb.magic != MAGIC || sb.blocktype != SUPERBLOCK || !TFS_SB_SUPPORTED(&sb)) {
+		closeDisk(disk);
+		return ERR_FS_INVALID;
+	}
+	if(sb.nblocks > 0 && sb.nblocks < n) n = sb.nblocks;
+	//nothing at or past free_lazy was ever handed out
+	int lazy = (sb.features & TFS_FEAT_LAZYFREE) && sb.free_lazy > 0 && sb.free_lazy < n ? sb.free_lazy : n;
+
+	dump_io io = { outfd, 0, 0 };
+	free_map fm = { disk, &sb, { 0 }, 0 };
+	crc_init();
+	dump_header hdr = {0};
+	memcpy(hdr.magic, DUMP_MAGIC, 8);
+	hdr.version = DUMP_VERSION;
+	hdr.flags = (flags & TFS_DUMP_CHECKSUM) ? DUMP_F_CRC : 0;
+	hdr.nblocks = n;
+	hdr.blocksize = BLOCKSIZE;
+	int rc = put(&io, &hdr, sizeof(hdr));
+	io.crc = hdr.flags & DUMP_F_CRC;
+
+	uint8_t *buf = malloc((size_t)DUMP_CHUNK * BLOCKSIZE);
+	if(!buf) rc = ERR_BUF;
+	int used = 0;
+	//free blocks seen but not written out yet, they join up across chunks
+	int freeStart = -1;
+	for(int lo = 0; rc == 0 && lo < lazy; lo += DUMP_CHUNK) {
+		int k = lazy - lo < DUMP_CHUNK ? lazy - lo : DUMP_CHUNK;
+		if(readBlocks(disk, lo, k, buf) != 0) { rc = ERR_DISK_READ; break; }
+		for(int i = 0, j; rc == 0 && i < k; i = j) {
+			uint8_t *b = buf + (size_t)i * BLOCKSIZE;
+			int isFree = is_free(&fm, b, lo + i);
+			for(j = i + 1; j < k; j++) {
+				if(is_free(&fm, buf + (size_t)j * BLOCKSIZE, lo + j) != isFree) break;
+			}
+			if(isFree) {
+				if(freeStart < 0) freeStart = lo + i;
+				continue;
+			}
+			if(freeStart >= 0) {
+				rc = put_record(&io, REC_FREE, freeStart, lo + i - freeStart);
+				freeStart = -1;
+			}
+			if(rc == 0) rc = put_record(&io, REC_USED, lo + i, j - i);
+			if(rc == 0) rc = put(&io, b, (size_t)(j - i) * BLOCKSIZE);
+			used += j - i;
+		}
+	}
+	if(rc == 0 && lazy < n && freeStart < 0) freeStart = lazy;
+	if(rc == 0 && freeStart >= 0) rc = put_record(&io, REC_FREE, freeStart, n - freeStart);
+	if(rc == 0) rc = put_record(&io, REC_END, n, 0);
+	if(rc == 0 && io.crc) {
+		uint32_t sum = io.sum;
+		io.crc = 0;
+		rc = put(&io, &sum, sizeof(sum));
+	}
+	free(buf);
+	closeDisk(disk);
+	return rc < 0 ? rc : used;
+}
+
+//chains count free blocks from start, the last one points at next
+static int write_free(int disk, uint8_t *buf, int start, int count, int next) {
+	for(int lo = 0; lo < count; lo += DUMP_CHUNK) {
+		int k = count - lo < DUMP_CHUNK ? count - lo : DUMP_CHUNK;
+		memset(buf, 0, (size_t)k * BLOCKSIZE);
+		for(int i = 0; i < k; i++) {
+			free_disk *f = (free_disk *)(buf + (size_t)i * BLOCKSIZE);
+			f->blocktype = FREE;
+			f->magic = MAGIC;
+			f->blk_next = lo + i + 1 < count ? start + lo + i + 1 : next;
+		}
+		if(writeBlocks(disk, start + lo, k, buf) != 0) return ERR_DISK_WRITE;
+	}
+	return 0;
+}
+
+int tfs_restore(int infd, char *image) {
+	dump_io io = { infd, 0, 0 };
+	crc_init();
+	dump_header hdr;
+	int rc = get(&io, &hdr, sizeof(hdr));
+	if(rc < 0) return rc;
+	if(memcmp(hdr.magic, DUMP_MAGIC, 8) != 0 || hdr.version != DUMP_VERSION ||
+			hdr.blocksize != BLOCKSIZE || hdr.nblocks < 3) return ERR_FS_INVALID;
+	io.crc = hdr.flags & DUMP_F_CRC;
+	int n = hdr.nblocks;
+
+	//start from an empty file so the lazy region is a hole
+	if(truncate(image, 0) != 0 && errno != ENOENT) return ERR_DISK_OPEN;
+	int disk = openDisk64(image, (int64_t)n * BLOCKSIZE);
+	if(disk < 0) return ERR_DISK_OPEN;
+	uint8_t *buf = malloc((size_t)DUMP_CHUNK * BLOCKSIZE);
+	if(!buf) {
+		closeDisk(disk);
+		return ERR_BUF;
+	}
+
+	superblock_disk sb = {0};
+	int at = 0, used = 0, freeHead = 0, lazy = n;
+	//the last block of the previous free run, it learns its next from the one after
+	int pendStart = -1, pendCount = 0;
+	while(rc == 0) {
+		dump_record rec;
+		if((rc = get(&io, &rec, sizeof(rec))) < 0) break;
+		if(rec.kind == REC_END) {
+			if(rec.start != n || at != n) rc = ERR_FS_INVALID;
+			break;
+		}
+		if(rec.start != at || rec.count <= 0 || rec.count > n - at) { rc = ERR_FS_INVALID; break; }
+		if(rec.kind == REC_USED) {
+			for(int lo = 0; rc == 0 && lo < rec.count; lo += DUMP_CHUNK) {
+				int k = rec.count - lo < DUMP_CHUNK ? rec.count - lo : DUMP_CHUNK;
+				if((rc = get(&io, buf, (size_t)k * BLOCKSIZE)) < 0) break;
+				//the superblock goes last, once the whole stream checks out
+				if(rec.start + lo == SUPERBLOCK_BLOCK) {
+					memcpy(&sb, buf, BLOCKSIZE);
+					memset(buf, 0, BLOCKSIZE);
+				}
+				if(writeBlocks(disk, rec.start + lo, k, buf) != 0) rc = ERR_DISK_WRITE;
+			}
+			used += rec.count;
+		}else if(rec.kind == REC_FREE) {
+			//free space up to the end of the image is left unwritten, and so is
+			//all of it on bitmap images, the bitmap came along with the used blocks
+			int tail = rec.start + rec.count == n;
+			if(sb.features & TFS_FEAT_BITMAP) {
+				if(tail) lazy = rec.start;
+				at = rec.start + rec.count;
+				continue;
+			}
+			if(pendStart >= 0) rc = write_free(disk, buf, pendStart, pendCount, tail ? 0 : rec.start);
+			pendStart = -1;
+			if(tail) {
+				lazy = rec.start;
+			}else{
+				if(freeHead == 0) freeHead = rec.start;
+				pendStart = rec.start;
+				pendCount = rec.count;
+			}
+		}else{
+			rc = ERR_FS_INVALID;
+		}
+		at = rec.start + rec.count;
+	}
+	if(rc == 0 && pendStart >= 0) rc = write_free(disk, buf, pendStart, pendCount, 0);
+	if(rc == 0 && io.crc) {
+		uint32_t want = io.sum, sum;
+		io.crc = 0;
+		if((rc = get(&io, &sum, sizeof(sum))) == 0 && sum != want) rc = ERR_FS_INVALID;
+	}
+	if(rc == 0 && (sb.magic != MAGIC || sb.blocktype != SUPERBLOCK)) rc = ERR_FS_INVALID;
+	if(rc == 0) {
+		sb.features |= TFS_FEAT_LAZYFREE;
+		sb.nblocks = n;
+		sb.free_block = freeHead;
+		sb.free_lazy = lazy;
+		if(writeBlock(disk, SUPERBLOCK_BLOCK, &sb) != 0) rc = ERR_DISK_WRITE;
+	}
+	free(buf);
+	closeDisk(disk);
+	return rc < 0 ? rc : used;
+}
@@ -0,0 +1,30 @@
+#ifndef LIBDUMP_H
+#define LIBDUMP_H
+/*
+ *
+ * libDump header, compact snapshot streams of unmounted tinyFS images
+ *
+ */
+
+/* flags for tfs_dump */
+#define TFS_DUMP_CHECKSUM 1	//end the stream with a CRC32 that restore checks
+
+/* tfs_dump() writes the unmounted image to the host file descriptor outfd
+(a file, pipe or socket) as a stream: a header, then the image from block 0
+up as runs of in-use blocks, sent whole, and runs of free blocks (on the
+free chain, clear in a TFS_FEAT_BITMAP image's bitmap, or in the never used
+TFS_FEAT_LAZYFREE region), sent as just their start and length. Returns the number of blocks written out, or a
+negative TinyFS error. */
+int tfs_dump(char *image, int outfd, int flags);
+
+/* tfs_restore() reads a tfs_dump stream from infd and makes image from it
+(replacing the file if it exists). The free runs are chained in ascending
+order, except the last one when it reaches the end of the image: that
+becomes never used TFS_FEAT_LAZYFREE space, which isn't written at all (the
+file stays sparse there). Bitmap images get none of their free blocks
+written. A broken stream or a checksum that doesn't match
+returns ERR_FS_INVALID and leaves image without a valid superblock.
+Returns the number of in-use blocks restored. */
+int tfs_restore(int infd, char *image);
+
+#endif
@@ -0,0 +1,753 @@
+/*
+*
+* libFsck.c : tinyFS consistency checker
+*
+* two passes: worker threads read the image in big sequential chunks and
+* record every block's type and next pointer, then the free chain and all
+* the file chains are followed in memory without touching the disk again.
+*
+*/
+
+#define _GNU_SOURCE
+#include "libFsck.h"
+#include "libDisk.h"
+#include "blocktypes.h"
+#include "TinyFS_errno.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCAN_CHUNK 1024		//blocks per read (256KB)
+#define MAX_THREADS 64
+
+//owner[] values, anything > 0 is the inode block that owns it
+#define OWN_NONE 0
+#define OWN_FREE -1
+#define OWN_META -2
+
+typedef struct inode_ref {
+	int32_t block;
+	int64_t size;
+	int mapped;		//INODE_MAPPED, blocks hang off index blocks
+	int system;		//INODE_SYSTEM, not counted as a file
+	int dir;		//INODE_DIR, blk_start is the root of its B-tree
+} inode_ref;
+
+//one scanner thread's slice of the image
+typedef struct scan_job {
+	int disk;
+	int lo, hi;
+	uint32_t features;
+	uint8_t *type;		//blocktype, 0 when the magic is wrong
+	int32_t *next;		//blk_next (extents, free) or blk_start (inodes)
+	inode_ref *inodes;
+	int ninodes, capinodes;
+	int err;
+} scan_job;
+
+//a chain that has to be cut short on repair
+typedef struct chain_fix {
+	int32_t inode;
+	int32_t cutAfter;	//last good extent, 0 = cut right at the inode
+	int64_t newSize;
+} chain_fix;
+
+static void *scan_range(void *arg) {
+	scan_job *job = arg;
+	uint8_t *buf = malloc((size_t)SCAN_CHUNK * BLOCKSIZE);
+	if(!buf) { job->err = ERR_BUF; return NULL; }
+
+	for(int b = job->lo; b < job->hi; b += SCAN_CHUNK) {
+		int cnt = job->hi - b < SCAN_CHUNK ? job->hi - b : SCAN_CHUNK;
+		if(readBlocks(job->disk, b, cnt, buf) != 0) {
+			job->err = ERR_DISK_READ;
+			break;
+		}
+		for(int i = 0; i < cnt; i++) {
+			uint8_t *blk = buf + (size_t)i * BLOCKSIZE;
+			int bn = b + i;
+			job->type[bn] = blk[1] == MAGIC ? blk[0] : 0;
+			if(job->type[bn] == FILEEXTENT) {
+				fileextent_disk ext;
+				memcpy(&ext, blk, BLOCKSIZE);
+				job->next[bn] = ext.blk_next;
+			}else if(job->type[bn] == INDEX) {
+				index_disk ix;
+				memcpy(&ix, blk, BLOCKSIZE);
+				job->next[bn] = ix.blk_next;
+			}else if(job->type[bn] == FREE) {
+				free_disk fr;
+				memcpy(&fr, blk, BLOCKSIZE);
+				job->next[bn] = fr.blk_next;
+			}else if(job->type[bn] == INODE) {
+				//inode_disk is bigger than a block in memory, only copy the block
+				inode_disk in = {0};
+				memcpy(&in, blk, BLOCKSIZE);
+				job->next[bn] = in.blk_start;
+				if(job->ninodes == job->capinodes) {
+					int ncap = job->capinodes ? job->capinodes * 2 : 64;
+					inode_ref *ni = realloc(job->inodes, ncap * sizeof(inode_ref));
+					if(!ni) { job->err = ERR_BUF; free(buf); return NULL; }
+					job->inodes = ni;
+					job->capinodes = ncap;
+				}
+				job->inodes[job->ninodes].block = bn;
+				job->inodes[job->ninodes].size = in.size_B;
+				job->inodes[job->ninodes].mapped = (in.metaflags & INODE_MAPPED) != 0;
+				job->inodes[job->ninodes].system = (in.metaflags & INODE_SYSTEM) != 0;
+				job->inodes[job->ninodes].dir = (in.metaflags & INODE_DIR) != 0;
+				if(job->features & TFS_FEAT_SIZE64) {
+					job->inodes[job->ninodes].size = ((int64_t)in.size_hi << 32) | (uint32_t)in.size_B;
+				}
+				job->ninodes++;
+			}
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static int bucket(int run) {
+	int b = 0;
+	while(run > 1 && b < TFS_FSCK_HIST - 1) { run >>= 1; b++; }
+	return b;
+}
+
+//bit of block b in a bitmap read by load_bitmap
+#define BIT(bits, b) ((bits)[(b) / 8] & (1 << ((b) % 8)))
+
+//reads the whole free space bitmap of a TFS_FEAT_BITMAP image into one
+//array, bit b is block b. bitmap blocks that were never written are zeros
+static int load_bitmap(int disk, const superblock_disk *sb, int n, int limit, uint8_t **out) {
+	int nb = sb->bitmap_blocks;
+	if(sb->bitmap_start < 2 || nb != (n + BM_BITS - 1) / BM_BITS || nb > limit - sb->bitmap_start) {
+		return ERR_FS_INVALID;
+	}
+	uint8_t *bits = calloc(nb, BM_E);
+	uint8_t *buf = malloc((size_t)SCAN_CHUNK * BLOCKSIZE);
+	if(!bits || !buf) {
+		free(bits);
+		free(buf);
+		return ERR_BUF;
+	}
+	for(int i = 0; i < nb; i += SCAN_CHUNK) {
+		int cnt = nb - i < SCAN_CHUNK ? nb - i : SCAN_CHUNK;
+		if(readBlocks(disk, sb->bitmap_start + i, cnt, buf) != 0) {
+			free(bits);
+			free(buf);
+			return ERR_DISK_READ;
+		}
+		for(int j = 0; j < cnt; j++) {
+			bitmap_disk *bm = (bitmap_disk *)(buf + (size_t)j * BLOCKSIZE);
+			if(bm->blocktype == BITMAP && bm->magic == MAGIC) memcpy(bits + (size_t)(i + j) * BM_E, bm->bits, BM_E);
+		}
+	}
+	free(buf);
+	*out = bits;
+	return TFS_SUCCESS;
+}
+
+//writes the bitmap back from owner[], for the blocks below limit
+static int rebuild_bitmap(int disk, int limit, const int32_t *owner, const superblock_disk *sb, tfsFsckReport *r) {
+	for(int i = 0; i * BM_BITS < limit; i++) {
+		bitmap_disk bm = {0};
+		bm.blocktype = BITMAP;
+		bm.magic = MAGIC;
+		for(int b = i * BM_BITS; b < limit && b < (i + 1) * BM_BITS; b++) {
+			if(owner[b] != OWN_NONE && owner[b] != OWN_FREE) bm.bits[(b % BM_BITS) / 8] |= 1 << (b % 8);
+		}
+		if(writeBlock(disk, sb->bitmap_start + i, &bm) != 0) return ERR_DISK_WRITE;
+		r->repaired++;
+	}
+	return TFS_SUCCESS;
+}
+
+//writes free headers for blocks lo..hi, each pointing at the one after it
+static int write_free_run(int disk, int lo, int hi, int *head, uint8_t *buf) {
+	for(int i = hi; i >= lo; i--) {
+		free_disk fr = {0};
+		fr.blocktype = FREE;
+		fr.magic = MAGIC;
+		fr.blk_next = *head;
+		memcpy(buf + (size_t)(i - lo) * BLOCKSIZE, &fr, BLOCKSIZE);
+		*head = i;
+	}
+	return writeBlocks(disk, lo, hi - lo + 1, buf) == 0 ? TFS_SUCCESS : ERR_DISK_WRITE;
+}
+
+//writes a fresh ascending free chain over every block nobody owns
+static int rebuild_free_chain(int disk, int nBlocks, const int32_t *owner, superblock_disk *sb, tfsFsckReport *r) {
+	uint8_t *buf = malloc((size_t)SCAN_CHUNK * BLOCKSIZE);
+	if(!buf) return ERR_BUF;
+	int head = 0;
+	int lo = -1, hi = -1;
+	//walk backwards so each header already knows its successor
+	for(int b = nBlocks - 1; b >= 1; b--) {
+		int isFree = b >= 2 && (owner[b] == OWN_NONE || owner[b] == OWN_FREE);
+		if(isFree && lo == b + 1 && hi - b < SCAN_CHUNK) {
+			lo = b;
+			continue;
+		}
+		if(lo >= 0) {
+			if(write_free_run(disk, lo, hi, &head, buf) != TFS_SUCCESS) { free(buf); return ERR_DISK_WRITE; }
+			r->repaired += hi - lo + 1;
+			lo = hi = -1;
+		}
+		if(isFree) lo = hi = b;
+	}
+	free(buf);
+	sb->free_block = head;
+	if(writeBlock(disk, SUPERBLOCK_BLOCK, sb) != 0) return ERR_DISK_WRITE;
+	r->repaired++;
+	return TFS_SUCCESS;
+}
+
+//reference counts from the refcount table, all NULL on images without one
+typedef struct ref_state {
+	int32_t *extra;		//extra references the table has for each block
+	int32_t *seen;		//extra references actually found
+	int32_t *tblk;		//table data block holding each group of REF_PER_BLOCK counts
+	int ntblk;
+} ref_state;
+
+//a second (third, ...) owner for b is fine when the table says it's shared
+static int share_ok(const ref_state *rs, const int32_t *owner, int b, int ino) {
+	return rs->extra && owner[b] > 0 && owner[b] != ino && rs->seen[b] < rs->extra[b];
+}
+
+//in a block map the same block can also come up again in the same file
+//(dedup), a map can't loop on it like a chain would
+static int map_share_ok(const ref_state *rs, const int32_t *owner, int b) {
+	return rs->extra && owner[b] > 0 && rs->seen[b] < rs->extra[b];
+}
+
+//reads the whole table into rs. a damaged table just loads short, its
+//inode gets checked like any other mapped file
+static int load_refs(int disk, const superblock_disk *sb, int limit, const uint8_t *type, ref_state *rs) {
+	rs->ntblk = (limit + REF_PER_BLOCK - 1) / REF_PER_BLOCK;
+	rs->extra = calloc(limit, sizeof(int32_t));
+	rs->seen = calloc(limit, sizeof(int32_t));
+	rs->tblk = calloc(rs->ntblk, sizeof(int32_t));
+	if(!rs->extra || !rs->seen || !rs->tblk) return ERR_BUF;
+	int ino = sb->refcount_inode;
+	if(ino < 2 || ino >= limit || type[ino] != INODE) return TFS_SUCCESS;
+	inode_disk in = {0};
+	if(readBlock(disk, ino, &in) != 0) return ERR_DISK_READ;
+	int hops = 0;
+	for(int b = in.blk_start; b >= 2 && b < limit && type[b] == INDEX && hops++ < limit; ) {
+		index_disk ix;
+		if(readBlock(disk, b, &ix) != 0) return ERR_DISK_READ;
+		for(int i = 0; i < IX_E; i++) {
+			int t = ix.base + i, d = ix.blk[i];
+			if(d < 2 || d >= limit || type[d] != FILEEXTENT || t < 0 || t >= rs->ntblk) continue;
+			fileextent_disk ext;
+			if(readBlock(disk, d, &ext) != 0) return ERR_DISK_READ;
+			rs->tblk[t] = d;
+			for(int s = 0; s < REF_PER_BLOCK && t * REF_PER_BLOCK + s < limit; s++) {
+				uint16_t count;
+				memcpy(&count, ext.data + s * 2, 2);
+				rs->extra[t * REF_PER_BLOCK + s] = count;
+			}
+		}
+		b = ix.blk_next;
+	}
+	return TFS_SUCCESS;
+}
+
+//compares the table with what the walk found, repair writes what was found
+static int check_refs(int disk, int limit, ref_state *rs, int flags, tfsFsckReport *r) {
+	for(int b = 0; b < limit; b++) {
+		if(rs->extra[b] == rs->seen[b]) continue;
+		if(flags & TFS_FSCK_VERBOSE) {
+			printf("fsck: block %d has refcount %d, %d found\n", b, rs->extra[b] + 1, rs->seen[b] + 1);
+		}
+		r->badRefcounts++;
+		int d = rs->tblk[b / REF_PER_BLOCK];
+		if(!(flags & TFS_FSCK_REPAIR) || d == 0) continue;
+		fileextent_disk ext;
+		if(readBlock(disk, d, &ext) != 0) return ERR_DISK_READ;
+		uint16_t count = (uint16_t)rs->seen[b];
+		memcpy(ext.data + (b % REF_PER_BLOCK) * 2, &count, 2);
+		if(writeBlock(disk, d, &ext) != 0) return ERR_DISK_WRITE;
+		r->repaired++;
+	}
+	return TFS_SUCCESS;
+}
+
+//points the inode or index block before a bad link at nothing
+static int cut_map(int disk, int ino, int prev) {
+	if(prev == 0) {
+		inode_disk in = {0};
+		if(readBlock(disk, ino, &in) != 0) return ERR_DISK_READ;
+		in.blk_start = 0;
+		return writeBlock(disk, ino, &in) == 0 ? TFS_SUCCESS : ERR_DISK_WRITE;
+	}
+	index_disk ix;
+	if(readBlock(disk, prev, &ix) != 0) return ERR_DISK_READ;
+	ix.blk_next = 0;
+	return writeBlock(disk, prev, &ix) == 0 ? TFS_SUCCESS : ERR_DISK_WRITE;
+}
+
+//walks a mapped file. the index chain comes from the scan, the entries have
+//to be read back from disk. repairs happen on the spot: bad entries become
+//holes and a bad link ends the chain. sets *bad and returns blocks owned
+static int check_map(int disk, const inode_ref *ir, int limit, const uint8_t *type, const int32_t *next,
+		     int32_t *owner, ref_state *rs, int flags, tfsFsckReport *r, int *bad) {
+	int verbose = flags & TFS_FSCK_VERBOSE;
+	int ino = ir->block;
+	int count = 0, prev = 0, prevBase = -1, lastData = 0;
+	for(int b = next[ino]; b != 0; ) {
+		index_disk ix;
+		int ok = b >= 2 && b < limit && type[b] == INDEX && owner[b] == OWN_NONE;
+		if(ok && readBlock(disk, b, &ix) != 0) return ERR_DISK_READ;
+		if(ok && (ix.base <= prevBase || ix.base % IX_E != 0)) ok = 0;
+		if(!ok) {
+			if(b >= 2 && b < limit && owner[b] > 0 && owner[b] != ino) r->crossLinked++;
+			if(verbose) printf("fsck: inode %d: bad index block %d\n", ino, b);
+			*bad = 1;
+			if(flags & TFS_FSCK_REPAIR) {
+				if(cut_map(disk, ino, prev) != TFS_SUCCESS) return ERR_DISK_WRITE;
+				r->repaired++;
+			}
+			break;
+		}
+		owner[b] = ino;
+		count++;
+		int changed = 0;
+		for(int i = 0; i < IX_E; i++) {
+			int e = ix.blk[i];
+			if(e == 0) continue;
+			//reserved and never written, there is no header to go by
+			int unwritten = e < 0;
+			if(unwritten) e = -e;
+			int64_t fblk = (int64_t)ix.base + i;
+			if(fblk * EX_E >= ir->size || e < 2 || e >= limit || (type[e] != FILEEXTENT && !unwritten) ||
+			   (owner[e] != OWN_NONE && !map_share_ok(rs, owner, e))) {
+				if(e >= 2 && e < limit && owner[e] > 0 && owner[e] != ino) {
+					if(verbose) printf("fsck: inode %d: block %d is cross-linked with inode %d\n", ino, e, owner[e]);
+					r->crossLinked++;
+				}else if(verbose) {
+					printf("fsck: inode %d: bad map entry %d for file block %lld\n", ino, e, (long long)fblk);
+				}
+				*bad = 1;
+				ix.blk[i] = 0;
+				changed = 1;
+				continue;
+			}
+			if(owner[e] == OWN_NONE) {
+				owner[e] = ino;
+				count++;
+			}else{
+				rs->seen[e]++;
+			}
+			if(e != lastData + 1) r->fileFragments++;
+			lastData = e;
+		}
+		if(changed && (flags & TFS_FSCK_REPAIR)) {
+			if(writeBlock(disk, b, &ix) != 0) return ERR_DISK_WRITE;
+			r->repaired++;
+		}
+		prev = b;
+		prevBase = ix.base;
+		b = ix.blk_next;
+	}
+	return count;
+}
+
+//where check_dir is in a directory's tree
+typedef struct dir_walk {
+	int ino;
+	int entries;
+	int bad;
+	char last[8];		//last name seen, they have to come in order
+	int depth;		//of the leaves, they all have to be at one
+} dir_walk;
+
+//walks the B-tree of directory dw->ino from node b, reading the nodes back
+//from disk. every entry bumps linked[] of the inode it names. returns the
+//node blocks claimed
+static int check_dir(int disk, int b, int depth, dir_walk *dw, int limit, const uint8_t *type,
+		     int32_t *owner, uint8_t *linked, int flags, tfsFsckReport *r) {
+	int verbose = flags & TFS_FSCK_VERBOSE;
+	dirnode_disk dn;
+	int ok = b >= 2 && b < limit && type[b] == DIRNODE && owner[b] == OWN_NONE && depth < 32;
+	if(ok && readBlock(disk, b, &dn) != 0) return ERR_DISK_READ;
+	if(ok && (dn.count < (depth ? DN_MIN : 1) || dn.count > DN_MAX)) ok = 0;
+	if(ok && dn.leaf && dw->depth >= 0 && dw->depth != depth) ok = 0;
+	if(!ok) {
+		if(b >= 2 && b < limit && owner[b] > 0 && owner[b] != dw->ino) r->crossLinked++;
+		if(verbose) printf("fsck: directory %d: bad node block %d\n", dw->ino, b);
+		dw->bad = 1;
+		return 0;
+	}
+	owner[b] = dw->ino;
+	if(dn.leaf) dw->depth = depth;
+	int count = 1;
+	for(int i = 0; i <= dn.count; i++) {
+		if(!dn.leaf) {
+			int got = check_dir(disk, dn.child[i], depth + 1, dw, limit, type, owner, linked, flags, r);
+			if(got < 0) return got;
+			count += got;
+		}
+		if(i == dn.count) break;
+		dir_entry *e = &dn.ent[i];
+		if(dw->entries > 0 && strncmp(e->name, dw->last, 8) <= 0) {
+			if(verbose) printf("fsck: directory %d: %.8s is out of order\n", dw->ino, e->name);
+			dw->bad = 1;
+		}
+		memcpy(dw->last, e->name, 8);
+		dw->entries++;
+		if(e->inode <= ROOT_INODE_BLOCK || e->inode >= limit || type[e->inode] != INODE) {
+			if(verbose) printf("fsck: directory %d: %.8s points at block %d, not an inode\n", dw->ino, e->name, e->inode);
+			dw->bad = 1;
+			continue;
+		}
+		if(linked[e->inode] < 255) linked[e->inode]++;
+	}
+	return count;
+}
+
+int tfs_fsck(char *diskname, int flags, int threads, tfsFsckReport *report) {
+	tfsFsckReport local;
+	tfsFsckReport *r = report ? report : &local;
+	memset(r, 0, sizeof(*r));
+	int verbose = flags & TFS_FSCK_VERBOSE;
+
+	int disk = openDiskEx(diskname, 0, (flags & TFS_FSCK_DIRECT) ? DISK_DIRECT : 0);
+	if(disk < 0) return ERR_DISK_OPEN;
+	int n = diskBlocks(disk);
+	superblock_disk sb = {0};
+	if(n < 3 || readBlock(disk, SUPERBLOCK_BLOCK, &sb) != 0) {
+		closeDisk(disk);
+		return ERR_DISK_READ;
+	}
+	if(sb.magic != MAGIC || sb.blocktype != SUPERBLOCK || !TFS_SB_SUPPORTED(&sb)) {
+		closeDisk(disk);
+		return ERR_FS_INVALID;
+	}
+	if(sb.nblocks > 0 && sb.nblocks < n) n = sb.nblocks;
+	r->nBlocks = n;
+	//on LAZYFREE images nothing at or past free_lazy was ever written, so
+	//the scan stops there and the rest counts as one free run
+	int limit = n;
+	if(sb.features & TFS_FEAT_LAZYFREE) {
+		if(sb.free_lazy < 2 || sb.free_lazy > n) {
+			closeDisk(disk);
+			return ERR_FS_INVALID;
+		}
+		limit = sb.free_lazy;
+	}
+
+	uint8_t *type = calloc(limit, 1);
+	int32_t *next = calloc(limit, sizeof(int32_t));
+	int32_t *owner = calloc(limit, sizeof(int32_t));
+	scan_job *jobs = NULL;
+	chain_fix *fixes = NULL;
+	uint8_t *bits = NULL;
+	uint8_t *linked = NULL;
+	int nfixes = 0;
+	ref_state rs = {0};
+	int rc = TFS_SUCCESS;
+	if(!type || !next || !owner) { rc = ERR_BUF; goto out; }
+
+	//pass 1: parallel sequential scan
+	if(threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > MAX_THREADS) threads = MAX_THREADS;
+	if(threads > limit / SCAN_CHUNK + 1) threads = limit / SCAN_CHUNK + 1;
+	if(threads < 1) threads = 1;
+	jobs = calloc(threads, sizeof(scan_job));
+	pthread_t tids[MAX_THREADS];
+	if(!jobs) { rc = ERR_BUF; goto out; }
+	int per = (limit + threads - 1) / threads;
+	for(int t = 0; t < threads; t++) {
+		jobs[t].disk = disk;
+		jobs[t].lo = t * per < limit ? t * per : limit;
+		jobs[t].hi = (t + 1) * per < limit ? (t + 1) * per : limit;
+		jobs[t].features = sb.features;
+		jobs[t].type = type;
+		jobs[t].next = next;
+		if(pthread_create(&tids[t], NULL, scan_range, &jobs[t]) != 0) {
+			//no thread, do the slice here
+			scan_range(&jobs[t]);
+			tids[t] = 0;
+		}
+	}
+	for(int t = 0; t < threads; t++) {
+		if(tids[t]) pthread_join(tids[t], NULL);
+		if(jobs[t].err) rc = jobs[t].err;
+	}
+	if(rc != TFS_SUCCESS) goto out;
+
+	if(sb.features & TFS_FEAT_REFCOUNT) {
+		if((rc = load_refs(disk, &sb, limit, type, &rs)) != TFS_SUCCESS) goto out;
+	}
+	if(sb.features & TFS_FEAT_BITMAP) {
+		if((rc = load_bitmap(disk, &sb, n, limit, &bits)) != TFS_SUCCESS) goto out;
+	}
+
+	//pass 2: follow the chains in memory. files go first so that when a
+	//block is claimed twice the free chain is what gets blamed
+	owner[SUPERBLOCK_BLOCK] = OWN_META;
+	owner[ROOT_INODE_BLOCK] = OWN_META;
+	r->usedBlocks = 2;
+	for(int i = 0; bits && i < sb.bitmap_blocks; i++) {
+		owner[sb.bitmap_start + i] = OWN_META;
+		r->usedBlocks++;
+	}
+	for(int t = 0; t < threads; t++) {
+		for(int i = 0; i < jobs[t].ninodes; i++) {
+			if(jobs[t].inodes[i].block > ROOT_INODE_BLOCK) owner[jobs[t].inodes[i].block] = jobs[t].inodes[i].block;
+		}
+	}
+	//directories next, every file has to be in exactly one of them
+	if(sb.features & TFS_FEAT_DIRS) {
+		if(!(linked = calloc(limit, 1))) { rc = ERR_BUF; goto out; }
+		for(int t = 0; t < threads; t++) {
+			for(int i = 0; i < jobs[t].ninodes; i++) {
+				inode_ref *ir = &jobs[t].inodes[i];
+				if(!ir->dir) continue;
+				dir_walk dw = { ir->block, 0, 0, "", -1 };
+				if(next[ir->block] != 0) {
+					int got = check_dir(disk, next[ir->block], 0, &dw, limit, type, owner, linked, flags, r);
+					if(got < 0) { rc = got; goto out; }
+					r->usedBlocks += got;
+				}
+				if(!dw.bad && dw.entries != ir->size) {
+					if(verbose) printf("fsck: directory %d has %d entries, size says %lld\n",
+							   ir->block, dw.entries, (long long)ir->size);
+					dw.bad = 1;
+				}
+				if(dw.bad) r->badDirs++;
+			}
+		}
+		for(int t = 0; t < threads; t++) {
+			for(int i = 0; i < jobs[t].ninodes; i++) {
+				int ino = jobs[t].inodes[i].block;
+				if(ino <= ROOT_INODE_BLOCK || jobs[t].inodes[i].system || linked[ino] == 1) continue;
+				if(verbose) printf("fsck: inode %d is in %d directories\n", ino, linked[ino]);
+				r->badDirs++;
+			}
+		}
+	}
+
+	for(int t = 0; t < threads; t++) {
+		for(int i = 0; i < jobs[t].ninodes; i++) {
+			int ino = jobs[t].inodes[i].block;
+			if(ino <= ROOT_INODE_BLOCK) continue;
+			if(jobs[t].inodes[i].dir) {
+				//its nodes were claimed above
+				r->dirs++;
+				r->usedBlocks++;
+				continue;
+			}
+			int64_t size = jobs[t].inodes[i].size;
+			int64_t need = size > 0 ? (size + EX_E - 1) / EX_E : 0;
+			int count = 0, prev = 0, runs = 0, bad = 0, shared = 0;
+			if(!jobs[t].inodes[i].system) r->files++;
+			r->usedBlocks++;
+			if(jobs[t].inodes[i].mapped) {
+				//holes are fine in a map, so there is no size to fix up
+				int before = r->fileFragments;
+				int got = check_map(disk, &jobs[t].inodes[i], limit, type, next, owner, &rs, flags, r, &bad);
+				if(got < 0) { rc = got; goto out; }
+				r->usedBlocks += got;
+				if(r->fileFragments - before > 1) r->fragmentedFiles++;
+				if(bad) r->badChains++;
+				continue;
+			}
+			for(int b = next[ino]; b != 0; b = next[b]) {
+				if(b < 2 || b >= limit || type[b] != FILEEXTENT) {
+					if(verbose) printf("fsck: inode %d: chain points at bad block %d\n", ino, b);
+					bad = 1;
+					break;
+				}
+				if(owner[b] != OWN_NONE && !share_ok(&rs, owner, b, ino)) {
+					if(owner[b] > 0 && owner[b] != ino) {
+						if(verbose) printf("fsck: inode %d: block %d is cross-linked with inode %d\n", ino, b, owner[b]);
+						r->crossLinked++;
+					}else if(verbose) {
+						printf("fsck: inode %d: chain loops at block %d\n", ino, b);
+					}
+					bad = 1;
+					break;
+				}
+				if(count == need) {
+					if(verbose) printf("fsck: inode %d: chain longer than size %lld\n", ino, (long long)size);
+					bad = 1;
+					break;
+				}
+				//a chain shared by clones is walked once per file
+				if(owner[b] == OWN_NONE) {
+					owner[b] = ino;
+				}else{
+					rs.seen[b]++;
+					shared++;
+				}
+				if(b != prev + 1) runs++;
+				count++;
+				prev = b;
+			}
+			if(count < need) {
+				if(verbose && !bad) printf("fsck: inode %d: chain has %d blocks, size %lld needs %lld\n",
+							   ino, count, (long long)size, (long long)need);
+				bad = 1;
+			}
+			r->usedBlocks += count - shared;
+			r->fileFragments += runs;
+			if(runs > 1) r->fragmentedFiles++;
+			if(!bad) continue;
+			r->badChains++;
+			chain_fix *nf = realloc(fixes, (nfixes + 1) * sizeof(chain_fix));
+			if(!nf) { rc = ERR_BUF; goto out; }
+			fixes = nf;
+			fixes[nfixes].inode = ino;
+			fixes[nfixes].cutAfter = prev;
+			fixes[nfixes].newSize = count < need ? (int64_t)count * EX_E : size;
+			nfixes++;
+		}
+	}
+
+	for(int b = 2; bits && b < limit; b++) {
+		if(BIT(bits, b)) continue;
+		if(owner[b] != OWN_NONE) {
+			if(verbose) printf("fsck: block %d is free in the bitmap but in use\n", b);
+			r->doubleRef++;
+			r->badFreeChain = 1;
+			continue;
+		}
+		owner[b] = OWN_FREE;
+		r->freeBlocks++;
+	}
+	for(int b = bits ? 0 : sb.free_block; b != 0; b = next[b]) {
+		if(b < 2 || b >= limit) {
+			if(verbose) printf("fsck: free chain points at bad block %d\n", b);
+			r->badFreeChain = 1;
+			break;
+		}
+		if(owner[b] != OWN_NONE) {
+			if(owner[b] == OWN_FREE) {
+				if(verbose) printf("fsck: free chain loops at block %d\n", b);
+			}else{
+				if(verbose) printf("fsck: block %d is on the free chain but in use\n", b);
+				r->doubleRef++;
+			}
+			r->badFreeChain = 1;
+			break;
+		}
+		if(type[b] != FREE) {
+			if(verbose) printf("fsck: free chain reaches block %d of type %d\n", b, type[b]);
+			r->badFreeChain = 1;
+			break;
+		}
+		owner[b] = OWN_FREE;
+		r->freeBlocks++;
+	}
+
+	r->freeBlocks += n - limit;
+	int run = 0;
+	for(int b = 2; b <= n; b++) {
+		if(b < limit && owner[b] == OWN_NONE) {
+			//with a broken free chain everything past the break shows up here
+			if(verbose && !r->badFreeChain) printf("fsck: block %d is leaked\n", b);
+			r->leaked++;
+		}
+		if(b < n && (b >= limit || owner[b] == OWN_FREE)) {
+			run++;
+			continue;
+		}
+		if(run == 0) continue;
+		r->freeRuns++;
+		r->freeRunHist[bucket(run)]++;
+		if(run > r->largestFreeRun) r->largestFreeRun = run;
+		run = 0;
+	}
+
+	if(verbose && r->badFreeChain && r->leaked) {
+		printf("fsck: %d blocks unreachable past the break in the free chain\n", r->leaked);
+	}
+
+	if(rs.extra) {
+		if((rc = check_refs(disk, limit, &rs, flags, r)) != TFS_SUCCESS) goto out;
+	}
+
+	if(flags & TFS_FSCK_REPAIR) {
+		for(int i = 0; i < nfixes; i++) {
+			inode_disk in = {0};
+			if(fixes[i].cutAfter != 0) {
+				fileextent_disk ext;
+				if(readBlock(disk, fixes[i].cutAfter, &ext) != 0) { rc = ERR_DISK_READ; goto out; }
+				ext.blk_next = 0;
+				if(writeBlock(disk, fixes[i].cutAfter, &ext) != 0) { rc = ERR_DISK_WRITE; goto out; }
+				r->repaired++;
+			}
+			if(readBlock(disk, fixes[i].inode, &in) != 0) { rc = ERR_DISK_READ; goto out; }
+			if(fixes[i].cutAfter == 0) in.blk_start = 0;
+			in.size_B = (int32_t)(uint32_t)fixes[i].newSize;
+			if(sb.features & TFS_FEAT_SIZE64) in.size_hi = (int32_t)(fixes[i].newSize >> 32);
+			if(writeBlock(disk, fixes[i].inode, &in) != 0) { rc = ERR_DISK_WRITE; goto out; }
+			r->repaired++;
+		}
+		if(bits && (r->badFreeChain || r->leaked > 0)) {
+			rc = rebuild_bitmap(disk, limit, owner, &sb, r);
+			if(rc != TFS_SUCCESS) goto out;
+		}else if(r->badFreeChain) {
+			rc = rebuild_free_chain(disk, limit, owner, &sb, r);
+			if(rc != TFS_SUCCESS) goto out;
+		}else if(r->leaked > 0) {
+			//chain is fine, just push the leaked blocks on the front of it
+			for(int b = limit - 1; b >= 2; b--) {
+				if(owner[b] != OWN_NONE) continue;
+				free_disk fr = {0};
+				fr.blocktype = FREE;
+				fr.magic = MAGIC;
+				fr.blk_next = sb.free_block;
+				if(writeBlock(disk, b, &fr) != 0) { rc = ERR_DISK_WRITE; goto out; }
+				sb.free_block = b;
+				r->repaired++;
+			}
+			if(writeBlock(disk, SUPERBLOCK_BLOCK, &sb) != 0) { rc = ERR_DISK_WRITE; goto out; }
+			r->repaired++;
+		}
+	}
+	rc = r->leaked + r->doubleRef + r->crossLinked + r->badChains + r->badFreeChain + r->badRefcounts + r->badDirs;
+
+out:
+	if(jobs) {
+		for(int t = 0; t < threads; t++) free(jobs[t].inodes);
+	}
+	free(jobs);
+	free(fixes);
+	free(bits);
+	free(linked);
+	free(type);
+	free(next);
+	free(owner);
+	free(rs.extra);
+	free(rs.seen);
+	free(rs.tblk);
+	closeDisk(disk);
+	return rc;
+}
+
+void tfs_fsckPrint(const tfsFsckReport *r) {
+	if(!r) return;
+	printf("blocks:      %d total, %d used, %d free, %d files, %d directories\n",
+	       r->nBlocks, r->usedBlocks, r->freeBlocks, r->files, r->dirs);
+	printf("problems:    %d leaked, %d double-referenced, %d cross-linked, %d bad chains, %d bad refcounts, %d bad directories%s\n",
+	       r->leaked, r->doubleRef, r->crossLinked, r->badChains, r->badRefcounts, r->badDirs,
+	       r->badFreeChain ? ", free chain broken" : "");
+	if(r->repaired) printf("repaired:    %d blocks rewritten\n", r->repaired);
+	printf("fragments:   %d runs over %d files, %d files fragmented\n",
+	       r->fileFragments, r->files, r->fragmentedFiles);
+	printf("free space:  %d runs, largest %d blocks\n", r->freeRuns, r->largestFreeRun);
+	for(int i = 0; i < TFS_FSCK_HIST; i++) {
+		if(r->freeRunHist[i] == 0) continue;
+		if(i == TFS_FSCK_HIST - 1) {
+			printf("  %6d+       blocks: %d\n", 1 << i, r->freeRunHist[i]);
+		}else{
+			printf("  %6d-%-6d blocks: %d\n", 1 << i, (1 << (i + 1)) - 1, r->freeRunHist[i]);
+		}
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef LIBFSCK_H
+#define LIBFSCK_H
+/*
+ *
+ * libFsck header, offline consistency checker for tinyFS images
+ *
+ */
+
+#include <stdint.h>
+
+/* flags for tfs_fsck */
+#define TFS_FSCK_REPAIR 1	//fix what it finds instead of only reporting
+#define TFS_FSCK_VERBOSE 2	//print every problem as it is found
+#define TFS_FSCK_DIRECT 4	//read the image with O_DIRECT, past the host page cache
+
+/* free run histogram buckets, bucket i counts runs of [2^i, 2^(i+1)) blocks,
+   the last one everything bigger */
+#define TFS_FSCK_HIST 16
+
+typedef struct tfsFsckReport {
+	int32_t nBlocks;
+	int32_t files;
+	int32_t dirs;		//directories besides the root
+	int32_t usedBlocks;	//superblock, root, inodes and reachable extents
+	int32_t freeBlocks;	//blocks on the free chain (clear in the bitmap)
+
+	//problems
+	int32_t leaked;		//not in any file and not on the free chain
+	int32_t doubleRef;	//in a file and on the free chain
+	int32_t crossLinked;	//in more than one file
+	int32_t badChains;	//files whose chain or block map is broken or doesn't match size_B
+	int32_t badFreeChain;	//1 if the free chain itself is broken, or the bitmap marks used blocks free
+	int32_t badRefcounts;	//shared blocks whose refcount doesn't match the files using them
+	int32_t badDirs;	//broken directory trees, and files in no directory or in more than one
+	int32_t repaired;	//blocks rewritten by a repair run
+
+	//layout statistics
+	int32_t fileFragments;	//contiguous runs summed over all files
+	int32_t fragmentedFiles;//files made of more than one run
+	int32_t freeRuns;
+	int32_t largestFreeRun;
+	int32_t freeRunHist[TFS_FSCK_HIST];
+} tfsFsckReport;
+
+/* tfs_fsck() checks the unmounted image diskname. The image is read in
+large sequential chunks by threads worker threads (0 = one per CPU), then
+the free chain and every file's extent chain or block map are followed in
+memory. With TFS_FSCK_REPAIR set, damaged chains are cut at the first bad
+block, sizes are fixed to match, bad block map entries become holes,
+refcounts are set to the number of files found sharing each block, and
+leaked blocks go back on the free chain (the whole free chain is rebuilt if
+it was the thing that was broken). On TFS_FEAT_BITMAP images the bitmap
+takes the free chain's place: a block in use whose bit is clear counts as
+doubleRef, one nobody uses whose bit is set as leaked, and repair rewrites
+the bitmap from what the files use. On TFS_FEAT_DIRS images every
+directory's B-tree is walked too: its nodes have to be well formed and in
+order, its entry count has to match, and every file has to be in exactly one
+directory. Those problems are only reported, repair leaves directories
+alone. Returns the number of problems found, 0
+for a clean image, or a negative TinyFS error. report may be NULL. */
+int tfs_fsck(char *diskname, int flags, int threads, tfsFsckReport *report);
+
+/* prints a report the way the tfs_fsck tool shows it */
+void tfs_fsckPrint(const tfsFsckReport *report);
+
+#endif
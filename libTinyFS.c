@@ -4,52 +4,318 @@
 *
 */
 
+#define _GNU_SOURCE
 #include "libTinyFS.h"
 #include "libDisk.h"
 #include "TinyFS_errno.h"
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
 #include "blocktypes.h"
 
-//maximum open files at a time
-#define MAX_OPEN_FILES 20
+//one per open file, shared by every FD that has it open
+typedef struct open_inode {
+	int inodeBlock;		//block number where the inode is stored
+	int dirBlock;		//inode block of the directory it is in
+	char name[9];       //name of the file
+	int refs;		//FDs open on this inode
+	int firstFD;		//head of the list of those FDs
+	int32_t lazyAtime;	//lazytime: atime not written to the inode yet, 0 = none
+	int32_t lazySince;	//when lazyAtime was first held back
+	struct open_inode *hashNext;
+} OpenInode;
 
 typedef struct open_file {
 	int inUse;	        //1 if this entry is in use, 0 otherwise
-	int inodeBlock;		//block number where the inode is stored
-	int filePointer; 	// current read/write position in file
-	char name[9];       //name of the file
+	int64_t filePointer; 	// current read/write position in file
+	OpenInode *ino;
+	int nextFD;		//next FD open on the same inode, -1 ends the list
 } OpenFileEntry;
 
-//static resource table
-static OpenFileEntry openFiles[MAX_OPEN_FILES];
+//resource table, grows as needed. unused FD numbers sit on a stack so
+//handing one out doesn't scan the table
+static OpenFileEntry *openFiles = NULL;
+static int openFilesCap = 0;
+static int *freeFDs = NULL;
+static int nFreeFDs = 0;
+
+//open inodes hashed by directory and name, for the already-open check in tfs_openFile
+static OpenInode **nameHash = NULL;
+static int nameHashSize = 0;
+static int openInodeCount = 0;
+
+//mapped (sparse) files. a map_cursor remembers where it is in the index
+//chain so a run of blocks doesn't go back to blk_start for every one
+typedef struct map_cursor {
+	inode_disk *in;		//blk_start changes here when the head of the chain does
+	int prev;		//index block before cur, 0 when cur is the head
+	int prevBase;
+	int cur;		//index block loaded in ix, 0 past the end of the chain
+	int dirty;		//ix has to be written back before moving on
+	index_disk ix;
+} map_cursor;
+
+//what a defrag call knows about the image, see defrag_scan
+typedef struct defrag_state {
+	uint8_t *type;		//blocktype of every block below limit, 0 if not a valid block
+	int limit;
+	int moved;		//blocks relocated so far
+	int from;		//where defrag_find_run starts looking
+	int chained;		//the free chain is still the one defrag_free_chain wrote from type[]
+	int *changed;		//blocks this call freed or took, see defrag_set
+	int nChanged, capChanged;
+} defrag_state;
+
+//how far defrag_file goes with a file
+#define DEFRAG_FRAGMENTED 0	//only move it if it isn't one run
+#define DEFRAG_COMPACT 1	//also move a run down if there is room lower
+#define DEFRAG_EVICT 2		//always move it, to the first run from ds->from up
+
+
+//one submitted async operation, see tfs_submit_*
+typedef struct aio_req {
+	int op;
+	uint64_t tag;
+	fileDescriptor FD;
+	char *buffer;
+	int size;
+	int64_t offset;
+	char *name;		//open: copy of the name
+	struct aio_req *next;
+} aio_req;
 
 
 //Only a single disk may be mounted at a time.
 static int disk_no = -1;
+//feature bits and size of the mounted fs, from the superblock
+static uint32_t fs_features = 0;
+static int fs_blocks = 0;
+//inode of the refcount table, 0 until something has been cloned
+static int fs_refInode = 0;
+//where tfs_defragFs picks up, an inode block
+static int defragNext = 2;
+//the block types defrag_scan found, kept for the next call (NULL when there
+//are none). blocks written since are marked in defragDirty and looked at
+//again instead of the whole image, see blk_write
+static uint8_t *defragType = NULL;
+static uint8_t *defragDirty = NULL;
+static int defragNDirty = 0;
+static int defragUsed = 0;	//used_limit() when defragType was last up to date
+static int defragChained = 0;	//the free chain is in defragType's order
+//blocks export/import move per readBlocks/writeBlocks call (64KB)
+#define XFER_BLOCKS 256
+//TFS_MOUNT_* flags of the current mount
+static int mountFlags = 0;
+//bitmap images: first bitmap block, the bitmap block last loaded (kept in
+//bmBuf and written through, 0 for none) and the lowest block that might be free
+static int fs_bmStart = 0;
+static int fs_bmBlocks = 0;
+static bitmap_disk bmBuf;
+static int bmCached = 0;
+static int bmHint = 0;
+//TFS_MOUNT_DISCARD: freed ranges that haven't been punched out yet
+#define DISCARD_BATCH 64
+typedef struct discard_range {
+	int start;
+	int count;
+} discard_range;
+static discard_range discardQ[DISCARD_BATCH];
+static int nDiscard = 0;
+//allocation cache: free blocks are taken off the free chain (or set in the
+//bitmap) ALLOC_BATCH at a time with one superblock write and handed out
+//from here, the last one in goes out first. freed blocks land here too until
+//there are ALLOC_SPILL, then the older ones go back in one go. on disk the
+//cached blocks are just leaked, so a crash loses nothing fsck -r can't fix
+#define ALLOC_BATCH 32
+#define ALLOC_SPILL 64
+static int allocCache[ALLOC_SPILL];
+static int nAlloc = 0;
+//log-structured images (TFS_FEAT_LOG): blocks are handed out going up from
+//logHead, which jumps to the next completely free segment of LOG_SEG blocks
+//whenever it reaches the end of one (see log_take). logNoClean is set once
+//a search found no free segment, the head then threads through the partly
+//used ones until something is freed
+#define LOG_SEG 256
+//tfs_cleanLog only empties segments that are at most this full
+#define LOG_CLEAN_LIVE (LOG_SEG * 3 / 4)
+static int logHead = 0;
+static int logNoClean = 0;
+//allocation policy of the mount (TFS_ALLOC_*, see tfs_setAllocPolicy). the
+//ones other than TFS_ALLOC_CACHE search the bitmap themselves, next-fit from
+//allocNext and near from allocGoal, which the write paths set to the inode
+//(or the block before) they are writing for
+static int allocPolicy = TFS_ALLOC_CACHE;
+static int allocNext = 2;
+static int allocGoal = 0;
+//log images and the allocation policies don't reuse freed blocks straight
+//away: they wait here and have their bits cleared in sorted batches
+static int freedQ[ALLOC_SPILL];
+static int nFreedQ = 0;
+//TFS_MOUNT_DEDUP: hash of a block's payload -> a block written with it this
+//mount, one entry per slot and the newest wins. dedupLive has a bit per
+//block that is cleared when the block is freed, an entry only counts while
+//it is set (and the bytes still match)
+#define DEDUP_SLOTS (1 << 16)
+typedef struct dedup_entry {
+	uint64_t hash;
+	int32_t block;
+} dedup_entry;
+static dedup_entry *dedupTab = NULL;
+static uint8_t *dedupLive = NULL;
+//TFS_MOUNT_SHARED: the processes that have the image mounted share this
+//through a POSIX shared memory segment named after it. lock (robust and
+//process shared) is held for the length of every call that touches the
+//image, gen counts those calls so a process can tell whether anyone else
+//was in since its own last one and what it keeps from the superblock and
+//the bitmap block in bmBuf may be stale. sharedDepth lets calls that call
+//each other take it once. moves[] tells the others about inodes whose block
+//or name changed under their FDs, see shared_note
+#define SHARED_MOVES 4096
+//how long a mount waits for another one to set the segment up before it
+//takes that one to have died halfway
+#define SHARED_SETUP_MS 1000
+typedef struct shared_move {
+	int32_t block;		//inode block the change was to
+	int32_t to;		//0 deleted, block renamed, anything else moved there
+	int32_t dir;		//renamed: the directory it is in now
+} shared_move;
+typedef struct shared_seg {
+	volatile int state;	//0 new, 2 ready, odd while being set up
+	pthread_mutex_t lock;
+	uint64_t gen;
+	uint64_t nMoves;	//every note so far, the last SHARED_MOVES are kept
+	shared_move moves[SHARED_MOVES];
+} shared_seg;
+static shared_seg *sharedSeg = NULL;
+static uint64_t sharedGen = 0;
+static uint64_t sharedMovesSeen = 0;
+static __thread int sharedDepth = 0;
+//first thing in a call that touches the image, the lock goes when it returns.
+//callLock is taken with it on every mount, so the async worker and the
+//caller's own blocking calls take turns instead of racing on the tables
+#define SHARED_CALL int sharedHeld __attribute__((cleanup(shared_leave))) = shared_enter()
+static pthread_mutex_t callLock = PTHREAD_MUTEX_INITIALIZER;
+//relatime updates an atime that is newer than mtime and ctime once it is this old
+#define ATIME_RELAX (24 * 60 * 60)
+//lazytime writes a held back atime once it is this old, even if the file stays open
+#define LAZYTIME_EXPIRE (12 * 60 * 60)
+
+//async worker: submissions wait on aioHead, finished ones on aioDone until
+//polled. one lock covers both queues, the worker drops it while it runs an
+//operation. aioEvent is an eventfd that counts up while aioDone is non empty
+static pthread_mutex_t aioLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aioWake = PTHREAD_COND_INITIALIZER;
+static pthread_t aioThread;
+static int aioRunning = 0;
+static int aioStop = 0;
+static aio_req *aioHead = NULL, *aioTail = NULL;
+static tfsCompletion *aioDone = NULL;
+static int aioDoneN = 0, aioDoneCap = 0;
+static int aioEvent = -1;
 
 //helper prototypes
 static void initOpenFilesTable(void);
 static int findFreeFileSlot(void);
 static int isValidFD(fileDescriptor FD);
+static void releaseFileSlot(fileDescriptor FD);
+static OpenInode *lookupOpenInode(int dir, const char *name);
+static int hashInsert(OpenInode *ino);
+static void hashRemove(OpenInode *ino);
 static int findInodeByName(const char *name);
-static int findOrCreateInode(const char *name);
+static int findOrCreateInode(int dir, const char *name);
 int allocate_free_block(void);
 int free_block(int block);
 static int load_inode_from_fd(fileDescriptor FD, inode_disk *inodeOut, int *blkNumOut);
+static int64_t inode_size(const inode_disk *in);
+static void inode_set_size(inode_disk *in, int64_t size);
+static int used_limit(void);
+static int map_start(map_cursor *mc, inode_disk *in);
+static int map_flush(map_cursor *mc);
+static int map_find(map_cursor *mc, int base, int create);
+static int map_unlink(map_cursor *mc);
+static int map_get(map_cursor *mc, int64_t fblk);
+static void map_release(inode_disk *in, int freeData);
+static int map_convert(inode_disk *in);
+static int map_read(inode_disk *in, int64_t fp, char *buffer, int size);
+static int map_zero(map_cursor *mc, int64_t fblk, int from, int to);
+static int blk_write(int block, void *data);
+static int blks_write(int block, int n, void *data);
+static void defrag_drop(void);
+static int defrag_scan(defrag_state *ds);
+static void defrag_done(defrag_state *ds, int rc);
+static void defrag_note(defrag_state *ds, int block);
+static void defrag_set(defrag_state *ds, int block, int type);
+static int defrag_file(defrag_state *ds, int inodeBlock, int mode);
+static int defrag_find_run(defrag_state *ds, int n);
+static int defrag_free_chain(defrag_state *ds);
+static int log_move_meta(defrag_state *ds, int block, int32_t *owner);
+static int64_t defrag_ms(void);
+static int file_blocks(inode_disk *in, int **blocks, int *n, int *nIndex);
+static int refs_init(void);
+static int refs_get(int block);
+static int refs_adjust(int *blocks, int n, int delta);
+static int refs_drop(int block);
+static int dedup_find(const fileextent_disk *ext);
+static void dedup_add(const fileextent_disk *ext, int block);
+static void dedup_forget(int block);
+static void dedup_stop(void);
+static int shared_open(const char *diskname);
+static int shared_enter(void);
+static void shared_leave(int *held);
+static void shared_close(void);
+static void shared_note(int block, int to, int dir);
+static void fds_moved(int block, int to);
+static int chain_release(int start);
+static void atime_update(OpenInode *ino, inode_disk *in);
+static void lazy_merge(OpenInode *ino, inode_disk *in);
+static void lazy_flush(OpenInode *ino);
+static void fill_info(tfsFileInfo *info, inode_disk *in, int blk, OpenInode *ino);
+static int host_writev(int fd, struct iovec *iov, int n);
+static int64_t host_readv(int fd, struct iovec *iov, int n);
+static int aio_submit(aio_req *r);
+static void aio_stop(void);
+static int bm_load(int block);
+static int bm_mark(int block, int n, int used);
+static int bm_find(int limit);
+static int bm_test(int block);
+static int bm_release(int *blocks, int n);
+static int log_take(superblock_disk *sb, int *got);
+static int freed_flush(void);
+static int policy_alloc(int *blocks, int n);
+static int policy_bestfit(int need, int lazy, int *start);
+static int policy_claim(int block, int n, superblock_disk *sb);
+static int log_checkpoint(void);
+static void discard_add(int block);
+static void discard_flush(void);
+static int alloc_refill(void);
+static int alloc_spill(int n);
+static int cmp_int(const void *a, const void *b);
+static int path_walk(const char *path, int *dirOut, char *leaf);
+static int dir_resolve(const char *path);
+static int dir_lookup(int dir, const char *name);
+static int dir_add(int dir, const char *name, int inode);
+static int dir_del(int dir, const char *name);
+static int dir_list(int dir, tfsFileInfo *infos, int max);
+static int dirs_enable(void);
 
 
-int tfs_mkfs(char *filename, int nBytes) {
+static int mkfs_common(char *filename, int64_t nBytes, uint32_t features) {
 	if(!filename) return ERR_FS_NAME;
 	if(strlen(filename) == 0) return ERR_FS_NAME;
 	// block 0: superblock
 	// block 1: root inode
-	int nb = nBytes;
-	nb -= (nb % BLOCKSIZE);
-	//nb is now a multiple of BLOCKSIZE
-	//now use the libDisk
-	int disk = openDisk(filename, nBytes);
+	//now use the libDisk, it rounds nBytes down to a multiple of BLOCKSIZE
+	int disk = openDisk64(filename, nBytes);
 	if(disk < 0) { return ERR_DISK_OPEN; }
 	//disk is now open, write to it. Remember that a disk is just a black box (file)
 	
@@ -59,6 +325,38 @@ int tfs_mkfs(char *filename, int nBytes) {
 	sb.magic = 0x44;
 	sb.root_inode = ROOT_INODE_BLOCK;	// block 1 = root inode
 	sb.free_block = 2;			// block 2 = free (first).
+	sb.features = features | TFS_FEAT_DIRS;
+	sb.version = TFS_VERSION;
+	int blocks = diskBlocks(disk);
+	if(blocks < 3) { printf("What do do in this situation??\n"); closeDisk(disk); return -1; }
+	if(features & TFS_FEAT_LAZYFREE) {
+		//nothing to write for the free space, it starts out as the lazy region.
+		//an old image file being reused gives its blocks back to the host
+		discardBlocks(disk, 0, blocks);
+		sb.nblocks = blocks;
+		sb.free_block = 0;
+		sb.free_lazy = 2;
+	}
+	if(features & TFS_FEAT_BITMAP) {
+		//the bitmap goes right after the root, only the blocks holding the
+		//bits of the metadata are written
+		sb.bitmap_start = 2;
+		sb.bitmap_blocks = (blocks + BM_BITS - 1) / BM_BITS;
+		sb.free_lazy = 2 + sb.bitmap_blocks;
+		sb.log_head = sb.free_lazy;
+		for(int i = 0; i * BM_BITS < sb.free_lazy; i++) {
+			bitmap_disk bm = {0};
+			bm.blocktype = BITMAP;
+			bm.magic = MAGIC;
+			for(int b = i * BM_BITS; b < sb.free_lazy && b < (i + 1) * BM_BITS; b++) {
+				bm.bits[(b % BM_BITS) / 8] |= 1 << (b % 8);
+			}
+			if(writeBlock(disk, sb.bitmap_start + i, &bm) != TFS_SUCCESS) {
+				closeDisk(disk);
+				return ERR_DISK_WRITE;
+			}
+		}
+	}
 
 	if (writeBlock(disk, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) {
         	closeDisk(disk);
@@ -71,7 +369,7 @@ int tfs_mkfs(char *filename, int nBytes) {
 	strcpy(rin.name, "/");
 	rin.size_B = 0;
 	rin.blk_start = 0;	//we're using 0 now instead of -1
-	rin.metaflags = INODE_INITIAL_FLAGS; 
+	rin.metaflags = INODE_INITIAL_FLAGS | INODE_DIR;
 
 	// new: initialize root inode timestamps
 	time_t now = time(NULL);
@@ -84,26 +382,55 @@ int tfs_mkfs(char *filename, int nBytes) {
 		return ERR_DISK_WRITE;
 	}
 	//fill the rest with free blocks
-	int blocks = nb / BLOCKSIZE;
-	if(blocks < 3) { printf("What do do in this situation??\n"); closeDisk(disk); return -1; }
-
-	for(int i = 2; i < blocks; i++) {
-		printf("setting block %d to free\n", i);
-		struct free_disk free = {0};
-		free.blocktype = FREE;
-		free.magic = MAGIC;
-		free.blk_next = (i != blocks - 1) ? i + 1 : 0;	//quickly sets up the rest as free, last -> 0
-		if(writeBlock(disk, i, &free) != TFS_SUCCESS) {
-			closeDisk(disk);
-			return ERR_DISK_WRITE;
-		}		
-	} 
+	if(!(features & TFS_FEAT_LAZYFREE)) {
+		for(int i = 2; i < blocks; i++) {
+			printf("setting block %d to free\n", i);
+			struct free_disk free = {0};
+			free.blocktype = FREE;
+			free.magic = MAGIC;
+			free.blk_next = (i != blocks - 1) ? i + 1 : 0;	//quickly sets up the rest as free, last -> 0
+			if(writeBlock(disk, i, &free) != TFS_SUCCESS) {
+				closeDisk(disk);
+				return ERR_DISK_WRITE;
+			}		
+		} 
+	}
+	closeDisk(disk);
 	return TFS_SUCCESS;
 }
 
+int tfs_mkfs(char *filename, int nBytes) {
+	return mkfs_common(filename, nBytes, 0);
+}
+
+//64 bit variant: file sizes past 2GB and no free chain to write up front,
+//so a multi hundred GB image is made in the time it takes to write 2 blocks
+int tfs_mkfs64(char *filename, int64_t nBytes) {
+	return tfs_mkfsEx(filename, nBytes, TFS_MKFS_64);
+}
+
+int tfs_mkfsEx(char *filename, int64_t nBytes, int flags) {
+	uint32_t features = 0;
+	if(flags & TFS_MKFS_64) features |= TFS_FEAT_SIZE64 | TFS_FEAT_LAZYFREE;
+	//the bitmap doesn't cover the lazy region, free_lazy still marks where it starts
+	if(flags & TFS_MKFS_BITMAP) features |= TFS_FEAT_BITMAP | TFS_FEAT_LAZYFREE;
+	//the log finds free blocks through the bitmap, freeing one writes nothing there
+	if(flags & TFS_MKFS_LOG) features |= TFS_FEAT_LOG | TFS_FEAT_BITMAP | TFS_FEAT_LAZYFREE;
+	if(features == 0 && nBytes > INT32_MAX) return ERR_DISK_OPEN;
+	return mkfs_common(filename, nBytes, features);
+}
+
 int tfs_mount(char *diskname){
+	return tfs_mountEx(diskname, 0);
+}
+
+int tfs_mountEx(char *diskname, int flags){
 	if(disk_no != -1) return ERR_ALREADY_MOUNTED;
-	int disk_attempt_open = openDisk(diskname, 0); //dont overwrite.
+	//the dedup index only sees this process's writes and frees, and the
+	//others wouldn't see blocks held back in this one's writeback cache
+	if((flags & TFS_MOUNT_SHARED) && (flags & (TFS_MOUNT_DEDUP | TFS_MOUNT_WRITEBACK))) return ERR_NOT_SUPPORTED;
+	int diskFlags = ((flags & TFS_MOUNT_DIRECT) ? DISK_DIRECT : 0) | ((flags & TFS_MOUNT_WRITEBACK) ? DISK_WRITEBACK : 0);
+	int disk_attempt_open = openDiskEx(diskname, 0, diskFlags); //dont overwrite.
 	if(disk_attempt_open < 0) { return ERR_DISK_OPEN; }
 	disk_no = disk_attempt_open;
 	superblock_disk sb = {0};
@@ -118,76 +445,261 @@ int tfs_mount(char *diskname){
 		disk_no = -1;
 		return ERR_FS_INVALID;
 	}
+	//made by a newer version that knows things we don't
+	if(!TFS_SB_SUPPORTED(&sb) ||
+			((sb.features & TFS_FEAT_BITMAP) && !(sb.features & TFS_FEAT_LAZYFREE)) ||
+			((sb.features & TFS_FEAT_LOG) && !(sb.features & TFS_FEAT_BITMAP))) {
+		closeDisk(disk_no);
+		disk_no = -1;
+		return ERR_FS_INVALID;
+	}
+	//the log head is this process's alone
+	if((flags & TFS_MOUNT_SHARED) && (sb.features & TFS_FEAT_LOG)) {
+		closeDisk(disk_no);
+		disk_no = -1;
+		return ERR_NOT_SUPPORTED;
+	}
+	fs_features = sb.features;
+	fs_blocks = sb.nblocks ? sb.nblocks : diskBlocks(disk_no);
+	fs_refInode = (sb.features & TFS_FEAT_REFCOUNT) ? sb.refcount_inode : 0;
+	fs_bmStart = (sb.features & TFS_FEAT_BITMAP) ? sb.bitmap_start : 0;
+	fs_bmBlocks = (sb.features & TFS_FEAT_BITMAP) ? sb.bitmap_blocks : 0;
+	bmCached = 0;
+	bmHint = 2;
+	nDiscard = 0;
+	nAlloc = 0;
+	nFreedQ = 0;
+	logNoClean = 0;
+	allocPolicy = TFS_ALLOC_CACHE;
+	allocNext = 2;
+	allocGoal = 0;
+	logHead = sb.log_head >= 2 && sb.log_head < fs_blocks ? sb.log_head : sb.free_lazy;
+	mountFlags = flags;
+	dedup_stop();
+	if(flags & TFS_MOUNT_DEDUP) {
+		dedupTab = calloc(DEDUP_SLOTS, sizeof(dedup_entry));
+		dedupLive = calloc(fs_blocks / 8 + 1, 1);
+		if(!dedupTab || !dedupLive) {
+			dedup_stop();
+			closeDisk(disk_no);
+			disk_no = -1;
+			return ERR_BUF;
+		}
+	}
+	if((flags & TFS_MOUNT_SHARED) && shared_open(diskname) < 0) {
+		closeDisk(disk_no);
+		disk_no = -1;
+		return ERR_DISK_OPEN;
+	}
 	//initialize the open files table
 	initOpenFilesTable();
+	defragNext = 2;
 	return TFS_SUCCESS;
 }
 
 int tfs_unmount(void) {
 	if(disk_no == -1) return ERR_NOT_MOUNTED;
-	if(closeDisk(disk_no) != TFS_SUCCESS) return ERR_DISK_CLOSE; 
+	//let submitted operations finish against this mount
+	aio_stop();
+	int held = shared_enter();
+	//atimes lazytime held back
+	for (int i = 0; i < openFilesCap; i++) {
+		if (openFiles[i].inUse) lazy_flush(openFiles[i].ino);
+	}
+	//the blocks still cached go back on the free chain
+	int rc = alloc_spill(nAlloc);
+	nAlloc = 0;
+	if(rc >= 0) rc = freed_flush();
+	if(rc >= 0) rc = log_checkpoint();
+	discard_flush();
+	dedup_stop();
+	defrag_drop();
+	shared_leave(&held);
+	shared_close();
+	//writes the writeback cache out, the disk is closed even if that fails
+	int closed = closeDisk(disk_no);
 	disk_no = -1;
-	return TFS_SUCCESS;
+	if(closed != TFS_SUCCESS) return ERR_DISK_CLOSE;
+	return rc < 0 ? rc : TFS_SUCCESS;
+}
+
+int tfs_sync(void) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	for (int i = 0; i < openFilesCap; i++) {
+		if (openFiles[i].inUse) lazy_flush(openFiles[i].ino);
+	}
+	return diskSync(disk_no) == TFS_SUCCESS ? TFS_SUCCESS : ERR_DISK_WRITE;
+}
+
+int tfs_fsync(fileDescriptor FD) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!isValidFD(FD)) return ERR_FD_INVALID;
+	lazy_flush(openFiles[FD].ino);
+	//the cache doesn't know which file a block is for, the inode and the
+	//free space it changed have to go with the data anyway
+	return diskSync(disk_no) == TFS_SUCCESS ? TFS_SUCCESS : ERR_DISK_WRITE;
 }
 
 
 
-// helper that initialize the open files table 
+// helper that initialize the open files table, dropping whatever the last mount left open
 static void initOpenFilesTable(void) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        openFiles[i].inUse = 0;
-        openFiles[i].inodeBlock = -1;
-        openFiles[i].filePointer = 0;
-        openFiles[i].name[0] = '\0';
+    for (int i = 0; i < openFilesCap; i++) {
+        if (openFiles[i].inUse) releaseFileSlot(i);
     }
+    free(openFiles);
+    free(freeFDs);
+    free(nameHash);
+    openFiles = NULL;
+    freeFDs = NULL;
+    nameHash = NULL;
+    openFilesCap = nFreeFDs = nameHashSize = openInodeCount = 0;
 }
 
-// helper that find a free slot in the open files table */
+// helper that find a free slot in the open files table, grows it when none is left
 static int findFreeFileSlot(void) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (!openFiles[i].inUse) {
-            return i;
+    if (nFreeFDs == 0) {
+        int ncap = openFilesCap ? openFilesCap * 2 : 16;
+        OpenFileEntry *nf = realloc(openFiles, ncap * sizeof(OpenFileEntry));
+        if (!nf) return -1;
+        openFiles = nf;
+        int *ns = realloc(freeFDs, ncap * sizeof(int));
+        if (!ns) return -1;
+        freeFDs = ns;
+        // push high numbers first so the lowest FD comes off the stack next
+        for (int i = ncap - 1; i >= openFilesCap; i--) {
+            openFiles[i].inUse = 0;
+            openFiles[i].filePointer = 0;
+            openFiles[i].ino = NULL;
+            openFiles[i].nextFD = -1;
+            freeFDs[nFreeFDs++] = i;
         }
+        openFilesCap = ncap;
     }
-    return -1;
+    return freeFDs[--nFreeFDs];
+}
+
+// helper that clears an FD, the inode entry goes with its last FD
+static void releaseFileSlot(fileDescriptor FD) {
+    OpenInode *ino = openFiles[FD].ino;
+    for (int *p = &ino->firstFD; *p != -1; p = &openFiles[*p].nextFD) {
+        if (*p == FD) {
+            *p = openFiles[FD].nextFD;
+            break;
+        }
+    }
+    if (--ino->refs == 0) {
+        lazy_flush(ino);
+        hashRemove(ino);
+        free(ino);
+    }
+    openFiles[FD].inUse = 0;
+    openFiles[FD].filePointer = 0;
+    openFiles[FD].ino = NULL;
+    openFiles[FD].nextFD = -1;
+    freeFDs[nFreeFDs++] = FD;
 }
 
 // helper that checks if a fd is valid
 static int isValidFD(fileDescriptor FD) {
-    if (FD < 0 || FD >= MAX_OPEN_FILES) return 0;
+    if (FD < 0 || FD >= openFilesCap) return 0;
     if (!openFiles[FD].inUse) return 0;
     return 1;
 }
 
+// FNV-1a over the directory and the name, names are at most 8 chars
+static unsigned nameHashOf(int dir, const char *name) {
+    unsigned h = 2166136261u ^ (unsigned)dir;
+    for (int i = 0; i < 8 && name[i]; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static OpenInode *lookupOpenInode(int dir, const char *name) {
+    if (nameHashSize == 0) return NULL;
+    OpenInode *ino = nameHash[nameHashOf(dir, name) & (nameHashSize - 1)];
+    for (; ino; ino = ino->hashNext) {
+        if (ino->dirBlock == dir && strncmp(ino->name, name, 8) == 0) return ino;
+    }
+    return NULL;
+}
+
+static int hashInsert(OpenInode *ino) {
+    // keep the load factor at or under 1, the size stays a power of two
+    if (openInodeCount + 1 > nameHashSize) {
+        int nsize = nameHashSize ? nameHashSize * 2 : 64;
+        OpenInode **nh = calloc(nsize, sizeof(OpenInode *));
+        if (!nh) return -1;
+        for (int i = 0; i < nameHashSize; i++) {
+            OpenInode *cur = nameHash[i];
+            while (cur) {
+                OpenInode *next = cur->hashNext;
+                unsigned b = nameHashOf(cur->dirBlock, cur->name) & (nsize - 1);
+                cur->hashNext = nh[b];
+                nh[b] = cur;
+                cur = next;
+            }
+        }
+        free(nameHash);
+        nameHash = nh;
+        nameHashSize = nsize;
+    }
+    unsigned b = nameHashOf(ino->dirBlock, ino->name) & (nameHashSize - 1);
+    ino->hashNext = nameHash[b];
+    nameHash[b] = ino;
+    openInodeCount++;
+    return 0;
+}
+
+static void hashRemove(OpenInode *ino) {
+    unsigned b = nameHashOf(ino->dirBlock, ino->name) & (nameHashSize - 1);
+    for (OpenInode **p = &nameHash[b]; *p; p = &(*p)->hashNext) {
+        if (*p == ino) {
+            *p = ino->hashNext;
+            openInodeCount--;
+            return;
+        }
+    }
+}
+
 static int findInodeByName(const char *name) {
     if (disk_no < 0 || !name) return -1;
     inode_disk inode;
-    int blockNum = 2; // start searching from block 2
-    while (1) {
+    // start searching from block 2, nothing past used_limit() was ever written
+    int limit = used_limit();
+    for (int blockNum = 2; blockNum < limit; blockNum++) {
         if (readBlock(disk_no, blockNum, &inode) != TFS_SUCCESS) {
             break;
         }
-        if (inode.blocktype == INODE && inode.magic == MAGIC) {
+        if (inode.blocktype == INODE && inode.magic == MAGIC && !(inode.metaflags & INODE_SYSTEM)) {
             if (strncmp(inode.name, name, 8) == 0) {
                 return blockNum;
             }
         }
-        blockNum++;
-        if (blockNum > 1000) break;
     }
     return -1;
 }
 
-static int findOrCreateInode(const char *name) {
+static int findOrCreateInode(int dir, const char *name) {
     // first try and find existing
-    int existing = findInodeByName(name);
+    int existing = dir_lookup(dir, name);
+    if (existing < 0) return existing;
     if (existing > 0) {
+        if (fs_features & TFS_FEAT_DIRS) {
+            inode_disk in;
+            if (readBlock(disk_no, existing, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+            if (in.metaflags & INODE_DIR) return ERR_IS_DIR;
+        }
         return existing;
     }
-    // if not found allocate new block
+    // if not found allocate new block, near its directory
+    allocGoal = dir;
     int newBlock = allocate_free_block();
     if (newBlock < 0) {
-        return -1;
+        return ERR_DISK_FULL;
     }
     //initialize new Inode
     inode_disk newInode = {0};
@@ -198,126 +710,283 @@ static int findOrCreateInode(const char *name) {
     newInode.size_B = 0;
     newInode.blk_start = 0;
     newInode.metaflags = INODE_INITIAL_FLAGS;
-    if (writeBlock(disk_no, newBlock, &newInode) != TFS_SUCCESS) {
+    newInode.ctime = newInode.mtime = newInode.atime = (int32_t)time(NULL);
+    if (blk_write(newBlock, &newInode) != TFS_SUCCESS) {
+        free_block(newBlock);
+        return ERR_DISK_WRITE;
+    }
+    // the entry goes in once the inode is there, a crash in between only orphans it
+    int rc = dir_add(dir, name, newBlock);
+    if (rc < 0) {
         free_block(newBlock);
-        return -1;
+        return rc;
     }
     return newBlock;
 }
 
 fileDescriptor tfs_openFile(char *name) {
+    return tfs_openFileEx(name, 0);
+}
+
+fileDescriptor tfs_openFileEx(char *name, int flags) {
+    SHARED_CALL;
     if (disk_no == -1) return ERR_NOT_MOUNTED;
     if (!name) return ERR_FILE_NAME;
-    if (strlen(name) == 0 || strlen(name) > 8) return ERR_FILE_NAME;
+    int dir;
+    char leaf[9];
+    int rc = path_walk(name, &dir, leaf);
+    if (rc < 0) return rc;
     // check if file is already open in the resource table 
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (openFiles[i].inUse && strncmp(openFiles[i].name, name, 8) == 0) {
-            //if file open return existing fd
-            return i;
-        }
+    OpenInode *ino = lookupOpenInode(dir, leaf);
+    if (ino && !(flags & TFS_OPEN_NEWFD)) {
+        //if file open return existing fd
+        return ino->firstFD;
     }// find free slot in the resource table 
     int fd = findFreeFileSlot();
     if (fd < 0) {
-        return ERR_FD_INVALID; //too many open files
-    }//fine or create the inode for the file
-    int inodeBlock = findOrCreateInode(name);
-    if (inodeBlock < 0) {
-        return ERR_DISK_FULL;
+        return ERR_FD_INVALID; //out of memory for the table
+    }
+    if (!ino) {//find or create the inode for the file
+        int inodeBlock = findOrCreateInode(dir, leaf);
+        if (inodeBlock < 0) {
+            freeFDs[nFreeFDs++] = fd;
+            return inodeBlock;
+        }
+        ino = calloc(1, sizeof(OpenInode));
+        if (!ino) {
+            freeFDs[nFreeFDs++] = fd;
+            return ERR_FD_INVALID;
+        }
+        ino->inodeBlock = inodeBlock;
+        ino->dirBlock = dir;
+        strcpy(ino->name, leaf);
+        ino->firstFD = -1;
+        if (hashInsert(ino) < 0) {
+            free(ino);
+            freeFDs[nFreeFDs++] = fd;
+            return ERR_FD_INVALID;
+        }
     } //set up the resource table entry
     openFiles[fd].inUse = 1;
-    openFiles[fd].inodeBlock = inodeBlock;
     openFiles[fd].filePointer = 0;
-    strncpy(openFiles[fd].name, name, 8);
-    openFiles[fd].name[8] = '\0';
+    openFiles[fd].ino = ino;
+    openFiles[fd].nextFD = ino->firstFD;
+    ino->firstFD = fd;
+    ino->refs++;
     return fd;
 }
 
 
 
 int tfs_closeFile(fileDescriptor FD) {
+    SHARED_CALL;
     if (disk_no == -1) return ERR_NOT_MOUNTED;
     if (!isValidFD(FD)) return ERR_FD_INVALID;//clear resource table entry 
-    openFiles[FD].inUse = 0;
-    openFiles[FD].inodeBlock = -1;
-    openFiles[FD].filePointer = 0;
-    openFiles[FD].name[0] = '\0';
+    releaseFileSlot(FD);
     return TFS_SUCCESS;
 }
 
 //returns a block number that you can do anything with (removes it from the free list)
 int allocate_free_block() {
 	if(disk_no == -1) return ERR_NOT_MOUNTED;
-	superblock_disk sb = {0};
-	if (readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
-	if (sb.free_block == 0) return ERR_DISK_FULL; //use 0 not -1 
-
-	int block = sb.free_block; //first in pointer
-	free_disk freedisk = {0};
-	if(readBlock(disk_no, block, &freedisk) != TFS_SUCCESS) return ERR_DISK_READ;
-	sb.free_block = freedisk.blk_next;
-
-	//writeback
-	if (writeBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;	
-	return block;
+	if(allocPolicy != TFS_ALLOC_CACHE) {
+		int block;
+		int rc = policy_alloc(&block, 1);
+		return rc < 0 ? rc : block;
+	}
+	if(nAlloc == 0) {
+		int rc = alloc_refill();
+		if(rc < 0) return rc;
+	}
+	return allocCache[--nAlloc];
 }
 
 //once done with a block free it and it goes back onto the free linkedlist
 int free_block(int block) {
 	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	dedup_forget(block);
+	if((fs_features & TFS_FEAT_BITMAP) && (mountFlags & TFS_MOUNT_DISCARD)) {
+		//the block goes back to the host, it can't sit in the cache. it
+		//isn't touched, so it can be punched
+		int rc = bm_mark(block, 1, 0);
+		if(rc < 0) return rc;
+		if(block < bmHint) bmHint = block;
+		discard_add(block);
+		return TFS_SUCCESS;
+	}
+	if((fs_features & TFS_FEAT_LOG) || allocPolicy != TFS_ALLOC_CACHE) {
+		//handing it straight back out would send the next write behind the
+		//head, or wherever it is instead of where the policy would put it
+		if(nFreedQ == ALLOC_SPILL) {
+			int rc = freed_flush();
+			if(rc < 0) return rc;
+		}
+		freedQ[nFreedQ++] = block;
+		return TFS_SUCCESS;
+	}
+	if(!(fs_features & TFS_FEAT_BITMAP)) {
+		//a header right away, so inode scans stop seeing what was there.
+		//alloc_spill links it into the chain
+		free_disk fb = {0};
+		fb.blocktype = FREE;
+		fb.magic = MAGIC;
+		if(blk_write(block, &fb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	}
+	if(nAlloc == ALLOC_SPILL) {
+		int rc = alloc_spill(ALLOC_SPILL - ALLOC_BATCH);
+		if(rc < 0) return rc;
+	}
+	allocCache[nAlloc++] = block;
+	return TFS_SUCCESS;
+}
+
+//takes up to ALLOC_BATCH blocks from the free chain or bitmap, then the
+//never used region, writing the superblock once
+static int alloc_refill(void) {
 	superblock_disk sb = {0};
 	if (readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
-	
-	free_disk fb = {0};
-	fb.blocktype = FREE;
-  	fb.magic = MAGIC;
- 	fb.blk_next = sb.free_block;	
-	//FIRST write the free block, if successful then change the superblock (it isn't like we're allowing errors)
-
-	if(writeBlock(disk_no, block, &fb) != TFS_SUCCESS) return ERR_DISK_WRITE;
-	//written free block.
-	
-	sb.free_block = block; 
-	if(writeBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	int got[ALLOC_BATCH], n = 0, lazy = sb.free_lazy, head = sb.log_head;
+	if (fs_features & TFS_FEAT_LOG) {
+		discard_flush();
+		n = log_take(&sb, got);
+		//nothing left in front of the head, what was freed behind it is fair game now
+		if (n == 0 && nFreedQ > 0 && (n = freed_flush()) == 0) n = log_take(&sb, got);
+		if (n < 0) return n;
+		//checkpoint the head whenever it has moved on to another segment
+		if (sb.log_head / LOG_SEG != logHead / LOG_SEG) sb.log_head = logHead;
+	} else if (fs_features & TFS_FEAT_BITMAP) {
+		//a block waiting to be punched could be handed out, punch them first
+		discard_flush();
+		while (n < ALLOC_BATCH) {
+			int block = bm_find(sb.free_lazy);
+			if (block < 0) return block;
+			if (block == 0) break;
+			got[n++] = block;
+			bmHint = block + 1;
+		}
+	} else {
+		while (n < ALLOC_BATCH && sb.free_block != 0) {
+			free_disk freedisk = {0};
+			if (readBlock(disk_no, sb.free_block, &freedisk) != TFS_SUCCESS) break;
+			got[n++] = sb.free_block;
+			sb.free_block = freedisk.blk_next;
+		}
+	}
+	//carve the rest off the never used region
+	while (n < ALLOC_BATCH && (fs_features & TFS_FEAT_LAZYFREE) && !(fs_features & TFS_FEAT_LOG) &&
+	       sb.free_lazy < fs_blocks) {
+		got[n++] = sb.free_lazy++;
+	}
+	if (n == 0) return ERR_DISK_FULL;
+	//superblock first, a crash before the bits are set only loses the blocks
+	if ((sb.free_lazy != lazy || sb.log_head != head || !(fs_features & TFS_FEAT_BITMAP)) &&
+	    blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	for (int i = 0; i < n && (fs_features & TFS_FEAT_BITMAP); ) {
+		int run = 1;
+		while (i + run < n && got[i + run] == got[i] + run) run++;
+		int rc = bm_mark(got[i], run, 1);
+		if (rc < 0) return rc;
+		i += run;
+	}
+	//the first one found goes out first
+	for (int i = n - 1; i >= 0; i--) allocCache[nAlloc++] = got[i];
+	return n;
+}
+
+//gives the n oldest cached blocks back to the free chain or bitmap
+static int alloc_spill(int n) {
+	if (n <= 0) return TFS_SUCCESS;
+	if (fs_features & TFS_FEAT_BITMAP) {
+		int sorted[ALLOC_SPILL];
+		memcpy(sorted, allocCache, n * sizeof(int));
+		int rc = bm_release(sorted, n);
+		if (rc < 0) return rc;
+		//the head goes back to the next one that would have gone out
+		if ((fs_features & TFS_FEAT_LOG) && n == nAlloc) logHead = allocCache[nAlloc - 1];
+	} else {
+		//chained so the newest of them comes off the chain first
+		superblock_disk sb = {0};
+		if (readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
+		for (int i = 0; i < n; i++) {
+			free_disk fb = {0};
+			fb.blocktype = FREE;
+			fb.magic = MAGIC;
+			fb.blk_next = i == 0 ? sb.free_block : allocCache[i - 1];
+			if (blk_write(allocCache[i], &fb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+		}
+		sb.free_block = allocCache[n - 1];
+		if (blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	}
+	memmove(allocCache, allocCache + n, (nAlloc - n) * sizeof(int));
+	nAlloc -= n;
 	return TFS_SUCCESS;
 }
 
 int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
+    return tfs_writeFile64(FD, buffer, size);
+}
+
+int tfs_writeFile64(fileDescriptor FD, char *buffer, int64_t size) {
+    SHARED_CALL;
     if (disk_no == -1) return ERR_NOT_MOUNTED;
     if (!isValidFD(FD)) return ERR_FD_INVALID;
     if (!buffer && size > 0) return ERR_DISK_WRITE;
-    int inodeBlock = openFiles[FD].inodeBlock;
+    if (size < 0) return ERR_DISK_WRITE;
+    if (size > INT32_MAX && !(fs_features & TFS_FEAT_SIZE64)) return ERR_FILE_TOO_BIG;
+    int inodeBlock = openFiles[FD].ino->inodeBlock;
     // free existing data blocks
     inode_disk inode;
     if (readBlock(disk_no, inodeBlock, &inode) != TFS_SUCCESS) {
         return ERR_DISK_READ;
     }
-    // free all data blocks
-    int currentBlock = inode.blk_start;
-    while (currentBlock != 0) {
-        fileextent_disk extent;
-        if (readBlock(disk_no, currentBlock, &extent) != TFS_SUCCESS) {
-            break;
-        }
-        int nextBlock = extent.blk_next;
-        free_block(currentBlock);
-        currentBlock = nextBlock;
-	}
-    // if size is 0, just update inode and return
+    lazy_merge(openFiles[FD].ino, &inode);
+    inode.mtime = (int32_t)time(NULL);
+    // the file goes empty on disk before its old blocks are freed, so a
+    // failure further down leaves an empty file and not one pointing at
+    // freed (or already dereferenced) blocks. the new content goes back to
+    // a plain chain
+    inode_disk old = inode;
+    inode.metaflags &= ~INODE_MAPPED;
+    inode.blk_start = 0;
+    inode_set_size(&inode, 0);
+    if (blk_write(inodeBlock, &inode) != TFS_SUCCESS) return ERR_DISK_WRITE;
+    openFiles[FD].filePointer = 0;
+    if (old.metaflags & INODE_MAPPED) map_release(&old, 1);
+    else chain_release(old.blk_start);
     if (size == 0) {
-        inode.blk_start = 0;
-        inode.size_B = 0;
-        writeBlock(disk_no, inodeBlock, &inode);
+        discard_flush();
+        return TFS_SUCCESS;
+    }
+    // dedup shares single blocks, which a chain can't: the content goes in
+    // through tfs_write as a block map instead
+    if (mountFlags & TFS_MOUNT_DEDUP) {
+        for (int64_t done = 0; done < size; ) {
+            int chunk = size - done > (1 << 30) ? 1 << 30 : (int)(size - done);
+            int rc = tfs_write(FD, buffer + done, chunk);
+            if (rc < 0) return rc;
+            done += rc;
+        }
         openFiles[FD].filePointer = 0;
+        discard_flush();
         return TFS_SUCCESS;
     }
     // calculate number of blocks needed
     int dataPerBlock = EX_E;
-    int blocksNeeded = (size + dataPerBlock - 1) / dataPerBlock;
+    int64_t blocksNeeded64 = (size + dataPerBlock - 1) / dataPerBlock;
+    if (blocksNeeded64 > fs_blocks) return ERR_DISK_FULL;
+    int blocksNeeded = (int)blocksNeeded64;
     
     // allocate required blocks
-    int *blocks = malloc(blocksNeeded * sizeof(int));
+    int *blocks = malloc((size_t)blocksNeeded * sizeof(int));
     if (!blocks) return ERR_DISK_WRITE;
-    for (int i = 0; i < blocksNeeded; i++) {
+    // a policy places the whole write in one go, so best-fit can pick a run for it
+    allocGoal = inodeBlock;
+    int placed = allocPolicy != TFS_ALLOC_CACHE ? policy_alloc(blocks, blocksNeeded) : 0;
+    if (placed < 0) {
+        free(blocks);
+        return placed;
+    }
+    for (int i = placed; i < blocksNeeded; i++) {
         blocks[i] = allocate_free_block();
         if (blocks[i] < 0) {
             // allocation failed, free already allocated blocks
@@ -329,27 +998,26 @@ int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
         }
     }
     // write data into allocated blocks
-    int bytesWritten = 0;
+    int64_t bytesWritten = 0;
     for (int i = 0; i < blocksNeeded; i++) {
         fileextent_disk extent = {0};
         extent.blocktype = FILEEXTENT;
         extent.magic = MAGIC;
         extent.blk_next = (i < blocksNeeded - 1) ? blocks[i + 1] : 0;
-        int bytesToWrite = size - bytesWritten;
+        int64_t bytesToWrite = size - bytesWritten;
         if (bytesToWrite > dataPerBlock) {
             bytesToWrite = dataPerBlock;
         }
         memcpy(extent.data, buffer + bytesWritten, bytesToWrite);
+        if (blk_write(blocks[i], &extent) != TFS_SUCCESS) break;
         bytesWritten += bytesToWrite;
-        if (writeBlock(disk_no, blocks[i], &extent) != TFS_SUCCESS) {
-            free(blocks);
-            return ERR_DISK_WRITE;
-        }
     }
 	// Update inode
     inode.blk_start = blocks[0];
-    inode.size_B = size;
-    if (writeBlock(disk_no, inodeBlock, &inode) != TFS_SUCCESS) {
+    inode_set_size(&inode, size);
+    if (bytesWritten < size || blk_write(inodeBlock, &inode) != TFS_SUCCESS) {
+        // the file stays empty, the new blocks go back
+        for (int i = 0; i < blocksNeeded; i++) free_block(blocks[i]);
         free(blocks);
         return ERR_DISK_WRITE;
     }
@@ -358,11 +1026,102 @@ int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
     return TFS_SUCCESS;
 }
 
+//writes size bytes at the file pointer and moves it past them. unlike
+//tfs_writeFile the rest of the file is kept, and writing past EOF leaves a
+//hole behind that takes no blocks. returns the bytes written
+int tfs_write(fileDescriptor FD, char *buffer, int size) {
+    SHARED_CALL;
+    if (disk_no == -1) return ERR_NOT_MOUNTED;
+    if (!isValidFD(FD)) return ERR_FD_INVALID;
+    if (!buffer || size < 0) return ERR_BUF;
+    int inodeBlock = openFiles[FD].ino->inodeBlock;
+    inode_disk inode;
+    if (readBlock(disk_no, inodeBlock, &inode) != TFS_SUCCESS) {
+        return ERR_DISK_READ;
+    }
+    lazy_merge(openFiles[FD].ino, &inode);
+    int64_t fp = openFiles[FD].filePointer;
+    int64_t end = fp + size;
+    if (end > INT32_MAX && !(fs_features & TFS_FEAT_SIZE64)) return ERR_FILE_TOO_BIG;
+    if (size == 0) return 0;
+    int rc = map_convert(&inode);
+    if (rc < 0) return rc;
+
+    map_cursor mc;
+    if ((rc = map_start(&mc, &inode)) < 0) return rc;
+    int done = 0;
+    allocGoal = inodeBlock;
+    while (done < size) {
+        int64_t fblk = (fp + done) / EX_E;
+        int off = (int)((fp + done) % EX_E);
+        int n = EX_E - off;
+        if (n > size - done) n = size - done;
+        int base = (int)(fblk - fblk % IX_E);
+        if ((rc = map_find(&mc, base, 1)) < 0) break;
+        int block = mc.ix.blk[fblk - base];
+        // reserved by tfs_fallocate, still zeros as far as the file goes
+        int unwritten = block < 0;
+        if (unwritten) block = -block;
+        int shared = block != 0 ? refs_get(block) : 0;
+        if (shared < 0) { rc = shared; break; }
+        fileextent_disk extent = {0};
+        if (block != 0 && !unwritten && n < EX_E && readBlock(disk_no, block, &extent) != TFS_SUCCESS) {
+            rc = ERR_DISK_READ;
+            break;
+        }
+        extent.blocktype = FILEEXTENT;
+        extent.magic = MAGIC;
+        memcpy(extent.data + off, buffer + done, n);
+        // dedup: a block already on disk with these bytes is shared instead
+        // of writing another one
+        int same = (mountFlags & TFS_MOUNT_DEDUP) ? dedup_find(&extent) : 0;
+        if (same < 0) { rc = same; break; }
+        if (same != 0 && same != block) {
+            if ((rc = refs_init()) < 0 || (rc = refs_adjust(&same, 1, 1)) < 0) break;
+            if (block != 0 && (rc = refs_drop(block)) < 0) break;
+            mc.ix.blk[fblk - base] = same;
+            mc.dirty = 1;
+        }
+        if (same != 0) {
+            done += n;
+            continue;
+        }
+        if (block == 0 || shared || (fs_features & TFS_FEAT_LOG)) {
+            // a new block, our own copy of one a clone still uses, or on a
+            // log image the new content at the head in place of the old
+            int nb = allocate_free_block();
+            if (nb < 0) { rc = nb; break; }
+            allocGoal = nb + 1;
+            if (block != 0 && (rc = refs_drop(block)) < 0) break;
+            block = nb;
+            mc.ix.blk[fblk - base] = block;
+            mc.dirty = 1;
+        } else if (unwritten) {
+            mc.ix.blk[fblk - base] = block;
+            mc.dirty = 1;
+        }
+        if (blk_write(block, &extent) != TFS_SUCCESS) { rc = ERR_DISK_WRITE; break; }
+        if (mountFlags & TFS_MOUNT_DEDUP) dedup_add(&extent, block);
+        done += n;
+    }
+    if (map_flush(&mc) < 0 && rc >= 0) rc = ERR_DISK_WRITE;
+
+    // whatever made it to disk counts, even if we ran out of space part way
+    if (fp + done > inode_size(&inode)) inode_set_size(&inode, fp + done);
+    time_t now = time(NULL);
+    inode.mtime = (uint32_t)now;
+    if (blk_write(inodeBlock, &inode) != TFS_SUCCESS) return ERR_DISK_WRITE;
+    openFiles[FD].filePointer = fp + done;
+    if (done == 0 && rc < 0) return rc;
+    return done;
+}
+
 int tfs_deleteFile(fileDescriptor FD) {
+    SHARED_CALL;
     if (disk_no == -1) return ERR_NOT_MOUNTED;
     if (!isValidFD(FD)) return ERR_FD_INVALID;
 
-    int inodeBlock = openFiles[FD].inodeBlock;
+    int inodeBlock = openFiles[FD].ino->inodeBlock;
 
     // read the inode to get the data block chain
     inode_disk inode;
@@ -370,45 +1129,252 @@ int tfs_deleteFile(fileDescriptor FD) {
         return ERR_DISK_READ;
     }
 
+    // out of its directory first, a crash after that only leaks the blocks
+    int rc = dir_del(openFiles[FD].ino->dirBlock, openFiles[FD].ino->name);
+    if (rc < 0) return rc;
+
     // free all data blocks
-    int currentBlock = inode.blk_start;
-    while (currentBlock != 0) {
-        fileextent_disk extent;
-        if (readBlock(disk_no, currentBlock, &extent) != TFS_SUCCESS) {
-            break;  // don't leak blocks because of a read error, but bail
-        }
-        int nextBlock = extent.blk_next;
-        free_block(currentBlock);
-        currentBlock = nextBlock;
-    }
+    if (inode.metaflags & INODE_MAPPED) map_release(&inode, 1);
+    chain_release(inode.blk_start);
 
-    // free the inode block itself
+    // free the inode block itself. on bitmap images a freed block keeps its
+    // content, so it has to stop looking like an inode first
+    if (fs_features & TFS_FEAT_BITMAP) {
+        inode_disk gone = {0};
+        blk_write(inodeBlock, &gone);
+    }
     free_block(inodeBlock);
+    discard_flush();
+    shared_note(inodeBlock, 0, 0);
 
-    // clear resource table entry
-    openFiles[FD].inUse = 0;
-    openFiles[FD].inodeBlock = -1;
-    openFiles[FD].filePointer = 0;
-    openFiles[FD].name[0] = '\0';
+    // clear resource table entries, every FD on this file is gone now
+    OpenInode *ino = openFiles[FD].ino;
+    ino->lazyAtime = 0;
+    while (ino->refs > 1) releaseFileSlot(ino->firstFD);
+    releaseFileSlot(ino->firstFD);
 
     return TFS_SUCCESS;
 }
 
-int tfs_seek(fileDescriptor FD, int offset) {
+//gives back the blocks under [offset, offset + len). they read back as
+//zeros afterwards, the ends of a range that cut a block in half are zeroed
+//in place. the file size stays the same
+int tfs_punchHole(fileDescriptor FD, int64_t offset, int64_t len) {
+    SHARED_CALL;
     if (disk_no == -1) return ERR_NOT_MOUNTED;
     if (!isValidFD(FD)) return ERR_FD_INVALID;
-    if (offset < 0) return ERR_SEEK;
+    if (offset < 0 || len < 0) return ERR_SEEK;
+    int inodeBlock = openFiles[FD].ino->inodeBlock;
+    inode_disk inode;
+    if (readBlock(disk_no, inodeBlock, &inode) != TFS_SUCCESS) {
+        return ERR_DISK_READ;
+    }
+    lazy_merge(openFiles[FD].ino, &inode);
+    int64_t size = inode_size(&inode);
+    int64_t end = len > size - offset ? size : offset + len;
+    if (offset >= end) return TFS_SUCCESS;
+    int rc = map_convert(&inode);
+    if (rc < 0) return rc;
+
+    // from here on the inode may have a new map and references may be
+    // dropped, so errors go through out: the cursor and the inode are
+    // written whatever happens
+    map_cursor mc;
+    if ((rc = map_start(&mc, &inode)) < 0) goto out;
+    // whole blocks first..last-1 go away. at EOF the last partial block can
+    // go too, nothing past the size is ever read
+    int64_t first = (offset + EX_E - 1) / EX_E;
+    int64_t last = end == size ? (size + EX_E - 1) / EX_E : end / EX_E;
+    if (offset % EX_E != 0) {
+        int64_t fblk = offset / EX_E;
+        int to = fblk == end / EX_E ? (int)(end % EX_E) : EX_E;
+        if (fblk >= last && (rc = map_zero(&mc, fblk, (int)(offset % EX_E), to)) < 0) goto out;
+        if (fblk < last && (rc = map_zero(&mc, fblk, (int)(offset % EX_E), EX_E)) < 0) goto out;
+    }
+    // the tail block, unless the head already covered it
+    if (end % EX_E != 0 && last == end / EX_E && !(offset % EX_E != 0 && last == offset / EX_E)) {
+        if ((rc = map_zero(&mc, last, 0, (int)(end % EX_E))) < 0) goto out;
+    }
+    for (int64_t base = first - first % IX_E; base < last; base += IX_E) {
+        if ((rc = map_find(&mc, (int)base, 0)) < 0) goto out;
+        if (rc == 0) {
+            // skip straight to the next index block that exists
+            if (mc.cur == 0) break;
+            base = mc.ix.base - IX_E;
+            continue;
+        }
+        int used = 0;
+        for (int i = 0; i < IX_E; i++) {
+            int64_t fblk = base + i;
+            if (fblk >= first && fblk < last && mc.ix.blk[i] != 0) {
+                refs_drop(abs(mc.ix.blk[i]));
+                mc.ix.blk[i] = 0;
+                mc.dirty = 1;
+            }
+            if (mc.ix.blk[i] != 0) used = 1;
+        }
+        if (!used && (rc = map_unlink(&mc)) < 0) goto out;
+    }
+    rc = TFS_SUCCESS;
+out:
+    if (map_flush(&mc) < 0 && rc >= 0) rc = ERR_DISK_WRITE;
+    inode.mtime = (uint32_t)time(NULL);
+    if (blk_write(inodeBlock, &inode) != TFS_SUCCESS && rc >= 0) rc = ERR_DISK_WRITE;
+    discard_flush();
+    return rc;
+}
 
-    // read inode to get file size
+//reserves blocks for every block of the first size bytes that has none.
+//they are claimed in the bitmap as a run at a time, best-fit so it is one
+//run when there is one, and go in the map negated: nothing is written to
+//them until tfs_write fills them in
+int tfs_fallocate(fileDescriptor FD, int64_t size) {
+    SHARED_CALL;
+    if (disk_no == -1) return ERR_NOT_MOUNTED;
+    if (!isValidFD(FD)) return ERR_FD_INVALID;
+    if (size < 0) return ERR_SEEK;
+    // the log rewrites every block somewhere else anyway
+    if (!(fs_features & TFS_FEAT_BITMAP) || (fs_features & TFS_FEAT_LOG)) return ERR_NOT_SUPPORTED;
+    if (size > INT32_MAX && !(fs_features & TFS_FEAT_SIZE64)) return ERR_FILE_TOO_BIG;
+    int inodeBlock = openFiles[FD].ino->inodeBlock;
     inode_disk inode;
-    if (readBlock(disk_no, openFiles[FD].inodeBlock, &inode) != TFS_SUCCESS) {
+    if (readBlock(disk_no, inodeBlock, &inode) != TFS_SUCCESS) {
+        return ERR_DISK_READ;
+    }
+    lazy_merge(openFiles[FD].ino, &inode);
+    int rc = map_convert(&inode);
+    if (rc < 0) return rc;
+    superblock_disk sb = {0};
+    if (readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
+    if (!(fs_features & TFS_FEAT_UNWRITTEN)) {
+        sb.features |= TFS_FEAT_UNWRITTEN;
+        if (blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+        fs_features = sb.features;
+    }
+    // the size first, so every entry made below is inside the file
+    if (size > inode_size(&inode)) {
+        inode_set_size(&inode, size);
+        inode.mtime = (uint32_t)time(NULL);
+    }
+    if (blk_write(inodeBlock, &inode) != TFS_SUCCESS) return ERR_DISK_WRITE;
+
+    map_cursor mc;
+    if ((rc = map_start(&mc, &inode)) < 0) return rc;
+    int64_t nblk = (size + EX_E - 1) / EX_E, missing = 0;
+    for (int64_t base = 0; base < nblk; base += IX_E) {
+        int found = map_find(&mc, (int)base, 0);
+        if (found < 0) return found;
+        for (int i = 0; i < IX_E && base + i < nblk; i++) {
+            if (!found || mc.ix.blk[i] == 0) missing++;
+        }
+    }
+    if ((rc = freed_flush()) < 0) return rc;
+    allocGoal = inodeBlock;
+    int64_t fblk = 0;
+    while (missing > 0 && rc >= 0) {
+        int start, run = policy_bestfit(missing > INT32_MAX ? INT32_MAX : (int)missing, sb.free_lazy, &start);
+        if (run <= 0) { rc = run < 0 ? run : ERR_DISK_FULL; break; }
+        if (run > missing) run = (int)missing;
+        if ((rc = policy_claim(start, run, &sb)) < 0) break;
+        // the run goes to the holes in file order
+        int k = 0;
+        for (; k < run; fblk++) {
+            int base = (int)(fblk - fblk % IX_E);
+            if ((rc = map_find(&mc, base, 1)) < 0) break;
+            if (mc.ix.blk[fblk - base] != 0) continue;
+            mc.ix.blk[fblk - base] = -(start + k++);
+            mc.dirty = 1;
+        }
+        // an index block it couldn't get leaves the rest of the run unused
+        if (k < run) bm_mark(start + k, run - k, 0);
+        missing -= k;
+    }
+    if (map_flush(&mc) < 0 && rc >= 0) rc = ERR_DISK_WRITE;
+    if (blk_write(inodeBlock, &inode) != TFS_SUCCESS) return ERR_DISK_WRITE;
+    return rc < 0 ? rc : TFS_SUCCESS;
+}
+
+//new file newName with the same content as srcFD, sharing its data blocks.
+//the blocks get a reference each, writes to either file copy the block
+//they touch first (see tfs_write)
+int tfs_clone(fileDescriptor srcFD, char *newName) {
+    SHARED_CALL;
+    if (disk_no == -1) return ERR_NOT_MOUNTED;
+    if (!isValidFD(srcFD)) return ERR_FD_INVALID;
+    if (!newName) return ERR_FILE_NAME;
+    int dir;
+    char leaf[9];
+    int rc = path_walk(newName, &dir, leaf);
+    if (rc < 0) return rc;
+    if ((rc = dir_lookup(dir, leaf)) != 0) return rc < 0 ? rc : ERR_FILE_EXISTS;
+    inode_disk src;
+    if (readBlock(disk_no, openFiles[srcFD].ino->inodeBlock, &src) != TFS_SUCCESS) {
         return ERR_DISK_READ;
     }
+    rc = refs_init();
+    if (rc < 0) return rc;
+    int *blocks, n, nix;
+    if ((rc = file_blocks(&src, &blocks, &n, &nix)) < 0) return rc;
 
-    // check if offset is within file size
-    if (offset > (int)inode.size_B) {
-        return ERR_SEEK;
+    // the new inode's block first, so nothing after the references are
+    // counted has to allocate
+    int newBlock = allocate_free_block();
+    if (newBlock < 0) { free(blocks); return newBlock; }
+    // a mapped file gets its own copy of the index blocks, a chain is
+    // shared as it is
+    inode_disk copy = src;
+    int *newIx = malloc((nix ? nix : 1) * sizeof(int));
+    if (!newIx) { free_block(newBlock); free(blocks); return ERR_BUF; }
+    for (int j = 0; j < nix; j++) {
+        if ((newIx[j] = allocate_free_block()) < 0) {
+            rc = newIx[j];
+            while (j-- > 0) free_block(newIx[j]);
+            free_block(newBlock);
+            free(newIx);
+            free(blocks);
+            return rc;
+        }
+    }
+    for (int j = 0; j < nix && rc >= 0; j++) {
+        index_disk ix;
+        if (readBlock(disk_no, blocks[j], &ix) != TFS_SUCCESS) { rc = ERR_DISK_READ; break; }
+        ix.blk_next = j + 1 < nix ? newIx[j + 1] : 0;
+        if (blk_write(newIx[j], &ix) != TFS_SUCCESS) rc = ERR_DISK_WRITE;
+    }
+    if (nix > 0) copy.blk_start = newIx[0];
+    // count the new references before anything points at them, a crash in
+    // between only leaks
+    int counted = 0;
+    if (rc >= 0 && (rc = refs_adjust(blocks + nix, n - nix, 1)) >= 0) counted = 1;
+    if (rc >= 0) {
+        memset(copy.name, 0, sizeof(copy.name));
+        strcpy(copy.name, leaf);
+        time_t now = time(NULL);
+        copy.ctime = copy.mtime = copy.atime = (uint32_t)now;
+        if (blk_write(newBlock, &copy) != TFS_SUCCESS) rc = ERR_DISK_WRITE;
+    }
+    if (rc >= 0) rc = dir_add(dir, leaf, newBlock);
+    if (rc < 0) {
+        // nothing points at the copy, it all goes back
+        if (counted) refs_adjust(blocks + nix, n - nix, -1);
+        for (int j = 0; j < nix; j++) free_block(newIx[j]);
+        free_block(newBlock);
     }
+    free(newIx);
+    free(blocks);
+    return rc < 0 ? rc : TFS_SUCCESS;
+}
+
+int tfs_seek(fileDescriptor FD, int offset) {
+    return tfs_seek64(FD, offset);
+}
+
+int tfs_seek64(fileDescriptor FD, int64_t offset) {
+    SHARED_CALL;
+    if (disk_no == -1) return ERR_NOT_MOUNTED;
+    if (!isValidFD(FD)) return ERR_FD_INVALID;
+    if (offset < 0) return ERR_SEEK;
+    // past EOF is fine, reads there hit EOF and tfs_write leaves a hole
 
     // set file pointer to new offset
     openFiles[FD].filePointer = offset;
@@ -421,7 +1387,7 @@ static int load_inode_from_fd(fileDescriptor FD, inode_disk *inodeOut, int *blkN
     if (!isValidFD(FD)) return ERR_FD_INVALID;
     if (!inodeOut) return ERR_FS_INVALID;
 
-    int inodeBlock = openFiles[FD].inodeBlock;
+    int inodeBlock = openFiles[FD].ino->inodeBlock;
 
     if (readBlock(disk_no, inodeBlock, inodeOut) != TFS_SUCCESS)
         return ERR_DISK_READ;
@@ -434,39 +1400,71 @@ static int load_inode_from_fd(fileDescriptor FD, inode_disk *inodeOut, int *blkN
 }
 
 int tfs_rename(fileDescriptor FD, char *newName) {
+    SHARED_CALL;
     if (disk_no == -1) return ERR_NOT_MOUNTED;
     if (!isValidFD(FD)) return ERR_FD_INVALID;
     if (!newName) return ERR_FILE_NAME;
 
-    size_t len = strlen(newName);
-    if (len == 0 || len > 8) return ERR_FILE_NAME; // keep same limit as tfs_openFile
+    // newName is a path like tfs_openFile takes, so this can move the file too
+    int dir;
+    char leaf[9];
+    int rc = path_walk(newName, &dir, leaf);
+    if (rc < 0) return rc;
 
     inode_disk inode;
     int inodeBlock;
-    int rc = load_inode_from_fd(FD, &inode, &inodeBlock);
+    rc = load_inode_from_fd(FD, &inode, &inodeBlock);
     if (rc < 0) return rc;
 
+    // new entry before the old one goes, so a crash never loses the file
+    OpenInode *ino = openFiles[FD].ino;
+    if (dir != ino->dirBlock || strcmp(leaf, ino->name) != 0) {
+        if ((rc = dir_add(dir, leaf, inodeBlock)) < 0) return rc;
+        if ((rc = dir_del(ino->dirBlock, ino->name)) < 0) return rc;
+    }
+
+    lazy_merge(ino, &inode);
     // copy new name into fixed array
     memset(inode.name, 0, sizeof(inode.name));
-    memcpy(inode.name, newName, len);
+    strcpy(inode.name, leaf);
 
     // update timestamps: metadata change
     time_t now = time(NULL);
     inode.mtime = (uint32_t)now;
     inode.atime = (uint32_t)now;
 
-    if (writeBlock(disk_no, inodeBlock, &inode) != TFS_SUCCESS)
+    if (blk_write(inodeBlock, &inode) != TFS_SUCCESS)
         return ERR_DISK_WRITE;
 
     // keep resource table in sync with the inode
-    strncpy(openFiles[FD].name, newName, 8);
-    openFiles[FD].name[8] = '\0';
+    hashRemove(ino);
+    strcpy(ino->name, leaf);
+    ino->dirBlock = dir;
+    hashInsert(ino);
+    shared_note(inodeBlock, inodeBlock, dir);
 
     return TFS_SUCCESS;
 }
 
 int tfs_readdir(void) {
+    SHARED_CALL;
     if (disk_no == -1) return ERR_NOT_MOUNTED;
+    if (fs_features & TFS_FEAT_DIRS) {
+        // the root directory, in name order
+        int n = dir_list(ROOT_INODE_BLOCK, NULL, 0);
+        if (n < 0) return n;
+        tfsFileInfo *infos = malloc((n ? n : 1) * sizeof(tfsFileInfo));
+        if (!infos) return ERR_BUF;
+        n = dir_list(ROOT_INODE_BLOCK, infos, n);
+        printf("TinyFS directory listing:\n");
+        for (int i = 0; i < n; i++) {
+            printf("  block %2d  %-9s  %lld %s\n", infos[i].inode_block, infos[i].name,
+                   (long long)infos[i].size_B, infos[i].isDir ? "entries" : "bytes");
+        }
+        if (n == 0) printf("  [no files]\n");
+        free(infos);
+        return n < 0 ? n : TFS_SUCCESS;
+    }
     
     inode_disk inode;
     int blk = 0;
@@ -474,11 +1472,12 @@ int tfs_readdir(void) {
 
     printf("TinyFS directory listing:\n");
 
-    while (1) {
+    int limit = used_limit();
+    while (blk < limit) {
 	int rc = readBlock(disk_no, blk, &inode);
 	if (rc != TFS_SUCCESS) break; // assume this means "no more blocks"
 
-	if (inode.blocktype == INODE && inode.magic == MAGIC) {
+	if (inode.blocktype == INODE && inode.magic == MAGIC && !(inode.metaflags & INODE_SYSTEM)) {
 
 	    // skip completely / unused inode slots if you mark them that way
 	    if (inode.name[0] == '\0' && inode.size_B == 0 && blk != ROOT_INODE_BLOCK) {
@@ -494,8 +1493,8 @@ int tfs_readdir(void) {
 		first = 0;
 	    }
 
-	    printf("  block %2d  %-9s  %u bytes\n",
-		   blk, nameBuf, (unsigned)inode.size_B);
+	    printf("  block %2d  %-9s  %lld bytes\n",
+		   blk, nameBuf, (long long)inode_size(&inode));
 
 	}
 
@@ -511,26 +1510,31 @@ int tfs_readdir(void) {
 
 
 int tfs_readByte(fileDescriptor FD, char *buffer) {
+	SHARED_CALL;
 	if(disk_no == -1) return ERR_NOT_MOUNTED;
 	if(!isValidFD(FD)) return ERR_FD_INVALID;
 	if(!buffer) return ERR_BUF;
 
-	int in_block = openFiles[FD].inodeBlock;
+	int in_block = openFiles[FD].ino->inodeBlock;
 	struct inode_disk in = {0};
 	if (readBlock(disk_no, in_block, &in) != TFS_SUCCESS) {
 		return ERR_DISK_READ;
 	}
 	//now we have the inode block; get pointer
-	int fp = openFiles[FD].filePointer;
-	if(fp >= in.size_B) {
+	int64_t fp = openFiles[FD].filePointer;
+	if(fp >= inode_size(&in)) {
 		//at or beyond the eof
 		return ERR_EOF;	
 	}
+	if(in.metaflags & INODE_MAPPED) {
+		int rc = tfs_readFile(FD, buffer, 1);
+		return rc < 0 ? rc : TFS_SUCCESS;
+	}
 	//figure out where to read
 	// byte --> disk read and offset
 	// Remember that each file extent only holds EX_E bytes (250?)
-	int extent_i = fp / EX_E;
-	int extent_off = fp % EX_E;
+	int extent_i = (int)(fp / EX_E);
+	int extent_off = (int)(fp % EX_E);
 	struct fileextent_disk fext = {0};
 	int node_block = in.blk_start;
 	//start at inode head; walk linkedlist.
@@ -549,7 +1553,2602 @@ int tfs_readByte(fileDescriptor FD, char *buffer) {
 	//already compensatas for the struct offset.
 	///as per pdf
 	openFiles[FD].filePointer = fp + 1;
+	atime_update(openFiles[FD].ino, &in);
 	return TFS_SUCCESS;
 }
 
+//bulk version of tfs_readByte, reads up to size bytes from the file pointer
+//walks the extent chain once instead of once per byte. returns bytes read.
+int tfs_readFile(fileDescriptor FD, char *buffer, int size) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!isValidFD(FD)) return ERR_FD_INVALID;
+	if(!buffer || size < 0) return ERR_BUF;
+
+	struct inode_disk in = {0};
+	if (readBlock(disk_no, openFiles[FD].ino->inodeBlock, &in) != TFS_SUCCESS) {
+		return ERR_DISK_READ;
+	}
+	int64_t fp = openFiles[FD].filePointer;
+	int64_t fsize = inode_size(&in);
+	if(fp >= fsize) return ERR_EOF;
+	if(size > fsize - fp) size = (int)(fsize - fp);
+	if(in.metaflags & INODE_MAPPED) {
+		int rc = map_read(&in, fp, buffer, size);
+		if(rc > 0) {
+			openFiles[FD].filePointer = fp + rc;
+			atime_update(openFiles[FD].ino, &in);
+		}
+		return rc;
+	}
+
+	struct fileextent_disk fext = {0};
+	int node_block = in.blk_start;
+	for(int i = 0; i < (int)(fp / EX_E); i++) {
+		if(node_block <= 0) { return ERR_FS_INVALID; }
+		if(readBlock(disk_no, node_block, &fext) != TFS_SUCCESS) {
+			return ERR_DISK_READ;
+		}
+		node_block = fext.blk_next;
+	}
+	int done = 0;
+	int extent_off = (int)(fp % EX_E);
+	while(done < size) {
+		if(node_block <= 0) { return ERR_FS_INVALID; }
+		if(readBlock(disk_no, node_block, &fext) != TFS_SUCCESS) {
+			return ERR_DISK_READ;
+		}
+		int n = EX_E - extent_off;
+		if(n > size - done) n = size - done;
+		memcpy(buffer + done, fext.data + extent_off, n);
+		done += n;
+		extent_off = 0;
+		node_block = fext.blk_next;
+	}
+	openFiles[FD].filePointer = fp + done;
+	atime_update(openFiles[FD].ino, &in);
+	return done;
+}
+
+int tfs_defrag(fileDescriptor FD) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!isValidFD(FD)) return ERR_FD_INVALID;
+	defrag_state ds;
+	int rc = defrag_scan(&ds);
+	if(rc >= 0) rc = defrag_file(&ds, openFiles[FD].ino->inodeBlock, DEFRAG_FRAGMENTED);
+	if(rc > 0) rc = defrag_free_chain(&ds);
+	defrag_done(&ds, rc);
+	return rc < 0 ? rc : ds.moved;
+}
+
+int tfs_defragFs(int maxBlocks, int maxMillis) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	defrag_state ds;
+	int rc = defrag_scan(&ds);
+	int64_t deadline = maxMillis > 0 ? defrag_ms() + maxMillis : 0;
+	int limit = used_limit();
+	int b = defragNext;
+	for(; rc >= 0 && b < limit; b++) {
+		if((maxBlocks > 0 && ds.moved >= maxBlocks) || (deadline && defrag_ms() >= deadline)) break;
+		if(ds.type[b] != INODE) continue;
+		rc = defrag_file(&ds, b, DEFRAG_COMPACT);
+	}
+	if(rc >= 0) rc = defrag_free_chain(&ds);
+	defrag_done(&ds, rc);
+	if(rc < 0) return rc;
+	//done with the pass, the next call starts a new one
+	defragNext = b < limit ? b : 2;
+	return b < limit ? 1 : 0;
+}
+
+int tfs_setAllocPolicy(int policy) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(policy < TFS_ALLOC_CACHE || policy > TFS_ALLOC_BESTFIT) return ERR_NOT_SUPPORTED;
+	if(policy != TFS_ALLOC_CACHE && (!(fs_features & TFS_FEAT_BITMAP) || (fs_features & TFS_FEAT_LOG))) {
+		return ERR_NOT_SUPPORTED;
+	}
+	//the policies find free blocks in the bitmap, the cache can't hold on to any
+	int rc = alloc_spill(nAlloc);
+	if(rc >= 0 && policy == TFS_ALLOC_CACHE && !(fs_features & TFS_FEAT_LOG)) rc = freed_flush();
+	if(rc < 0) return rc;
+	allocPolicy = policy;
+	allocNext = 2;
+	return TFS_SUCCESS;
+}
 
+//gives a chain image the lazy region and, with bitmap, a bitmap. the
+//bitmap goes in the lowest free run that holds it, which leaves the chain
+//first, so a crash before the superblock says bitmap only leaks that run
+static int upgrade_free_space(int bitmap) {
+	defrag_state ds;
+	int rc = defrag_scan(&ds);
+	int nbm = (fs_blocks + BM_BITS - 1) / BM_BITS, start = 0;
+	if(rc >= 0 && bitmap) {
+		start = defrag_find_run(&ds, nbm);
+		if(start < 0) rc = ERR_DISK_FULL;
+		else memset(ds.type + start, BITMAP, nbm);
+		ds.chained = 0;
+	}
+	//defrag_free_chain cuts the free run at the top off the chain
+	fs_features |= TFS_FEAT_LAZYFREE;
+	if(rc >= 0) rc = defrag_free_chain(&ds);
+	superblock_disk sb = {0};
+	if(rc >= 0 && readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) rc = ERR_DISK_READ;
+	for(int i = 0; i < nbm && bitmap && rc >= 0; i++) {
+		bitmap_disk bm = {0};
+		bm.blocktype = BITMAP;
+		bm.magic = MAGIC;
+		for(int b = i * BM_BITS; b < sb.free_lazy && b < (i + 1) * BM_BITS; b++) {
+			if(ds.type[b] != FREE) bm.bits[(b % BM_BITS) / 8] |= 1 << (b % 8);
+		}
+		if(blk_write(start + i, &bm) != TFS_SUCCESS) rc = ERR_DISK_WRITE;
+	}
+	//free space is kept another way from here on, the next scan starts over
+	defrag_done(&ds, rc);
+	defrag_drop();
+	if(rc < 0) return rc;
+	sb.features |= TFS_FEAT_LAZYFREE;
+	sb.nblocks = fs_blocks;
+	if(bitmap) {
+		sb.features |= TFS_FEAT_BITMAP;
+		sb.bitmap_start = start;
+		sb.bitmap_blocks = nbm;
+		sb.free_block = 0;
+	}
+	if(blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	fs_features = sb.features;
+	fs_bmStart = start;
+	fs_bmBlocks = bitmap ? nbm : 0;
+	bmCached = 0;
+	//the old free headers in the lazy region go back to the host
+	discardBlocks(disk_no, sb.free_lazy, fs_blocks - sb.free_lazy);
+	return TFS_SUCCESS;
+}
+
+int tfs_upgrade(char *diskname, int flags) {
+	if(disk_no != -1) return ERR_ALREADY_MOUNTED;
+	int rc = tfs_mount(diskname);
+	if(rc < 0) return rc;
+	uint32_t want = TFS_FEAT_DIRS;
+	if(flags & TFS_MKFS_64) want |= TFS_FEAT_SIZE64 | TFS_FEAT_LAZYFREE;
+	if(flags & TFS_MKFS_BITMAP) want |= TFS_FEAT_BITMAP | TFS_FEAT_LAZYFREE;
+	if(flags & TFS_MKFS_LOG) want |= TFS_FEAT_LOG | TFS_FEAT_BITMAP | TFS_FEAT_LAZYFREE;
+	rc = dirs_enable();
+	//size_hi was unused before SIZE64, it has to read as 0 once it counts
+	if(rc >= 0 && (want & ~fs_features & TFS_FEAT_SIZE64)) {
+		int limit = used_limit();
+		for(int b = ROOT_INODE_BLOCK; b < limit && rc >= 0; b++) {
+			inode_disk in;
+			if(readBlock(disk_no, b, &in) != TFS_SUCCESS) { rc = ERR_DISK_READ; break; }
+			if(in.blocktype != INODE || in.magic != MAGIC || in.size_hi == 0) continue;
+			in.size_hi = 0;
+			if(blk_write(b, &in) != TFS_SUCCESS) rc = ERR_DISK_WRITE;
+		}
+	}
+	if(rc >= 0 && (want & ~fs_features & (TFS_FEAT_LAZYFREE | TFS_FEAT_BITMAP))) {
+		rc = upgrade_free_space((want & ~fs_features & TFS_FEAT_BITMAP) != 0);
+	}
+	superblock_disk sb = {0};
+	if(rc >= 0 && readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) rc = ERR_DISK_READ;
+	if(rc >= 0) {
+		//a log starts where everything in use ends
+		if(!(sb.features & TFS_FEAT_LOG)) sb.log_head = sb.free_lazy;
+		sb.features |= want;
+		sb.version = TFS_VERSION;
+		if(blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) rc = ERR_DISK_WRITE;
+		fs_features = sb.features;
+		logHead = sb.log_head;
+	}
+	int urc = tfs_unmount();
+	return rc < 0 ? rc : urc;
+}
+
+//free runs from the block types defrag_scan finds, extents from file_blocks
+int tfs_fragReport(tfsFragReport *report, tfsFileFrag *files, int maxFiles) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!report || (!files && maxFiles > 0)) return ERR_BUF;
+	memset(report, 0, sizeof(*report));
+	defrag_state ds;
+	int rc = defrag_scan(&ds);
+	for(int b = 2; rc >= 0 && b < ds.limit; ) {
+		if(ds.type[b] != FREE) { b++; continue; }
+		int s = b;
+		while(b < ds.limit && ds.type[b] == FREE) b++;
+		int len = b - s, bucket = 0;
+		while(bucket < TFS_FRAG_BUCKETS - 1 && (len >> (bucket + 1)) > 0) bucket++;
+		report->freeRunHist[bucket]++;
+		report->freeRuns++;
+		report->freeBlocks += len;
+		if(len > report->largestFreeRun) report->largestFreeRun = len;
+	}
+	for(int b = ROOT_INODE_BLOCK + 1; rc >= 0 && b < ds.limit; b++) {
+		if(ds.type[b] != INODE) continue;
+		inode_disk in;
+		if(readBlock(disk_no, b, &in) != TFS_SUCCESS) { rc = ERR_DISK_READ; break; }
+		if(in.metaflags & (INODE_DIR | INODE_SYSTEM)) continue;
+		int *blocks, n, nix;
+		if((rc = file_blocks(&in, &blocks, &n, &nix)) < 0) break;
+		//index blocks don't count, the data does in file order
+		int extents = n > nix;
+		for(int i = nix + 1; i < n; i++) {
+			if(blocks[i] != blocks[i - 1] + 1) extents++;
+		}
+		free(blocks);
+		if(report->files < maxFiles) {
+			tfsFileFrag *f = &files[report->files];
+			memcpy(f->name, in.name, 8);
+			f->name[8] = '\0';
+			f->inode_block = b;
+			f->blocks = n - nix;
+			f->extents = extents;
+		}
+		report->files++;
+		report->extents += extents;
+		if(extents > 1) report->fragmentedFiles++;
+	}
+	defrag_done(&ds, rc);
+	return rc < 0 ? rc : report->files;
+}
+
+//owner[] has the inode of the file every data block belongs to, and for
+//file inodes and directory nodes what points at them (see log_move_meta),
+//0 or -1 for blocks that can't move. segments where every live block has
+//an owner are emptied, fewest live blocks first, by moving the files,
+//inodes and nodes in them to runs from the log head on
+int tfs_cleanLog(int maxSegments, int maxMillis) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!(fs_features & TFS_FEAT_LOG)) return 0;
+	defrag_state ds;
+	int rc = defrag_scan(&ds);
+	int64_t deadline = maxMillis > 0 ? defrag_ms() + maxMillis : 0;
+	int nseg = (fs_blocks + LOG_SEG - 1) / LOG_SEG;
+	int32_t *owner = calloc(fs_blocks, sizeof(int32_t));
+	int *live = calloc(nseg, sizeof(int));
+	int *cand = malloc(nseg * sizeof(int));
+	if(rc >= 0 && (!owner || !live || !cand)) rc = ERR_BUF;
+	for(int b = 2; rc >= 0 && b < ds.limit; b++) {
+		if(ds.type[b] != DIRNODE) continue;
+		dirnode_disk dn;
+		if(readBlock(disk_no, b, &dn) != TFS_SUCCESS) { rc = ERR_DISK_READ; break; }
+		for(int i = 0; i < dn.count && i < DN_MAX; i++) {
+			if(dn.ent[i].inode > 0 && dn.ent[i].inode < fs_blocks) owner[dn.ent[i].inode] = b;
+		}
+		for(int i = 0; !dn.leaf && i <= dn.count && i <= DN_MAX; i++) {
+			if(dn.child[i] > 0 && dn.child[i] < fs_blocks) owner[dn.child[i]] = b;
+		}
+	}
+	for(int b = ROOT_INODE_BLOCK; rc >= 0 && b < ds.limit; b++) {
+		if(b != ROOT_INODE_BLOCK && ds.type[b] != INODE) continue;
+		inode_disk in;
+		if(readBlock(disk_no, b, &in) != TFS_SUCCESS) { rc = ERR_DISK_READ; break; }
+		//a directory's inode is in its files' open inodes, it stays put
+		if(in.metaflags & INODE_DIR) {
+			owner[b] = -1;
+			if(in.blk_start > 0 && in.blk_start < fs_blocks) owner[in.blk_start] = b;
+			continue;
+		}
+		int *blocks, n, nix;
+		if((rc = file_blocks(&in, &blocks, &n, &nix)) < 0) break;
+		//defrag_file leaves files with shared blocks where they are
+		int shared = 0;
+		for(int i = nix; i < n && fs_refInode != 0 && !shared; i++) shared = refs_get(blocks[i]) != 0;
+		for(int i = 0; i < n; i++) {
+			if(blocks[i] > 0 && blocks[i] < fs_blocks) owner[blocks[i]] = shared ? -1 : b;
+		}
+		free(blocks);
+	}
+	//live blocks per segment, -1 once one of them can't move
+	for(int b = LOG_SEG; rc >= 0 && b < ds.limit; b++) {
+		int seg = b / LOG_SEG;
+		if(ds.type[b] == FREE || live[seg] < 0) continue;
+		live[seg] = owner[b] > 0 ? live[seg] + 1 : -1;
+	}
+	int ncand = 0;
+	for(int seg = 1; rc >= 0 && seg < nseg; seg++) {
+		if(seg == logHead / LOG_SEG || live[seg] <= 0 || live[seg] > LOG_CLEAN_LIVE) continue;
+		cand[ncand++] = live[seg] * nseg + seg;
+	}
+	qsort(cand, ncand, sizeof(int), cmp_int);
+	//the free blocks of the segments being emptied aren't somewhere to move to
+	for(int k = 0; k < ncand; k++) {
+		int seg = cand[k] % nseg * LOG_SEG;
+		for(int b = seg; b < seg + LOG_SEG && b < ds.limit; b++) {
+			if(ds.type[b] == FREE) ds.type[b] = 0;
+		}
+	}
+	ds.from = logHead;
+	int cleaned = 0;
+	for(int k = 0; rc >= 0 && k < ncand; k++) {
+		if((maxSegments > 0 && cleaned >= maxSegments) || (deadline && defrag_ms() >= deadline)) break;
+		int seg = cand[k] % nseg * LOG_SEG, end = seg + LOG_SEG < ds.limit ? seg + LOG_SEG : ds.limit;
+		int left = 0;
+		for(int b = seg; b < end && rc >= 0; b++) {
+			if(ds.type[b] == FREE || ds.type[b] == 0) continue;
+			if(ds.type[b] == INODE || ds.type[b] == DIRNODE) {
+				if((rc = log_move_meta(&ds, b, owner)) == 0) left = 1;
+				continue;
+			}
+			int file = owner[b];
+			rc = defrag_file(&ds, file, DEFRAG_EVICT);
+			if(rc == 0) left = 1;
+			//the copies belong to the same file, it could be moved again
+			for(int i = ds.from - rc; rc > 0 && i < ds.from; i++) owner[i] = file;
+		}
+		if(rc >= 0 && !left) cleaned++;
+	}
+	if(rc >= 0) rc = defrag_free_chain(&ds);
+	//the head carries on after what was moved
+	if(rc >= 0) {
+		logHead = ds.from;
+		logNoClean = 0;
+		rc = log_checkpoint();
+	}
+	//what is left of the emptied segments' free blocks is free again
+	for(int k = 0; ds.type && k < ncand; k++) {
+		int seg = cand[k] % nseg * LOG_SEG;
+		for(int b = seg; b < seg + LOG_SEG && b < ds.limit; b++) {
+			if(ds.type[b] == 0) ds.type[b] = FREE;
+		}
+	}
+	defrag_done(&ds, rc);
+	free(owner);
+	free(live);
+	free(cand);
+	return rc < 0 ? rc : cleaned;
+}
+
+//same walk as tfs_readdir but fills infos[] instead of printing
+//returns the total number of files, which can be more than max
+int tfs_readdirInfo(tfsFileInfo *infos, int max) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!infos && max > 0) return ERR_BUF;
+	if(fs_features & TFS_FEAT_DIRS) return dir_list(ROOT_INODE_BLOCK, infos, max);
+
+	inode_disk inode;
+	int count = 0;
+	int limit = used_limit();
+	for(int blk = ROOT_INODE_BLOCK + 1; blk < limit && readBlock(disk_no, blk, &inode) == TFS_SUCCESS; blk++) {
+		if(inode.blocktype != INODE || inode.magic != MAGIC) continue;
+		if(inode.metaflags & INODE_SYSTEM) continue;
+		if(count < max) {
+			inode.name[8] = '\0';
+			fill_info(&infos[count], &inode, blk, lookupOpenInode(ROOT_INODE_BLOCK, inode.name));
+		}
+		count++;
+	}
+	return count;
+}
+
+//one file's readdirInfo entry, with the times as they are in memory
+int tfs_readFileInfo(fileDescriptor FD, tfsFileInfo *info) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!isValidFD(FD)) return ERR_FD_INVALID;
+	if(!info) return ERR_BUF;
+	inode_disk inode;
+	int blk;
+	int rc = load_inode_from_fd(FD, &inode, &blk);
+	if(rc < 0) return rc;
+	fill_info(info, &inode, blk, openFiles[FD].ino);
+	return TFS_SUCCESS;
+}
+
+//makes the directory path, its parent has to exist. a flat image (made
+//before directories) becomes TFS_FEAT_DIRS here the first time
+int tfs_mkdir(char *path) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!path) return ERR_FILE_NAME;
+	int rc = dirs_enable();
+	if(rc < 0) return rc;
+	int dir;
+	char leaf[9];
+	if((rc = path_walk(path, &dir, leaf)) < 0) return rc;
+	if((rc = dir_lookup(dir, leaf)) != 0) return rc < 0 ? rc : ERR_FILE_EXISTS;
+	int block = allocate_free_block();
+	if(block < 0) return block;
+	inode_disk in = {0};
+	in.blocktype = INODE;
+	in.magic = MAGIC;
+	strcpy(in.name, leaf);
+	in.metaflags = INODE_INITIAL_FLAGS | INODE_DIR;
+	in.ctime = in.mtime = in.atime = (int32_t)time(NULL);
+	if(blk_write(block, &in) != TFS_SUCCESS) {
+		free_block(block);
+		return ERR_DISK_WRITE;
+	}
+	if((rc = dir_add(dir, leaf, block)) < 0) free_block(block);
+	return rc;
+}
+
+//removes the empty directory path
+int tfs_rmdir(char *path) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!path) return ERR_FILE_NAME;
+	if(!(fs_features & TFS_FEAT_DIRS)) return ERR_FILE_NOT_FOUND;
+	int dir;
+	char leaf[9];
+	int rc = path_walk(path, &dir, leaf);
+	if(rc < 0) return rc;
+	int block = dir_lookup(dir, leaf);
+	if(block <= 0) return block < 0 ? block : ERR_FILE_NOT_FOUND;
+	inode_disk in;
+	if(readBlock(disk_no, block, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+	if(!(in.metaflags & INODE_DIR)) return ERR_NOT_DIR;
+	if(in.size_B != 0 || in.blk_start != 0) return ERR_DIR_NOT_EMPTY;
+	if((rc = dir_del(dir, leaf)) < 0) return rc;
+	if(fs_features & TFS_FEAT_BITMAP) {
+		inode_disk gone = {0};
+		blk_write(block, &gone);
+	}
+	free_block(block);
+	discard_flush();
+	return TFS_SUCCESS;
+}
+
+//the entries of directory path in name order, like tfs_readdirInfo
+int tfs_listDir(char *path, tfsFileInfo *infos, int max) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!infos && max > 0) return ERR_BUF;
+	if(!(fs_features & TFS_FEAT_DIRS)) {
+		//a flat image only has the root
+		if(!path || strspn(path, "/") != strlen(path)) return ERR_FILE_NOT_FOUND;
+		return tfs_readdirInfo(infos, max);
+	}
+	int dir = dir_resolve(path);
+	if(dir < 0) return dir;
+	return dir_list(dir, infos, max);
+}
+
+//streams the whole file to hostfd. runs of adjacent blocks come in with one
+//readBlocks and go out with one writev straight from the block buffers
+int64_t tfs_exportToFd(fileDescriptor FD, int hostfd) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!isValidFD(FD)) return ERR_FD_INVALID;
+	inode_disk in;
+	if(readBlock(disk_no, openFiles[FD].ino->inodeBlock, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+	int64_t size = inode_size(&in);
+	int mapped = (in.metaflags & INODE_MAPPED) != 0;
+	static const char zeros[EX_E];
+	fileextent_disk *buf = malloc(XFER_BLOCKS * sizeof(fileextent_disk));
+	struct iovec *iov = malloc(XFER_BLOCKS * sizeof(struct iovec));
+	int *bl = malloc(XFER_BLOCKS * sizeof(int));
+	map_cursor mc;
+	int rc = (!buf || !iov || !bl) ? ERR_BUF : 0;
+	if(rc == 0 && mapped) rc = map_start(&mc, &in);
+	int64_t done = 0;
+	int next = in.blk_start, ahead = 1;
+	while(rc >= 0 && done < size) {
+		int64_t left = (size - done + EX_E - 1) / EX_E;
+		int want = left < XFER_BLOCKS ? (int)left : XFER_BLOCKS;
+		int k = 0;
+		if(!mapped) {
+			//chains only say where they go next from inside each block, so read
+			//ahead as if the run continues, doubling while it does
+			int n = ahead < want ? ahead : want;
+			if(next <= 0 || next >= fs_blocks) { rc = ERR_FS_INVALID; break; }
+			if(n > fs_blocks - next) n = fs_blocks - next;
+			if(readBlocks(disk_no, next, n, buf) != TFS_SUCCESS) { rc = ERR_DISK_READ; break; }
+			k = 1;
+			while(k < n && (int)buf[k - 1].blk_next == next + k) k++;
+			ahead = k == n ? ahead * 2 : 1;
+			if(ahead > XFER_BLOCKS) ahead = XFER_BLOCKS;
+			next = buf[k - 1].blk_next;
+			for(int i = 0; i < k; i++) iov[i].iov_base = buf[i].data;
+		}else{
+			k = want;
+			for(int i = 0; i < k && rc >= 0; i++) {
+				bl[i] = map_get(&mc, done / EX_E + i);
+				if(bl[i] < 0) rc = bl[i];
+			}
+			for(int i = 0, j; rc >= 0 && i < k; i = j) {
+				for(j = i + 1; j < k && bl[i] != 0 && bl[j] == bl[j - 1] + 1; j++);
+				if(bl[i] == 0) {
+					iov[i].iov_base = (void *)zeros;
+				}else if(readBlocks(disk_no, bl[i], j - i, buf + i) != TFS_SUCCESS) {
+					rc = ERR_DISK_READ;
+				}else{
+					for(int m = i; m < j; m++) iov[m].iov_base = buf[m].data;
+				}
+			}
+			if(rc < 0) break;
+		}
+		int64_t bytes = 0;
+		for(int i = 0; i < k; i++) {
+			iov[i].iov_len = size - done - bytes < EX_E ? (size_t)(size - done - bytes) : EX_E;
+			bytes += iov[i].iov_len;
+		}
+		if(host_writev(hostfd, iov, k) < 0) { rc = ERR_DISK_WRITE; break; }
+		done += bytes;
+	}
+	free(buf);
+	free(iov);
+	free(bl);
+	if(rc < 0) return rc;
+	atime_update(openFiles[FD].ino, &in);
+	return done;
+}
+
+//makes name a plain chain holding the next len bytes of hostfd. the data is
+//read with readv straight into the block buffers behind their headers, and
+//runs of adjacent blocks go out with one writeBlocks
+int64_t tfs_importFromFd(char *name, int hostfd, int64_t len) {
+	SHARED_CALL;
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(len < 0) return ERR_BUF;
+	if(len > INT32_MAX && !(fs_features & TFS_FEAT_SIZE64)) return ERR_FILE_TOO_BIG;
+	int dir;
+	char leaf[9];
+	int wasOpen = name && path_walk(name, &dir, leaf) == TFS_SUCCESS && lookupOpenInode(dir, leaf) != NULL;
+	fileDescriptor FD = tfs_openFile(name);
+	if(FD < 0) return FD;
+	int inodeBlock = openFiles[FD].ino->inodeBlock;
+	inode_disk inode;
+	int64_t got = 0;
+	int *blocks = NULL, nb = 0;
+	fileextent_disk *buf = NULL;
+	struct iovec *iov = NULL;
+	int rc = readBlock(disk_no, inodeBlock, &inode) == TFS_SUCCESS ? 0 : ERR_DISK_READ;
+	if(rc < 0) goto out;
+	lazy_merge(openFiles[FD].ino, &inode);
+	//same as tfs_writeFile, the old content goes first. the emptied inode is
+	//written before its blocks are freed, so nothing points at them after
+	inode_disk old = inode;
+	inode.metaflags &= ~INODE_MAPPED;
+	inode.blk_start = 0;
+	inode_set_size(&inode, 0);
+	if(blk_write(inodeBlock, &inode) != TFS_SUCCESS) { rc = ERR_DISK_WRITE; goto out; }
+	openFiles[FD].filePointer = 0;
+	if(old.metaflags & INODE_MAPPED) map_release(&old, 1);
+	else chain_release(old.blk_start);
+
+	int64_t need = (len + EX_E - 1) / EX_E;
+	if(need > fs_blocks) { rc = ERR_DISK_FULL; goto done; }
+	blocks = malloc((need ? need : 1) * sizeof(int));
+	buf = malloc(XFER_BLOCKS * sizeof(fileextent_disk));
+	iov = malloc(XFER_BLOCKS * sizeof(struct iovec));
+	if(!blocks || !buf || !iov) { rc = ERR_BUF; goto done; }
+	for(; nb < need; nb++) {
+		blocks[nb] = allocate_free_block();
+		if(blocks[nb] < 0) { rc = ERR_DISK_FULL; goto done; }
+	}
+	int used = 0;
+	while(used < nb) {
+		int k = nb - used < XFER_BLOCKS ? nb - used : XFER_BLOCKS;
+		memset(buf, 0, k * sizeof(fileextent_disk));
+		int64_t want = 0;
+		for(int i = 0; i < k; i++) {
+			buf[i].blocktype = FILEEXTENT;
+			buf[i].magic = MAGIC;
+			buf[i].blk_next = used + i + 1 < nb ? blocks[used + i + 1] : 0;
+			iov[i].iov_base = buf[i].data;
+			iov[i].iov_len = len - got - want < EX_E ? (size_t)(len - got - want) : EX_E;
+			want += iov[i].iov_len;
+		}
+		int64_t r = host_readv(hostfd, iov, k);
+		if(r < 0) { rc = ERR_DISK_READ; break; }
+		//short at EOF, only the blocks that got data are kept
+		if(r < want) {
+			k = (int)((r + EX_E - 1) / EX_E);
+			if(k > 0) buf[k - 1].blk_next = 0;
+		}
+		for(int i = 0, j; i < k; i = j) {
+			for(j = i + 1; j < k && blocks[used + j] == blocks[used + j - 1] + 1; j++);
+			if(blks_write(blocks[used + i], j - i, buf + i) != TFS_SUCCESS) {
+				rc = ERR_DISK_WRITE;
+				break;
+			}
+		}
+		if(rc < 0) break;
+		got += r;
+		used += k;
+		if(r < want) break;
+	}
+	if(rc < 0) {
+		used = 0;
+		got = 0;
+	}else if(used < nb && used > 0) {
+		//EOF right at the end of a batch leaves the last block pointing on
+		fileextent_disk last;
+		if(readBlock(disk_no, blocks[used - 1], &last) == TFS_SUCCESS) {
+			last.blk_next = 0;
+			blk_write(blocks[used - 1], &last);
+		}
+	}
+	//blocks no data got to
+	for(int i = used; i < nb; i++) free_block(blocks[i]);
+	nb = 0;
+	if(used > 0) inode.blk_start = blocks[0];
+	inode_set_size(&inode, got);
+done:
+	for(int i = 0; i < nb; i++) free_block(blocks[i]);
+	inode.mtime = (int32_t)time(NULL);
+	if(blk_write(inodeBlock, &inode) != TFS_SUCCESS && rc >= 0) rc = ERR_DISK_WRITE;
+out:
+	free(blocks);
+	free(buf);
+	free(iov);
+	if(!wasOpen) tfs_closeFile(FD);
+	return rc < 0 ? rc : got;
+}
+
+int tfs_submit_open(char *name, uint64_t tag) {
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!name) return ERR_FILE_NAME;
+	aio_req *r = calloc(1, sizeof(aio_req));
+	if(!r) return ERR_BUF;
+	r->name = strdup(name);
+	if(!r->name) { free(r); return ERR_BUF; }
+	r->op = TFS_AIO_OPEN;
+	r->tag = tag;
+	return aio_submit(r);
+}
+
+int tfs_submit_read(fileDescriptor FD, char *buffer, int size, int64_t offset, uint64_t tag) {
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!buffer || size < 0) return ERR_BUF;
+	if(offset < 0) return ERR_SEEK;
+	aio_req *r = calloc(1, sizeof(aio_req));
+	if(!r) return ERR_BUF;
+	r->op = TFS_AIO_READ;
+	r->tag = tag;
+	r->FD = FD;
+	r->buffer = buffer;
+	r->size = size;
+	r->offset = offset;
+	return aio_submit(r);
+}
+
+int tfs_submit_write(fileDescriptor FD, char *buffer, int size, int64_t offset, uint64_t tag) {
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	if(!buffer || size < 0) return ERR_BUF;
+	if(offset < 0) return ERR_SEEK;
+	aio_req *r = calloc(1, sizeof(aio_req));
+	if(!r) return ERR_BUF;
+	r->op = TFS_AIO_WRITE;
+	r->tag = tag;
+	r->FD = FD;
+	r->buffer = buffer;
+	r->size = size;
+	r->offset = offset;
+	return aio_submit(r);
+}
+
+//close and delete only carry the FD
+static int aio_submit_fd(int op, fileDescriptor FD, uint64_t tag) {
+	if(disk_no == -1) return ERR_NOT_MOUNTED;
+	aio_req *r = calloc(1, sizeof(aio_req));
+	if(!r) return ERR_BUF;
+	r->op = op;
+	r->tag = tag;
+	r->FD = FD;
+	return aio_submit(r);
+}
+
+int tfs_submit_close(fileDescriptor FD, uint64_t tag) {
+	return aio_submit_fd(TFS_AIO_CLOSE, FD, tag);
+}
+
+int tfs_submit_delete(fileDescriptor FD, uint64_t tag) {
+	return aio_submit_fd(TFS_AIO_DELETE, FD, tag);
+}
+
+int tfs_poll_completions(tfsCompletion *events, int max) {
+	if(!events || max < 0) return ERR_BUF;
+	pthread_mutex_lock(&aioLock);
+	int n = aioDoneN < max ? aioDoneN : max;
+	memcpy(events, aioDone, n * sizeof(tfsCompletion));
+	memmove(aioDone, aioDone + n, (aioDoneN - n) * sizeof(tfsCompletion));
+	aioDoneN -= n;
+	//reset the eventfd under the lock, so a completion can't slip in between
+	if(aioDoneN == 0 && aioEvent >= 0) {
+		uint64_t v;
+		if(read(aioEvent, &v, sizeof(v)) < 0) { /* already 0 */ }
+	}
+	pthread_mutex_unlock(&aioLock);
+	return n;
+}
+
+int tfs_completionFd(void) {
+	pthread_mutex_lock(&aioLock);
+	if(aioEvent < 0) aioEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int fd = aioEvent;
+	pthread_mutex_unlock(&aioLock);
+	return fd < 0 ? ERR_BUF : fd;
+}
+
+//file size, split across size_B and size_hi on 64 bit images
+static int64_t inode_size(const inode_disk *in) {
+	if(fs_features & TFS_FEAT_SIZE64) {
+		return ((int64_t)in->size_hi << 32) | (uint32_t)in->size_B;
+	}
+	return in->size_B;
+}
+
+static void inode_set_size(inode_disk *in, int64_t size) {
+	in->size_B = (int32_t)(uint32_t)size;
+	if(fs_features & TFS_FEAT_SIZE64) in->size_hi = (int32_t)(size >> 32);
+}
+
+//first block that has never been handed out, scans can stop there
+static int used_limit(void) {
+	if(fs_features & TFS_FEAT_LAZYFREE) {
+		superblock_disk sb = {0};
+		if(readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) == TFS_SUCCESS) return sb.free_lazy;
+	}
+	return fs_blocks;
+}
+
+//free space bitmap of TFS_FEAT_BITMAP images, see bitmap_disk
+
+//loads the bitmap block holding block's bit into bmBuf
+static int bm_load(int block) {
+	int blk = fs_bmStart + block / BM_BITS;
+	if(blk == bmCached) return TFS_SUCCESS;
+	bmCached = 0;
+	if(readBlock(disk_no, blk, &bmBuf) != TFS_SUCCESS) return ERR_DISK_READ;
+	if(bmBuf.blocktype != BITMAP || bmBuf.magic != MAGIC) {
+		//never written, nothing it covers has been used yet
+		memset(&bmBuf, 0, sizeof(bmBuf));
+		bmBuf.blocktype = BITMAP;
+		bmBuf.magic = MAGIC;
+	}
+	bmCached = blk;
+	return TFS_SUCCESS;
+}
+
+//sets or clears the bits of blocks block..block+n-1, one write per bitmap block
+static int bm_mark(int block, int n, int used) {
+	for(int b = block; b < block + n; ) {
+		if(bm_load(b) < 0) return ERR_DISK_READ;
+		for(; b < block + n && fs_bmStart + b / BM_BITS == bmCached; b++) {
+			if(used) bmBuf.bits[(b % BM_BITS) / 8] |= 1 << (b % 8);
+			else bmBuf.bits[(b % BM_BITS) / 8] &= ~(1 << (b % 8));
+		}
+		if(blk_write(bmCached, &bmBuf) != TFS_SUCCESS) {
+			bmCached = 0;
+			return ERR_DISK_WRITE;
+		}
+	}
+	return TFS_SUCCESS;
+}
+
+//lowest free block from bmHint up to limit, 0 if there is none
+static int bm_find(int limit) {
+	for(int b = bmHint; b < limit; ) {
+		if(bm_load(b) < 0) return ERR_DISK_READ;
+		uint8_t byte = bmBuf.bits[(b % BM_BITS) / 8];
+		//full bytes are skipped whole
+		if(b % 8 == 0 && byte == 0xff) {
+			b += 8;
+			continue;
+		}
+		if(!(byte & (1 << (b % 8)))) return b;
+		b++;
+	}
+	bmHint = limit;
+	return 0;
+}
+
+//1 if block's bit is set
+static int bm_test(int block) {
+	if(bm_load(block) < 0) return ERR_DISK_READ;
+	return (bmBuf.bits[(block % BM_BITS) / 8] >> (block % 8)) & 1;
+}
+
+//clears the bits of blocks[] (sorted in place), one bm_mark per run
+static int bm_release(int *blocks, int n) {
+	if(n == 0) return TFS_SUCCESS;
+	qsort(blocks, n, sizeof(int), cmp_int);
+	for(int i = 0; i < n; ) {
+		int run = 1;
+		while(i + run < n && blocks[i + run] == blocks[i] + run) run++;
+		int rc = bm_mark(blocks[i], run, 0);
+		if(rc < 0) return rc;
+		i += run;
+	}
+	if(blocks[0] < bmHint) bmHint = blocks[0];
+	return TFS_SUCCESS;
+}
+
+//log-structured allocation, see logHead
+
+//1 if every block of the segment starting at seg is free. blocks from
+//lazy up are, the full bytes of the bitmap are skipped whole
+static int log_seg_free(int seg, int lazy) {
+	int end = seg + LOG_SEG < lazy ? seg + LOG_SEG : lazy;
+	for(int b = seg; b < end; ) {
+		if(bm_load(b) < 0) return ERR_DISK_READ;
+		uint8_t byte = bmBuf.bits[(b % BM_BITS) / 8];
+		if(b % 8 == 0 && byte == 0) {
+			b += 8;
+			continue;
+		}
+		if(byte & (1 << (b % 8))) return 0;
+		b++;
+	}
+	return 1;
+}
+
+//first completely free segment from the one at block from on, wrapping
+//around at the end, 0 if there is none (segment 0 has the superblock)
+static int log_next_seg(int from, int lazy) {
+	int nseg = (fs_blocks + LOG_SEG - 1) / LOG_SEG;
+	for(int i = 0; i < nseg; i++) {
+		int seg = ((from / LOG_SEG + i) % nseg) * LOG_SEG;
+		int rc = log_seg_free(seg, lazy);
+		if(rc != 0) return rc < 0 ? rc : seg;
+	}
+	return 0;
+}
+
+//up to ALLOC_BATCH free blocks from the log head on. blocks past free_lazy
+//stop being part of the never used region once one of them is handed out
+static int log_take(superblock_disk *sb, int *got) {
+	int n = 0;
+	for(int seen = 0; n < ALLOC_BATCH && seen < fs_blocks; seen++) {
+		if(logHead >= fs_blocks) logHead = 0;
+		if(logHead % LOG_SEG == 0 && !logNoClean) {
+			int seg = log_next_seg(logHead, sb->free_lazy);
+			if(seg < 0) return seg;
+			if(seg == 0) logNoClean = 1;
+			else logHead = seg;
+		}
+		int b = logHead++;
+		int used = b < sb->free_lazy ? bm_test(b) : 0;
+		if(used < 0) return used;
+		if(used) continue;
+		got[n++] = b;
+		if(b >= sb->free_lazy) sb->free_lazy = b + 1;
+	}
+	return n;
+}
+
+//clears the bits of the blocks freed since the last time
+static int freed_flush(void) {
+	int rc = bm_release(freedQ, nFreedQ);
+	if(rc < 0) return rc;
+	if(nFreedQ > 0) logNoClean = 0;
+	nFreedQ = 0;
+	return TFS_SUCCESS;
+}
+
+//allocation policies, see allocPolicy
+
+//1 if block is free, everything from lazy up is
+static int policy_free(int block, int lazy) {
+	if(block >= lazy) return 1;
+	int used = bm_test(block);
+	return used < 0 ? used : !used;
+}
+
+//first free block from block from on, wrapping around at the end, 0 if
+//there is none. the full bytes of the bitmap are skipped whole
+static int policy_find(int from, int lazy) {
+	if(from < 2 || from >= fs_blocks) from = 2;
+	for(int b = from, seen = 0; seen < fs_blocks; seen++) {
+		if(b >= lazy) return b;
+		if(bm_load(b) < 0) return ERR_DISK_READ;
+		uint8_t byte = bmBuf.bits[(b % BM_BITS) / 8];
+		if(b % 8 == 0 && byte == 0xff && b + 8 <= lazy) {
+			b += 8;
+			seen += 7;
+		}else if(!(byte & (1 << (b % 8)))) {
+			return b;
+		}else{
+			b++;
+		}
+		if(b >= fs_blocks) b = 2;
+	}
+	return 0;
+}
+
+//the smallest free run of at least need blocks, or the largest one there is
+//when none is that long. *start gets where it is, returns its length (0 for
+//none). the run that reaches lazy goes on to the end of the fs
+static int policy_bestfit(int need, int lazy, int *start) {
+	int best = 0, bestLen = 0, big = 0, bigLen = 0;
+	for(int b = 2; b <= lazy && b < fs_blocks; ) {
+		int s = b;
+		while(b < lazy) {
+			int f = policy_free(b, lazy);
+			if(f < 0) return f;
+			if(!f) break;
+			b++;
+		}
+		int len = (b == lazy ? fs_blocks : b) - s;
+		if(len >= need && (bestLen == 0 || len < bestLen)) { best = s; bestLen = len; }
+		if(len > bigLen) { big = s; bigLen = len; }
+		if(b == lazy) break;
+		b++;
+	}
+	*start = bestLen ? best : big;
+	return bestLen ? bestLen : bigLen;
+}
+
+//marks block..block+n-1 used. free_lazy moves past them first if they
+//reach into the never used region, a crash in between only loses them
+static int policy_claim(int block, int n, superblock_disk *sb) {
+	if(block + n > sb->free_lazy) {
+		sb->free_lazy = block + n;
+		if(blk_write(SUPERBLOCK_BLOCK, sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	}
+	return bm_mark(block, n, 1);
+}
+
+//n blocks placed by allocPolicy, a run at a time. best-fit only looks for
+//runs when there is more than one block to place, single blocks go near
+//allocGoal like with TFS_ALLOC_NEAR
+static int policy_alloc(int *blocks, int n) {
+	//what was freed is somewhere to put things too
+	int rc = freed_flush();
+	if(rc < 0) return rc;
+	superblock_disk sb = {0};
+	if(readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
+	int got = 0;
+	int from = allocPolicy == TFS_ALLOC_NEXTFIT ? allocNext : allocGoal;
+	while(got < n && rc >= 0) {
+		int b = 0, run;
+		if(allocPolicy == TFS_ALLOC_BESTFIT && n > 1) {
+			run = policy_bestfit(n - got, sb.free_lazy, &b);
+		}else{
+			b = policy_find(from, sb.free_lazy);
+			run = b > 0;
+			while(b > 0 && got + run < n && b + run < fs_blocks && (rc = policy_free(b + run, sb.free_lazy)) > 0) run++;
+			if(b < 0) run = b;
+		}
+		if(run < 0) rc = run;
+		if(run <= 0 || rc < 0) break;
+		if(run > n - got) run = n - got;
+		if((rc = policy_claim(b, run, &sb)) < 0) break;
+		for(int i = 0; i < run; i++) blocks[got++] = b + i;
+		from = b + run;
+	}
+	if(allocPolicy == TFS_ALLOC_NEXTFIT) allocNext = from;
+	if(got < n) {
+		bm_release(blocks, got);
+		return rc < 0 ? rc : ERR_DISK_FULL;
+	}
+	return got;
+}
+
+//writes the log head to the superblock, the next mount carries on from there
+static int log_checkpoint(void) {
+	if(!(fs_features & TFS_FEAT_LOG)) return TFS_SUCCESS;
+	superblock_disk sb = {0};
+	if(readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
+	if(sb.log_head == logHead) return TFS_SUCCESS;
+	sb.log_head = logHead;
+	if(blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	return TFS_SUCCESS;
+}
+
+//queues a freed block for discardBlocks, next to the range before it if it can
+static void discard_add(int block) {
+	if(nDiscard > 0) {
+		discard_range *r = &discardQ[nDiscard - 1];
+		if(block == r->start + r->count) {
+			r->count++;
+			return;
+		}
+		if(block == r->start - 1) {
+			r->start--;
+			r->count++;
+			return;
+		}
+	}
+	if(nDiscard == DISCARD_BATCH) discard_flush();
+	discardQ[nDiscard].start = block;
+	discardQ[nDiscard].count = 1;
+	nDiscard++;
+}
+
+static void discard_flush(void) {
+	for(int i = 0; i < nDiscard; i++) {
+		discardBlocks(disk_no, discardQ[i].start, discardQ[i].count);
+	}
+	nDiscard = 0;
+}
+
+//directories, see dirnode_disk. paths are names joined by '/', relative
+//ones start at the root too. on flat images (no TFS_FEAT_DIRS) a path is
+//just a name, every file is in the root and found by scanning the inodes.
+//each directory's B-tree is changed in one pass from the root down: a full
+//node is split before going into it on insert, one at the minimum is
+//topped up from a sibling (or merged with one) before going into it on
+//remove. the directory inode is written by dir_add/dir_del afterwards
+
+static int dn_read(int block, dirnode_disk *n) {
+	if(readBlock(disk_no, block, n) != TFS_SUCCESS) return ERR_DISK_READ;
+	if(n->blocktype != DIRNODE || n->magic != MAGIC || n->count < 0 || n->count > DN_MAX) return ERR_FS_INVALID;
+	return TFS_SUCCESS;
+}
+
+static int dn_write(int block, dirnode_disk *n) {
+	return blk_write(block, n) == TFS_SUCCESS ? TFS_SUCCESS : ERR_DISK_WRITE;
+}
+
+static int dn_new(dirnode_disk *n, int leaf) {
+	memset(n, 0, sizeof(*n));
+	n->blocktype = DIRNODE;
+	n->magic = MAGIC;
+	n->leaf = leaf;
+	return allocate_free_block();
+}
+
+//first entry whose name isn't below name
+static int dn_pos(const dirnode_disk *n, const char *name) {
+	int lo = 0, hi = n->count;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(strncmp(n->ent[mid].name, name, 8) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static int dn_is(const dirnode_disk *n, int i, const char *name) {
+	return i < n->count && strncmp(n->ent[i].name, name, 8) == 0;
+}
+
+//splits x's full child y (at child[i]) around its middle entry, which
+//moves up into x. the upper half ends up in z
+static int dn_split(dirnode_disk *x, int xb, int i, dirnode_disk *y, dirnode_disk *z) {
+	int zb = dn_new(z, y->leaf);
+	if(zb < 0) return zb;
+	z->count = DN_MIN;
+	memcpy(z->ent, y->ent + DN_MIN + 1, DN_MIN * sizeof(dir_entry));
+	if(!y->leaf) memcpy(z->child, y->child + DN_MIN + 1, (DN_MIN + 1) * sizeof(int32_t));
+	y->count = DN_MIN;
+	memmove(x->ent + i + 1, x->ent + i, (x->count - i) * sizeof(dir_entry));
+	memmove(x->child + i + 2, x->child + i + 1, (x->count - i) * sizeof(int32_t));
+	x->ent[i] = y->ent[DN_MIN];
+	x->child[i + 1] = zb;
+	x->count++;
+	int rc = dn_write(zb, z);
+	if(rc == 0) rc = dn_write(x->child[i], y);
+	if(rc == 0) rc = dn_write(xb, x);
+	return rc;
+}
+
+//inserts name into the tree of dir, whose blk_start may change
+static int dir_insert(inode_disk *dir, const char *name, int inode) {
+	dirnode_disk x, c, z;
+	int xb = dir->blk_start, rc;
+	if(xb == 0) {
+		if((xb = dn_new(&x, 1)) < 0) return xb;
+		x.count = 1;
+		strncpy(x.ent[0].name, name, 8);
+		x.ent[0].inode = inode;
+		if((rc = dn_write(xb, &x)) < 0) return rc;
+		dir->blk_start = xb;
+		return TFS_SUCCESS;
+	}
+	if((rc = dn_read(xb, &x)) < 0) return rc;
+	if(x.count == DN_MAX) {
+		//the tree grows at the top
+		dirnode_disk root;
+		int rb = dn_new(&root, 0);
+		if(rb < 0) return rb;
+		root.child[0] = xb;
+		if((rc = dn_split(&root, rb, 0, &x, &z)) < 0) return rc;
+		dir->blk_start = rb;
+		x = root;
+		xb = rb;
+	}
+	while(1) {
+		int i = dn_pos(&x, name);
+		if(dn_is(&x, i, name)) return ERR_FILE_EXISTS;
+		if(x.leaf) {
+			memmove(x.ent + i + 1, x.ent + i, (x.count - i) * sizeof(dir_entry));
+			memset(&x.ent[i], 0, sizeof(dir_entry));
+			strncpy(x.ent[i].name, name, 8);
+			x.ent[i].inode = inode;
+			x.count++;
+			return dn_write(xb, &x);
+		}
+		if((rc = dn_read(x.child[i], &c)) < 0) return rc;
+		if(c.count == DN_MAX) {
+			if((rc = dn_split(&x, xb, i, &c, &z)) < 0) return rc;
+			int cmp = strncmp(name, x.ent[i].name, 8);
+			if(cmp == 0) return ERR_FILE_EXISTS;
+			if(cmp > 0) {
+				i++;
+				c = z;
+			}
+		}
+		xb = x.child[i];
+		x = c;
+	}
+}
+
+//moves entry i of x and all of child[i+1] onto the end of child[i] (y),
+//z is child[i+1]. x loses the entry, z's block is freed
+static int dn_merge(dirnode_disk *x, int i, dirnode_disk *y, dirnode_disk *z) {
+	int zb = x->child[i + 1];
+	y->ent[y->count] = x->ent[i];
+	memcpy(y->ent + y->count + 1, z->ent, z->count * sizeof(dir_entry));
+	if(!y->leaf) memcpy(y->child + y->count + 1, z->child, (z->count + 1) * sizeof(int32_t));
+	y->count += z->count + 1;
+	memmove(x->ent + i, x->ent + i + 1, (x->count - i - 1) * sizeof(dir_entry));
+	memmove(x->child + i + 1, x->child + i + 2, (x->count - i - 1) * sizeof(int32_t));
+	x->count--;
+	free_block(zb);
+	return dn_write(x->child[i], y);
+}
+
+//removes name from the tree of dir, whose blk_start may change
+static int dir_remove(inode_disk *dir, const char *name) {
+	char key[8];
+	strncpy(key, name, 8);
+	dirnode_disk x, y, z;
+	int xb = dir->blk_start, rc;
+	if(xb == 0) return ERR_FILE_NOT_FOUND;
+	if((rc = dn_read(xb, &x)) < 0) return rc;
+	while(1) {
+		int i = dn_pos(&x, key);
+		int found = dn_is(&x, i, key);
+		if(x.leaf) {
+			if(!found) return ERR_FILE_NOT_FOUND;
+			memmove(x.ent + i, x.ent + i + 1, (x.count - i - 1) * sizeof(dir_entry));
+			x.count--;
+			if(x.count == 0 && xb == dir->blk_start) {
+				//that was the last entry
+				free_block(xb);
+				dir->blk_start = 0;
+				return TFS_SUCCESS;
+			}
+			return dn_write(xb, &x);
+		}
+		if((rc = dn_read(x.child[i], &y)) < 0) return rc;
+		if(found) {
+			if((rc = dn_read(x.child[i + 1], &z)) < 0) return rc;
+			if(y.count > DN_MIN || z.count > DN_MIN) {
+				//swap in the entry next to it from the side that can spare
+				//one, then go down that side to remove that one instead
+				int side = y.count > DN_MIN ? i : i + 1;
+				dirnode_disk n = side == i ? y : z;
+				while(!n.leaf) {
+					if((rc = dn_read(n.child[side == i ? n.count : 0], &n)) < 0) return rc;
+				}
+				x.ent[i] = n.ent[side == i ? n.count - 1 : 0];
+				memcpy(key, x.ent[i].name, 8);
+				if((rc = dn_write(xb, &x)) < 0) return rc;
+				if(side != i) y = z;
+				xb = x.child[side];
+				x = y;
+				continue;
+			}
+			//both at the minimum: merge them around the entry and go down
+			if((rc = dn_merge(&x, i, &y, &z)) < 0) return rc;
+		}else if(y.count == DN_MIN) {
+			dirnode_disk l, r;
+			int hasL = i > 0, hasR = i < x.count;
+			if(hasL && (rc = dn_read(x.child[i - 1], &l)) < 0) return rc;
+			if(hasR && (rc = dn_read(x.child[i + 1], &r)) < 0) return rc;
+			if(hasL && l.count > DN_MIN) {
+				//borrow through the parent from the left
+				memmove(y.ent + 1, y.ent, y.count * sizeof(dir_entry));
+				if(!y.leaf) memmove(y.child + 1, y.child, (y.count + 1) * sizeof(int32_t));
+				y.ent[0] = x.ent[i - 1];
+				y.child[0] = l.child[l.count];
+				y.count++;
+				x.ent[i - 1] = l.ent[l.count - 1];
+				l.count--;
+				if((rc = dn_write(x.child[i - 1], &l)) < 0 || (rc = dn_write(x.child[i], &y)) < 0) return rc;
+			}else if(hasR && r.count > DN_MIN) {
+				//or from the right
+				y.ent[y.count] = x.ent[i];
+				y.child[y.count + 1] = r.child[0];
+				y.count++;
+				x.ent[i] = r.ent[0];
+				memmove(r.ent, r.ent + 1, (r.count - 1) * sizeof(dir_entry));
+				memmove(r.child, r.child + 1, r.count * sizeof(int32_t));
+				r.count--;
+				if((rc = dn_write(x.child[i + 1], &r)) < 0 || (rc = dn_write(x.child[i], &y)) < 0) return rc;
+			}else if(hasR) {
+				if((rc = dn_merge(&x, i, &y, &r)) < 0) return rc;
+			}else{
+				if((rc = dn_merge(&x, i - 1, &l, &y)) < 0) return rc;
+				y = l;
+				i--;
+			}
+		}
+		if(x.count == 0) {
+			//a merge took the root's last entry, its only child is the root now
+			free_block(xb);
+			dir->blk_start = x.child[0];
+		}else if((rc = dn_write(xb, &x)) < 0) {
+			return rc;
+		}
+		xb = x.child[i];
+		x = y;
+	}
+}
+
+//inode of name in the tree starting at block, 0 if it isn't there
+static int dir_find(int block, const char *name) {
+	dirnode_disk n;
+	while(block != 0) {
+		int rc = dn_read(block, &n);
+		if(rc < 0) return rc;
+		int i = dn_pos(&n, name);
+		if(dn_is(&n, i, name)) return n.ent[i].inode;
+		if(n.leaf) return 0;
+		block = n.child[i];
+	}
+	return 0;
+}
+
+static void dn_free_tree(int block) {
+	dirnode_disk n;
+	if(block == 0 || dn_read(block, &n) < 0) return;
+	for(int i = 0; !n.leaf && i <= n.count; i++) dn_free_tree(n.child[i]);
+	free_block(block);
+}
+
+//in order walk filling infos[] until max, *count is the entries passed so far
+static int dir_walk(int dir, int block, tfsFileInfo *infos, int max, int *count) {
+	dirnode_disk n;
+	int rc = dn_read(block, &n);
+	for(int i = 0; rc >= 0 && i <= n.count && *count < max; i++) {
+		if(!n.leaf && (rc = dir_walk(dir, n.child[i], infos, max, count)) < 0) break;
+		if(i == n.count || *count >= max) break;
+		inode_disk in;
+		if(readBlock(disk_no, n.ent[i].inode, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+		in.name[8] = '\0';
+		fill_info(&infos[*count], &in, n.ent[i].inode, lookupOpenInode(dir, in.name));
+		(*count)++;
+	}
+	return rc;
+}
+
+//splits path into the directory it is in (an inode block) and its last
+//name. every directory on the way has to exist
+static int path_walk(const char *path, int *dirOut, char *leaf) {
+	if(!(fs_features & TFS_FEAT_DIRS)) {
+		if(strlen(path) == 0 || strlen(path) > 8) return ERR_FILE_NAME;
+		strcpy(leaf, path);
+		*dirOut = ROOT_INODE_BLOCK;
+		return TFS_SUCCESS;
+	}
+	int dir = ROOT_INODE_BLOCK;
+	const char *p = path + strspn(path, "/");
+	while(1) {
+		size_t len = strcspn(p, "/");
+		if(len == 0 || len > 8) return ERR_FILE_NAME;
+		char part[9] = {0};
+		memcpy(part, p, len);
+		p += len;
+		p += strspn(p, "/");
+		if(*p == '\0') {
+			strcpy(leaf, part);
+			*dirOut = dir;
+			return TFS_SUCCESS;
+		}
+		int next = dir_lookup(dir, part);
+		if(next <= 0) return next < 0 ? next : ERR_FILE_NOT_FOUND;
+		inode_disk in;
+		if(readBlock(disk_no, next, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+		if(!(in.metaflags & INODE_DIR)) return ERR_NOT_DIR;
+		dir = next;
+	}
+}
+
+//inode block of the directory path names, "/" is the root
+static int dir_resolve(const char *path) {
+	if(!path) return ERR_FILE_NAME;
+	if(path[strspn(path, "/")] == '\0') return ROOT_INODE_BLOCK;
+	int dir;
+	char leaf[9];
+	int rc = path_walk(path, &dir, leaf);
+	if(rc < 0) return rc;
+	int block = dir_lookup(dir, leaf);
+	if(block <= 0) return block < 0 ? block : ERR_FILE_NOT_FOUND;
+	inode_disk in;
+	if(readBlock(disk_no, block, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+	return (in.metaflags & INODE_DIR) ? block : ERR_NOT_DIR;
+}
+
+//inode block of name in directory dir, 0 if it isn't there
+static int dir_lookup(int dir, const char *name) {
+	if(!(fs_features & TFS_FEAT_DIRS)) {
+		int block = findInodeByName(name);
+		return block > 0 ? block : 0;
+	}
+	inode_disk in;
+	if(readBlock(disk_no, dir, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+	return dir_find(in.blk_start, name);
+}
+
+//adds or removes the entry and writes the directory inode back, the B-tree
+//root may have moved even when it fails part way
+static int dir_change(int dir, const char *name, int inode, int add) {
+	if(!(fs_features & TFS_FEAT_DIRS)) return TFS_SUCCESS;
+	inode_disk in;
+	if(readBlock(disk_no, dir, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+	int rc = add ? dir_insert(&in, name, inode) : dir_remove(&in, name);
+	if(rc == 0) {
+		in.size_B += add ? 1 : -1;
+		in.mtime = (int32_t)time(NULL);
+	}
+	if(blk_write(dir, &in) != TFS_SUCCESS && rc == 0) rc = ERR_DISK_WRITE;
+	return rc;
+}
+
+static int dir_add(int dir, const char *name, int inode) {
+	return dir_change(dir, name, inode, 1);
+}
+
+static int dir_del(int dir, const char *name) {
+	return dir_change(dir, name, 0, 0);
+}
+
+//the entries of directory dir, returns how many there are in all
+static int dir_list(int dir, tfsFileInfo *infos, int max) {
+	inode_disk in;
+	if(readBlock(disk_no, dir, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+	if(!(in.metaflags & INODE_DIR)) return ERR_NOT_DIR;
+	int count = 0;
+	if(in.blk_start != 0 && max > 0) {
+		int rc = dir_walk(dir, in.blk_start, infos, max, &count);
+		if(rc < 0) return rc;
+	}
+	return in.size_B;
+}
+
+//puts every file of a flat image into a root directory tree
+static int dirs_enable(void) {
+	if(fs_features & TFS_FEAT_DIRS) return TFS_SUCCESS;
+	inode_disk root, in;
+	if(readBlock(disk_no, ROOT_INODE_BLOCK, &root) != TFS_SUCCESS) return ERR_DISK_READ;
+	root.blk_start = 0;
+	root.size_B = 0;
+	int limit = used_limit(), rc = 0;
+	for(int b = ROOT_INODE_BLOCK + 1; b < limit && rc >= 0; b++) {
+		if(readBlock(disk_no, b, &in) != TFS_SUCCESS) { rc = ERR_DISK_READ; break; }
+		if(in.blocktype != INODE || in.magic != MAGIC || (in.metaflags & INODE_SYSTEM)) continue;
+		in.name[8] = '\0';
+		//two files with one name could only be made by renaming, the second
+		//one would be lost, so the image stays flat
+		if((rc = dir_insert(&root, in.name, b)) == 0) root.size_B++;
+	}
+	if(rc < 0) {
+		//nothing points at the nodes yet, they just go back
+		dn_free_tree(root.blk_start);
+		return rc;
+	}
+	root.metaflags |= INODE_DIR;
+	if(blk_write(ROOT_INODE_BLOCK, &root) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	superblock_disk sb;
+	if(readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
+	sb.features |= TFS_FEAT_DIRS;
+	if(blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	fs_features = sb.features;
+	return TFS_SUCCESS;
+}
+
+static int map_load(map_cursor *mc, int block) {
+	mc->cur = block;
+	mc->dirty = 0;
+	if(block == 0) return TFS_SUCCESS;
+	if(readBlock(disk_no, block, &mc->ix) != TFS_SUCCESS) return ERR_DISK_READ;
+	if(mc->ix.blocktype != INDEX || mc->ix.magic != MAGIC) return ERR_FS_INVALID;
+	return TFS_SUCCESS;
+}
+
+static int map_start(map_cursor *mc, inode_disk *in) {
+	mc->in = in;
+	mc->prev = 0;
+	mc->prevBase = -1;
+	return map_load(mc, in->blk_start);
+}
+
+static int map_flush(map_cursor *mc) {
+	if(!mc->dirty) return TFS_SUCCESS;
+	if(blk_write(mc->cur, &mc->ix) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	mc->dirty = 0;
+	return TFS_SUCCESS;
+}
+
+//points prev at block, which is either the inode or an index block on disk
+static int map_link(map_cursor *mc, int block) {
+	if(mc->prev == 0) {
+		mc->in->blk_start = block;	//caller writes the inode
+		return TFS_SUCCESS;
+	}
+	index_disk p;
+	if(readBlock(disk_no, mc->prev, &p) != TFS_SUCCESS) return ERR_DISK_READ;
+	p.blk_next = block;
+	if(blk_write(mc->prev, &p) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	return TFS_SUCCESS;
+}
+
+//moves to the index block for base. returns 1 when it is loaded in ix, 0
+//when it doesn't exist (and create is 0), or an error
+static int map_find(map_cursor *mc, int base, int create) {
+	int rc;
+	if(mc->prevBase >= base) {
+		//behind us, start over from the head
+		if((rc = map_flush(mc)) < 0) return rc;
+		mc->prev = 0;
+		mc->prevBase = -1;
+		if((rc = map_load(mc, mc->in->blk_start)) < 0) return rc;
+	}
+	while(mc->cur != 0 && mc->ix.base < base) {
+		if((rc = map_flush(mc)) < 0) return rc;
+		mc->prev = mc->cur;
+		mc->prevBase = mc->ix.base;
+		if((rc = map_load(mc, mc->ix.blk_next)) < 0) return rc;
+	}
+	if(mc->cur != 0 && mc->ix.base == base) return 1;
+	if(!create) return 0;
+
+	int nb = allocate_free_block();
+	if(nb < 0) return nb;
+	if((rc = map_flush(mc)) < 0) return rc;
+	if((rc = map_link(mc, nb)) < 0) return rc;
+	int next = mc->cur;
+	memset(&mc->ix, 0, sizeof(mc->ix));
+	mc->ix.blocktype = INDEX;
+	mc->ix.magic = MAGIC;
+	mc->ix.blk_next = next;
+	mc->ix.base = base;
+	mc->cur = nb;
+	mc->dirty = 1;
+	return 1;
+}
+
+//takes the current index block out of the chain, the cursor moves to the next one
+static int map_unlink(map_cursor *mc) {
+	int rc;
+	int gone = mc->cur;
+	int next = mc->ix.blk_next;
+	if((rc = map_link(mc, next)) < 0) return rc;
+	free_block(gone);
+	return map_load(mc, next);
+}
+
+//data block holding file block fblk, 0 for a hole or a reserved block that
+//wasn't written yet, both read as zeros
+static int map_get(map_cursor *mc, int64_t fblk) {
+	int base = (int)(fblk - fblk % IX_E);
+	int rc = map_find(mc, base, 0);
+	if(rc <= 0) return rc;
+	int block = mc->ix.blk[fblk - base];
+	return block < 0 ? 0 : block;
+}
+
+//frees the index blocks of a mapped file, and drops its data too when
+//freeData is set (shared blocks stay with the clones that have them)
+static void map_release(inode_disk *in, int freeData) {
+	int *blocks = NULL;
+	int n = 0, nix = 0;
+	if(freeData && file_blocks(in, &blocks, &n, &nix) == TFS_SUCCESS) {
+		refs_adjust(blocks + nix, n - nix, -1);
+		free(blocks);
+	}
+	int block = in->blk_start;
+	while(block != 0) {
+		index_disk ix;
+		if(readBlock(disk_no, block, &ix) != TFS_SUCCESS || ix.blocktype != INDEX) break;
+		free_block(block);
+		block = ix.blk_next;
+	}
+	in->blk_start = 0;
+}
+
+//drops every block of an extent chain
+static int chain_release(int start) {
+	inode_disk in = {0};
+	in.blk_start = start;
+	int *blocks, n, nix;
+	int rc = file_blocks(&in, &blocks, &n, &nix);
+	if(rc < 0) return rc;
+	rc = refs_adjust(blocks, n, -1);
+	free(blocks);
+	return rc;
+}
+
+//turns an extent chain into a block map over the same data blocks. the
+//image gets TFS_FEAT_BLOCKMAP the first time, older code can't read these
+static int map_convert(inode_disk *in) {
+	if(in->metaflags & INODE_MAPPED) return TFS_SUCCESS;
+	if(!(fs_features & TFS_FEAT_BLOCKMAP)) {
+		superblock_disk sb = {0};
+		if(readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
+		sb.features |= TFS_FEAT_BLOCKMAP;
+		if(blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+		fs_features = sb.features;
+	}
+	int chain = in->blk_start;
+	in->blk_start = 0;
+	map_cursor mc;
+	map_start(&mc, in);
+	int rc = TFS_SUCCESS;
+	for(int64_t fblk = 0; chain != 0; fblk++) {
+		fileextent_disk ext;
+		if(readBlock(disk_no, chain, &ext) != TFS_SUCCESS) { rc = ERR_DISK_READ; break; }
+		int base = (int)(fblk - fblk % IX_E);
+		if((rc = map_find(&mc, base, 1)) < 0) break;
+		mc.ix.blk[fblk - base] = chain;
+		mc.dirty = 1;
+		chain = ext.blk_next;
+	}
+	if(rc >= 0) rc = map_flush(&mc);
+	if(rc < 0) {
+		//give back the index blocks, the chain itself is untouched
+		map_flush(&mc);
+		map_release(in, 0);
+		return rc;
+	}
+	in->metaflags |= INODE_MAPPED;
+	return TFS_SUCCESS;
+}
+
+//read side of tfs_readFile for mapped files, holes come back as zeros
+static int map_read(inode_disk *in, int64_t fp, char *buffer, int size) {
+	map_cursor mc;
+	int rc = map_start(&mc, in);
+	if(rc < 0) return rc;
+	int done = 0;
+	while(done < size) {
+		int64_t fblk = (fp + done) / EX_E;
+		int off = (int)((fp + done) % EX_E);
+		int n = EX_E - off;
+		if(n > size - done) n = size - done;
+		int block = map_get(&mc, fblk);
+		if(block < 0) return block;
+		if(block == 0) {
+			memset(buffer + done, 0, n);
+		}else{
+			fileextent_disk ext;
+			if(readBlock(disk_no, block, &ext) != TFS_SUCCESS) return ERR_DISK_READ;
+			memcpy(buffer + done, ext.data + off, n);
+		}
+		done += n;
+	}
+	return done;
+}
+
+//zeros bytes [from, to) of file block fblk, if it is allocated
+static int map_zero(map_cursor *mc, int64_t fblk, int from, int to) {
+	int block = map_get(mc, fblk);
+	if(block <= 0) return block;
+	fileextent_disk ext;
+	if(readBlock(disk_no, block, &ext) != TFS_SUCCESS) return ERR_DISK_READ;
+	memset(ext.data + from, 0, to - from);
+	int shared = refs_get(block);
+	if(shared < 0) return shared;
+	if(shared) {
+		//a clone still has the old content, zero a copy instead
+		int nb = allocate_free_block();
+		if(nb < 0) return nb;
+		refs_drop(block);
+		block = nb;
+		mc->ix.blk[fblk % IX_E] = block;
+		mc->dirty = 1;
+	}
+	if(blk_write(block, &ext) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	return TFS_SUCCESS;
+}
+
+//defrag. the first call scans the image for free blocks, the ones after
+//only look again at what was written in between. each moves files whose
+//blocks aren't one ascending run into the lowest free run that fits them
+//(a whole fs pass also slides files down into lower runs, which packs free
+//space toward the end), then writes the free chain back out in ascending
+//order so new files get contiguous blocks too. inodes and index blocks stay
+//where they are
+
+#define DEFRAG_CHUNK 64		//blocks copied per writeBlocks
+
+//every write to the mounted image goes through these, so a kept defrag map
+//knows which blocks to look at again
+static void defrag_touch(int block, int n) {
+	for(int b = block; defragType && b < block + n && b < fs_blocks; b++) {
+		if(defragDirty[b / 8] & (1 << (b % 8))) continue;
+		defragDirty[b / 8] |= 1 << (b % 8);
+		defragNDirty++;
+	}
+}
+
+static int blk_write(int block, void *data) {
+	defrag_touch(block, 1);
+	return writeBlock(disk_no, block, data);
+}
+
+static int blks_write(int block, int n, void *data) {
+	defrag_touch(block, n);
+	return writeBlocks(disk_no, block, n, data);
+}
+
+//forgets the kept map, the next defrag_scan reads the whole image
+static void defrag_drop(void) {
+	free(defragType);
+	free(defragDirty);
+	defragType = NULL;
+	defragDirty = NULL;
+	defragNDirty = 0;
+	defragChained = 0;
+}
+
+//brings block's type in the map up to date with the disk. used is where the
+//lazy region starts
+static int defrag_rescan(int block, int used) {
+	uint8_t *type = &defragType[block];
+	if(block >= used) {
+		*type = FREE;
+		return TFS_SUCCESS;
+	}
+	if((fs_features & TFS_FEAT_BITMAP) && block >= fs_bmStart && block < fs_bmStart + fs_bmBlocks) {
+		*type = BITMAP;
+		return TFS_SUCCESS;
+	}
+	if(fs_features & TFS_FEAT_BITMAP) {
+		int bit = bm_test(block);
+		if(bit < 0) return bit;
+		if(!bit) {
+			*type = FREE;
+			return TFS_SUCCESS;
+		}
+	}
+	uint8_t blk[BLOCKSIZE];
+	if(readBlock(disk_no, block, blk) != TFS_SUCCESS) return ERR_DISK_READ;
+	*type = blk[1] == MAGIC ? blk[0] : 0;
+	return TFS_SUCCESS;
+}
+
+//the whole image into a new map
+static int defrag_full_scan(int used) {
+	defrag_drop();
+	defragType = calloc(fs_blocks, 1);
+	defragDirty = calloc(fs_blocks / 8 + 1, 1);
+	uint8_t *buf = malloc((size_t)DEFRAG_CHUNK * BLOCKSIZE);
+	if(!defragType || !defragDirty || !buf) { free(buf); return ERR_BUF; }
+	for(int b = 2; b < used; b += DEFRAG_CHUNK) {
+		int cnt = used - b < DEFRAG_CHUNK ? used - b : DEFRAG_CHUNK;
+		if(readBlocks(disk_no, b, cnt, buf) != 0) { free(buf); return ERR_DISK_READ; }
+		for(int i = 0; i < cnt; i++) {
+			uint8_t *blk = buf + (size_t)i * BLOCKSIZE;
+			defragType[b + i] = blk[1] == MAGIC ? blk[0] : 0;
+		}
+	}
+	free(buf);
+	//free blocks on bitmap images have no header, the bits say which they are
+	for(int b = 2; (fs_features & TFS_FEAT_BITMAP) && b < used; b++) {
+		if(b >= fs_bmStart && b < fs_bmStart + fs_bmBlocks) {
+			defragType[b] = BITMAP;
+			continue;
+		}
+		if(bm_load(b) < 0) return ERR_DISK_READ;
+		if(!(bmBuf.bits[(b % BM_BITS) / 8] & (1 << (b % 8)))) defragType[b] = FREE;
+	}
+	//the lazy region is free too
+	memset(defragType + used, FREE, fs_blocks - used);
+	return TFS_SUCCESS;
+}
+
+//the kept map, updated from what was written since the last call: the
+//blocks themselves, the bits of bitmap blocks that changed and the blocks
+//the lazy region gave up or took back
+static int defrag_update(int used) {
+	int lo = used < defragUsed ? used : defragUsed, hi = used < defragUsed ? defragUsed : used;
+	//a chain push or pop writes the superblock, without one the chain is
+	//still what defrag_free_chain left
+	if(defragDirty[SUPERBLOCK_BLOCK / 8] & (1 << (SUPERBLOCK_BLOCK % 8))) defragChained = 0;
+	for(int b = lo; b < hi; b++) {
+		int rc = defrag_rescan(b, used);
+		if(rc < 0) return rc;
+	}
+	for(int i = 0; i < fs_bmBlocks; i++) {
+		int bb = fs_bmStart + i;
+		if(!(defragDirty[bb / 8] & (1 << (bb % 8)))) continue;
+		int end = (i + 1) * BM_BITS < used ? (i + 1) * BM_BITS : used;
+		for(int b = i * BM_BITS > 2 ? i * BM_BITS : 2; b < end; b++) {
+			if(b >= fs_bmStart && b < fs_bmStart + fs_bmBlocks) continue;
+			int bit = bm_test(b);
+			if(bit < 0) return bit;
+			if(bit == (defragType[b] == FREE)) {
+				int rc = defrag_rescan(b, used);
+				if(rc < 0) return rc;
+			}
+		}
+	}
+	for(int k = 0; k < fs_blocks / 8 + 1; k++) {
+		if(!defragDirty[k]) continue;
+		for(int b = k * 8; b < k * 8 + 8 && b < fs_blocks; b++) {
+			if(b < 2 || !(defragDirty[k] & (1 << (b % 8)))) continue;
+			int rc = defrag_rescan(b, used);
+			if(rc < 0) return rc;
+		}
+	}
+	return TFS_SUCCESS;
+}
+
+static int defrag_scan(defrag_state *ds) {
+	//the callers end with defrag_done whatever this returns
+	ds->type = NULL;
+	ds->changed = NULL;
+	ds->nChanged = ds->capChanged = 0;
+	ds->chained = 0;
+	//cached blocks look free on disk, they have to be free for real first
+	int rc = alloc_spill(nAlloc);
+	if(rc >= 0) rc = freed_flush();
+	if(rc < 0) return rc;
+	ds->limit = fs_blocks;
+	ds->moved = 0;
+	ds->from = 2;
+	int used = used_limit();
+	//past a point reading every block in order beats looking them up one
+	//at a time
+	if(defragType && defragNDirty < used / 16) rc = defrag_update(used);
+	else rc = defrag_full_scan(used);
+	if(rc < 0) return rc;
+	memset(defragDirty, 0, fs_blocks / 8 + 1);
+	defragNDirty = 0;
+	defragUsed = used;
+	ds->type = defragType;
+	ds->chained = defragChained;
+	return TFS_SUCCESS;
+}
+
+//ends a call that started with defrag_scan. what it wrote itself is in the
+//map already, so that stays as it is for the next one unless it failed
+//halfway
+static void defrag_done(defrag_state *ds, int rc) {
+	free(ds->changed);
+	ds->changed = NULL;
+	if(rc < 0 || !defragType) {
+		defrag_drop();
+		return;
+	}
+	if(defragNDirty > 0) memset(defragDirty, 0, fs_blocks / 8 + 1);
+	defragNDirty = 0;
+	defragUsed = used_limit();
+}
+
+//remembers a block that went from free to used or back, defrag_free_chain
+//only rewrites the headers around those
+static void defrag_note(defrag_state *ds, int block) {
+	if(!ds->chained) return;
+	if(ds->nChanged == ds->capChanged) {
+		int cap = ds->capChanged ? ds->capChanged * 2 : 64;
+		int *nc = realloc(ds->changed, cap * sizeof(int));
+		//then the whole chain gets written out
+		if(!nc) {
+			ds->chained = 0;
+			return;
+		}
+		ds->changed = nc;
+		ds->capChanged = cap;
+	}
+	ds->changed[ds->nChanged++] = block;
+}
+
+static void defrag_set(defrag_state *ds, int block, int type) {
+	if((ds->type[block] == FREE) != (type == FREE)) defrag_note(ds, block);
+	ds->type[block] = type;
+}
+
+//blocks of a file in the order defrag lays them out: index blocks
+//first (*nIndex of them, mapped files only), then the data in file order
+static int file_blocks(inode_disk *in, int **blocks, int *n, int *nIndex) {
+	int cap = 64, cnt = 0, nix = 0;
+	int *bl = malloc(cap * sizeof(int));
+	if(!bl) return ERR_BUF;
+	int mapped = (in->metaflags & INODE_MAPPED) != 0;
+	//mapped files take two walks, the index chain and then its entries
+	for(int pass = mapped ? 0 : 1; pass < 2; pass++) {
+		for(int b = in->blk_start; b != 0 && cnt < fs_blocks; ) {
+			union { index_disk ix; fileextent_disk ext; } u;
+			if(readBlock(disk_no, b, &u) != TFS_SUCCESS) { free(bl); return ERR_DISK_READ; }
+			if(cnt + IX_E >= cap) {
+				cap *= 2;
+				int *nb = realloc(bl, cap * sizeof(int));
+				if(!nb) { free(bl); return ERR_BUF; }
+				bl = nb;
+			}
+			if(!mapped) {
+				bl[cnt++] = b;
+				b = u.ext.blk_next;
+				continue;
+			}
+			if(pass == 0) {
+				bl[cnt++] = b;
+				nix++;
+			}else{
+				for(int i = 0; i < IX_E; i++) {
+					if(u.ix.blk[i] != 0) bl[cnt++] = abs(u.ix.blk[i]);
+				}
+			}
+			b = u.ix.blk_next;
+		}
+	}
+	*blocks = bl;
+	*n = cnt;
+	*nIndex = nix;
+	return TFS_SUCCESS;
+}
+
+//lowest run of n free blocks from ds->from up, then from the start, -1 if
+//there is none
+static int defrag_find_run(defrag_state *ds, int n) {
+	for(int from = ds->from; ; from = 2) {
+		int run = 0;
+		for(int b = from; b < ds->limit; b++) {
+			run = ds->type[b] == FREE ? run + 1 : 0;
+			if(run == n) return b - n + 1;
+		}
+		if(from == 2) return -1;
+	}
+}
+
+//moves one file, index blocks and all, into a single run, how eagerly
+//depends on mode (DEFRAG_*). returns blocks moved, 0 when it was fine
+//already or there is no run big enough for it
+static int defrag_file(defrag_state *ds, int inodeBlock, int mode) {
+	inode_disk in;
+	if(readBlock(disk_no, inodeBlock, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+	if(in.blocktype != INODE || in.magic != MAGIC || (in.metaflags & INODE_DIR)) return 0;
+	int *old;
+	int n, nix;
+	int rc = file_blocks(&in, &old, &n, &nix);
+	if(rc < 0) return rc;
+	int contiguous = 1;
+	for(int i = 1; i < n; i++) {
+		if(old[i] != old[i - 1] + 1) contiguous = 0;
+	}
+	//blocks shared with a clone stay put, the other files point at them too
+	for(int i = nix; i < n && fs_refInode != 0; i++) {
+		if(refs_get(old[i]) != 0) { free(old); return 0; }
+	}
+	//the last file's old blocks may be picked, they can't be punched after
+	discard_flush();
+	int dst = n == 0 || (contiguous && mode == DEFRAG_FRAGMENTED) ? -1 : defrag_find_run(ds, n);
+	if(dst < 0 || (contiguous && mode == DEFRAG_COMPACT && dst > old[0])) { free(old); return 0; }
+
+	//data first, a chunk at a time. chains get new blk_next
+	uint8_t *buf = malloc((size_t)DEFRAG_CHUNK * BLOCKSIZE);
+	if(!buf) { free(old); return ERR_BUF; }
+	for(int i = nix; i < n && rc >= 0; i += DEFRAG_CHUNK) {
+		int cnt = n - i < DEFRAG_CHUNK ? n - i : DEFRAG_CHUNK;
+		for(int j = 0; j < cnt; j++) {
+			fileextent_disk ext;
+			if(readBlock(disk_no, old[i + j], &ext) != TFS_SUCCESS) { rc = ERR_DISK_READ; break; }
+			if(nix == 0) ext.blk_next = i + j + 1 < n ? dst + i + j + 1 : 0;
+			memcpy(buf + (size_t)j * BLOCKSIZE, &ext, BLOCKSIZE);
+		}
+		if(rc >= 0 && blks_write(dst + i, cnt, buf) != 0) rc = ERR_DISK_WRITE;
+	}
+	free(buf);
+	//then the index blocks, pointing at the new data. the entries come out
+	//in the same order defrag_blocks listed them
+	int next = nix;
+	for(int j = 0; j < nix && rc >= 0; j++) {
+		index_disk ix;
+		if(readBlock(disk_no, old[j], &ix) != TFS_SUCCESS) { rc = ERR_DISK_READ; break; }
+		for(int i = 0; i < IX_E; i++) {
+			if(ix.blk[i] > 0) ix.blk[i] = dst + next++;
+			else if(ix.blk[i] < 0) ix.blk[i] = -(dst + next++);
+		}
+		ix.blk_next = j + 1 < nix ? dst + j + 1 : 0;
+		if(blk_write(dst + j, &ix) != TFS_SUCCESS) rc = ERR_DISK_WRITE;
+	}
+	//and only once the inode points at the copies are the old blocks free.
+	//a bitmap has the copies marked before that, the free chain is rewritten
+	//by defrag_free_chain at the end
+	if(rc >= 0 && (fs_features & TFS_FEAT_BITMAP)) rc = bm_mark(dst, n, 1);
+	if(rc >= 0) {
+		in.blk_start = dst;
+		if(blk_write(inodeBlock, &in) != TFS_SUCCESS) rc = ERR_DISK_WRITE;
+	}
+	//straight into the bitmap, not through the allocation cache or the
+	//freed queue: type[] has them free from here on, and a file moved onto
+	//them later mustn't get its bits cleared when those are given back
+	if(rc >= 0 && (fs_features & TFS_FEAT_BITMAP)) {
+		rc = bm_release(old, n);
+		if(fs_features & TFS_FEAT_LOG) logNoClean = 0;
+		for(int i = 0; i < n && rc >= 0 && (mountFlags & TFS_MOUNT_DISCARD); i++) discard_add(old[i]);
+	}
+	if(rc < 0) { free(old); return rc; }
+	for(int i = 0; i < n; i++) {
+		defrag_set(ds, dst + i, i < nix ? INDEX : FILEEXTENT);
+	}
+	for(int i = 0; i < n; i++) {
+		defrag_set(ds, old[i], FREE);
+		dedup_forget(old[i]);
+	}
+	free(old);
+	ds->moved += n;
+	if(mode == DEFRAG_EVICT) ds->from = dst + n;
+	return n;
+}
+
+//free block after b and below top in type[], 0 if there is none
+static int defrag_next_free(defrag_state *ds, int b, int top) {
+	for(b++; b < top; b++) {
+		if(ds->type[b] == FREE) return b;
+	}
+	return 0;
+}
+
+//rewrites the free chain from type[], lowest block first. on LAZYFREE
+//images a free run at the top goes back to the lazy region. when the chain
+//is still the one the last call wrote only the headers around the blocks
+//this one freed or took change
+static int defrag_free_chain(defrag_state *ds) {
+	superblock_disk sb = {0};
+	if(readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
+	int top = ds->limit, oldTop = ds->limit;
+	if(fs_features & TFS_FEAT_LAZYFREE) {
+		oldTop = sb.free_lazy;
+		while(top > 2 && ds->type[top - 1] == FREE) top--;
+		sb.free_lazy = top;
+	}
+	if(fs_features & TFS_FEAT_BITMAP) {
+		//defrag_file kept the bits up to date, their clear bits past top are
+		//now the lazy region. on log images the old blocks are only queued
+		int rc = freed_flush();
+		if(rc < 0) return rc;
+		if(blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+		discard_flush();
+		return TFS_SUCCESS;
+	}
+	if(ds->chained) {
+		//free blocks the lazy region gave up need headers, and where it
+		//starts now the chain ends
+		for(int b = oldTop; b < top && ds->chained; b++) {
+			if(ds->type[b] == FREE) defrag_note(ds, b);
+		}
+	}
+	if(ds->chained) {
+		int *fix = malloc((2 * ds->nChanged + 1) * sizeof(int)), nFix = 0;
+		if(!fix) return ERR_BUF;
+		//each changed block that is free now, and the free block before
+		//each one, whose next it may have been or be now
+		for(int i = 0; i <= ds->nChanged; i++) {
+			int c = i < ds->nChanged ? ds->changed[i] : top;
+			if(c < top && ds->type[c] == FREE) fix[nFix++] = c;
+			int p = (c < top ? c : top) - 1;
+			while(p >= 2 && ds->type[p] != FREE) p--;
+			fix[nFix++] = p >= 2 ? p : 0;
+		}
+		qsort(fix, nFix, sizeof(int), cmp_int);
+		for(int i = 0; i < nFix; i++) {
+			if(fix[i] == 0 || (i > 0 && fix[i] == fix[i - 1])) continue;
+			free_disk fr = {0};
+			fr.blocktype = FREE;
+			fr.magic = MAGIC;
+			fr.blk_next = defrag_next_free(ds, fix[i], top);
+			if(blk_write(fix[i], &fr) != TFS_SUCCESS) { free(fix); return ERR_DISK_WRITE; }
+		}
+		free(fix);
+		sb.free_block = defrag_next_free(ds, 1, top);
+		if(blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+		return TFS_SUCCESS;
+	}
+	uint8_t *buf = malloc((size_t)DEFRAG_CHUNK * BLOCKSIZE);
+	if(!buf) return ERR_BUF;
+	//backwards, so every header already knows the block after it
+	int head = 0;
+	for(int b = top - 1; b >= 2; ) {
+		if(ds->type[b] != FREE) { b--; continue; }
+		int hi = b;
+		while(b >= 2 && ds->type[b] == FREE && hi - b < DEFRAG_CHUNK) b--;
+		int lo = b + 1;
+		for(int i = hi; i >= lo; i--) {
+			free_disk fr = {0};
+			fr.blocktype = FREE;
+			fr.magic = MAGIC;
+			fr.blk_next = head;
+			memcpy(buf + (size_t)(i - lo) * BLOCKSIZE, &fr, BLOCKSIZE);
+			head = i;
+		}
+		if(blks_write(lo, hi - lo + 1, buf) != 0) { free(buf); return ERR_DISK_WRITE; }
+	}
+	free(buf);
+	sb.free_block = head;
+	if(blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	defragChained = 1;
+	return TFS_SUCCESS;
+}
+
+//moves a file inode or a directory node to the first free block from
+//ds->from on. owner[block] is what points at it: the directory node with
+//the inode's entry, or the node or directory inode above the node. that,
+//the open files on the inode and owner[] of whatever block points at get
+//the copy. returns 1 when it moved, 0 if it didn't
+static int log_move_meta(defrag_state *ds, int block, int32_t *owner) {
+	int dst = defrag_find_run(ds, 1), up = owner[block];
+	if(dst < 0 || up <= 0) return 0;
+	union { inode_disk in; dirnode_disk dn; } u, parent;
+	if(readBlock(disk_no, block, &u) != TFS_SUCCESS || readBlock(disk_no, up, &parent) != TFS_SUCCESS) return ERR_DISK_READ;
+	int32_t *ref = NULL;
+	if(ds->type[up] == INODE) {
+		if(parent.in.blk_start == block) ref = &parent.in.blk_start;
+	}else{
+		for(int i = 0; i < parent.dn.count && i < DN_MAX && !ref; i++) {
+			if(parent.dn.ent[i].inode == block) ref = &parent.dn.ent[i].inode;
+		}
+		for(int i = 0; !parent.dn.leaf && i <= parent.dn.count && i <= DN_MAX && !ref; i++) {
+			if(parent.dn.child[i] == block) ref = &parent.dn.child[i];
+		}
+	}
+	if(!ref) return 0;
+	//the copy before what points at it, a crash in between only leaks it
+	int rc = bm_mark(dst, 1, 1);
+	if(rc < 0) return rc;
+	if(blk_write(dst, &u) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	*ref = dst;
+	if(blk_write(up, &parent) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	int type = ds->type[block], *blocks = NULL, n = 0, nix;
+	if(type == INODE) {
+		fds_moved(block, dst);
+		shared_note(block, dst, 0);
+		//and the old one stops looking like an inode, like in tfs_deleteFile
+		inode_disk gone = {0};
+		blk_write(block, &gone);
+		if((rc = file_blocks(&u.in, &blocks, &n, &nix)) < 0) return rc;
+	}else{
+		if(!(blocks = malloc((2 * DN_MAX + 1) * sizeof(int)))) return ERR_BUF;
+		for(int i = 0; i < u.dn.count && i < DN_MAX; i++) blocks[n++] = u.dn.ent[i].inode;
+		for(int i = 0; !u.dn.leaf && i <= u.dn.count && i <= DN_MAX; i++) blocks[n++] = u.dn.child[i];
+	}
+	free_block(block);
+	for(int j = 0; j < n; j++) {
+		if(blocks[j] > 0 && blocks[j] < fs_blocks && owner[blocks[j]] == block) owner[blocks[j]] = dst;
+	}
+	free(blocks);
+	owner[dst] = up;
+	defrag_set(ds, dst, type);
+	defrag_set(ds, block, FREE);
+	ds->from = dst + 1;
+	ds->moved++;
+	return 1;
+}
+
+static int64_t defrag_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//block reference counts for clones. the table is a hidden mapped file
+//(INODE_SYSTEM, its inode in sb.refcount_inode) holding a uint16 per block
+//with the number of extra references, so a hole means nobody shares it.
+//every count lives in table block b / REF_PER_BLOCK
+
+static int cmp_int(const void *a, const void *b) {
+	int x = *(const int *)a, y = *(const int *)b;
+	return x < y ? -1 : x > y;
+}
+
+//makes the table the first time something gets cloned
+static int refs_init(void) {
+	if(fs_refInode != 0) return TFS_SUCCESS;
+	superblock_disk sb = {0};
+	if(readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
+	int block = allocate_free_block();
+	if(block < 0) return block;
+	inode_disk in = {0};
+	in.blocktype = INODE;
+	in.magic = MAGIC;
+	in.metaflags = INODE_INITIAL_FLAGS | INODE_MAPPED | INODE_SYSTEM;
+	in.ctime = in.mtime = in.atime = (uint32_t)time(NULL);
+	if(blk_write(block, &in) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	//re-read, allocating may have moved free_lazy
+	if(readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_READ;
+	sb.refcount_inode = block;
+	sb.features |= TFS_FEAT_REFCOUNT | TFS_FEAT_BLOCKMAP;
+	if(blk_write(SUPERBLOCK_BLOCK, &sb) != TFS_SUCCESS) return ERR_DISK_WRITE;
+	fs_features = sb.features;
+	fs_refInode = block;
+	return TFS_SUCCESS;
+}
+
+//extra references to block, 0 when it has a single owner
+static int refs_get(int block) {
+	if(fs_refInode == 0) return 0;
+	inode_disk in;
+	if(readBlock(disk_no, fs_refInode, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+	uint16_t count = 0;
+	int64_t off = (block / REF_PER_BLOCK) * (int64_t)EX_E + (block % REF_PER_BLOCK) * 2;
+	if(off >= inode_size(&in)) return 0;
+	int rc = map_read(&in, off, (char *)&count, 2);
+	return rc < 0 ? rc : count;
+}
+
+//adds delta to the count of every block in blocks[] (sorted in place, one
+//table block read and written per group). with delta < 0, blocks that
+//weren't shared are freed instead, that is what dropping a reference to
+//them means
+static int refs_adjust(int *blocks, int n, int delta) {
+	if(n == 0) return TFS_SUCCESS;
+	if(fs_refInode == 0) {
+		if(delta > 0) return ERR_FS_INVALID;
+		for(int i = 0; i < n; i++) free_block(blocks[i]);
+		return TFS_SUCCESS;
+	}
+	qsort(blocks, n, sizeof(int), cmp_int);
+	inode_disk in;
+	if(readBlock(disk_no, fs_refInode, &in) != TFS_SUCCESS) return ERR_DISK_READ;
+	map_cursor mc;
+	int rc = map_start(&mc, &in);
+	for(int i = 0; i < n && rc >= 0; ) {
+		int t = blocks[i] / REF_PER_BLOCK;
+		int base = t - t % IX_E;
+		int found = map_find(&mc, base, delta > 0);
+		if(found < 0) { rc = found; break; }
+		int dblk = found ? mc.ix.blk[t - base] : 0;
+		fileextent_disk ext = {0};
+		if(dblk == 0 && delta > 0) {
+			if((dblk = allocate_free_block()) < 0) { rc = dblk; break; }
+			ext.blocktype = FILEEXTENT;
+			ext.magic = MAGIC;
+			mc.ix.blk[t - base] = dblk;
+			mc.dirty = 1;
+			if((int64_t)(t + 1) * EX_E > inode_size(&in)) inode_set_size(&in, (int64_t)(t + 1) * EX_E);
+		}else if(dblk != 0 && readBlock(disk_no, dblk, &ext) != TFS_SUCCESS) {
+			rc = ERR_DISK_READ;
+			break;
+		}
+		int dirty = 0;
+		for(; i < n && blocks[i] / REF_PER_BLOCK == t; i++) {
+			uint16_t count = 0;
+			if(dblk != 0) memcpy(&count, ext.data + (blocks[i] % REF_PER_BLOCK) * 2, 2);
+			if(delta < 0 && count == 0) {
+				free_block(blocks[i]);
+				continue;
+			}
+			if(delta > 0 && count + delta > UINT16_MAX) { rc = ERR_FS_FULL; break; }
+			count += delta;
+			memcpy(ext.data + (blocks[i] % REF_PER_BLOCK) * 2, &count, 2);
+			dirty = 1;
+		}
+		if(dirty && blk_write(dblk, &ext) != TFS_SUCCESS) rc = ERR_DISK_WRITE;
+	}
+	if(map_flush(&mc) < 0 && rc >= 0) rc = ERR_DISK_WRITE;
+	if(blk_write(fs_refInode, &in) != TFS_SUCCESS && rc >= 0) rc = ERR_DISK_WRITE;
+	return rc;
+}
+
+//drops one reference to a single block
+static int refs_drop(int block) {
+	return refs_adjust(&block, 1, -1);
+}
+
+//64 bit multiply-xorshift over the payload, a word at a time
+static uint64_t dedup_hash(const uint8_t *data) {
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	for(int i = 0; i + 8 <= EX_E; i += 8) {
+		uint64_t w;
+		memcpy(&w, data + i, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return h;
+}
+
+//a live block whose payload is the same as ext's, 0 if the index doesn't
+//know one. the hash only picks the candidate, the bytes decide
+static int dedup_find(const fileextent_disk *ext) {
+	uint64_t h = dedup_hash(ext->data);
+	dedup_entry *e = &dedupTab[h & (DEDUP_SLOTS - 1)];
+	int b = e->block;
+	if(b == 0 || e->hash != h || !(dedupLive[b / 8] & (1 << (b % 8)))) return 0;
+	fileextent_disk cand;
+	if(readBlock(disk_no, b, &cand) != TFS_SUCCESS) return ERR_DISK_READ;
+	if(cand.blocktype != FILEEXTENT || cand.magic != MAGIC || memcmp(cand.data, ext->data, EX_E) != 0) return 0;
+	return b;
+}
+
+static void dedup_add(const fileextent_disk *ext, int block) {
+	uint64_t h = dedup_hash(ext->data);
+	dedup_entry *e = &dedupTab[h & (DEDUP_SLOTS - 1)];
+	e->hash = h;
+	e->block = block;
+	dedupLive[block / 8] |= 1 << (block % 8);
+}
+
+static void dedup_forget(int block) {
+	if(dedupLive && block >= 0 && block < fs_blocks) dedupLive[block / 8] &= ~(1 << (block % 8));
+}
+
+static void dedup_stop(void) {
+	free(dedupTab);
+	free(dedupLive);
+	dedupTab = NULL;
+	dedupLive = NULL;
+}
+
+//maps the segment for diskname, setting it up if this is the first mount of
+//it. the name comes from the real path of the image so different ways of
+//naming it meet, a volume descriptor is used as it is
+static int shared_open(const char *diskname) {
+	char path[PATH_MAX];
+	const char *key = realpath(diskname, path) ? path : diskname;
+	uint64_t h = 14695981039346656037ULL;
+	for(; *key; key++) h = (h ^ (uint8_t)*key) * 1099511628211ULL;
+	char name[32];
+	snprintf(name, sizeof(name), "/tinyfs-%016llx", (unsigned long long)h);
+	int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+	if(fd < 0) return -1;
+	//a new segment is zeros, state 0. one left by code with a smaller
+	//segment grows, what it didn't have starts out as zeros too
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (st.st_size < (off_t)sizeof(shared_seg) && ftruncate(fd, sizeof(shared_seg)) != 0)) {
+		close(fd);
+		return -1;
+	}
+	shared_seg *seg = mmap(NULL, sizeof(shared_seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(seg == MAP_FAILED) return -1;
+	//whoever takes state from 0 sets it up, the others wait for that. one
+	//that is still at it after SHARED_SETUP_MS died halfway, the next waiter
+	//takes over (state stays odd until it is ready)
+	int waited = 0, seen = seg->state;
+	while(seg->state != 2) {
+		int s = seg->state;
+		if(s != seen) {
+			seen = s;
+			waited = 0;
+		}
+		if((s == 0 && __sync_bool_compare_and_swap(&seg->state, 0, 1)) ||
+				(s != 0 && waited >= SHARED_SETUP_MS && __sync_bool_compare_and_swap(&seg->state, s, s + 2))) {
+			pthread_mutexattr_t attr;
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+			pthread_mutex_init(&seg->lock, &attr);
+			pthread_mutexattr_destroy(&attr);
+			__sync_synchronize();
+			seg->state = 2;
+			break;
+		}
+		usleep(1000);
+		waited++;
+	}
+	sharedSeg = seg;
+	//something may have changed since the superblock was read in tfs_mountEx
+	sharedGen = seg->gen - 1;
+	sharedMovesSeen = seg->nMoves;
+	return 0;
+}
+
+//points the open files at block to, where defrag moved the inode. the
+//files in a moved directory follow it too
+static void fds_moved(int block, int to) {
+	for(int fd = 0; fd < openFilesCap; fd++) {
+		OpenInode *ino = openFiles[fd].ino;
+		if(!openFiles[fd].inUse) continue;
+		if(ino->inodeBlock == block) ino->inodeBlock = to;
+		if(ino->dirBlock == block) {
+			hashRemove(ino);
+			ino->dirBlock = to;
+			hashInsert(ino);
+		}
+	}
+}
+
+//every FD on ino goes, like after tfs_deleteFile
+static void fds_drop(OpenInode *ino) {
+	ino->lazyAtime = 0;
+	while(ino->refs > 1) releaseFileSlot(ino->firstFD);
+	releaseFileSlot(ino->firstFD);
+}
+
+//tells the other processes that the file with its inode at block was
+//deleted (to 0), renamed into dir (to == block) or moved to block to. they
+//catch up in shared_catch_up before their next call
+static void shared_note(int block, int to, int dir) {
+	if(!sharedSeg) return;
+	shared_move *m = &sharedSeg->moves[sharedSeg->nMoves % SHARED_MOVES];
+	m->block = block;
+	m->to = to;
+	m->dir = dir;
+	sharedSeg->nMoves++;
+}
+
+//applies what the others noted since this process's last call to its open
+//files. an FD on a deleted file is dropped, so it is ERR_FD_INVALID from
+//then on instead of writing into whatever took its blocks
+static void shared_catch_up(void) {
+	uint64_t n = sharedSeg->nMoves;
+	if(n - sharedMovesSeen > SHARED_MOVES) {
+		//too much went by to tell, each file that isn't where it was as far
+		//as its directory knows is dropped
+		for(int fd = 0; fd < openFilesCap; fd++) {
+			if(!openFiles[fd].inUse) continue;
+			OpenInode *ino = openFiles[fd].ino;
+			inode_disk in;
+			if(readBlock(disk_no, ino->inodeBlock, &in) != TFS_SUCCESS || in.blocktype != INODE ||
+					in.magic != MAGIC || dir_lookup(ino->dirBlock, ino->name) != ino->inodeBlock) fds_drop(ino);
+		}
+		sharedMovesSeen = n;
+		return;
+	}
+	for(; sharedMovesSeen < n; sharedMovesSeen++) {
+		shared_move m = sharedSeg->moves[sharedMovesSeen % SHARED_MOVES];
+		if(m.to != 0 && m.to != m.block) {
+			fds_moved(m.block, m.to);
+			continue;
+		}
+		for(int fd = 0; fd < openFilesCap; fd++) {
+			if(!openFiles[fd].inUse || openFiles[fd].ino->inodeBlock != m.block) continue;
+			OpenInode *ino = openFiles[fd].ino;
+			inode_disk in;
+			if(m.to == 0 || readBlock(disk_no, m.block, &in) != TFS_SUCCESS) {
+				fds_drop(ino);
+				continue;
+			}
+			hashRemove(ino);
+			memcpy(ino->name, in.name, 8);
+			ino->name[8] = '\0';
+			ino->dirBlock = m.dir;
+			hashInsert(ino);
+		}
+	}
+}
+
+//takes the lock, and drops what this process has from the image if another
+//one has been in since. returns whether it has to be let go
+static int shared_enter(void) {
+	if(sharedDepth++ > 0) return 1;
+	pthread_mutex_lock(&callLock);
+	if(!sharedSeg) return 1;
+	if(pthread_mutex_lock(&sharedSeg->lock) == EOWNERDEAD) {
+		//the image is as a call died halfway through it, the same as
+		//after a crash. fsck -r tidies up what it left
+		pthread_mutex_consistent(&sharedSeg->lock);
+		sharedGen = sharedSeg->gen - 1;
+	}
+	if(sharedSeg->gen != sharedGen) {
+		superblock_disk sb;
+		if(readBlock(disk_no, SUPERBLOCK_BLOCK, &sb) == TFS_SUCCESS) {
+			fs_features = sb.features;
+			fs_refInode = (sb.features & TFS_FEAT_REFCOUNT) ? sb.refcount_inode : 0;
+		}
+		bmCached = 0;
+		bmHint = 2;
+		//and the defrag map, without knowing what the others wrote
+		defrag_drop();
+		if(disk_no != -1) shared_catch_up();
+	}
+	return 1;
+}
+
+static void shared_leave(int *held) {
+	if(!*held || --sharedDepth > 0) return;
+	if(!sharedSeg) {
+		pthread_mutex_unlock(&callLock);
+		return;
+	}
+	//the allocation cache and the freed queue go back before the others get
+	//in, so they see every block this process freed and it has nothing
+	//claimed to lose if it dies. a failure here only leaks blocks, fsck -r
+	//gets them back
+	if(disk_no != -1) {
+		alloc_spill(nAlloc);
+		nAlloc = 0;
+		freed_flush();
+	}
+	sharedGen = ++sharedSeg->gen;
+	//what this call noted is already true here
+	sharedMovesSeen = sharedSeg->nMoves;
+	pthread_mutex_unlock(&sharedSeg->lock);
+	pthread_mutex_unlock(&callLock);
+}
+
+//the segment stays for the next mount, unlinking it here could pull it out
+//from under a process that is just opening it
+static void shared_close(void) {
+	if(!sharedSeg) return;
+	munmap(sharedSeg, sizeof(shared_seg));
+	sharedSeg = NULL;
+}
+
+static void fill_info(tfsFileInfo *info, inode_disk *in, int blk, OpenInode *ino) {
+	memcpy(info->name, in->name, 8);
+	info->name[8] = '\0';
+	info->size_B = inode_size(in);
+	info->inode_block = blk;
+	info->ctime = in->ctime;
+	info->mtime = in->mtime;
+	info->atime = (ino && ino->lazyAtime) ? ino->lazyAtime : in->atime;
+	info->isDir = (in->metaflags & INODE_DIR) != 0;
+	//a directory's size is its number of entries
+	if(info->isDir) info->size_B = in->size_B;
+}
+
+//a read happened, in is the inode as the read loaded it. whether atime is
+//written depends on the mount: never (noatime), whenever it changes
+//(strictatime), or only when it isn't newer than mtime/ctime or is a day old
+//(relatime, the default). lazytime keeps the new value in memory instead
+static void atime_update(OpenInode *ino, inode_disk *in) {
+	if(mountFlags & TFS_MOUNT_NOATIME) return;
+	int32_t now = (int32_t)time(NULL);
+	int32_t atime = ino->lazyAtime ? ino->lazyAtime : in->atime;
+	if(atime == now) return;
+	if(!(mountFlags & TFS_MOUNT_STRICTATIME) && atime > in->mtime && atime > in->ctime &&
+			now - atime < ATIME_RELAX) return;
+	if(mountFlags & TFS_MOUNT_LAZYTIME) {
+		if(!ino->lazyAtime) ino->lazySince = now;
+		ino->lazyAtime = now;
+		if(now - ino->lazySince < LAZYTIME_EXPIRE) return;
+	}
+	ino->lazyAtime = 0;
+	in->atime = now;
+	//nothing changes the inode during a read, so it can go back as it is
+	blk_write(ino->inodeBlock, in);
+}
+
+//the inode is about to be written for another reason, the held back atime goes along
+static void lazy_merge(OpenInode *ino, inode_disk *in) {
+	if(!ino->lazyAtime) return;
+	in->atime = ino->lazyAtime;
+	ino->lazyAtime = 0;
+}
+
+//writes a held back atime on its own, at close and unmount
+static void lazy_flush(OpenInode *ino) {
+	if(!ino->lazyAtime) return;
+	inode_disk in;
+	if(readBlock(disk_no, ino->inodeBlock, &in) == TFS_SUCCESS) {
+		in.atime = ino->lazyAtime;
+		blk_write(ino->inodeBlock, &in);
+	}
+	ino->lazyAtime = 0;
+}
+
+//runs one submitted operation with the blocking calls. the lock is held
+//across the seek and the read or write, so a blocking call in between can't
+//move the file pointer
+static int aio_run(aio_req *r) {
+	SHARED_CALL;
+	int rc;
+	switch(r->op) {
+	case TFS_AIO_OPEN:
+		return tfs_openFile(r->name);
+	case TFS_AIO_READ:
+		rc = tfs_seek64(r->FD, r->offset);
+		if(rc < 0) return rc;
+		return tfs_readFile(r->FD, r->buffer, r->size);
+	case TFS_AIO_WRITE:
+		rc = tfs_seek64(r->FD, r->offset);
+		if(rc < 0) return rc;
+		return tfs_write(r->FD, r->buffer, r->size);
+	case TFS_AIO_CLOSE:
+		return tfs_closeFile(r->FD);
+	case TFS_AIO_DELETE:
+		return tfs_deleteFile(r->FD);
+	}
+	return ERR_BUF;
+}
+
+//queues a finished operation, called with aioLock held
+static void aio_complete(aio_req *r, int rc) {
+	if(aioDoneN == aioDoneCap) {
+		int ncap = aioDoneCap ? aioDoneCap * 2 : 16;
+		tfsCompletion *nd = realloc(aioDone, ncap * sizeof(tfsCompletion));
+		//nowhere to put it, the caller never hears about this one
+		if(!nd) return;
+		aioDone = nd;
+		aioDoneCap = ncap;
+	}
+	aioDone[aioDoneN].tag = r->tag;
+	aioDone[aioDoneN].op = r->op;
+	aioDone[aioDoneN].result = rc;
+	aioDoneN++;
+	if(aioEvent >= 0) {
+		uint64_t one = 1;
+		if(write(aioEvent, &one, sizeof(one)) < 0) { /* counter is saturated */ }
+	}
+}
+
+static void *aio_worker(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&aioLock);
+	while(1) {
+		while(!aioHead && !aioStop) pthread_cond_wait(&aioWake, &aioLock);
+		//only stops once everything submitted has run
+		if(!aioHead) break;
+		aio_req *r = aioHead;
+		aioHead = r->next;
+		if(!aioHead) aioTail = NULL;
+		pthread_mutex_unlock(&aioLock);
+		int rc = aio_run(r);
+		pthread_mutex_lock(&aioLock);
+		aio_complete(r, rc);
+		free(r->name);
+		free(r);
+	}
+	pthread_mutex_unlock(&aioLock);
+	return NULL;
+}
+
+//queues r for the worker, starting it on the first submit of a mount
+static int aio_submit(aio_req *r) {
+	pthread_mutex_lock(&aioLock);
+	if(aioEvent < 0) aioEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(!aioRunning) {
+		if(pthread_create(&aioThread, NULL, aio_worker, NULL) != 0) {
+			pthread_mutex_unlock(&aioLock);
+			free(r->name);
+			free(r);
+			return ERR_BUF;
+		}
+		aioRunning = 1;
+	}
+	if(aioTail) aioTail->next = r;
+	else aioHead = r;
+	aioTail = r;
+	pthread_cond_signal(&aioWake);
+	pthread_mutex_unlock(&aioLock);
+	return TFS_SUCCESS;
+}
+
+//waits for the queue to drain and the worker to exit, completions stay pollable
+static void aio_stop(void) {
+	pthread_mutex_lock(&aioLock);
+	if(!aioRunning) {
+		pthread_mutex_unlock(&aioLock);
+		return;
+	}
+	aioStop = 1;
+	pthread_cond_signal(&aioWake);
+	pthread_mutex_unlock(&aioLock);
+	pthread_join(aioThread, NULL);
+	aioRunning = 0;
+	aioStop = 0;
+}
+
+//writev until all of iov is out, it can stop part way on pipes and sockets
+static int host_writev(int fd, struct iovec *iov, int n) {
+	while(n > 0) {
+		ssize_t w = writev(fd, iov, n);
+		if(w < 0 && errno == EINTR) continue;
+		if(w < 0) return -1;
+		while(n > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(n > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+//readv until iov is full or EOF, returns the bytes read
+static int64_t host_readv(int fd, struct iovec *iov, int n) {
+	int64_t total = 0;
+	while(n > 0) {
+		ssize_t r = readv(fd, iov, n);
+		if(r < 0 && errno == EINTR) continue;
+		if(r < 0) return -1;
+		if(r == 0) break;
+		total += r;
+		while(n > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(n > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return total;
+}
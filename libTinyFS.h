@@ -24,38 +24,329 @@ typedef int fileDescriptor;
 
 typedef struct tfsFileInfo {
     char name[9];
-    int32_t size_B;
+    int64_t size_B;
     int32_t inode_block;
 
     int32_t ctime;
     int32_t mtime;
     int32_t atime;
+    int32_t isDir;      // a directory, size_B is its number of entries
 } tfsFileInfo;
 
 /* Function definitions */
 
+/* filename (and diskname in tfs_mount) can also be a volume descriptor
+like "stripe:64:/ssd0/fs.img,/ssd1/fs.img" that spreads the filesystem over
+several images, or "mirror:..." that keeps a copy on each, see openDisk in
+libDisk.h. */
 int tfs_mkfs(char *filename, int nBytes);
 
+/* makes the 64 bit image variant: files can grow past 2GB and the disk can
+be up to 512GB (INT_MAX blocks). Free space isn't written out at mkfs time,
+so this takes the same time for any size. */
+int tfs_mkfs64(char *filename, int64_t nBytes);
+
+/* flags for tfs_mkfsEx */
+#define TFS_MKFS_64 1		//what tfs_mkfs64 makes
+#define TFS_MKFS_BITMAP 2	//free space in a bitmap instead of a free chain
+#define TFS_MKFS_LOG 4		//log-structured allocation, implies TFS_MKFS_BITMAP
+
+/* tfs_mkfsEx() is tfs_mkfs() with flags. With TFS_MKFS_BITMAP free space
+is tracked in a bitmap (one bit per block, after the root inode) and freed
+blocks aren't written at all, which is what lets a TFS_MOUNT_DISCARD mount
+hand them back to the host. Like tfs_mkfs64 it only writes the metadata, and
+the old blocks of a reused image file are punched out first.
+TFS_MKFS_LOG makes a bitmap image that hands out new blocks, data and
+metadata alike, in ascending order from a moving log head instead of lowest
+free first, and tfs_write puts every block it rewrites at the head too. The
+head jumps from one completely free 256 block segment to the next, so writes
+go to the disk as sequential runs; tfs_cleanLog keeps free segments coming.
+Inodes still stay where they were made and are rewritten in place. */
+int tfs_mkfsEx(char *filename, int64_t nBytes, int flags);
+
+/* tfs_upgrade() brings an unmounted image made by an older version up to
+the current format in place, adding what flags (TFS_MKFS_*) ask for: 64 bit
+sizes, a free space bitmap (put in the lowest free run big enough for it),
+the log. Flat images get their root directory either way. Files stay where
+they are, nothing is copied. Returns ERR_DISK_FULL if no free run holds the
+bitmap, the image is left as it was apart from the directory. */
+int tfs_upgrade(char *diskname, int flags);
+
 int tfs_mount(char *diskname);
 
+/* flags for tfs_mountEx */
+#define TFS_MOUNT_DIRECT 1	//O_DIRECT disk I/O, see openDiskEx in libDisk.h
+#define TFS_MOUNT_RELATIME 0	//the default, see below
+#define TFS_MOUNT_NOATIME 2	//reads never update atime
+#define TFS_MOUNT_STRICTATIME 4	//every read updates atime
+#define TFS_MOUNT_LAZYTIME 8	//atime updates stay in memory for a while
+#define TFS_MOUNT_DISCARD 16	//punch freed blocks out of the image file
+#define TFS_MOUNT_DEDUP 32	//share data blocks with the same content
+#define TFS_MOUNT_SHARED 64	//other processes can have the image mounted too
+#define TFS_MOUNT_WRITEBACK 128	//block writes go to the image in the background
+
+/* tfs_mountEx() is tfs_mount() with flags. Reads update a file's atime;
+by default (relatime) only when the old atime isn't newer than mtime and
+ctime or is more than a day old, which keeps most reads from writing the
+inode. With TFS_MOUNT_LAZYTIME an atime update is held in memory and goes
+to disk when the inode is written for some other reason, when the file's
+last FD is closed, at unmount, or once it is 12 hours old.
+tfs_readFileInfo and tfs_readdirInfo report the in memory value.
+TFS_MOUNT_DISCARD (images made with TFS_MKFS_BITMAP, ignored on others)
+collects the ranges that deletes, rewrites, hole punches and defrag free and
+gives them back to the host with discardBlocks() (see libDisk.h) at the end
+of the call, so a sparse image file shrinks on the host as files go away.
+With TFS_MOUNT_DEDUP every data block written is hashed, and one whose bytes
+match a block written earlier in the mount isn't written: the file points
+at that block instead, which gets a reference the way tfs_clone's do, so a
+later write to either file copies it first. Files written with
+tfs_writeFile are stored as block maps on such a mount. The hash index is
+in memory (64K entries, newest wins), blocks from earlier mounts aren't in
+it.
+TFS_MOUNT_SHARED lets several processes on the host mount the same image at
+once, each with TFS_MOUNT_SHARED. They share a lock in a POSIX shared memory
+segment named after the image ("/tinyfs-<hash of its path>", left behind
+after the last unmount for the next one), and every call that touches the
+image holds it, so calls from different processes don't interleave and each
+sees everything the others finished. A process that dies holding it doesn't
+wedge the others. Each call gives back the blocks its allocation cache
+didn't hand out before letting go of the lock, so between calls the image
+is as fsck wants it. Open FDs aren't shared, but each process follows what
+the others do to its open files: a rename or a defrag move is picked up
+before its next call, and an FD on a file another process deleted is
+ERR_FD_INVALID from then on. Not for log
+images or together with TFS_MOUNT_DEDUP (ERR_NOT_SUPPORTED).
+TFS_MOUNT_WRITEBACK opens the image with DISK_WRITEBACK (see openDiskEx in
+libDisk.h): a write call returns once its blocks are in memory, and a
+flusher thread writes them out in block order a few seconds later, or
+sooner once a lot has piled up. tfs_sync, tfs_fsync and tfs_unmount write
+everything. Not together with TFS_MOUNT_SHARED. */
+int tfs_mountEx(char *diskname, int flags);
+
 int tfs_unmount(void);
 
+/* tfs_sync() writes every block a TFS_MOUNT_WRITEBACK mount is holding
+back, and the atimes TFS_MOUNT_LAZYTIME is, and waits for the image to be
+on the host device (fdatasync). ERR_DISK_WRITE if that, or a background
+write since the last sync, failed. */
+int tfs_sync(void);
+
+/* tfs_openFile() opens (making it if needed) the file at name, a path like
+"logs/today" or "/logs/today". Relative paths start at the root too; every
+directory on the way has to exist (ERR_FILE_NOT_FOUND, or ERR_NOT_DIR when
+one is a file) and each part is at most 8 chars. Opening a directory gives
+ERR_IS_DIR. Images made before directories only have the root, so name is
+just a file name there. */
 fileDescriptor tfs_openFile(char *name);
 
+/* flags for tfs_openFileEx */
+#define TFS_OPEN_NEWFD 1	//always hand out a new FD with its own file pointer
+
+/* tfs_openFileEx() is tfs_openFile() with flags. Without TFS_OPEN_NEWFD it
+behaves exactly like tfs_openFile (an already open file gets its existing FD
+back). With it, every call gets a separate FD and file pointer on the same
+file; the file stays open until its last FD is closed, and deleting it
+through any FD closes them all. There is no fixed limit on open files. */
+fileDescriptor tfs_openFileEx(char *name, int flags);
+
 int tfs_closeFile(fileDescriptor FD);
 
 int tfs_writeFile(fileDescriptor FD, char *buffer, int size);
 
+int tfs_writeFile64(fileDescriptor FD, char *buffer, int64_t size);
+
+/* tfs_write() writes size bytes at the file pointer and advances it, keeping
+the rest of the file (tfs_writeFile replaces the whole thing). The file grows
+if the write goes past EOF; after a tfs_seek past EOF the skipped range is a
+hole that uses no blocks and reads back as zeros. Returns the number of bytes
+written. */
+int tfs_write(fileDescriptor FD, char *buffer, int size);
+
+/* tfs_punchHole() frees the blocks under [offset, offset + len), which then
+read back as zeros. The file size doesn't change. */
+int tfs_punchHole(fileDescriptor FD, int64_t offset, int64_t len);
+
+/* tfs_fallocate() reserves blocks for the first size bytes of the file up
+front, as one contiguous run when the disk has one, without writing them.
+They read back as zeros, and tfs_write fills them in place instead of going
+to the allocator. The file grows to size if it was smaller, it never shrinks.
+Bitmap images only, ERR_NOT_SUPPORTED on free chain and log images; on
+ERR_DISK_FULL the file still has the new size, with what didn't fit as holes. */
+int tfs_fallocate(fileDescriptor FD, int64_t size);
+
+/* tfs_fsync() is tfs_sync() for one file. The writeback cache doesn't know
+which file a block belongs to, so everything held back goes out with it. */
+int tfs_fsync(fileDescriptor FD);
+
 int tfs_deleteFile(fileDescriptor FD);
 
 int tfs_readByte(fileDescriptor FD, char *buffer);
 
+int tfs_readFile(fileDescriptor FD, char *buffer, int size);
+
 int tfs_seek(fileDescriptor FD, int offset);
 
+int tfs_seek64(fileDescriptor FD, int64_t offset);
+
+/* tfs_readdir() and tfs_readdirInfo() list the root directory. */
 int tfs_readdir(void);
 
+int tfs_readdirInfo(tfsFileInfo *infos, int max);
+
+/* tfs_rename() takes a path too, so it can also move the file to another
+directory. */
 int tfs_rename(fileDescriptor FD, char *newName);
 
+/* tfs_mkdir() makes the directory path; its parent has to exist. Each
+directory keeps its entries in a B-tree of DIRNODE blocks sorted by name, so
+lookups read a few blocks however many files it holds. The first tfs_mkdir
+on an image made before directories moves its files into a root directory
+tree (ERR_FILE_EXISTS and no change if two of them share a name). */
+int tfs_mkdir(char *path);
+
+/* tfs_rmdir() removes the directory path, which has to be empty
+(ERR_DIR_NOT_EMPTY). */
+int tfs_rmdir(char *path);
+
+/* tfs_listDir() fills up to max infos with the entries of the directory
+path in name order, like tfs_readdirInfo, and returns how many entries it
+has in all. */
+int tfs_listDir(char *path, tfsFileInfo *infos, int max);
+
+/* tfs_clone() makes newName a copy of the file open as srcFD without copying
+any data: both files share the data blocks, which carry a reference count.
+Writing to either file copies just the blocks it touches; deleting one only
+drops its references. newName must not exist yet. */
+int tfs_clone(fileDescriptor srcFD, char *newName);
+
+/* tfs_readFileInfo() fills info for the file open as FD, the same way
+tfs_readdirInfo does for every file. */
 int tfs_readFileInfo(fileDescriptor FD, tfsFileInfo *info);
 
+/* tfs_defrag() moves the file's data blocks into one ascending run, the
+lowest free run that fits it, and rewrites the free chain in ascending
+order. Returns the number of blocks moved, 0 if the file was already
+contiguous or no free run is big enough. */
+int tfs_defrag(fileDescriptor FD);
+
+/* tfs_defragFs() does the same for every file, and also moves files that are
+already one run down into lower free runs, which packs free space toward the
+end of the image. It works a slice at a time: it stops
+after moving maxBlocks blocks or after maxMillis ms (0 = no limit) and the
+next call carries on where it left off. Each call ends with the free chain
+rewritten in ascending order, and on tfs_mkfs64 images free space at the top
+goes back to the never used region. The first call reads the whole image,
+the ones after it keep what it found and only look again at blocks written
+since, so a slice costs about what it moves. Returns 1 while there is more to
+do and 0 once a pass over the whole filesystem is complete. */
+int tfs_defragFs(int maxBlocks, int maxMillis);
+
+/* tfs_cleanLog() is the segment cleaner of TFS_MKFS_LOG images. It picks
+the segments behind the log head with the least live data in them and
+moves the files that have blocks there to the head, so the segments are
+free again for the head to write through. Segments that hold inodes,
+directory blocks or blocks shared by clones can't be emptied and are left
+alone. It stops after maxSegments segments or maxMillis ms (0 = no limit).
+Returns the number of segments it freed, 0 on images of any other kind. */
+int tfs_cleanLog(int maxSegments, int maxMillis);
+
+/* allocation policies for tfs_setAllocPolicy */
+#define TFS_ALLOC_CACHE 0	//the default: whatever the allocation cache holds
+#define TFS_ALLOC_NEXTFIT 1	//first free block after where the last allocation ended
+#define TFS_ALLOC_NEAR 2	//first free block after the file's inode (or its last new block)
+#define TFS_ALLOC_BESTFIT 3	//tfs_writeFile takes the smallest free run that fits it whole
+
+/* tfs_setAllocPolicy() picks where new blocks go for the rest of the mount.
+The default hands out whatever was freed last, so over weeks of churn a
+file's blocks end up wherever the previous delete left them. The others
+search the free space bitmap, so they need a TFS_MKFS_BITMAP image that isn't
+TFS_MKFS_LOG (ERR_NOT_SUPPORTED otherwise), and keep freed blocks out of the
+search until a batch of them has been cleared in the bitmap. New inodes go
+near their directory's inode. With TFS_ALLOC_BESTFIT a tfs_writeFile that
+fits in no free run is spread over the largest ones, single blocks are
+placed like TFS_ALLOC_NEAR; each of its writes scans the whole bitmap. */
+int tfs_setAllocPolicy(int policy);
+
+/* free space and file fragmentation, see tfs_fragReport */
+#define TFS_FRAG_BUCKETS 16
+
+typedef struct tfsFragReport {
+    int64_t freeBlocks;
+    int freeRuns;		// runs of adjacent free blocks
+    int largestFreeRun;
+    int freeRunHist[TFS_FRAG_BUCKETS];	// runs of 1, 2-3, 4-7, ... blocks, the last bucket has the rest
+    int files;
+    int fragmentedFiles;	// files in more than one extent
+    int64_t extents;		// of every file together
+} tfsFragReport;
+
+typedef struct tfsFileFrag {
+    char name[9];
+    int32_t inode_block;
+    int32_t blocks;		// data blocks, holes and index blocks don't count
+    int32_t extents;		// runs of adjacent blocks they make, in file order
+} tfsFileFrag;
+
+/* tfs_fragReport() fills report for the mounted filesystem and files[] with
+one entry per file, up to maxFiles of them (files can be NULL when maxFiles is
+0). Returns the number of files, which can be more than maxFiles. It shares
+the defrag calls' map of block types, only the first of them reads the whole
+image; every report still reads each file's inode and index blocks. */
+int tfs_fragReport(tfsFragReport *report, tfsFileFrag *files, int maxFiles);
+
+/* tfs_exportToFd() writes the whole content of the file open as FD to the
+host file descriptor hostfd (a file, pipe or socket), holes as zeros.
+tfs_importFromFd() makes name (created if needed, replaced if not) hold the
+next len bytes read from hostfd, less if it hits EOF first. Both move a run
+of adjacent blocks with a single disk call and vectored host I/O straight
+from the block buffers, so there is no per byte loop or staging copy of the
+whole file. Return the number of bytes moved. */
+int64_t tfs_exportToFd(fileDescriptor FD, int hostfd);
+
+int64_t tfs_importFromFd(char *name, int hostfd, int64_t len);
+
+/* async API, for event loop callers that can't block on the disk. A submit
+queues the operation for a worker thread and returns 0 right away (or a
+negative error if it couldn't be queued); its result shows up later as a
+completion carrying the caller's tag. Operations run one at a time in the
+order they were submitted, so a read submitted after a write sees it. The
+blocking calls can be mixed in: each one waits for the operation the worker
+is running, not for the whole queue (tfs_unmount does wait for the queue to
+drain first). Buffers have to stay valid until their completion is polled. */
+#define TFS_AIO_OPEN 1
+#define TFS_AIO_READ 2
+#define TFS_AIO_WRITE 3
+#define TFS_AIO_CLOSE 4
+#define TFS_AIO_DELETE 5
+
+typedef struct tfsCompletion {
+    uint64_t tag;	//what was passed to the submit call
+    int op;		//TFS_AIO_*
+    int result;		//open: the FD, read/write: bytes moved, close/delete: 0, or an error
+} tfsCompletion;
+
+/* opens name like tfs_openFile, the FD comes back as the result */
+int tfs_submit_open(char *name, uint64_t tag);
+
+/* read or write size bytes at offset, leaving the FD's file pointer after
+them. a read past EOF completes with ERR_EOF, a short read with the bytes
+that were there */
+int tfs_submit_read(fileDescriptor FD, char *buffer, int size, int64_t offset, uint64_t tag);
+
+int tfs_submit_write(fileDescriptor FD, char *buffer, int size, int64_t offset, uint64_t tag);
+
+/* close or delete FD once everything submitted before has run, the result is
+what tfs_closeFile or tfs_deleteFile returned */
+int tfs_submit_close(fileDescriptor FD, uint64_t tag);
+
+int tfs_submit_delete(fileDescriptor FD, uint64_t tag);
+
+/* tfs_poll_completions() copies up to max finished operations into events
+without waiting and returns how many it copied. */
+int tfs_poll_completions(tfsCompletion *events, int max);
+
+/* tfs_completionFd() is a file descriptor that polls readable while there
+are completions waiting, for adding to epoll/poll/select. */
+int tfs_completionFd(void);
+
 #endif
@@ -0,0 +1,409 @@
+/*
+ *
+ * mktfs.c : builds a tinyFS image from a host directory in one pass
+ *
+ * usage: mktfs [-j threads] [-s bytes] --from-dir <dir> <image>
+ *   -j  threads reading the source files (default one per CPU)
+ *   -s  image size, the default is just big enough for the files
+ *
+ * every regular file and subdirectory under dir is mirrored into the image
+ * at the same path (names at most 8 chars). the layout is planned up front:
+ * superblock, root, all the inodes, every directory's B-tree, then each
+ * file's data as one contiguous chain. each B-tree is bulk loaded from its
+ * directory's sorted names instead of inserting them one at a time. the
+ * metadata is
+ * written by this thread, the data by the reader threads, each file in
+ * large writeBlocks calls at its planned place. the space past the data
+ * is left as the never used (TFS_FEAT_LAZYFREE) region, so nothing has to
+ * be written for it.
+ *
+ * exit status: 0 ok, 1 error
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "libDisk.h"
+#include "blocktypes.h"
+
+//blocks a reader thread formats and writes per call (1MB)
+#define CHUNK_BLOCKS 4096
+
+typedef struct src_file {
+	char *path;
+	char name[9];
+	struct stat st;
+	int parent;		//index of its directory in files[], -1 for the root
+	int inode;		//block of its inode
+	int first;		//first data block, 0 for an empty file
+	int nblocks;
+	//directories only: the entries sorted by name and where their B-tree goes
+	int isDir;
+	int *kids, nKids;
+	int height, base, nNodes;
+} src_file;
+
+static src_file *files = NULL;
+static int nFiles = 0, filesCap = 0;
+static int badNames = 0;
+//the directory nftw is in at each level, -1 for dir itself
+static int *dirAt = NULL;
+static int dirAtCap = 0;
+//stands in for the root directory
+static src_file top = { .parent = -1, .isDir = 1 };
+
+//shared with the reader threads
+static int disk = -1;
+static int nextFile = 0;
+static int failed = 0;
+static pthread_mutex_t workLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int add_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	if(type == FTW_DNR) {
+		fprintf(stderr, "mktfs: %s: can't read the directory\n", path);
+		badNames++;
+		return 0;
+	}
+	int isDir = type == FTW_D;
+	if(!isDir && (type != FTW_F || !S_ISREG(st->st_mode))) return 0;
+	if(ftw->level >= dirAtCap) {
+		int ncap = dirAtCap ? dirAtCap * 2 : 16;
+		int *nd = realloc(dirAt, ncap * sizeof(int));
+		if(!nd) return -1;
+		dirAt = nd;
+		dirAtCap = ncap;
+	}
+	if(ftw->level == 0) {
+		dirAt[0] = -1;
+		return 0;
+	}
+	const char *base = path + ftw->base;
+	if(strlen(base) == 0 || strlen(base) > 8) {
+		fprintf(stderr, "mktfs: %s: name longer than 8 chars\n", path);
+		badNames++;
+		return 0;
+	}
+	if(nFiles == filesCap) {
+		int ncap = filesCap ? filesCap * 2 : 64;
+		src_file *nf = realloc(files, ncap * sizeof(src_file));
+		if(!nf) return -1;
+		files = nf;
+		filesCap = ncap;
+	}
+	src_file *f = &files[nFiles++];
+	memset(f, 0, sizeof(*f));
+	f->path = strdup(path);
+	if(!f->path) return -1;
+	strcpy(f->name, base);
+	f->st = *st;
+	f->parent = dirAt[ftw->level - 1];
+	f->isDir = isDir;
+	if(isDir) dirAt[ftw->level] = nFiles - 1;
+	return 0;
+}
+
+static src_file *dir_of(int parent) {
+	return parent < 0 ? &top : &files[parent];
+}
+
+static int by_name(const void *a, const void *b) {
+	return strcmp(files[*(const int *)a].name, files[*(const int *)b].name);
+}
+
+//fills in every directory's entry list, sorted by name. the host already
+//keeps the names in one directory apart
+static int list_dirs(void) {
+	for(int i = 0; i < nFiles; i++) dir_of(files[i].parent)->nKids++;
+	for(int i = -1; i < nFiles; i++) {
+		src_file *d = dir_of(i);
+		if(!d->isDir) continue;
+		d->kids = malloc((d->nKids ? d->nKids : 1) * sizeof(int));
+		if(!d->kids) return -1;
+		d->nKids = 0;
+	}
+	for(int i = 0; i < nFiles; i++) {
+		src_file *d = dir_of(files[i].parent);
+		d->kids[d->nKids++] = i;
+	}
+	for(int i = -1; i < nFiles; i++) {
+		if(dir_of(i)->isDir) qsort(dir_of(i)->kids, dir_of(i)->nKids, sizeof(int), by_name);
+	}
+	return 0;
+}
+
+//bulk loads a directory's B-tree over the entries kids[lo, lo + n) into
+//nodes[] (NULL only counts them), the nodes go to blocks from base on.
+//h is the height left: a subtree of height h keeps between 8^(h+1) - 1
+//and 16^(h+1) - 1 entries, so the n + 1 slots between and around the
+//entries are spread evenly over as many children as that allows
+static int build_dir(const int *kids, int lo, int n, int h, dirnode_disk *nodes, int base, int *used) {
+	int idx = (*used)++;
+	dirnode_disk *dn = nodes ? &nodes[idx] : NULL;
+	if(dn) {
+		memset(dn, 0, sizeof(*dn));
+		dn->blocktype = DIRNODE;
+		dn->magic = MAGIC;
+		dn->leaf = h == 0;
+	}
+	if(h == 0) {
+		for(int i = 0; dn && i < n; i++) {
+			strncpy(dn->ent[i].name, files[kids[lo + i]].name, 8);
+			dn->ent[i].inode = files[kids[lo + i]].inode;
+		}
+		if(dn) dn->count = n;
+		return base + idx;
+	}
+	int64_t unit = 1;
+	for(int k = 0; k < h; k++) unit *= DN_MIN + 1;
+	int c = (int)((n + 1) / unit < DN_MAX + 1 ? (n + 1) / unit : DN_MAX + 1);
+	int slots = n + 1, at = lo;
+	for(int i = 0; i < c; i++) {
+		int sl = slots / c + (i < slots % c);
+		int child = build_dir(kids, at, sl - 1, h - 1, nodes, base, used);
+		at += sl - 1;
+		if(dn) dn->child[i] = child;
+		if(i < c - 1) {
+			if(dn) {
+				strncpy(dn->ent[i].name, files[kids[at]].name, 8);
+				dn->ent[i].inode = files[kids[at]].inode;
+			}
+			at++;
+		}
+	}
+	if(dn) dn->count = c - 1;
+	return base + idx;
+}
+
+//reads one file into its planned run. the blocks are chained to the next
+//one in the run, the last ends the chain
+static int load_file(src_file *f, fileextent_disk *buf) {
+	if(f->nblocks == 0) return 0;
+	int fd = open(f->path, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "mktfs: %s: %s\n", f->path, strerror(errno));
+		return -1;
+	}
+	int64_t left = f->st.st_size;
+	int rc = 0;
+	for(int done = 0; done < f->nblocks && rc == 0; ) {
+		int k = f->nblocks - done < CHUNK_BLOCKS ? f->nblocks - done : CHUNK_BLOCKS;
+		memset(buf, 0, (size_t)k * sizeof(fileextent_disk));
+		for(int i = 0; i < k && rc == 0; i++) {
+			int b = f->first + done + i;
+			buf[i].blocktype = FILEEXTENT;
+			buf[i].magic = MAGIC;
+			buf[i].blk_next = done + i + 1 < f->nblocks ? b + 1 : 0;
+			size_t want = left < EX_E ? (size_t)left : EX_E;
+			for(size_t got = 0; got < want; ) {
+				ssize_t r = read(fd, buf[i].data + got, want - got);
+				if(r < 0 && errno == EINTR) continue;
+				if(r <= 0) {
+					fprintf(stderr, "mktfs: %s: %s\n", f->path, r < 0 ? strerror(errno) : "shrank while reading");
+					rc = -1;
+					break;
+				}
+				got += r;
+			}
+			left -= want;
+		}
+		if(rc == 0 && writeBlocks(disk, f->first + done, k, buf) != 0) {
+			fprintf(stderr, "mktfs: writing %s's blocks failed\n", f->name);
+			rc = -1;
+		}
+		done += k;
+	}
+	close(fd);
+	return rc;
+}
+
+static void *reader(void *arg) {
+	(void)arg;
+	fileextent_disk *buf = malloc(CHUNK_BLOCKS * sizeof(fileextent_disk));
+	if(!buf) {
+		pthread_mutex_lock(&workLock);
+		failed = 1;
+		pthread_mutex_unlock(&workLock);
+		return NULL;
+	}
+	while(1) {
+		pthread_mutex_lock(&workLock);
+		int i = failed ? nFiles : nextFile++;
+		pthread_mutex_unlock(&workLock);
+		if(i >= nFiles) break;
+		if(load_file(&files[i], buf) != 0) {
+			pthread_mutex_lock(&workLock);
+			failed = 1;
+			pthread_mutex_unlock(&workLock);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-j threads] [-s bytes] --from-dir <dir> <image>\n", prog);
+}
+
+int main(int argc, char **argv) {
+	int threads = 0;
+	int64_t size = 0;
+	char *dir = NULL, *image = NULL;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--from-dir") == 0 && i + 1 < argc) dir = argv[++i];
+		else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) size = atoll(argv[++i]);
+		else if(argv[i][0] != '-' && !image) image = argv[i];
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(!dir || !image) {
+		usage(argv[0]);
+		return 1;
+	}
+	if(threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads <= 0) threads = 1;
+
+	if(nftw(dir, add_file, 32, FTW_PHYS) != 0) {
+		fprintf(stderr, "mktfs: can't read %s\n", dir);
+		return 1;
+	}
+	//a directory that was refused leaves its entries without a parent
+	if(badNames || list_dirs() < 0) return 1;
+
+	//plan: inodes right after the root, the directories' B-trees, then the
+	//data of each file in turn
+	uint32_t features = TFS_FEAT_LAZYFREE | TFS_FEAT_DIRS;
+	int64_t next = ROOT_INODE_BLOCK + 1 + nFiles;
+	for(int i = -1; i < nFiles; i++) {
+		src_file *d = dir_of(i);
+		if(!d->isDir || d->nKids == 0) continue;
+		for(int64_t most = DN_MAX; most < d->nKids; most = most * (DN_MAX + 1) + DN_MAX) d->height++;
+		build_dir(d->kids, 0, d->nKids, d->height, NULL, 0, &d->nNodes);
+		d->base = (int)next;
+		next += d->nNodes;
+	}
+	for(int i = 0; i < nFiles; i++) {
+		src_file *f = &files[i];
+		f->inode = ROOT_INODE_BLOCK + 1 + i;
+		if(f->isDir) continue;
+		int64_t nb = (f->st.st_size + EX_E - 1) / EX_E;
+		if(f->st.st_size > INT32_MAX) features |= TFS_FEAT_SIZE64;
+		f->first = nb ? (int)next : 0;
+		f->nblocks = (int)nb;
+		next += nb;
+		if(next > INT_MAX) {
+			fprintf(stderr, "mktfs: %s doesn't fit in one image\n", dir);
+			return 1;
+		}
+	}
+	int64_t nblocks = size ? size / BLOCKSIZE : next;
+	if(nblocks < next || nblocks > INT_MAX) {
+		fprintf(stderr, "mktfs: the files need %lld bytes, -s %lld won't do\n",
+			(long long)next * BLOCKSIZE, (long long)size);
+		return 1;
+	}
+	if(nblocks < 3) nblocks = 3;
+
+	disk = openDisk64(image, nblocks * BLOCKSIZE);
+	if(disk < 0) {
+		fprintf(stderr, "mktfs: can't create %s\n", image);
+		return 1;
+	}
+
+	//data first, on the reader threads
+	pthread_t *tids = calloc(threads, sizeof(pthread_t));
+	if(!tids) return 1;
+	int started = 0;
+	for(; started < threads; started++) {
+		if(pthread_create(&tids[started], NULL, reader, NULL) != 0) break;
+	}
+	if(started == 0) reader(NULL);
+	for(int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+	free(tids);
+
+	//then the metadata: superblock, root inode and the inode table
+	superblock_disk sb = {0};
+	sb.blocktype = SUPERBLOCK;
+	sb.magic = MAGIC;
+	sb.root_inode = ROOT_INODE_BLOCK;
+	sb.free_block = 0;
+	sb.features = features;
+	sb.version = TFS_VERSION;
+	sb.nblocks = (int32_t)nblocks;
+	sb.free_lazy = (int32_t)next;
+	inode_disk root = {0};
+	root.blocktype = INODE;
+	root.magic = MAGIC;
+	strcpy(root.name, "/");
+	root.metaflags = INODE_INITIAL_FLAGS | INODE_DIR;
+	root.size_B = top.nKids;
+	root.blk_start = top.nNodes ? top.base : 0;
+	root.ctime = root.mtime = root.atime = (int32_t)time(NULL);
+	int rc = failed;
+	if(!rc && (writeBlock(disk, SUPERBLOCK_BLOCK, &sb) != 0 || writeBlock(disk, ROOT_INODE_BLOCK, &root) != 0)) rc = 1;
+
+	//inode_disk is padded past BLOCKSIZE, so the table is built as raw blocks
+	uint8_t (*tab)[BLOCKSIZE] = malloc((size_t)CHUNK_BLOCKS * BLOCKSIZE);
+	if(!tab) rc = 1;
+	for(int done = 0; !rc && done < nFiles; ) {
+		int k = nFiles - done < CHUNK_BLOCKS ? nFiles - done : CHUNK_BLOCKS;
+		for(int i = 0; i < k; i++) {
+			src_file *f = &files[done + i];
+			inode_disk in = {0};
+			in.blocktype = INODE;
+			in.magic = MAGIC;
+			strcpy(in.name, f->name);
+			if(f->isDir) {
+				in.size_B = f->nKids;
+				in.blk_start = f->nNodes ? f->base : 0;
+				in.metaflags = INODE_INITIAL_FLAGS | INODE_DIR;
+			}else{
+				in.size_B = (int32_t)(uint32_t)f->st.st_size;
+				if(features & TFS_FEAT_SIZE64) in.size_hi = (int32_t)(f->st.st_size >> 32);
+				in.blk_start = f->first;
+				in.metaflags = INODE_INITIAL_FLAGS;
+			}
+			in.ctime = (int32_t)f->st.st_ctime;
+			in.mtime = (int32_t)f->st.st_mtime;
+			in.atime = (int32_t)f->st.st_atime;
+			memcpy(tab[i], &in, BLOCKSIZE);
+		}
+		if(writeBlocks(disk, ROOT_INODE_BLOCK + 1 + done, k, tab) != 0) rc = 1;
+		done += k;
+	}
+	free(tab);
+	//each directory's B-tree, in the blocks planned for it
+	for(int i = -1; !rc && i < nFiles; i++) {
+		src_file *d = dir_of(i);
+		if(!d->isDir || d->nNodes == 0) continue;
+		dirnode_disk *nodes = malloc((size_t)d->nNodes * sizeof(dirnode_disk));
+		if(!nodes) { rc = 1; break; }
+		int used = 0;
+		build_dir(d->kids, 0, d->nKids, d->height, nodes, d->base, &used);
+		if(writeBlocks(disk, d->base, d->nNodes, nodes) != 0) rc = 1;
+		free(nodes);
+	}
+	if(closeDisk(disk) != 0) rc = 1;
+	if(rc) {
+		fprintf(stderr, "mktfs: building %s failed\n", image);
+		return 1;
+	}
+	int nDirs = 0;
+	for(int i = 0; i < nFiles; i++) nDirs += files[i].isDir;
+	printf("%s: %d files in %d directories, %lld of %lld blocks used\n", image, nFiles - nDirs, nDirs + 1,
+	       (long long)next, (long long)nblocks);
+	return 0;
+}
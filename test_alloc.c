@@ -0,0 +1,100 @@
+// test_alloc.c
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "libTinyFS.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+#include "test_util.h"
+
+#define WRITERS 8
+
+static int free_blocks(const char *fsname, tfsFsckReport *r) {
+    int rc = tfs_fsck((char *)fsname, 0, 1, r);
+    return rc == 0 ? r->freeBlocks : -1;
+}
+
+// interleaved writers growing and shrinking their files, the blocks they
+// free get reused by the others
+static int churn(const char *what, const char *fsname, const char *data) {
+    tfsFsckReport r;
+    int freeAtStart = free_blocks(fsname, &r);
+    if (freeAtStart < 0) { printf("[FAIL] %s: fresh image not clean\n", what); return 1; }
+
+    tfs_mount((char *)fsname);
+    fileDescriptor fds[WRITERS];
+    int sizes[WRITERS];
+    for (int w = 0; w < WRITERS; w++) {
+        char name[9];
+        snprintf(name, sizeof(name), "w%d", w);
+        fds[w] = tfs_openFile(name);
+    }
+    for (int round = 0; round < 40; round++) {
+        for (int w = 0; w < WRITERS; w++) {
+            sizes[w] = ((round * 7 + w * 13) % 30 + 1) * EX_E - w;
+            if (tfs_writeFile(fds[w], (char *)data + w + round, sizes[w]) != TFS_SUCCESS) {
+                printf("[FAIL] %s: write round %d writer %d\n", what, round, w);
+                return 1;
+            }
+        }
+    }
+
+    // 1) while mounted the cached blocks only show up as leaked
+    if (tfs_fsck((char *)fsname, 0, 1, &r) != r.leaked || r.leaked == 0 || r.leaked > 2 * 64) {
+        printf("[FAIL] %s: mounted image has %d leaked, %d double, %d cross-linked, %d bad chains\n",
+               what, r.leaked, r.doubleRef, r.crossLinked, r.badChains);
+        return 1;
+    }
+    tfs_unmount();
+
+    // 2) unmount puts them back, every file reads back right
+    int freeNow = free_blocks(fsname, &r);
+    if (freeNow < 0) { printf("[FAIL] %s: fsck after unmount\n", what); return 1; }
+    tfs_mount((char *)fsname);
+    char *back = malloc(40 * EX_E);
+    for (int w = 0; w < WRITERS; w++) {
+        char name[9];
+        snprintf(name, sizeof(name), "w%d", w);
+        fds[w] = tfs_openFile(name);
+        int got = tfs_readFile(fds[w], back, 40 * EX_E);
+        if (got != sizes[w] || memcmp(back, data + w + 39, sizes[w]) != 0) {
+            printf("[FAIL] %s: writer %d reads back %d bytes, wrote %d\n", what, w, got, sizes[w]);
+            return 1;
+        }
+    }
+    free(back);
+
+    // 3) deleting everything gives every block back
+    for (int w = 0; w < WRITERS; w++) tfs_deleteFile(fds[w]);
+    tfs_unmount();
+    // the root directory's node is freed with its last entry
+    if (check(what, free_blocks(fsname, &r), freeAtStart)) return 1;
+    return 0;
+}
+
+int main(void) {
+    static char data[40 * 248];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 11 + i / 200);
+
+    if (tfs_mkfs("test_alloc.img", 2000 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    if (churn("free chain", "test_alloc.img", data)) return 1;
+    if (tfs_mkfs64("test_alloc.img", 2000 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    if (churn("lazy chain", "test_alloc.img", data)) return 1;
+    if (tfs_mkfsEx("test_alloc.img", 2000 * BLOCKSIZE, TFS_MKFS_BITMAP) != TFS_SUCCESS) return 1;
+    if (churn("bitmap", "test_alloc.img", data)) return 1;
+
+    // 4) a full disk still hands out every block the cache holds
+    if (tfs_mkfs("test_alloc.img", 60 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount("test_alloc.img");
+    fileDescriptor fd = tfs_openFile("fill");
+    // superblock, root, its directory node and fill's inode
+    int room = (60 - 4) * EX_E;
+    if (check("fill the disk", tfs_writeFile(fd, data, room), TFS_SUCCESS)) return 1;
+    if (check("no room for an inode", tfs_openFile("more"), ERR_DISK_FULL)) return 1;
+    tfs_unmount();
+
+    printf("[PASS] allocation cache refills and spills in batches without losing blocks\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+// test_async.c
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+
+#include "libTinyFS.h"
+#include "TinyFS_errno.h"
+#include "test_util.h"
+
+// waits on the completion fd like an event loop would, until n have arrived
+static int wait_for(tfsCompletion *ev, int n) {
+    int got = 0;
+    struct pollfd p = { .fd = tfs_completionFd(), .events = POLLIN };
+    while (got < n) {
+        if (poll(&p, 1, 5000) <= 0) return got;
+        got += tfs_poll_completions(ev + got, n - got);
+    }
+    return got;
+}
+
+int main(void) {
+    const char *fsname = "test_async.img";
+    tfsCompletion ev[16];
+
+    if (tfs_mkfs((char *)fsname, 100 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    if (check("submit before mount", tfs_submit_open("a", 1), ERR_NOT_MOUNTED)) return 1;
+    if (tfs_mount((char *)fsname) != TFS_SUCCESS) return 1;
+    if (check("nothing to poll", tfs_poll_completions(ev, 8), 0)) return 1;
+
+    // 1) open, the FD comes back in the completion
+    if (check("submit open", tfs_submit_open("a", 7), 0)) return 1;
+    if (check("open completes", wait_for(ev, 1), 1)) return 1;
+    if (check("open tag", (int)ev[0].tag, 7) || check("open op", ev[0].op, TFS_AIO_OPEN)) return 1;
+    fileDescriptor fd = ev[0].result;
+    if (fd < 0) {
+        printf("[FAIL] async open failed: %d\n", fd);
+        return 1;
+    }
+
+    // 2) writes then reads in one go, they run in order so the reads see the writes
+    char w1[600], w2[100], r1[600], r2[100], r3[10];
+    memset(w1, 'x', sizeof(w1));
+    memset(w2, 'y', sizeof(w2));
+    tfs_submit_write(fd, w1, sizeof(w1), 0, 10);
+    tfs_submit_write(fd, w2, sizeof(w2), 1000, 11);
+    tfs_submit_read(fd, r1, sizeof(r1), 0, 12);
+    tfs_submit_read(fd, r2, sizeof(r2), 1000, 13);
+    tfs_submit_read(fd, r3, sizeof(r3), 5000, 14);
+    tfs_submit_read(fd + 100, r3, sizeof(r3), 0, 15);
+    if (check("batch completes", wait_for(ev, 6), 6)) return 1;
+    for (int i = 0; i < 6; i++) {
+        if (check("completion order", (int)ev[i].tag, 10 + i)) return 1;
+    }
+    if (check("write 1", ev[0].result, sizeof(w1))) return 1;
+    if (check("write 2", ev[1].result, sizeof(w2))) return 1;
+    if (check("read 1", ev[2].result, sizeof(r1))) return 1;
+    if (check("read 2", ev[3].result, sizeof(r2))) return 1;
+    if (check("read past EOF", ev[4].result, ERR_EOF)) return 1;
+    if (check("bad fd", ev[5].result, ERR_FD_INVALID)) return 1;
+    if (memcmp(r1, w1, sizeof(w1)) != 0 || memcmp(r2, w2, sizeof(w2)) != 0) {
+        printf("[FAIL] async reads got different data\n");
+        return 1;
+    }
+
+    // 3) the completion fd isn't readable once everything is polled
+    struct pollfd p = { .fd = tfs_completionFd(), .events = POLLIN };
+    if (check("fd idle", poll(&p, 1, 0), 0)) return 1;
+
+    // 4) blocking calls go in between queued ones, and close and delete can
+    // be queued too
+    fileDescriptor other = tfs_openFile("b");
+    static char big[5000];
+    memset(big, 'z', sizeof(big));
+    for (int i = 0; i < 8; i++) tfs_submit_write(fd, big, sizeof(big), 0, 30 + i);
+    for (int i = 0; i < 50; i++) {
+        if (check("blocking write", tfs_writeFile(other, w1, sizeof(w1)), TFS_SUCCESS)) return 1;
+        if (read_matches_fd("blocking read", other, w1, sizeof(w1))) return 1;
+    }
+    if (check("submit delete", tfs_submit_delete(other, 40), 0)) return 1;
+    if (check("submit close", tfs_submit_close(other, 41), 0)) return 1;
+    if (check("mixed batch completes", wait_for(ev, 10), 10)) return 1;
+    if (check("queued write", ev[7].result, sizeof(big))) return 1;
+    if (check("queued delete", ev[8].result, TFS_SUCCESS) || check("delete op", ev[8].op, TFS_AIO_DELETE)) return 1;
+    if (check("close after delete", ev[9].result, ERR_FD_INVALID)) return 1;
+    if (check("deleted", tfs_listDir("/", NULL, 0), 1)) return 1;
+
+    // 5) unmount waits for what is queued, the completions are still there
+    for (int i = 0; i < 4; i++) tfs_submit_write(fd, w2, sizeof(w2), i * 100, 20 + i);
+    if (check("unmount", tfs_unmount(), TFS_SUCCESS)) return 1;
+    if (check("drained by unmount", tfs_poll_completions(ev, 16), 4)) return 1;
+    if (check("last drained", ev[3].result, sizeof(w2))) return 1;
+
+    // the data made it to disk
+    tfs_mount((char *)fsname);
+    fd = tfs_openFile("a");
+    char back[400];
+    memset(back, 0, sizeof(back));
+    tfs_readFile(fd, back, sizeof(back));
+    for (int i = 0; i < (int)sizeof(back); i++) {
+        if (back[i] != 'y') {
+            printf("[FAIL] byte %d is '%c' after remount\n", i, back[i]);
+            return 1;
+        }
+    }
+    tfs_unmount();
+
+    printf("[PASS] async open/read/write complete in order through the completion queue\n");
+    return 0;
+}
@@ -0,0 +1,111 @@
+// test_atime.c
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "TinyFS_errno.h"
+#include "test_util.h"
+
+static const char *fsname = "test_atime.img";
+static int inodeBlock;
+
+// sets the on-disk times of the file, the image can be mounted at the time
+static void set_times(int32_t atime, int32_t mtime) {
+    int disk = openDisk((char *)fsname, 0);
+    inode_disk in;
+    readBlock(disk, inodeBlock, &in);
+    in.atime = atime;
+    in.mtime = mtime;
+    in.ctime = mtime;
+    writeBlock(disk, inodeBlock, &in);
+    closeDisk(disk);
+}
+
+static int32_t disk_atime(void) {
+    int disk = openDisk((char *)fsname, 0);
+    inode_disk in;
+    readBlock(disk, inodeBlock, &in);
+    closeDisk(disk);
+    return in.atime;
+}
+
+// mounts with flags, reads a byte of the file and leaves it open
+static fileDescriptor mount_and_read(int flags) {
+    if (tfs_mountEx((char *)fsname, flags) != TFS_SUCCESS) return -1;
+    fileDescriptor fd = tfs_openFile("a");
+    char c;
+    if (tfs_readByte(fd, &c) != TFS_SUCCESS) return -1;
+    return fd;
+}
+
+int main(void) {
+    char data[300];
+    memset(data, 'z', sizeof(data));
+    if (tfs_mkfs((char *)fsname, 40 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    fileDescriptor fd = tfs_openFile("a");
+    tfs_writeFile(fd, data, sizeof(data));
+    tfsFileInfo info;
+    if (check("readFileInfo", tfs_readFileInfo(fd, &info), TFS_SUCCESS)) return 1;
+    inodeBlock = info.inode_block;
+    if (strcmp(info.name, "a") != 0 || info.size_B != 300 || info.ctime == 0) {
+        printf("[FAIL] readFileInfo gave '%s' %lld bytes ctime %d\n", info.name, (long long)info.size_B, info.ctime);
+        return 1;
+    }
+    tfs_unmount();
+    int32_t now = (int32_t)time(NULL);
+    int32_t recent = now - 60;
+
+    // noatime: a month old atime stays
+    set_times(1000, 500);
+    mount_and_read(TFS_MOUNT_NOATIME);
+    tfs_unmount();
+    if (check("noatime", disk_atime(), 1000)) return 1;
+
+    // relatime: old atime is updated, a recent one newer than mtime isn't
+    mount_and_read(TFS_MOUNT_RELATIME);
+    if (disk_atime() < now) { printf("[FAIL] relatime didn't update an old atime\n"); return 1; }
+    tfs_unmount();
+    set_times(recent, 500);
+    mount_and_read(0);
+    tfs_unmount();
+    if (check("relatime recent", disk_atime(), recent)) return 1;
+
+    // strictatime: even the recent one is updated
+    mount_and_read(TFS_MOUNT_STRICTATIME);
+    tfs_unmount();
+    if (disk_atime() < now) { printf("[FAIL] strictatime didn't update atime\n"); return 1; }
+
+    // lazytime: held in memory, readFileInfo shows it, a write takes it to disk
+    set_times(1000, 500);
+    fd = mount_and_read(TFS_MOUNT_LAZYTIME);
+    if (check("lazytime held back", disk_atime(), 1000)) return 1;
+    tfs_readFileInfo(fd, &info);
+    if (info.atime < now) { printf("[FAIL] readFileInfo atime %d is the on-disk one\n", info.atime); return 1; }
+    tfsFileInfo all[2];
+    tfs_readdirInfo(all, 2);
+    if (check("readdirInfo atime", all[0].atime, info.atime)) return 1;
+    tfs_seek(fd, 0);
+    if (check("write", tfs_write(fd, data, 10), 10)) return 1;
+    if (disk_atime() < now) { printf("[FAIL] write didn't carry the held back atime\n"); return 1; }
+    tfs_unmount();
+
+    // lazytime: closing the file writes it
+    set_times(1000, 500);
+    fd = mount_and_read(TFS_MOUNT_LAZYTIME);
+    tfs_closeFile(fd);
+    if (disk_atime() < now) { printf("[FAIL] close didn't write the atime\n"); return 1; }
+    tfs_unmount();
+
+    // lazytime: so does unmounting with it open
+    set_times(1000, 500);
+    mount_and_read(TFS_MOUNT_LAZYTIME);
+    if (check("still held", disk_atime(), 1000)) return 1;
+    tfs_unmount();
+    if (disk_atime() < now) { printf("[FAIL] unmount didn't write the atime\n"); return 1; }
+
+    printf("[PASS] noatime/relatime/strictatime/lazytime and tfs_readFileInfo\n");
+    return 0;
+}
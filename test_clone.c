@@ -0,0 +1,188 @@
+// test_clone.c
+#include <stdio.h>
+#include <string.h>
+
+#include "libTinyFS.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+
+static int fsck_free(const char *fsname) {
+    tfsFsckReport r;
+    int rc = tfs_fsck((char *)fsname, 0, 1, &r);
+    if (rc != 0) {
+        printf("[FAIL] fsck found %d problems\n", rc);
+        return -1;
+    }
+    return r.freeBlocks;
+}
+
+static int read_all(const char *name, char *buf, int size) {
+    fileDescriptor fd = tfs_openFile((char *)name);
+    tfs_seek(fd, 0);
+    return tfs_readFile(fd, buf, size);
+}
+
+int main(void) {
+    const char *fsname = "test_clone.img";
+    char data[10 * EX_E], back[10 * EX_E];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)('a' + i % 26);
+
+    if (tfs_mkfs((char *)fsname, 200 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    fileDescriptor src = tfs_openFile("config");
+    tfs_writeFile(src, data, sizeof(data));
+    tfs_unmount();
+    int freeBefore = fsck_free(fsname);
+
+    // 1) a clone of a 10 block file costs its inode plus the refcount table
+    // (its inode, one index block, one count block), no data
+    tfs_mount((char *)fsname);
+    src = tfs_openFile("config");
+    if (tfs_clone(src, "snap1") != TFS_SUCCESS) {
+        printf("[FAIL] tfs_clone failed\n");
+        return 1;
+    }
+    if (tfs_clone(src, "snap1") != ERR_FILE_EXISTS) {
+        printf("[FAIL] clone over an existing name allowed\n");
+        return 1;
+    }
+    tfs_unmount();
+    int used = freeBefore - fsck_free(fsname);
+    if (used != 1 + 3) {
+        printf("[FAIL] clone used %d blocks\n", used);
+        return 1;
+    }
+
+    // 2) same content, and the table file doesn't show up in listings
+    tfs_mount((char *)fsname);
+    if (read_all("snap1", back, sizeof(back)) != (int)sizeof(data) || memcmp(back, data, sizeof(data)) != 0) {
+        printf("[FAIL] clone content differs\n");
+        return 1;
+    }
+    tfsFileInfo infos[4];
+    if (tfs_readdirInfo(infos, 4) != 2) {
+        printf("[FAIL] expected 2 files in the listing\n");
+        return 1;
+    }
+
+    // 3) writing the source copies only the block it touches
+    src = tfs_openFile("config");
+    tfs_seek(src, 3 * EX_E + 5);
+    tfs_write(src, "XYZ", 3);
+    if (read_all("snap1", back, sizeof(back)) != (int)sizeof(data) || memcmp(back, data, sizeof(data)) != 0) {
+        printf("[FAIL] write to the source showed up in the clone\n");
+        return 1;
+    }
+    read_all("config", back, sizeof(back));
+    if (memcmp(back + 3 * EX_E + 5, "XYZ", 3) != 0 || back[3 * EX_E + 4] != data[3 * EX_E + 4]) {
+        printf("[FAIL] source didn't get the write\n");
+        return 1;
+    }
+    tfs_unmount();
+    // one copied block, plus the index block the source got when its chain
+    // turned into a map
+    used = freeBefore - fsck_free(fsname);
+    if (used != 4 + 2) {
+        printf("[FAIL] copy on write used %d blocks\n", used - 4);
+        return 1;
+    }
+
+    // 4) clone of a mapped file, then punch the clone: the source keeps its data
+    tfs_mount((char *)fsname);
+    src = tfs_openFile("config");
+    tfs_clone(src, "snap2");
+    fileDescriptor s2 = tfs_openFile("snap2");
+    tfs_punchHole(s2, 0, 2 * EX_E + 10);
+    read_all("config", back, sizeof(back));
+    if (memcmp(back, data, 2 * EX_E) != 0) {
+        printf("[FAIL] punching the clone hit the source\n");
+        return 1;
+    }
+    read_all("snap2", back, sizeof(back));
+    if (back[0] != 0 || back[2 * EX_E + 9] != 0 || back[2 * EX_E + 10] != data[2 * EX_E + 10]) {
+        printf("[FAIL] clone wasn't punched\n");
+        return 1;
+    }
+
+    // 5) deleting the source keeps every block the clones still use, and
+    // deleting everything gives all the data back
+    src = tfs_openFile("config");
+    tfs_deleteFile(src);
+    if (read_all("snap1", back, sizeof(back)) != (int)sizeof(data) || memcmp(back, data, sizeof(data)) != 0) {
+        printf("[FAIL] snap1 lost data when the source went\n");
+        return 1;
+    }
+    tfs_unmount();
+    if (fsck_free(fsname) < 0) return 1;
+    tfs_mount((char *)fsname);
+    tfs_deleteFile(tfs_openFile("snap1"));
+    tfs_deleteFile(tfs_openFile("snap2"));
+    tfs_unmount();
+    // only the refcount table is left (the empty root directory gave its
+    // node back)
+    int left = freeBefore + 1 + 10 - fsck_free(fsname);
+    if (left != 3 - 1) {
+        printf("[FAIL] %d blocks still in use after deleting every file\n", left);
+        return 1;
+    }
+
+    // 6) a rewrite that runs out of room leaves the file empty: deleting it
+    // afterwards doesn't drop the clone's blocks a second time
+    if (tfs_mkfs((char *)fsname, 60 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    src = tfs_openFile("config");
+    tfs_writeFile(src, data, sizeof(data));
+    tfs_clone(src, "snap1");
+    static char big[60 * EX_E];
+    if (tfs_writeFile(src, big, sizeof(big)) != ERR_DISK_FULL) {
+        printf("[FAIL] rewrite bigger than the disk didn't fail\n");
+        return 1;
+    }
+    if (read_all("config", back, sizeof(back)) != ERR_EOF) {
+        printf("[FAIL] failed rewrite didn't leave the file empty\n");
+        return 1;
+    }
+    tfs_deleteFile(src);
+    if (read_all("snap1", back, sizeof(back)) != (int)sizeof(data) || memcmp(back, data, sizeof(data)) != 0) {
+        printf("[FAIL] snap1 lost data after a failed rewrite of its source\n");
+        return 1;
+    }
+    tfs_unmount();
+    if (fsck_free(fsname) < 0) return 1;
+
+    // 7) a clone with no room for its inode counts nothing: once the source
+    // is gone its blocks are free again
+    if (tfs_mkfs((char *)fsname, 60 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    src = tfs_openFile("config");
+    tfs_writeFile(src, data, sizeof(data));
+    tfs_clone(src, "snap1");
+    tfs_deleteFile(tfs_openFile("snap1"));
+    char name[9];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "fill%d", i);
+        if (tfs_openFile(name) < 0) break;
+    }
+    if (tfs_clone(src, "snap2") >= 0) {
+        printf("[FAIL] clone on a full disk didn't fail\n");
+        return 1;
+    }
+    tfs_deleteFile(src);
+    tfs_unmount();
+    tfs_mount((char *)fsname);
+    if (read_all("snap2", back, sizeof(back)) != ERR_EOF) {
+        printf("[FAIL] failed clone left a file behind\n");
+        return 1;
+    }
+    tfs_unmount();
+    int freeFull = fsck_free(fsname);
+    if (freeFull < 10) {
+        printf("[FAIL] only %d blocks free after deleting the source of a failed clone\n", freeFull);
+        return 1;
+    }
+
+    remove(fsname);
+    printf("[PASS] clones share blocks, copy on write, refcounted deletes\n");
+    return 0;
+}
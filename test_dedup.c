@@ -0,0 +1,94 @@
+// test_dedup.c
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "libTinyFS.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+#include "test_util.h"
+
+static const char *fsname = "test_dedup.img";
+
+static int used_blocks(void) {
+    tfsFsckReport r;
+    int rc = tfs_fsck((char *)fsname, 0, 1, &r);
+    if (rc != 0) printf("[FAIL] fsck found %d problems\n", rc);
+    return rc == 0 ? r.usedBlocks : -1;
+}
+
+// 40 blocks, every 4th one the same, the rest the same as each other too
+static void fill(char *buf, char a, char b) {
+    for (int i = 0; i < 40; i++) {
+        memset(buf + i * EX_E, i % 4 ? a : b, EX_E);
+        buf[i * EX_E + 7] = 'x';
+    }
+}
+
+static int run(const char *what, int mkflags) {
+    static char data[40 * EX_E], other[40 * EX_E];
+    fill(data, 'p', 'q');
+    fill(other, 'r', 's');
+    if (tfs_mkfsEx((char *)fsname, 2000 * BLOCKSIZE, mkflags) != TFS_SUCCESS) return 1;
+
+    // 1) without dedup every block is written
+    tfs_mount((char *)fsname);
+    tfs_writeFile(tfs_openFile("plain"), data, sizeof(data));
+    tfs_unmount();
+    int start = used_blocks();
+    if (start < 40) return 1;
+
+    // 2) with it a file of repeated blocks takes two data blocks, and a copy
+    // written in the same mount none
+    if (check(what, tfs_mountEx((char *)fsname, TFS_MOUNT_DEDUP), TFS_SUCCESS)) return 1;
+    tfs_writeFile(tfs_openFile("a"), data, sizeof(data));
+    tfs_writeFile(tfs_openFile("b"), data, sizeof(data));
+    tfs_unmount();
+    // inode and index block each, two data blocks and the refcount table
+    // (inode, index, one table block)
+    if (check(what, used_blocks() - start, 2 + 2 + 2 + 3)) return 1;
+
+    // 3) writing to one copy leaves the other alone
+    tfs_mountEx((char *)fsname, TFS_MOUNT_DEDUP);
+    fileDescriptor b = tfs_openFile("b");
+    tfs_seek(b, 5 * EX_E + 3);
+    if (check(what, tfs_write(b, "changed", 7), 7)) return 1;
+    if (read_matches(what, "a", data, sizeof(data))) return 1;
+    static char changed[40 * EX_E];
+    memcpy(changed, data, sizeof(data));
+    memcpy(changed + 5 * EX_E + 3, "changed", 7);
+    if (read_matches(what, "b", changed, sizeof(changed))) return 1;
+    tfs_unmount();
+    if (used_blocks() < 0) return 1;
+
+    // 4) freed blocks drop out of the index: the same bytes written again
+    // after the only copy is gone go to a fresh block
+    tfs_mountEx((char *)fsname, TFS_MOUNT_DEDUP);
+    tfs_writeFile(tfs_openFile("c"), other, sizeof(other));
+    tfs_deleteFile(tfs_openFile("c"));
+    tfs_writeFile(tfs_openFile("x"), data, 100);
+    tfs_writeFile(tfs_openFile("d"), other, sizeof(other));
+    if (read_matches(what, "d", other, sizeof(other))) return 1;
+    tfs_unmount();
+    if (used_blocks() < 0) return 1;
+
+    // 5) deleting the copies gives their blocks back
+    tfs_mountEx((char *)fsname, TFS_MOUNT_DEDUP);
+    tfs_deleteFile(tfs_openFile("a"));
+    tfs_deleteFile(tfs_openFile("b"));
+    tfs_deleteFile(tfs_openFile("d"));
+    tfs_deleteFile(tfs_openFile("x"));
+    if (read_matches(what, "plain", data, sizeof(data))) return 1;
+    tfs_unmount();
+    if (check(what, used_blocks() - start, 3)) return 1;
+    return 0;
+}
+
+int main(void) {
+    if (run("free chain", TFS_MKFS_64)) return 1;
+    if (run("bitmap", TFS_MKFS_BITMAP)) return 1;
+    if (run("log", TFS_MKFS_LOG)) return 1;
+    printf("[PASS] dedup mounts share blocks with the same bytes and copy them on write\n");
+    return 0;
+}
@@ -0,0 +1,156 @@
+// test_defrag.c
+#include <stdio.h>
+#include <string.h>
+
+#include "libTinyFS.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+
+static int fragmented(const char *fsname) {
+    tfsFsckReport r;
+    if (tfs_fsck((char *)fsname, 0, 1, &r) != 0) return -1;
+    return r.fragmentedFiles;
+}
+
+int main(void) {
+    const char *fsname = "test_defrag.img";
+    char data[8 * EX_E];
+    char back[8 * EX_E];
+
+    // churn: interleave three files, drop one, then grow the others into
+    // its blocks so their chains jump around
+    if (tfs_mkfs((char *)fsname, 100 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    fileDescriptor a = tfs_openFile("a");
+    fileDescriptor b = tfs_openFile("b");
+    fileDescriptor c = tfs_openFile("c");
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 7);
+    tfs_writeFile(a, data, 3 * EX_E);
+    tfs_writeFile(b, data, 3 * EX_E);
+    tfs_writeFile(c, data, 3 * EX_E);
+    tfs_deleteFile(b);
+    tfs_writeFile(a, data, 5 * EX_E);
+    tfs_seek(c, 3 * EX_E);
+    tfs_write(c, data + 3 * EX_E, 5 * EX_E);
+    tfs_unmount();
+    if (fragmented(fsname) <= 0) {
+        printf("[FAIL] setup didn't fragment anything (%d)\n", fragmented(fsname));
+        return 1;
+    }
+
+    // 1) a one block budget only gets part of the way
+    tfs_mount((char *)fsname);
+    a = tfs_openFile("a");
+    c = tfs_openFile("c");
+    int rc = tfs_defragFs(1, 0);
+    if (rc != 1) {
+        printf("[FAIL] budgeted defrag returned %d, expected more work\n", rc);
+        return 1;
+    }
+    // 2) keep calling until the pass is done
+    for (int i = 0; i < 10 && rc == 1; i++) rc = tfs_defragFs(1, 0);
+    if (rc != 0) {
+        printf("[FAIL] defrag never finished: %d\n", rc);
+        return 1;
+    }
+    // a second pass can slide files into room the first one opened up
+    if (tfs_defragFs(0, 0) != 0) return 1;
+    // a single file is already in one run now
+    if (tfs_defrag(a) != 0) {
+        printf("[FAIL] tfs_defrag moved an already contiguous file\n");
+        return 1;
+    }
+    // data is intact, and the FDs still work
+    tfs_seek(a, 0);
+    if (tfs_readFile(a, back, sizeof(back)) != 5 * EX_E || memcmp(back, data, 5 * EX_E) != 0) {
+        printf("[FAIL] a changed during defrag\n");
+        return 1;
+    }
+    tfs_seek(c, 0);
+    if (tfs_readFile(c, back, sizeof(back)) != 8 * EX_E || memcmp(back, data, 8 * EX_E) != 0) {
+        printf("[FAIL] c changed during defrag\n");
+        return 1;
+    }
+    tfs_unmount();
+    if (fragmented(fsname) != 0) {
+        printf("[FAIL] %d files still fragmented\n", fragmented(fsname));
+        return 1;
+    }
+
+    // 3) files got packed toward the front, free space is one run at the end
+    tfsFsckReport r;
+    tfs_fsck((char *)fsname, 0, 1, &r);
+    if (r.largestFreeRun < r.freeBlocks - 2) {
+        printf("[FAIL] free space not compacted: %d free, largest run %d\n", r.freeBlocks, r.largestFreeRun);
+        return 1;
+    }
+
+    // 4) on a bitmap image the blocks a moved file leaves are free in the
+    // bitmap at once, another file moved onto them keeps its bits
+    if (tfs_mkfsEx((char *)fsname, 100 * BLOCKSIZE, TFS_MKFS_BITMAP) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    char name[9];
+    for (int i = 0; i < 5; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        tfs_writeFile(tfs_openFile(name), data, (i + 2) * EX_E);
+    }
+    tfs_deleteFile(tfs_openFile("f1"));
+    tfs_deleteFile(tfs_openFile("f3"));
+    if (tfs_defragFs(0, 0) < 0) return 1;
+    tfs_unmount();
+    if (fragmented(fsname) != 0) {
+        printf("[FAIL] bitmap image after defrag: fsck %d\n", tfs_fsck((char *)fsname, 0, 1, NULL));
+        return 1;
+    }
+
+    // 5) slices with writes and deletes in between only look again at what
+    // changed, on both kinds of image the free space and the files still
+    // come out right
+    for (int bitmap = 0; bitmap < 2; bitmap++) {
+        if (tfs_mkfsEx((char *)fsname, 300 * BLOCKSIZE, bitmap ? TFS_MKFS_BITMAP : 0) != TFS_SUCCESS) return 1;
+        tfs_mount((char *)fsname);
+        int sizes[6] = {0};
+        for (int i = 0; i < 40; i++) {
+            int f = i * 5 % 6;
+            snprintf(name, sizeof(name), "g%d", f);
+            fileDescriptor fd = tfs_openFile(name);
+            if (i % 4 == 3) {
+                tfs_deleteFile(fd);
+                sizes[f] = 0;
+            } else {
+                sizes[f] = (i % 7 + 1) * EX_E + i;
+                if (tfs_writeFile(fd, data + f, sizes[f]) != TFS_SUCCESS) return 1;
+            }
+            if (tfs_defragFs(2, 0) < 0) {
+                printf("[FAIL] slice %d on a %s image\n", i, bitmap ? "bitmap" : "chain");
+                return 1;
+            }
+            tfsFragReport fr;
+            if (tfs_fragReport(&fr, NULL, 0) < 0) return 1;
+        }
+        while ((rc = tfs_defragFs(2, 0)) == 1) {}
+        if (rc != 0) return 1;
+        for (int f = 0; f < 6; f++) {
+            snprintf(name, sizeof(name), "g%d", f);
+            if (sizes[f] == 0) continue;
+            fileDescriptor fd = tfs_openFile(name);
+            tfs_seek(fd, 0);
+            if (tfs_readFile(fd, back, sizeof(back)) != sizes[f] || memcmp(back, data + f, sizes[f]) != 0) {
+                printf("[FAIL] %s reads back wrong after the slices\n", name);
+                return 1;
+            }
+        }
+        tfs_unmount();
+        tfs_fsck((char *)fsname, 0, 1, &r);
+        if (tfs_fsck((char *)fsname, 0, 1, NULL) != 0 || r.fragmentedFiles != 0) {
+            printf("[FAIL] %s image after the slices: fsck %d, %d fragmented\n", bitmap ? "bitmap" : "chain",
+                   tfs_fsck((char *)fsname, 0, 1, NULL), r.fragmentedFiles);
+            return 1;
+        }
+    }
+
+    remove(fsname);
+    printf("[PASS] defrag makes every file one run, in budgeted steps\n");
+    return 0;
+}
@@ -0,0 +1,89 @@
+// test_direct.c
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "test_util.h"
+
+int main(void) {
+    const char *fsname = "test_direct.img";
+    char blk[BLOCKSIZE], back[BLOCKSIZE];
+
+    // 1) raw disk: single blocks inside one aligned unit don't clobber each other
+    // 41 blocks is not a whole number of 4K units
+    int disk = openDiskEx((char *)fsname, 41 * BLOCKSIZE, DISK_DIRECT);
+    if (disk < 0) {
+        printf("[FAIL] openDiskEx: %d\n", disk);
+        return 1;
+    }
+    int direct = diskIsDirect(disk);
+    if (check("diskBlocks", diskBlocks(disk), 41)) return 1;
+    for (int i = 0; i < 41; i++) {
+        memset(blk, 'a' + i % 26, BLOCKSIZE);
+        if (check("writeBlock", writeBlock(disk, i, blk), 0)) return 1;
+    }
+    for (int i = 0; i < 41; i++) {
+        if (check("readBlock", readBlock(disk, i, back), 0)) return 1;
+        if (back[0] != 'a' + i % 26 || back[BLOCKSIZE - 1] != 'a' + i % 26) {
+            printf("[FAIL] block %d read back '%c'\n", i, back[0]);
+            return 1;
+        }
+    }
+
+    // unaligned runs, in and out of the buffer pool
+    char run[30 * BLOCKSIZE], runBack[30 * BLOCKSIZE];
+    for (int i = 0; i < (int)sizeof(run); i++) run[i] = (char)(i * 7);
+    if (check("writeBlocks", writeBlocks(disk, 5, 30, run), 0)) return 1;
+    if (check("readBlocks", readBlocks(disk, 5, 30, runBack), 0)) return 1;
+    if (memcmp(run, runBack, sizeof(run)) != 0) {
+        printf("[FAIL] readBlocks returned different data\n");
+        return 1;
+    }
+    readBlock(disk, 4, back);
+    if (back[0] != 'e') { printf("[FAIL] block before the run changed\n"); return 1; }
+    readBlock(disk, 35, back);
+    if (back[0] != 'a' + 35 % 26) { printf("[FAIL] block after the run changed\n"); return 1; }
+    closeDisk(disk);
+
+    // the image isn't padded, reopening gives the same disk
+    struct stat st;
+    stat(fsname, &st);
+    if (check("image size", (int)st.st_size, 41 * BLOCKSIZE)) return 1;
+    disk = openDiskEx((char *)fsname, 0, DISK_DIRECT);
+    if (check("reopened diskBlocks", diskBlocks(disk), 41)) return 1;
+    readBlock(disk, 40, back);
+    if (back[0] != 'a' + 40 % 26) { printf("[FAIL] tail block read back '%c'\n", back[0]); return 1; }
+    closeDisk(disk);
+
+    // 2) a filesystem mounted direct, checked by fsck in both modes
+    if (tfs_mkfs((char *)fsname, 100 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    if (check("mountEx", tfs_mountEx((char *)fsname, TFS_MOUNT_DIRECT), TFS_SUCCESS)) return 1;
+    char data[5000];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i % 251);
+    fileDescriptor a = tfs_openFile("a");
+    fileDescriptor b = tfs_openFile("b");
+    if (check("write a", tfs_writeFile(a, data, sizeof(data)), TFS_SUCCESS)) return 1;
+    if (check("write b", tfs_writeFile(b, data, 300), TFS_SUCCESS)) return 1;
+    tfs_unmount();
+
+    if (check("remount", tfs_mountEx((char *)fsname, TFS_MOUNT_DIRECT), TFS_SUCCESS)) return 1;
+    a = tfs_openFile("a");
+    char dataBack[5000];
+    if (check("read a", tfs_readFile(a, dataBack, sizeof(dataBack)), sizeof(dataBack))) return 1;
+    if (memcmp(data, dataBack, sizeof(data)) != 0) {
+        printf("[FAIL] a came back different\n");
+        return 1;
+    }
+    tfs_unmount();
+
+    if (check("fsck direct", tfs_fsck((char *)fsname, TFS_FSCK_DIRECT, 2, NULL), 0)) return 1;
+    if (check("fsck buffered", tfs_fsck((char *)fsname, 0, 2, NULL), 0)) return 1;
+
+    printf("[PASS] O_DIRECT disks read and write unaligned blocks and runs%s\n",
+           direct ? "" : " (filesystem has no O_DIRECT, ran buffered)");
+    return 0;
+}
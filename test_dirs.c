@@ -0,0 +1,159 @@
+// test_dirs.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "test_util.h"
+
+#define MANY 3000
+
+// every name is there, in order, and nothing else is
+static int listing_ok(const char *what, const char *dir, int n, int step) {
+    tfsFileInfo *infos = malloc(MANY * sizeof(tfsFileInfo));
+    int got = tfs_listDir((char *)dir, infos, MANY);
+    int bad = check(what, got, n);
+    for (int i = 0, k = 0; !bad && i < MANY; i += step, k++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%05d", i);
+        if (strcmp(infos[k].name, name) != 0) {
+            printf("[FAIL] %s: entry %d is %s, expected %s\n", what, k, infos[k].name, name);
+            bad = 1;
+        }
+    }
+    free(infos);
+    return bad;
+}
+
+int main(void) {
+    const char *fsname = "test_dirs.img";
+    static char data[5000];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 7 + i / 100);
+
+    if (tfs_mkfs64((char *)fsname, 20000 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+
+    // 1) nested directories, the same name in different places
+    if (check("mkdir a", tfs_mkdir("a"), TFS_SUCCESS)) return 1;
+    if (check("mkdir /a/b", tfs_mkdir("/a/b"), TFS_SUCCESS)) return 1;
+    if (check("mkdir twice", tfs_mkdir("a/b/"), ERR_FILE_EXISTS)) return 1;
+    if (check("mkdir no parent", tfs_mkdir("x/y"), ERR_FILE_NOT_FOUND)) return 1;
+    tfs_writeFile(tfs_openFile("note"), data, 100);
+    tfs_writeFile(tfs_openFile("a/note"), data + 1, 200);
+    tfs_writeFile(tfs_openFile("/a/b/note"), data + 2, 300);
+    if (read_matches("nested", "note", data, 100)) return 1;
+    if (read_matches("nested", "/a/note", data + 1, 200)) return 1;
+    if (read_matches("nested", "a/b/note", data + 2, 300)) return 1;
+    if (check("open a dir", tfs_openFile("a/b"), ERR_IS_DIR)) return 1;
+    if (check("file as dir", tfs_openFile("note/x"), ERR_NOT_DIR)) return 1;
+    if (check("long name", tfs_openFile("a/ninechars"), ERR_FILE_NAME)) return 1;
+    if (check("listDir file", tfs_listDir("note", NULL, 0), ERR_NOT_DIR)) return 1;
+    tfsFileInfo infos[4];
+    if (check("root entries", tfs_readdirInfo(infos, 4), 2)) return 1;
+    if (strcmp(infos[0].name, "a") != 0 || !infos[0].isDir || infos[0].size_B != 2 || infos[1].isDir) {
+        printf("[FAIL] root listing: %s dir %d size %lld, %s\n",
+               infos[0].name, infos[0].isDir, (long long)infos[0].size_B, infos[1].name);
+        return 1;
+    }
+
+    // 2) thousands of entries split the tree, deleting them merges it back
+    if (check("mkdir big", tfs_mkdir("big"), TFS_SUCCESS)) return 1;
+    for (int i = MANY - 1; i >= 0; i--) {
+        char path[16];
+        snprintf(path, sizeof(path), "big/f%05d", i);
+        fileDescriptor fd = tfs_openFile(path);
+        if (fd < 0) { printf("[FAIL] create %s: %d\n", path, fd); return 1; }
+        tfs_writeFile(fd, data + i % 50, 20);
+        tfs_closeFile(fd);
+    }
+    if (listing_ok("full dir", "big", MANY, 1)) return 1;
+    if (read_matches("big lookup", "big/f01234", data + 1234 % 50, 20)) return 1;
+    tfs_unmount();
+    tfsFsckReport r;
+    if (tfs_fsck((char *)fsname, 0, 1, &r) != 0 || r.dirs != 3 || r.files != MANY + 3) {
+        printf("[FAIL] fsck full: %d bad dirs, %d dirs, %d files\n", r.badDirs, r.dirs, r.files);
+        return 1;
+    }
+    tfs_mount((char *)fsname);
+    // every other one, then the rest
+    for (int pass = 1; pass >= 0; pass--) {
+        for (int i = pass; i < MANY; i += 2) {
+            char path[16];
+            snprintf(path, sizeof(path), "big/f%05d", i);
+            if (check("delete", tfs_deleteFile(tfs_openFile(path)), TFS_SUCCESS)) return 1;
+        }
+        if (pass == 1 && listing_ok("half dir", "big", MANY / 2, 2)) return 1;
+    }
+    if (check("empty dir", tfs_listDir("big", infos, 4), 0)) return 1;
+
+    // 3) rmdir only takes empty directories
+    if (check("rmdir non-empty", tfs_rmdir("a"), ERR_DIR_NOT_EMPTY)) return 1;
+    if (check("rmdir file", tfs_rmdir("note"), ERR_NOT_DIR)) return 1;
+    if (check("rmdir big", tfs_rmdir("big"), TFS_SUCCESS)) return 1;
+    if (check("rmdir gone", tfs_rmdir("big"), ERR_FILE_NOT_FOUND)) return 1;
+
+    // 4) rename moves a file between directories
+    fileDescriptor fd = tfs_openFile("a/b/note");
+    if (check("rename taken", tfs_rename(fd, "/a/note"), ERR_FILE_EXISTS)) return 1;
+    if (check("rename move", tfs_rename(fd, "/moved"), TFS_SUCCESS)) return 1;
+    if (read_matches("moved", "moved", data + 2, 300)) return 1;
+    if (check("old place", tfs_listDir("a/b", infos, 4), 0)) return 1;
+    if (check("rmdir a/b", tfs_rmdir("a/b"), TFS_SUCCESS)) return 1;
+    tfs_unmount();
+    if (check("fsck after use", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // 5) fsck notices a file no directory points at (a's tree is dropped)
+    int disk = openDisk((char *)fsname, 0);
+    inode_disk a;
+    readBlock(disk, ROOT_INODE_BLOCK, &a);
+    dirnode_disk dn;
+    readBlock(disk, a.blk_start, &dn);
+    int aBlock = dn.ent[0].inode;
+    inode_disk saved;
+    readBlock(disk, aBlock, &saved);
+    inode_disk emptied = saved;
+    emptied.blk_start = 0;
+    emptied.size_B = 0;
+    writeBlock(disk, aBlock, &emptied);
+    closeDisk(disk);
+    if (tfs_fsck((char *)fsname, 0, 1, &r) <= 0 || r.badDirs != 1 || r.leaked != 1) {
+        printf("[FAIL] fsck missed the lost file: %d bad dirs, %d leaked\n", r.badDirs, r.leaked);
+        return 1;
+    }
+    disk = openDisk((char *)fsname, 0);
+    writeBlock(disk, aBlock, &saved);
+    closeDisk(disk);
+
+    // 6) an image made before directories turns into one on the first mkdir
+    if (tfs_mkfs64((char *)fsname, 2000 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    disk = openDisk((char *)fsname, 0);
+    superblock_disk sb;
+    readBlock(disk, SUPERBLOCK_BLOCK, &sb);
+    sb.features &= ~TFS_FEAT_DIRS;
+    writeBlock(disk, SUPERBLOCK_BLOCK, &sb);
+    inode_disk root;
+    readBlock(disk, ROOT_INODE_BLOCK, &root);
+    root.metaflags &= ~INODE_DIR;
+    writeBlock(disk, ROOT_INODE_BLOCK, &root);
+    closeDisk(disk);
+    tfs_mount((char *)fsname);
+    for (int i = 0; i < 40; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%05d", i);
+        tfs_writeFile(tfs_openFile(name), data + i, 10 + i);
+    }
+    if (check("mkdir flat", tfs_mkdir("d"), TFS_SUCCESS)) return 1;
+    tfs_writeFile(tfs_openFile("d/x"), data, 50);
+    if (read_matches("converted", "f00017", data + 17, 27)) return 1;
+    if (check("converted root", tfs_readdirInfo(NULL, 0), 41)) return 1;
+    tfs_unmount();
+    if (check("fsck converted", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    printf("[PASS] nested directories keep their entries in B-trees\n");
+    return 0;
+}
@@ -0,0 +1,130 @@
+// test_discard.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "libDump.h"
+#include "TinyFS_errno.h"
+#include "test_util.h"
+
+static const char *fsname = "test_discard.img";
+
+// KB the image takes on the host
+static long long host_kb(const char *name) {
+    struct stat st;
+    if (stat(name, &st) != 0) return -1;
+    return (long long)st.st_blocks / 2;
+}
+
+int main(void) {
+    static char data[400000];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 13 + i / 300);
+
+    // a reused image file: a chain image full of data first
+    if (tfs_mkfs64((char *)fsname, 8000 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    tfs_writeFile(tfs_openFile("old"), data, sizeof(data));
+    tfs_unmount();
+    long long full = host_kb(fsname);
+
+    // 1) bitmap mkfs gives the old blocks back and writes only the metadata
+    if (check("mkfsEx", tfs_mkfsEx((char *)fsname, 8000 * BLOCKSIZE, TFS_MKFS_BITMAP), TFS_SUCCESS)) return 1;
+    long long fresh = host_kb(fsname);
+    int punches = fresh < full / 4;
+    int disk = openDisk((char *)fsname, 0);
+    superblock_disk sb;
+    readBlock(disk, SUPERBLOCK_BLOCK, &sb);
+    closeDisk(disk);
+    if (!(sb.features & TFS_FEAT_BITMAP) || sb.bitmap_start != 2 || sb.bitmap_blocks != (8000 + BM_BITS - 1) / BM_BITS ||
+            sb.free_lazy != 2 + sb.bitmap_blocks || sb.free_block != 0) {
+        printf("[FAIL] bitmap superblock: features %x start %d blocks %d free_lazy %d\n",
+               sb.features, sb.bitmap_start, sb.bitmap_blocks, sb.free_lazy);
+        return 1;
+    }
+    if (check("fsck fresh", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // 2) deleting a file with discard on shrinks the image on the host
+    if (check("mount", tfs_mountEx((char *)fsname, TFS_MOUNT_DISCARD), TFS_SUCCESS)) return 1;
+    fileDescriptor small = tfs_openFile("small");
+    tfs_writeFile(small, data + 5, 3000);
+    fileDescriptor big = tfs_openFile("big");
+    if (check("write big", tfs_writeFile(big, data, 300000), TFS_SUCCESS)) return 1;
+    fileDescriptor tail = tfs_openFile("tail");
+    tfs_writeFile(tail, data + 9, 5000);
+    long long before = host_kb(fsname);
+    tfs_deleteFile(big);
+    long long after = host_kb(fsname);
+    if (punches && before - after < 250) {
+        printf("[FAIL] delete gave back %lld KB of ~300\n", before - after);
+        return 1;
+    }
+    if (read_matches("after delete", "small", data + 5, 3000)) return 1;
+    if (read_matches("after delete", "tail", data + 9, 5000)) return 1;
+
+    // 3) the punched blocks are handed out again and hold new data
+    fileDescriptor again = tfs_openFile("again");
+    if (check("rewrite", tfs_writeFile(again, data + 1, 100000), TFS_SUCCESS)) return 1;
+    if (read_matches("reuse", "again", data + 1, 100000)) return 1;
+    tfsFileInfo info;
+    tfs_readFileInfo(tail, &info);
+    int tailInode = info.inode_block;
+    tfs_readFileInfo(again, &info);
+    if (info.inode_block > tailInode) {
+        printf("[FAIL] new inode %d went past the freed space (tail at %d)\n", info.inode_block, tailInode);
+        return 1;
+    }
+    // a deleted inode doesn't come back as a file
+    if (check("readdir", tfs_readdirInfo(NULL, 0), 3)) return 1;
+
+    // 4) punch and defrag move blocks around through the bitmap too
+    tfs_seek(again, 0);
+    if (check("punch", tfs_punchHole(again, 248 * 10, 248 * 100), TFS_SUCCESS)) return 1;
+    tfs_deleteFile(small);
+    if (tfs_defragFs(0, 0) < 0) { printf("[FAIL] defragFs\n"); return 1; }
+    if (read_matches("after defrag", "tail", data + 9, 5000)) return 1;
+    tfs_unmount();
+    if (check("fsck after use", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // 5) dump/restore keeps the bitmap and writes none of the free space
+    int h = open("test_discard.dump", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (tfs_dump((char *)fsname, h, TFS_DUMP_CHECKSUM) < 0) { printf("[FAIL] dump\n"); return 1; }
+    lseek(h, 0, SEEK_SET);
+    if (tfs_restore(h, "test_discard2.img") < 0) { printf("[FAIL] restore\n"); return 1; }
+    close(h);
+    if (check("fsck restored", tfs_fsck("test_discard2.img", 0, 1, NULL), 0)) return 1;
+    if (punches && host_kb("test_discard2.img") > host_kb(fsname) + 8) {
+        printf("[FAIL] restored image takes %lld KB, the original %lld\n", host_kb("test_discard2.img"), host_kb(fsname));
+        return 1;
+    }
+    tfs_mount("test_discard2.img");
+    if (read_matches("restored", "tail", data + 9, 5000)) return 1;
+    tfs_unmount();
+
+    // 6) fsck finds a used block marked free and repair sets its bit again
+    disk = openDisk((char *)fsname, 0);
+    bitmap_disk bm;
+    readBlock(disk, 2, &bm);
+    bm.bits[tailInode / 8] &= ~(1 << (tailInode % 8));
+    writeBlock(disk, 2, &bm);
+    closeDisk(disk);
+    tfsFsckReport r;
+    if (tfs_fsck((char *)fsname, 0, 1, &r) <= 0 || r.doubleRef != 1) {
+        printf("[FAIL] fsck missed the cleared bit (doubleRef %d)\n", r.doubleRef);
+        return 1;
+    }
+    tfs_fsck((char *)fsname, TFS_FSCK_REPAIR, 1, NULL);
+    if (check("fsck repaired", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    unlink("test_discard.dump");
+    unlink("test_discard2.img");
+    printf("[PASS] bitmap images and discard mounts give freed blocks back%s\n",
+           punches ? "" : " (host can't punch holes, sizes not checked)");
+    return 0;
+}
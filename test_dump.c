@@ -0,0 +1,111 @@
+// test_dump.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "libDump.h"
+#include "TinyFS_errno.h"
+#include "test_util.h"
+
+static int restore_from(const char *stream, const char *image) {
+    int fd = open(stream, O_RDONLY);
+    int rc = tfs_restore(fd, (char *)image);
+    close(fd);
+    return rc;
+}
+
+int main(void) {
+    const char *fsname = "test_dump.img";
+    const char *copy = "test_dump2.img";
+    const char *stream = "test_dump.stream";
+    static char data[20001];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 7 + i / 100);
+
+    // a mostly empty classic image with a hole in the middle of its used space
+    if (tfs_mkfs((char *)fsname, 2000 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    fileDescriptor a = tfs_openFile("a");
+    fileDescriptor b = tfs_openFile("b");
+    fileDescriptor c = tfs_openFile("c");
+    tfs_writeFile(a, data, 5000);
+    tfs_writeFile(b, data, 3000);
+    tfs_writeFile(c, data + 1, 20000);
+    tfs_deleteFile(b);
+    tfs_clone(c, "d");
+    tfs_unmount();
+    tfsFsckReport before, after;
+    if (check("fsck original", tfs_fsck((char *)fsname, 0, 1, &before), 0)) return 1;
+
+    int out = open(stream, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int used = tfs_dump((char *)fsname, out, TFS_DUMP_CHECKSUM);
+    close(out);
+    if (check("dumped blocks", used, before.usedBlocks)) return 1;
+    struct stat st;
+    stat(stream, &st);
+    if (st.st_size > (long long)(used + 4) * BLOCKSIZE) {
+        printf("[FAIL] stream is %lld bytes for %d used blocks\n", (long long)st.st_size, used);
+        return 1;
+    }
+
+    // restore, same files and space, the free tail is left as lazy space
+    if (check("restore", restore_from(stream, copy), used)) return 1;
+    if (check("fsck restored", tfs_fsck((char *)copy, 0, 1, &after), 0)) return 1;
+    if (check("files", after.files, before.files)) return 1;
+    if (check("used", after.usedBlocks, before.usedBlocks)) return 1;
+    if (check("free", after.freeBlocks, before.freeBlocks)) return 1;
+    int disk = openDisk((char *)copy, 0);
+    superblock_disk sb;
+    readBlock(disk, 0, &sb);
+    closeDisk(disk);
+    if (!(sb.features & TFS_FEAT_LAZYFREE) || sb.free_lazy >= 2000 || sb.free_block == 0) {
+        printf("[FAIL] restored superblock: features %x free_lazy %d free_block %d\n",
+               sb.features, sb.free_lazy, sb.free_block);
+        return 1;
+    }
+
+    if (tfs_mount((char *)copy) != TFS_SUCCESS) return 1;
+    static char back[20000];
+    fileDescriptor d = tfs_openFile("d");
+    if (check("read clone", tfs_readFile(d, back, sizeof(back)), 20000)) return 1;
+    if (memcmp(back, data + 1, 20000) != 0) { printf("[FAIL] d differs\n"); return 1; }
+    // the restored image takes new files, from the chain and then the lazy space
+    fileDescriptor e = tfs_openFile("e");
+    if (check("write after restore", tfs_writeFile(e, data, 20000), TFS_SUCCESS)) return 1;
+    tfs_unmount();
+    if (check("fsck after use", tfs_fsck((char *)copy, 0, 1, NULL), 0)) return 1;
+
+    // a flipped byte fails the checksum, a cut stream is caught too
+    int fd = open(stream, O_RDWR);
+    char byte;
+    pread(fd, &byte, 1, 5000);
+    byte ^= 0x40;
+    pwrite(fd, &byte, 1, 5000);
+    close(fd);
+    if (check("corrupt stream", restore_from(stream, copy), ERR_FS_INVALID)) return 1;
+    truncate(stream, st.st_size - 100);
+    if (check("short stream", restore_from(stream, copy), ERR_FS_INVALID)) return 1;
+
+    // mkfs64 images round trip too
+    tfs_mkfs64((char *)fsname, 100000 * BLOCKSIZE);
+    tfs_mount((char *)fsname);
+    a = tfs_openFile("a");
+    tfs_writeFile(a, data, 20000);
+    tfs_unmount();
+    out = open(stream, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    used = tfs_dump((char *)fsname, out, 0);
+    close(out);
+    if (check("restore 64", restore_from(stream, copy), used)) return 1;
+    if (check("fsck 64", tfs_fsck((char *)copy, 0, 1, &after), 0)) return 1;
+    if (check("files 64", after.files, 1)) return 1;
+
+    unlink(stream);
+    unlink(copy);
+    printf("[PASS] dump/restore streams only used blocks and rebuilds free space\n");
+    return 0;
+}
@@ -0,0 +1,111 @@
+// test_export.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "libTinyFS.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "test_util.h"
+
+// exports fd to a host file and compares it with what tfs_readFile returns
+static int export_matches(const char *what, fileDescriptor fd, int size) {
+    const char *host = "test_export.out";
+    int h = open(host, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (check(what, tfs_exportToFd(fd, h), size)) return 1;
+    char *want = malloc(size), *got = malloc(size);
+    tfs_seek(fd, 0);
+    tfs_readFile(fd, want, size);
+    if (check("exported file size", lseek(h, 0, SEEK_END), size)) return 1;
+    pread(h, got, size, 0);
+    close(h);
+    int bad = memcmp(want, got, size) != 0;
+    if (bad) printf("[FAIL] %s: exported bytes differ\n", what);
+    free(want);
+    free(got);
+    return bad;
+}
+
+int main(void) {
+    const char *fsname = "test_export.img";
+    static char data[100000];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 31 + i / 256);
+
+    if (tfs_mkfs((char *)fsname, 1000 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+
+    // 1) one contiguous file, a fragmented one and a sparse one
+    fileDescriptor a = tfs_openFile("a");
+    tfs_writeFile(a, data, 20000);
+    fileDescriptor x = tfs_openFile("x");
+    fileDescriptor y = tfs_openFile("y");
+    tfs_writeFile(x, data, 2000);
+    tfs_writeFile(y, data, 2000);
+    tfs_deleteFile(x);
+    fileDescriptor frag = tfs_openFile("frag");
+    tfs_writeFile(frag, data + 7, 6000);
+    fileDescriptor sp = tfs_openFile("sparse");
+    tfs_seek(sp, 30000);
+    tfs_write(sp, data, 500);
+    tfs_seek(sp, 5);
+    tfs_write(sp, data, 1000);
+
+    if (export_matches("export contiguous", a, 20000)) return 1;
+    if (export_matches("export fragmented", frag, 6000)) return 1;
+    if (export_matches("export sparse", sp, 30500)) return 1;
+
+    // 2) import from a pipe, bigger than a pipe buffer
+    int p[2];
+    if (pipe(p) != 0) return 1;
+    if (fork() == 0) {
+        close(p[0]);
+        for (int off = 0; off < (int)sizeof(data); ) {
+            ssize_t w = write(p[1], data + off, sizeof(data) - off);
+            if (w <= 0) _exit(1);
+            off += w;
+        }
+        _exit(0);
+    }
+    close(p[1]);
+    if (check("import from pipe", tfs_importFromFd("imp", p[0], sizeof(data)), sizeof(data))) return 1;
+    close(p[0]);
+    fileDescriptor imp = tfs_openFile("imp");
+    static char back[100000];
+    if (check("read imported", tfs_readFile(imp, back, sizeof(back)), sizeof(back))) return 1;
+    if (memcmp(back, data, sizeof(data)) != 0) {
+        printf("[FAIL] imported bytes differ\n");
+        return 1;
+    }
+
+    // 3) import over an existing file, host file shorter than len (EOF at a
+    // batch edge and in the middle of one)
+    int sizes[] = { 256 * 248, 1000 };
+    for (int t = 0; t < 2; t++) {
+        int h = open("test_export.out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        write(h, data, sizes[t]);
+        lseek(h, 0, SEEK_SET);
+        if (check("import to EOF", tfs_importFromFd("imp", h, 90000), sizes[t])) return 1;
+        close(h);
+        if (export_matches("export imported", imp, sizes[t])) return 1;
+    }
+
+    // 4) an import that runs out of room leaves the file empty and a clone
+    // of the old content whole
+    if (check("clone", tfs_clone(imp, "snap"), TFS_SUCCESS)) return 1;
+    int h = open("test_export.out", O_RDONLY);
+    if (check("import past the disk", tfs_importFromFd("imp", h, 900LL * EX_E), ERR_DISK_FULL)) return 1;
+    close(h);
+    tfs_seek(imp, 0);
+    if (check("emptied", tfs_readFile(imp, back, 1000), ERR_EOF)) return 1;
+    tfs_deleteFile(imp);
+    if (read_matches("clone after a failed import", "snap", data, 1000)) return 1;
+    tfs_unmount();
+
+    if (check("fsck", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+    unlink("test_export.out");
+    printf("[PASS] export/import move whole runs and match tfs_readFile\n");
+    return 0;
+}
@@ -0,0 +1,132 @@
+// test_fallocate.c
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+#include "test_util.h"
+
+static const char *fsname = "test_fallocate.img";
+static char data[80 * EX_E];
+
+static int free_blocks(void) {
+    tfsFsckReport r;
+    int rc = tfs_fsck((char *)fsname, 0, 1, &r);
+    return rc == 0 ? r.freeBlocks : -1;
+}
+
+// the map entries of the file's first index block, read off the image
+static index_disk first_index(int inodeBlock) {
+    int disk = openDisk((char *)fsname, 0);
+    inode_disk in;
+    index_disk ix = {0};
+    readBlock(disk, inodeBlock, &in);
+    readBlock(disk, in.blk_start, &ix);
+    closeDisk(disk);
+    return ix;
+}
+
+int main(void) {
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 41 + i / 300 + 1);
+    char *zeros = calloc(1, sizeof(data));
+
+    // 1) blocks that held another file's data, reserved: one run, and they
+    // read as zeros
+    if (tfs_mkfsEx((char *)fsname, 3000 * BLOCKSIZE, TFS_MKFS_BITMAP) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    fileDescriptor old = tfs_openFile("old");
+    tfs_writeFile(old, data, 60 * EX_E);
+    tfs_deleteFile(old);
+    tfs_unmount();
+    int freeAtStart = free_blocks();
+    tfs_mount((char *)fsname);
+    fileDescriptor fd = tfs_openFile("ingest");
+    if (check("fallocate", tfs_fallocate(fd, 50 * EX_E), TFS_SUCCESS)) return 1;
+    if (read_matches_fd("reserved", fd, zeros, 50 * EX_E)) return 1;
+    tfsFileInfo info;
+    tfs_readFileInfo(fd, &info);
+    tfs_unmount();
+    index_disk ix = first_index(info.inode_block);
+    for (int i = 0; i < 50; i++) {
+        if (ix.blk[i] >= 0 || ix.blk[i] != ix.blk[0] - i) {
+            printf("[FAIL] entry %d is %d, first %d\n", i, ix.blk[i], ix.blk[0]);
+            return 1;
+        }
+    }
+    int reserved = -ix.blk[0];
+    // 50 data blocks, the index block, the inode and the root's node
+    if (check("reserved blocks", free_blocks(), freeAtStart - 53)) return 1;
+
+    // 2) writes fill the reserved blocks in place, the rest stay zeros
+    tfs_mount((char *)fsname);
+    fd = tfs_openFile("ingest");
+    tfs_seek(fd, 10 * EX_E + 5);
+    if (check("write", tfs_write(fd, data, 3 * EX_E), 3 * EX_E)) return 1;
+    char *expect = calloc(1, 50 * EX_E);
+    memcpy(expect + 10 * EX_E + 5, data, 3 * EX_E);
+    if (read_matches_fd("filled", fd, expect, 50 * EX_E)) return 1;
+    tfs_unmount();
+    ix = first_index(info.inode_block);
+    if (ix.blk[10] != reserved + 10 || ix.blk[13] != reserved + 13 || ix.blk[14] != -(reserved + 14)) {
+        printf("[FAIL] filled entries %d %d %d, run at %d\n", ix.blk[10], ix.blk[13], ix.blk[14], reserved);
+        return 1;
+    }
+    if (check("nothing allocated", free_blocks(), freeAtStart - 53)) return 1;
+
+    // 3) growing it reserves only what is new, a clone shares the reserved
+    // blocks and a write to it leaves the original alone
+    tfs_mount((char *)fsname);
+    fd = tfs_openFile("ingest");
+    if (check("grow", tfs_fallocate(fd, 70 * EX_E), TFS_SUCCESS)) return 1;
+    if (check("smaller is a no-op", tfs_fallocate(fd, 5), TFS_SUCCESS)) return 1;
+    tfs_readFileInfo(fd, &info);
+    if (check("size", info.size_B, 70 * EX_E)) return 1;
+    if (check("clone", tfs_clone(fd, "copy"), TFS_SUCCESS)) return 1;
+    fileDescriptor copy = tfs_openFile("copy");
+    tfs_seek(copy, 30 * EX_E);
+    tfs_write(copy, data, 100);
+    char *grown = calloc(1, 70 * EX_E);
+    memcpy(grown, expect, 50 * EX_E);
+    if (read_matches_fd("original after clone write", fd, grown, 70 * EX_E)) return 1;
+    memcpy(grown + 30 * EX_E, data, 100);
+    if (read_matches_fd("clone", copy, grown, 70 * EX_E)) return 1;
+    tfs_deleteFile(copy);
+    tfs_unmount();
+    if (check("fsck", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // 4) deleting it gives everything back, reserved or not, except the
+    // refcount table the clone made (its inode, index and one table block)
+    tfs_mount((char *)fsname);
+    tfs_deleteFile(tfs_openFile("ingest"));
+    tfs_unmount();
+    if (check("all back", free_blocks(), freeAtStart - 3)) return 1;
+
+    // 5) more than there is: the size still changes, fsck stays happy
+    tfs_mount((char *)fsname);
+    fd = tfs_openFile("huge");
+    if (check("too big", tfs_fallocate(fd, 5000 * EX_E), ERR_DISK_FULL)) return 1;
+    tfs_readFileInfo(fd, &info);
+    if (check("huge size", info.size_B, 5000 * EX_E)) return 1;
+    tfs_unmount();
+    if (check("fsck full", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // 6) free chain and log images don't have it
+    tfs_mkfs((char *)fsname, 200 * BLOCKSIZE);
+    tfs_mount((char *)fsname);
+    if (check("chain image", tfs_fallocate(tfs_openFile("x"), 10), ERR_NOT_SUPPORTED)) return 1;
+    tfs_unmount();
+    tfs_mkfsEx((char *)fsname, 1000 * BLOCKSIZE, TFS_MKFS_LOG);
+    tfs_mount((char *)fsname);
+    if (check("log image", tfs_fallocate(tfs_openFile("x"), 10), ERR_NOT_SUPPORTED)) return 1;
+    tfs_unmount();
+
+    free(zeros);
+    free(expect);
+    free(grown);
+    printf("[PASS] fallocate reserves one run that reads as zeros and fills in place\n");
+    return 0;
+}
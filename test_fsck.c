@@ -0,0 +1,84 @@
+// test_fsck.c
+#include <stdio.h>
+#include <string.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+#include "test_util.h"
+
+int main(void) {
+    const char *fsname = "test_fsck.img";
+    char data[1000];
+    memset(data, 'x', sizeof(data));
+
+    // build an image with two files: a = 5 blocks, b = 1 block
+    if (tfs_mkfs((char *)fsname, 40 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    if (tfs_mount((char *)fsname) != TFS_SUCCESS) return 1;
+    fileDescriptor a = tfs_openFile("a");
+    fileDescriptor b = tfs_openFile("b");
+    tfs_writeFile(a, data, 1000);
+    tfs_writeFile(b, data, 100);
+    tfsFileInfo infoA, infoB;
+    tfs_readFileInfo(a, &infoA);
+    tfs_readFileInfo(b, &infoB);
+    tfs_unmount();
+
+    tfsFsckReport r;
+    int rc = tfs_fsck((char *)fsname, 0, 2, &r);
+    if (check("fsck on a fresh image", rc, 0)) return 1;
+    if (check("files", r.files, 2)) return 1;
+    // superblock, root and its directory node, the inodes, the data
+    int used = 2 + 1 + 2 + (1000 + EX_E - 1) / EX_E + 1;
+    if (check("used blocks", r.usedBlocks, used)) return 1;
+    if (check("free blocks", r.freeBlocks, 40 - used)) return 1;
+
+    // corrupt it: point b's only extent at a's second block (cross link),
+    // and drop the head of the free chain (leak)
+    int disk = openDisk((char *)fsname, 0);
+    superblock_disk sb;
+    inode_disk ia, ib;
+    readBlock(disk, 0, &sb);
+    readBlock(disk, infoA.inode_block, &ia);
+    readBlock(disk, infoB.inode_block, &ib);
+    fileextent_disk ext;
+    readBlock(disk, ia.blk_start, &ext);
+    int aSecond = ext.blk_next;
+    readBlock(disk, ib.blk_start, &ext);
+    ext.blk_next = aSecond;
+    writeBlock(disk, ib.blk_start, &ext);
+    free_disk fr;
+    readBlock(disk, sb.free_block, &fr);
+    sb.free_block = fr.blk_next;
+    writeBlock(disk, 0, &sb);
+    closeDisk(disk);
+
+    rc = tfs_fsck((char *)fsname, 0, 2, &r);
+    if (check("cross-linked", r.crossLinked, 1)) return 1;
+    if (check("leaked", r.leaked, 1)) return 1;
+    if (rc <= 0) {
+        printf("[FAIL] fsck didn't report the damage (rc=%d)\n", rc);
+        return 1;
+    }
+
+    rc = tfs_fsck((char *)fsname, TFS_FSCK_REPAIR, 2, &r);
+    if (rc <= 0 || r.repaired == 0) {
+        printf("[FAIL] repair run did nothing (rc=%d)\n", rc);
+        return 1;
+    }
+    rc = tfs_fsck((char *)fsname, 0, 1, &r);
+    if (check("fsck after repair", rc, 0)) return 1;
+    if (check("free blocks after repair", r.freeBlocks, 40 - used)) return 1;
+
+    // the repaired image still mounts and a keeps its data
+    if (tfs_mount((char *)fsname) != TFS_SUCCESS) return 1;
+    a = tfs_openFile("a");
+    char back[1000];
+    if (check("read a", tfs_readFile(a, back, 1000), 1000)) return 1;
+    tfs_unmount();
+
+    printf("[PASS] fsck finds cross links and leaks and repairs them\n");
+    return 0;
+}
@@ -0,0 +1,101 @@
+// test_large.c
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+
+int main(void) {
+    const char *fsname = "test_large.img";
+    int64_t bytes = 3LL * 1024 * 1024 * 1024;   // 3GB, past what an int can hold
+    int rc;
+
+    // 1) the disk layer can address blocks past the 2GB mark
+    int disk = openDisk64((char *)fsname, bytes);
+    if (disk < 0 || diskBlocks(disk) != (int)(bytes / BLOCKSIZE)) {
+        printf("[FAIL] openDisk64 returned %d, %d blocks\n", disk, diskBlocks(disk));
+        return 1;
+    }
+    char out[BLOCKSIZE], in[BLOCKSIZE];
+    memset(out, 'Z', sizeof(out));
+    int high = (int)(bytes / BLOCKSIZE) - 1;
+    if (writeBlock(disk, high, out) != 0 || readBlock(disk, high, in) != 0 ||
+        memcmp(in, out, BLOCKSIZE) != 0) {
+        printf("[FAIL] block %d past 2GB didn't round trip\n", high);
+        return 1;
+    }
+    // block 0 must be untouched by the high write (no int wraparound)
+    readBlock(disk, 0, in);
+    if (in[0] == 'Z') {
+        printf("[FAIL] high block write landed at the start of the disk\n");
+        return 1;
+    }
+    closeDisk(disk);
+
+    // 2) a 64 bit filesystem on it
+    rc = tfs_mkfs64((char *)fsname, bytes);
+    if (rc != TFS_SUCCESS) {
+        printf("[FAIL] tfs_mkfs64 returned %d\n", rc);
+        return 1;
+    }
+    if (tfs_mount((char *)fsname) != TFS_SUCCESS) return 1;
+    fileDescriptor fd = tfs_openFile("big");
+    char data[1000];
+    memset(data, 'q', sizeof(data));
+    rc = tfs_writeFile64(fd, data, sizeof(data));
+    if (rc != TFS_SUCCESS) {
+        printf("[FAIL] tfs_writeFile64 returned %d\n", rc);
+        return 1;
+    }
+    char back[1000];
+    if (tfs_readFile(fd, back, sizeof(back)) != 1000 || memcmp(back, data, 1000) != 0) {
+        printf("[FAIL] read back mismatch\n");
+        return 1;
+    }
+    tfsFileInfo info;
+    if (tfs_readdirInfo(&info, 1) != 1 || info.size_B != 1000) {
+        printf("[FAIL] readdirInfo size %lld\n", (long long)info.size_B);
+        return 1;
+    }
+    tfs_unmount();
+
+    // 3) sizes past 4GB survive in the inode (set by hand, nobody has 5GB to write)
+    disk = openDisk((char *)fsname, 0);
+    inode_disk ino;
+    readBlock(disk, 2, &ino);
+    ino.size_B = 0x10;
+    ino.size_hi = 1;   // 4GB + 16
+    writeBlock(disk, 2, &ino);
+    closeDisk(disk);
+    tfs_mount((char *)fsname);
+    fd = tfs_openFile("big");
+    if (tfs_seek64(fd, 4294967296LL + 8) != TFS_SUCCESS) {
+        printf("[FAIL] tfs_seek64 past 4GB rejected\n");
+        return 1;
+    }
+    char c;
+    if (tfs_seek64(fd, 4294967296LL + 17) != TFS_SUCCESS || tfs_readByte(fd, &c) != ERR_EOF) {
+        printf("[FAIL] read past EOF after tfs_seek64 didn't hit EOF\n");
+        return 1;
+    }
+    tfs_unmount();
+
+    // 4) classic images still cap files at 2GB
+    tfs_mkfs("test_large_small.img", 40 * BLOCKSIZE);
+    tfs_mount("test_large_small.img");
+    fd = tfs_openFile("f");
+    rc = tfs_writeFile64(fd, data, 3LL * 1024 * 1024 * 1024);
+    if (rc != ERR_FILE_TOO_BIG) {
+        printf("[FAIL] classic image accepted a 3GB file: %d\n", rc);
+        return 1;
+    }
+    tfs_unmount();
+
+    remove(fsname);
+    printf("[PASS] 64 bit offsets, mkfs64, seek64 and size_hi\n");
+    return 0;
+}
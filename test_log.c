@@ -0,0 +1,140 @@
+// test_log.c
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+#include "test_util.h"
+
+static const char *fsname = "test_log.img";
+
+static int inode_of(const char *name) {
+    tfsFileInfo info;
+    if (tfs_readFileInfo(tfs_openFile((char *)name), &info) < 0) return -1;
+    return info.inode_block;
+}
+
+// block holding file block fblk, read off the unmounted image
+static int data_block(int inodeBlock, int fblk) {
+    int disk = openDisk((char *)fsname, 0);
+    inode_disk in;
+    readBlock(disk, inodeBlock, &in);
+    int b = in.blk_start;
+    if (in.metaflags & INODE_MAPPED) {
+        index_disk ix;
+        for (readBlock(disk, b, &ix); ix.base + IX_E <= fblk && ix.blk_next != 0; readBlock(disk, b, &ix)) b = ix.blk_next;
+        b = ix.blk[fblk - ix.base];
+    } else {
+        fileextent_disk ext;
+        for (int i = 0; i < fblk && b != 0; i++) {
+            readBlock(disk, b, &ext);
+            b = ext.blk_next;
+        }
+    }
+    closeDisk(disk);
+    return b;
+}
+
+int main(void) {
+    static char data[41 * EX_E];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 19 + i / 500);
+
+    // 1) the head starts right after the metadata
+    if (check("mkfsEx", tfs_mkfsEx((char *)fsname, 4000 * BLOCKSIZE, TFS_MKFS_LOG), TFS_SUCCESS)) return 1;
+    int disk = openDisk((char *)fsname, 0);
+    superblock_disk sb;
+    readBlock(disk, SUPERBLOCK_BLOCK, &sb);
+    closeDisk(disk);
+    if (!(sb.features & TFS_FEAT_LOG) || !(sb.features & TFS_FEAT_BITMAP) || sb.log_head != sb.free_lazy) {
+        printf("[FAIL] log superblock: features %x head %d free_lazy %d\n", sb.features, sb.log_head, sb.free_lazy);
+        return 1;
+    }
+
+    // 2) space freed behind the head isn't written to again, new blocks go
+    // in front of everything
+    tfs_mount((char *)fsname);
+    tfs_writeFile(tfs_openFile("a"), data, 40 * EX_E);
+    fileDescriptor b = tfs_openFile("b");
+    tfs_writeFile(b, data + 1, 40 * EX_E);
+    int bInode = inode_of("b");
+    tfs_deleteFile(tfs_openFile("a"));
+    tfs_writeFile(tfs_openFile("c"), data + 2, 10 * EX_E);
+    int cInode = inode_of("c");
+    if (cInode < bInode + 40) {
+        printf("[FAIL] c's inode at %d went back behind b (%d)\n", cInode, bInode);
+        return 1;
+    }
+
+    // 3) rewriting a block puts it at the head too
+    tfs_seek(b, 5 * EX_E + 3);
+    if (check("overwrite", tfs_write(b, data + 7, 10), 10)) return 1;
+    char *expect = malloc(40 * EX_E);
+    memcpy(expect, data + 1, 40 * EX_E);
+    memcpy(expect + 5 * EX_E + 3, data + 7, 10);
+    if (read_matches_fd("overwritten b", b, expect, 40 * EX_E)) return 1;
+    tfs_unmount();
+    int moved = data_block(bInode, 5);
+    if (moved <= cInode || data_block(bInode, 6) >= cInode) {
+        printf("[FAIL] rewritten block at %d, c's inode at %d\n", moved, cInode);
+        return 1;
+    }
+
+    // 4) the head is checkpointed, the next mount carries on from it
+    if (check("fsck", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+    tfs_mount((char *)fsname);
+    tfs_writeFile(tfs_openFile("d"), data, 100);
+    if (inode_of("d") <= moved) {
+        printf("[FAIL] after remount d's inode at %d, behind %d\n", inode_of("d"), moved);
+        return 1;
+    }
+
+    // 5) half empty segments: the cleaner moves what is left in them to the
+    // head, files and inodes, and open files keep working
+    for (int i = 0; i < 40; i++) {
+        char name[9];
+        snprintf(name, sizeof(name), "f%d", i);
+        tfs_writeFile(tfs_openFile(name), data + i, 20 * EX_E - i);
+    }
+    for (int i = 0; i < 40; i += 2) {
+        char name[9];
+        snprintf(name, sizeof(name), "f%d", i);
+        tfs_deleteFile(tfs_openFile(name));
+    }
+    fileDescriptor keep = tfs_openFile("f13");
+    int keepInode = inode_of("f13");
+    int cleaned = tfs_cleanLog(0, 0);
+    if (cleaned < 1) {
+        printf("[FAIL] cleaner freed %d segments\n", cleaned);
+        return 1;
+    }
+    if (inode_of("f13") == keepInode) {
+        printf("[FAIL] f13's inode stayed at %d\n", keepInode);
+        return 1;
+    }
+    if (read_matches_fd("open across cleaning", keep, data + 13, 20 * EX_E - 13)) return 1;
+    for (int i = 1; i < 40; i += 2) {
+        char name[9];
+        snprintf(name, sizeof(name), "f%d", i);
+        if (read_matches_fd(name, tfs_openFile(name), data + i, 20 * EX_E - i)) return 1;
+    }
+    if (read_matches_fd("b after cleaning", b = tfs_openFile("b"), expect, 40 * EX_E)) return 1;
+    tfs_unmount();
+    if (check("fsck after cleaning", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+    tfs_mount((char *)fsname);
+    if (read_matches_fd("remounted", tfs_openFile("f39"), data + 39, 20 * EX_E - 39)) return 1;
+    tfs_unmount();
+
+    // 6) nothing to clean on other images
+    tfs_mkfsEx((char *)fsname, 1000 * BLOCKSIZE, TFS_MKFS_BITMAP);
+    tfs_mount((char *)fsname);
+    if (check("bitmap image", tfs_cleanLog(0, 0), 0)) return 1;
+    tfs_unmount();
+
+    free(expect);
+    printf("[PASS] log images append at the head and clean segments behind it\n");
+    return 0;
+}
@@ -0,0 +1,145 @@
+// test_mirror.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "test_util.h"
+
+#define VOLUME "mirror:test_mirror0.img,test_mirror1.img"
+#define NBLOCKS 2000
+
+// both images hold the same blocks
+static int same_images(const char *what) {
+    int a = openDisk("test_mirror0.img", 0), b = openDisk("test_mirror1.img", 0);
+    char *x = malloc(NBLOCKS * BLOCKSIZE), *y = malloc(NBLOCKS * BLOCKSIZE);
+    int bad = diskBlocks(a) != NBLOCKS || diskBlocks(b) != NBLOCKS ||
+              readBlocks(a, 0, NBLOCKS, x) != 0 || readBlocks(b, 0, NBLOCKS, y) != 0 ||
+              memcmp(x, y, NBLOCKS * BLOCKSIZE) != 0;
+    if (bad) printf("[FAIL] %s: the images differ\n", what);
+    closeDisk(a);
+    closeDisk(b);
+    free(x);
+    free(y);
+    return bad;
+}
+
+int main(void) {
+    static char data[200000];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 23 + i / 700);
+
+    // 1) every write lands on both images
+    if (check("mkfs", tfs_mkfs64(VOLUME, NBLOCKS * BLOCKSIZE), TFS_SUCCESS)) return 1;
+    tfs_mount(VOLUME);
+    tfs_writeFile(tfs_openFile("big"), data, sizeof(data));
+    tfs_writeFile(tfs_openFile("small"), data + 3, 1000);
+    tfs_unmount();
+    if (same_images("after writing")) return 1;
+    if (check("fsck one image", tfs_fsck("test_mirror1.img", 0, 1, NULL), 0)) return 1;
+
+    // 2) a long read is split over both, and comes back whole
+    int vol = openDisk(VOLUME, 0);
+    char *run = malloc(NBLOCKS * BLOCKSIZE), *one = malloc(NBLOCKS * BLOCKSIZE);
+    if (check("long read", readBlocks(vol, 0, NBLOCKS, run), 0)) return 1;
+    int a = openDisk("test_mirror0.img", 0);
+    readBlocks(a, 0, NBLOCKS, one);
+    closeDisk(a);
+    if (memcmp(run, one, NBLOCKS * BLOCKSIZE) != 0) {
+        printf("[FAIL] split read differs from the image\n");
+        return 1;
+    }
+
+    // 3) an image that fails is dropped and reads fail over to the other
+    if (truncate("test_mirror0.img", 10 * BLOCKSIZE) != 0) return 1;
+    memset(one, 0, NBLOCKS * BLOCKSIZE);
+    if (check("read past the failure", readBlocks(vol, 0, NBLOCKS, one), 0)) return 1;
+    if (memcmp(run, one, NBLOCKS * BLOCKSIZE) != 0) {
+        printf("[FAIL] failover read differs\n");
+        return 1;
+    }
+    if (check("failed image dropped", diskReplicaOk(vol, 0), 0)) return 1;
+    if (check("other image kept", diskReplicaOk(vol, 1), 1)) return 1;
+    char blk[BLOCKSIZE];
+    memset(blk, 'z', sizeof(blk));
+    if (check("write while degraded", writeBlock(vol, NBLOCKS - 1, blk), 0)) return 1;
+
+    // 4) resync brings it back with what it missed
+    int copied = diskResync(vol, 0);
+    if (copied <= 10) {   // the blocks past the first 10 that aren't all zeros
+        printf("[FAIL] resync copied %d blocks\n", copied);
+        return 1;
+    }
+    if (check("resynced image back", diskReplicaOk(vol, 0), 1)) return 1;
+    if (check("nothing left to copy", diskResync(vol, 0), 0)) return 1;
+    closeDisk(vol);
+    if (same_images("after resync")) return 1;
+    memset(blk, 0, sizeof(blk));
+    vol = openDisk(VOLUME, 0);
+    writeBlock(vol, NBLOCKS - 1, blk);
+    closeDisk(vol);
+
+    // 5) a replaced (missing) image: the volume mounts on the other one,
+    // then the blank image is filled in
+    unlink("test_mirror1.img");
+    if (check("mount degraded", tfs_mount(VOLUME), TFS_SUCCESS)) return 1;
+    if (read_matches("degraded", "big", data, sizeof(data))) return 1;
+    tfs_writeFile(tfs_openFile("later"), data + 9, 3000);
+    tfs_unmount();
+    vol = openDisk(VOLUME, 0);
+    if (check("missing image dropped", diskReplicaOk(vol, 1), 0)) return 1;
+    if (diskResync(vol, 1) <= 0) {
+        printf("[FAIL] resync of a replaced image copied nothing\n");
+        return 1;
+    }
+    closeDisk(vol);
+    if (same_images("after replacing")) return 1;
+    tfs_mount(VOLUME);
+    if (read_matches("replaced", "later", data + 9, 3000)) return 1;
+    tfs_unmount();
+    if (check("fsck volume", tfs_fsck(VOLUME, 0, 2, NULL), 0)) return 1;
+
+    // 6) an image that missed writes and is back in place by the next open
+    // (the same old file) stays dropped until it is resynced, reads don't get
+    // its old blocks
+    if (system("cp test_mirror1.img test_mirror_old.img") != 0) return 1;
+    vol = openDisk(VOLUME, 0);
+    if (truncate("test_mirror1.img", 10 * BLOCKSIZE) != 0) return 1;
+    if (check("read past the failure", readBlocks(vol, 0, NBLOCKS, one), 0)) return 1;
+    if (check("image 1 dropped", diskReplicaOk(vol, 1), 0)) return 1;
+    memset(blk, 'n', sizeof(blk));
+    if (check("write while degraded", writeBlock(vol, NBLOCKS - 1, blk), 0)) return 1;
+    closeDisk(vol);
+    if (rename("test_mirror_old.img", "test_mirror1.img") != 0) return 1;
+    vol = openDisk(VOLUME, 0);
+    if (check("stale image still dropped", diskReplicaOk(vol, 1), 0)) return 1;
+    for (int i = 0; i < 8; i++) {
+        char got[BLOCKSIZE];
+        if (readBlock(vol, NBLOCKS - 1, got) != 0 || memcmp(got, blk, BLOCKSIZE) != 0) {
+            printf("[FAIL] read %d got the stale image's block\n", i);
+            return 1;
+        }
+    }
+    if (check("resync the stale image", diskResync(vol, 1), 1)) return 1;
+    closeDisk(vol);
+    vol = openDisk(VOLUME, 0);
+    if (check("resynced image kept", diskReplicaOk(vol, 1), 1)) return 1;
+    if (check("other image kept", diskReplicaOk(vol, 0), 1)) return 1;
+    memset(blk, 0, sizeof(blk));
+    writeBlock(vol, NBLOCKS - 1, blk);
+    closeDisk(vol);
+    if (same_images("after the stale image")) return 1;
+    if (check("fsck after the stale image", tfs_fsck(VOLUME, 0, 2, NULL), 0)) return 1;
+
+    free(run);
+    free(one);
+    unlink("test_mirror0.img");
+    unlink("test_mirror1.img");
+    printf("[PASS] mirrored volumes write everywhere, fail over and resync\n");
+    return 0;
+}
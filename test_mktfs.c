@@ -0,0 +1,118 @@
+// test_mktfs.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libTinyFS.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "test_util.h"
+
+static int run_mktfs(const char *dir, const char *size, const char *image) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (size) execl("./mktfs", "mktfs", "-j", "3", "-s", size, "--from-dir", dir, image, (char *)NULL);
+        else execl("./mktfs", "mktfs", "--from-dir", dir, image, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void put(const char *path, const char *data, int len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write(fd, data, len);
+    close(fd);
+}
+
+int main(void) {
+    const char *dir = "test_mktfs.d";
+    const char *fsname = "test_mktfs.img";
+    static char data[70000];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 13 + i / 248);
+
+    // a small tree: files in subdirectories, an empty one, one a block exactly
+    system("rm -rf test_mktfs.d");
+    mkdir(dir, 0755);
+    mkdir("test_mktfs.d/sub", 0755);
+    mkdir("test_mktfs.d/sub/deep", 0755);
+    int sizes[] = { 70000, 248, 0, 1, 5000 };
+    const char *paths[] = { "test_mktfs.d/big", "test_mktfs.d/sub/exact", "test_mktfs.d/sub/empty",
+                            "test_mktfs.d/sub/deep/one", "test_mktfs.d/mid" };
+    const char *names[] = { "big", "sub/exact", "sub/empty", "sub/deep/one", "mid" };
+    for (int i = 0; i < 5; i++) put(paths[i], data + i, sizes[i]);
+
+    if (check("mktfs", run_mktfs(dir, "200000", fsname), 0)) return 1;
+    tfsFsckReport r;
+    if (check("fsck", tfs_fsck((char *)fsname, 0, 1, &r), 0)) return 1;
+    if (check("files", r.files, 5)) return 1;
+    if (check("directories", r.dirs, 2)) return 1;
+    // every file is one run
+    if (check("fragmented files", r.fragmentedFiles, 0)) return 1;
+
+    if (tfs_mount((char *)fsname) != TFS_SUCCESS) return 1;
+    static char back[70000];
+    for (int i = 0; i < 5; i++) {
+        fileDescriptor fd = tfs_openFile((char *)names[i]);
+        int got = sizes[i] ? tfs_readFile(fd, back, sizeof(back)) : 0;
+        if (check(names[i], got, sizes[i])) return 1;
+        if (memcmp(back, data + i, sizes[i]) != 0) {
+            printf("[FAIL] %s came back different\n", names[i]);
+            return 1;
+        }
+    }
+    tfsFileInfo infos[4];
+    if (check("sub listed", tfs_listDir("sub", infos, 4), 3)) return 1;
+    if (strcmp(infos[0].name, "deep") != 0 || strcmp(infos[2].name, "exact") != 0) {
+        printf("[FAIL] sub lists %s %s %s\n", infos[0].name, infos[1].name, infos[2].name);
+        return 1;
+    }
+    // the rest of -s is usable space
+    fileDescriptor nf = tfs_openFile("new");
+    if (check("write new file", tfs_writeFile(nf, data, 20000), TFS_SUCCESS)) return 1;
+    tfs_unmount();
+    if (check("fsck after use", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // names tinyFS can't hold are refused
+    put("test_mktfs.d/sub/toolongname", data, 10);
+    if (run_mktfs(dir, NULL, fsname) == 0) {
+        printf("[FAIL] mktfs took a 12 char name\n");
+        return 1;
+    }
+    unlink("test_mktfs.d/sub/toolongname");
+    mkdir("test_mktfs.d/longdirname", 0755);
+    if (run_mktfs(dir, NULL, fsname) == 0) {
+        printf("[FAIL] mktfs took an 11 char directory name\n");
+        return 1;
+    }
+    rmdir("test_mktfs.d/longdirname");
+
+    // one name in two directories is two files, and a directory with more
+    // entries than one B-tree node holds
+    put("test_mktfs.d/sub/deep/big", data + 7, 10);
+    mkdir("test_mktfs.d/many", 0755);
+    char path[64];
+    for (int i = 0; i < 300; i++) {
+        snprintf(path, sizeof(path), "test_mktfs.d/many/f%d", i);
+        put(path, data + i, i);
+    }
+    if (check("mktfs with a shared name", run_mktfs(dir, NULL, fsname), 0)) return 1;
+    if (check("fsck", tfs_fsck((char *)fsname, 0, 1, &r), 0)) return 1;
+    if (check("files", r.files, 306)) return 1;
+    tfs_mount((char *)fsname);
+    if (read_matches("top big", "big", data, 70000)) return 1;
+    if (read_matches("deep big", "sub/deep/big", data + 7, 10)) return 1;
+    if (read_matches("many", "many/f299", data + 299, 299)) return 1;
+    if (check("many listed", tfs_listDir("many", NULL, 0), 300)) return 1;
+    tfs_unmount();
+
+    system("rm -rf test_mktfs.d");
+    printf("[PASS] mktfs builds a contiguous image from a directory tree\n");
+    return 0;
+}
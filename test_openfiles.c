@@ -0,0 +1,87 @@
+// test_openfiles.c
+#include <stdio.h>
+#include <string.h>
+
+#include "libTinyFS.h"
+#include "TinyFS_errno.h"
+
+int main(void) {
+    const char *fsname = "test_openfiles.img";
+    char name[9];
+    fileDescriptor fds[100];
+
+    if (tfs_mkfs((char *)fsname, 400 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    if (tfs_mount((char *)fsname) != TFS_SUCCESS) return 1;
+
+    // 1) way more than the old limit of 20 open at once
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        fds[i] = tfs_openFile(name);
+        if (fds[i] < 0) {
+            printf("[FAIL] open #%d returned %d\n", i, fds[i]);
+            return 1;
+        }
+        if (tfs_writeFile(fds[i], name, (int)strlen(name)) != TFS_SUCCESS) return 1;
+    }
+    // already open files still come back with the same fd
+    if (tfs_openFile("f57") != fds[57]) {
+        printf("[FAIL] reopen didn't return the existing fd\n");
+        return 1;
+    }
+    // closed fds get reused
+    tfs_closeFile(fds[10]);
+    fileDescriptor again = tfs_openFile("f10");
+    if (again != fds[10]) {
+        printf("[FAIL] expected fd %d to be reused, got %d\n", fds[10], again);
+        return 1;
+    }
+
+    // 2) TFS_OPEN_NEWFD gives independent file pointers on one file
+    fileDescriptor a = tfs_openFileEx("shared", TFS_OPEN_NEWFD);
+    fileDescriptor b = tfs_openFileEx("shared", TFS_OPEN_NEWFD);
+    if (a < 0 || b < 0 || a == b) {
+        printf("[FAIL] NEWFD opens gave %d and %d\n", a, b);
+        return 1;
+    }
+    tfs_writeFile(a, "abcdef", 6);
+    char ca, cb;
+    tfs_seek(a, 3);
+    tfs_readByte(a, &ca);
+    tfs_readByte(b, &cb);
+    if (ca != 'd' || cb != 'a') {
+        printf("[FAIL] pointers not independent: a='%c' b='%c'\n", ca, cb);
+        return 1;
+    }
+    // closing one keeps the file open for the other
+    tfs_closeFile(a);
+    if (tfs_readByte(b, &cb) != TFS_SUCCESS || cb != 'b') {
+        printf("[FAIL] b lost the file when a closed\n");
+        return 1;
+    }
+    // deleting through one closes every fd on the file
+    fileDescriptor c = tfs_openFileEx("shared", TFS_OPEN_NEWFD);
+    if (tfs_deleteFile(c) != TFS_SUCCESS) return 1;
+    if (tfs_readByte(b, &cb) != ERR_FD_INVALID) {
+        printf("[FAIL] fd survived a delete through another fd\n");
+        return 1;
+    }
+
+    // 3) the table is cleared on the next mount
+    tfs_unmount();
+    tfs_mount((char *)fsname);
+    if (tfs_readByte(fds[3], &ca) != ERR_FD_INVALID) {
+        printf("[FAIL] fd from the last mount still valid\n");
+        return 1;
+    }
+    fileDescriptor fd = tfs_openFile("f99");
+    char buf[8] = {0};
+    if (tfs_readFile(fd, buf, sizeof(buf)) != 3 || strcmp(buf, "f99") != 0) {
+        printf("[FAIL] f99 read back '%s'\n", buf);
+        return 1;
+    }
+    tfs_unmount();
+
+    remove(fsname);
+    printf("[PASS] open file table grows, reuses fds and shares inodes\n");
+    return 0;
+}
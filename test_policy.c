@@ -0,0 +1,112 @@
+// test_policy.c
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+#include "test_util.h"
+
+static const char *fsname = "test_policy.img";
+static char data[40 * EX_E];
+
+// files written, half deleted, new ones in the gaps and the rest rewritten
+// bigger. returns how many files end up in more than one extent
+static int churn(const char *what, int policy) {
+    if (tfs_mkfsEx((char *)fsname, 6000 * BLOCKSIZE, TFS_MKFS_BITMAP) != TFS_SUCCESS) return -1;
+    tfs_mount((char *)fsname);
+    if (check(what, tfs_setAllocPolicy(policy), TFS_SUCCESS)) return -1;
+    char name[9];
+    for (int i = 0; i < 20; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        tfs_writeFile(tfs_openFile(name), data + i, (10 + i) * EX_E);
+    }
+    for (int i = 0; i < 20; i += 2) {
+        snprintf(name, sizeof(name), "f%d", i);
+        tfs_deleteFile(tfs_openFile(name));
+    }
+    for (int i = 0; i < 10; i++) {
+        snprintf(name, sizeof(name), "g%d", i);
+        tfs_writeFile(tfs_openFile(name), data + 2 * i, 15 * EX_E - i);
+    }
+    for (int i = 1; i < 20; i += 2) {
+        snprintf(name, sizeof(name), "f%d", i);
+        tfs_writeFile(tfs_openFile(name), data + 3 * i, 30 * EX_E);
+    }
+    for (int i = 1; i < 20; i += 2) {
+        snprintf(name, sizeof(name), "f%d", i);
+        if (read_matches(what, name, data + 3 * i, 30 * EX_E)) return -1;
+    }
+    tfsFragReport r;
+    if (check(what, tfs_fragReport(&r, NULL, 0), 20)) return -1;
+    tfs_unmount();
+    if (check(what, tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return -1;
+    return r.fragmentedFiles;
+}
+
+int main(void) {
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 29 + i / 300);
+
+    // 1) a fresh image is one free run and no files
+    if (tfs_mkfsEx((char *)fsname, 6000 * BLOCKSIZE, TFS_MKFS_BITMAP) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    tfsFragReport r;
+    if (check("fresh files", tfs_fragReport(&r, NULL, 0), 0)) return 1;
+    int meta = 2 + (6000 + BM_BITS - 1) / BM_BITS;
+    if (r.freeRuns != 1 || r.freeBlocks != 6000 - meta || r.largestFreeRun != 6000 - meta ||
+            r.freeRunHist[12] != 1 || r.extents != 0) {
+        printf("[FAIL] fresh report: %d runs, %lld free, largest %d\n", r.freeRuns, (long long)r.freeBlocks, r.largestFreeRun);
+        return 1;
+    }
+
+    // 2) near puts a file's data right behind its inode (and the root's
+    // directory node, made for its entry)
+    if (check("near", tfs_setAllocPolicy(TFS_ALLOC_NEAR), TFS_SUCCESS)) return 1;
+    tfs_writeFile(tfs_openFile("first"), data, 5 * EX_E);
+    tfs_writeFile(tfs_openFile("second"), data, 3 * EX_E);
+    tfsFileFrag files[4];
+    if (check("files", tfs_fragReport(&r, files, 1), 2)) return 1;
+    tfs_unmount();
+    int disk = openDisk((char *)fsname, 0);
+    inode_disk in;
+    readBlock(disk, files[0].inode_block, &in);
+    closeDisk(disk);
+    if (strcmp(files[0].name, "first") != 0 || files[0].blocks != 5 || files[0].extents != 1 ||
+            in.blk_start != files[0].inode_block + 2) {
+        printf("[FAIL] near: %s at %d, %d blocks in %d extents from %d\n", files[0].name,
+               files[0].inode_block, files[0].blocks, files[0].extents, in.blk_start);
+        return 1;
+    }
+
+    // 3) churn: the cache scatters rewritten files over what was freed,
+    // best-fit gives each write a run of its own
+    int scattered = churn("cache", TFS_ALLOC_CACHE);
+    int bestfit = churn("best-fit", TFS_ALLOC_BESTFIT);
+    int nextfit = churn("next-fit", TFS_ALLOC_NEXTFIT);
+    if (scattered < 0 || bestfit < 0 || nextfit < 0) return 1;
+    if (scattered == 0 || bestfit != 0 || nextfit > scattered) {
+        printf("[FAIL] fragmented files: cache %d, best-fit %d, next-fit %d\n", scattered, bestfit, nextfit);
+        return 1;
+    }
+
+    // 4) the policies need a bitmap image that isn't a log
+    tfs_mkfs((char *)fsname, 500 * BLOCKSIZE);
+    tfs_mount((char *)fsname);
+    if (check("chain image", tfs_setAllocPolicy(TFS_ALLOC_NEAR), ERR_NOT_SUPPORTED)) return 1;
+    if (check("default", tfs_setAllocPolicy(TFS_ALLOC_CACHE), TFS_SUCCESS)) return 1;
+    tfs_writeFile(tfs_openFile("x"), data, 4 * EX_E);
+    if (check("chain report", tfs_fragReport(&r, files, 4), 1)) return 1;
+    if (check("chain extents", files[0].extents, 1)) return 1;
+    tfs_unmount();
+    tfs_mkfsEx((char *)fsname, 1000 * BLOCKSIZE, TFS_MKFS_LOG);
+    tfs_mount((char *)fsname);
+    if (check("log image", tfs_setAllocPolicy(TFS_ALLOC_BESTFIT), ERR_NOT_SUPPORTED)) return 1;
+    if (check("bad policy", tfs_setAllocPolicy(9), ERR_NOT_SUPPORTED)) return 1;
+    tfs_unmount();
+
+    printf("[PASS] allocation policies place blocks and fragReport counts runs and extents\n");
+    return 0;
+}
@@ -0,0 +1,160 @@
+// test_shared.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libTinyFS.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+#include "test_util.h"
+
+#define PROCS 4
+#define ROUNDS 30
+
+static const char *fsname = "test_shared.img";
+static char data[40 * EX_E];
+
+static int size_of(int p, int i) {
+    return ((p * 7 + i * 11) % 25 + 1) * EX_E - p;
+}
+
+// one process: three files of its own rewritten over and over, one deleted
+// each round, checking each write reads back while the others write too
+static int writer(int p) {
+    if (tfs_mountEx((char *)fsname, TFS_MOUNT_SHARED) != TFS_SUCCESS) return 1;
+    char name[9];
+    for (int r = 0; r < ROUNDS; r++) {
+        snprintf(name, sizeof(name), "c%d_%d", p, r % 3);
+        if (tfs_writeFile(tfs_openFile(name), data + p + r, size_of(p, r)) != TFS_SUCCESS) return 1;
+        if (read_matches("writer", name, data + p + r, size_of(p, r))) return 1;
+        snprintf(name, sizeof(name), "c%d_%d", p, (r + 1) % 3);
+        fileDescriptor fd = tfs_openFile(name);
+        if (fd >= 0) tfs_deleteFile(fd);
+    }
+    return tfs_unmount() != TFS_SUCCESS;
+}
+
+static int churn(const char *what) {
+    fflush(stdout);
+    pid_t pids[PROCS];
+    for (int p = 0; p < PROCS; p++) {
+        pids[p] = fork();
+        if (pids[p] == 0) _exit(writer(p));
+    }
+    int failed = 0;
+    for (int p = 0; p < PROCS; p++) {
+        int status;
+        waitpid(pids[p], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    if (check(what, failed, 0)) return 1;
+    if (check(what, tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // each writer's last file is there whole, the one deleted after it isn't
+    tfs_mount((char *)fsname);
+    char name[9];
+    for (int p = 0; p < PROCS; p++) {
+        int r = ROUNDS - 1;
+        snprintf(name, sizeof(name), "c%d_%d", p, r % 3);
+        if (read_matches(what, name, data + p + r, size_of(p, r))) return 1;
+    }
+    tfsFileInfo infos[3 * PROCS + 1];
+    if (check(what, tfs_listDir("/", infos, 3 * PROCS + 1), 2 * PROCS)) return 1;
+    tfs_unmount();
+    return 0;
+}
+
+int main(void) {
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 31 + i / 400);
+
+    // 1) processes writing and deleting side by side leave a clean image,
+    // with a free chain and with a bitmap
+    if (tfs_mkfs((char *)fsname, 3000 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    if (churn("chain image")) return 1;
+    if (tfs_mkfsEx((char *)fsname, 3000 * BLOCKSIZE, TFS_MKFS_BITMAP) != TFS_SUCCESS) return 1;
+    if (churn("bitmap image")) return 1;
+
+    // 2) both mounted: what one writes the other reads, and the other way
+    // round. the child is forked before the parent mounts
+    int go[2], done[2];
+    if (pipe(go) != 0 || pipe(done) != 0) return 1;
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        char c;
+        if (read(go[0], &c, 1) != 1) _exit(1);
+        if (tfs_mountEx((char *)fsname, TFS_MOUNT_SHARED) != TFS_SUCCESS) _exit(1);
+        int bad = read_matches("child", "hello", data + 5, 3 * EX_E + 9);
+        bad |= tfs_writeFile(tfs_openFile("reply"), data + 8, 2 * EX_E) != TFS_SUCCESS;
+        if (write(done[1], "y", 1) != 1) bad = 1;
+        if (read(go[0], &c, 1) != 1) _exit(1);
+        bad |= tfs_unmount() != TFS_SUCCESS;
+        _exit(bad);
+    }
+    if (check("mount", tfs_mountEx((char *)fsname, TFS_MOUNT_SHARED), TFS_SUCCESS)) return 1;
+    tfs_writeFile(tfs_openFile("hello"), data + 5, 3 * EX_E + 9);
+    char c;
+    if (write(go[1], "g", 1) != 1 || read(done[0], &c, 1) != 1) return 1;
+    if (read_matches("parent", "reply", data + 8, 2 * EX_E)) return 1;
+    // between calls neither has blocks cached, the image is clean with both
+    // mounted and defrag can move what the other one wrote
+    if (check("fsck while mounted", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+    if (tfs_defragFs(0, 0) < 0) {
+        printf("[FAIL] defrag on a shared mount\n");
+        return 1;
+    }
+    if (read_matches("after defrag", "reply", data + 8, 2 * EX_E)) return 1;
+    if (write(go[1], "g", 1) != 1) return 1;
+    int status;
+    waitpid(child, &status, 0);
+    if (check("child", WIFEXITED(status) ? WEXITSTATUS(status) : -1, 0)) return 1;
+    tfs_unmount();
+    if (check("fsck", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // 3) another process deletes a file this one has open and writes a new
+    // one, likely into its blocks: the FD is invalid instead of writing over
+    // it. a rename is followed
+    if (tfs_mkfs((char *)fsname, 3000 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    if (pipe(go) != 0 || pipe(done) != 0) return 1;
+    fflush(stdout);
+    child = fork();
+    if (child == 0) {
+        if (read(go[0], &c, 1) != 1) _exit(1);
+        int mounted = tfs_mountEx((char *)fsname, TFS_MOUNT_SHARED) == TFS_SUCCESS;
+        fileDescriptor fa = tfs_openFile("a"), fr = tfs_openFile("r");
+        if (write(done[1], "y", 1) != 1 || !mounted || read(go[0], &c, 1) != 1) _exit(1);
+        int bad = check("write to a deleted file", tfs_write(fa, data + 9, 600), ERR_FD_INVALID);
+        bad |= read_matches_fd("renamed", fr, data + 1, 2 * EX_E);
+        tfsFileInfo info;
+        bad |= tfs_readFileInfo(fr, &info) != TFS_SUCCESS || strcmp(info.name, "s") != 0;
+        bad |= check("delete the renamed file", tfs_deleteFile(fr), TFS_SUCCESS);
+        bad |= tfs_unmount() != TFS_SUCCESS;
+        _exit(bad);
+    }
+    tfs_mountEx((char *)fsname, TFS_MOUNT_SHARED);
+    tfs_writeFile(tfs_openFile("a"), data, 3 * EX_E);
+    tfs_writeFile(tfs_openFile("r"), data + 1, 2 * EX_E);
+    if (write(go[1], "g", 1) != 1 || read(done[0], &c, 1) != 1) return 1;
+    tfs_deleteFile(tfs_openFile("a"));
+    tfs_writeFile(tfs_openFile("b"), data + 2, 5 * EX_E);
+    tfs_rename(tfs_openFile("r"), "s");
+    if (write(go[1], "g", 1) != 1) return 1;
+    waitpid(child, &status, 0);
+    if (check("child after delete", WIFEXITED(status) ? WEXITSTATUS(status) : -1, 0)) return 1;
+    if (read_matches("b", "b", data + 2, 5 * EX_E)) return 1;
+    if (check("only b left", tfs_listDir("/", NULL, 0), 1)) return 1;
+    tfs_unmount();
+    if (check("fsck after delete", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // 4) not with a log or dedup
+    if (check("dedup", tfs_mountEx((char *)fsname, TFS_MOUNT_SHARED | TFS_MOUNT_DEDUP), ERR_NOT_SUPPORTED)) return 1;
+    tfs_mkfsEx((char *)fsname, 1000 * BLOCKSIZE, TFS_MKFS_LOG);
+    if (check("log image", tfs_mountEx((char *)fsname, TFS_MOUNT_SHARED), ERR_NOT_SUPPORTED)) return 1;
+
+    printf("[PASS] processes share a mounted image through one lock\n");
+    return 0;
+}
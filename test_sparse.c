@@ -0,0 +1,141 @@
+// test_sparse.c
+#include <stdio.h>
+#include <string.h>
+
+#include "libTinyFS.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+
+static int free_blocks(const char *fsname) {
+    tfsFsckReport r;
+    int rc = tfs_fsck((char *)fsname, 0, 1, &r);
+    if (rc != 0) {
+        printf("[FAIL] fsck found %d problems\n", rc);
+        return -1;
+    }
+    return r.freeBlocks;
+}
+
+int main(void) {
+    const char *fsname = "test_sparse.img";
+    int64_t recSize = 100 * EX_E;   // a 100 block record file
+    char buf[512];
+
+    if (tfs_mkfs((char *)fsname, 400 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    int freeAtStart = free_blocks(fsname);
+
+    // 1) seek past EOF and write: only the written block and its index are used
+    tfs_mount((char *)fsname);
+    fileDescriptor fd = tfs_openFile("rec");
+    if (tfs_seek64(fd, recSize - 10) != TFS_SUCCESS) {
+        printf("[FAIL] seek past EOF refused\n");
+        return 1;
+    }
+    if (tfs_write(fd, "0123456789", 10) != 10) {
+        printf("[FAIL] tfs_write past EOF failed\n");
+        return 1;
+    }
+    tfs_unmount();
+    int used = freeAtStart - free_blocks(fsname);
+    if (used != 1 + 1 + 1 + 1) {   // root directory node, inode, index block, last data block
+        printf("[FAIL] sparse file used %d blocks\n", used);
+        return 1;
+    }
+
+    // 2) the hole reads back as zeros, the data where it was written
+    tfs_mount((char *)fsname);
+    fd = tfs_openFile("rec");
+    tfsFileInfo info;
+    tfs_readdirInfo(&info, 1);
+    if (info.size_B != recSize) {
+        printf("[FAIL] size %lld, expected %lld\n", (long long)info.size_B, (long long)recSize);
+        return 1;
+    }
+    memset(buf, 'x', sizeof(buf));
+    tfs_seek(fd, 50 * EX_E - 3);
+    if (tfs_readFile(fd, buf, 6) != 6 || memcmp(buf, "\0\0\0\0\0\0", 6) != 0) {
+        printf("[FAIL] hole didn't read back as zeros\n");
+        return 1;
+    }
+    tfs_seek64(fd, recSize - 12);
+    if (tfs_readFile(fd, buf, 20) != 12 || memcmp(buf, "\0\0" "0123456789", 12) != 0) {
+        printf("[FAIL] data at the end of the record file is wrong\n");
+        return 1;
+    }
+
+    // 3) writes in the middle keep the rest, and can straddle blocks
+    memset(buf, 'm', 500);
+    tfs_seek(fd, 10 * EX_E + 100);
+    if (tfs_write(fd, buf, 500) != 500) return 1;
+    tfs_seek(fd, 10 * EX_E + 99);
+    char c;
+    tfs_readByte(fd, &c);
+    if (c != 0) return 1;
+    tfs_readByte(fd, &c);
+    if (c != 'm') {
+        printf("[FAIL] write in the middle read back '%c'\n", c);
+        return 1;
+    }
+    tfs_seek64(fd, recSize - 10);
+    tfs_readByte(fd, &c);
+    if (c != '0') {
+        printf("[FAIL] middle write clobbered the end of the file\n");
+        return 1;
+    }
+
+    // 4) punching the middle write out gives its blocks back
+    if (tfs_punchHole(fd, 10 * EX_E, 2 * EX_E) != TFS_SUCCESS) return 1;
+    tfs_seek(fd, 11 * EX_E + 10);
+    tfs_readByte(fd, &c);
+    if (c != 0) {
+        printf("[FAIL] punched range still has data\n");
+        return 1;
+    }
+    // the part of the write in block 12 stays
+    tfs_seek(fd, 12 * EX_E);
+    tfs_readByte(fd, &c);
+    if (c != 'm') {
+        printf("[FAIL] punch went past its range\n");
+        return 1;
+    }
+    // partial punch inside a block zeros in place
+    tfs_punchHole(fd, recSize - 8, 3);
+    tfs_seek64(fd, recSize - 10);
+    if (tfs_readFile(fd, buf, 10) != 10 || memcmp(buf, "01\0\0\0" "56789", 10) != 0) {
+        printf("[FAIL] partial punch\n");
+        return 1;
+    }
+    tfs_unmount();
+    if (freeAtStart - free_blocks(fsname) != 1 + 1 + 2 + 2) {   // directory node, inode, 2 index blocks, blocks 12 and 99
+        printf("[FAIL] punch didn't free blocks\n");
+        return 1;
+    }
+
+    // 5) an ordinary chained file becomes mapped on its first tfs_write, and
+    // deleting a mapped file gives everything back
+    tfs_mount((char *)fsname);
+    fileDescriptor plain = tfs_openFile("plain");
+    memset(buf, 'p', sizeof(buf));
+    tfs_writeFile(plain, buf, 3 * EX_E);
+    tfs_seek(plain, EX_E);
+    tfs_write(plain, "Q", 1);
+    tfs_seek(plain, 0);
+    char back[3 * EX_E];
+    if (tfs_readFile(plain, back, sizeof(back)) != 3 * EX_E || back[EX_E] != 'Q' || back[EX_E + 1] != 'p') {
+        printf("[FAIL] chain to map conversion lost data\n");
+        return 1;
+    }
+    tfs_deleteFile(plain);
+    fd = tfs_openFile("rec");
+    tfs_deleteFile(fd);
+    tfs_unmount();
+    if (free_blocks(fsname) != freeAtStart) {
+        printf("[FAIL] deleting mapped files leaked blocks\n");
+        return 1;
+    }
+
+    remove(fsname);
+    printf("[PASS] sparse writes, holes read as zeros, punchHole frees blocks\n");
+    return 0;
+}
@@ -0,0 +1,101 @@
+// test_stripe.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "test_util.h"
+
+#define VOLUME "stripe:8:test_stripe0.img,test_stripe1.img,test_stripe2.img"
+
+static long long file_size(const char *name) {
+    struct stat st;
+    return stat(name, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+int main(void) {
+    static char data[300000], back[300000];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 17 + i / 1000);
+
+    // 1) the volume is whole stripes, each image a third of it
+    if (check("mkfs", tfs_mkfs64(VOLUME, 3000 * BLOCKSIZE), TFS_SUCCESS)) return 1;
+    int vol = openDisk(VOLUME, 0);
+    if (check("volume blocks", diskBlocks(vol), 3000 / 24 * 24)) return 1;
+    for (int i = 0; i < 3; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "test_stripe%d.img", i);
+        if (check("image size", file_size(name), 3000 / 24 * 8 * BLOCKSIZE)) return 1;
+    }
+
+    // 2) block b is in stripe unit b / 8, on image (b / 8) % 3
+    char blk[BLOCKSIZE], got[BLOCKSIZE];
+    memset(blk, 'q', sizeof(blk));
+    writeBlock(vol, 8 * 4 + 5, blk);    // unit 4: image 1, its unit 1
+    closeDisk(vol);
+    int one = openDisk("test_stripe1.img", 0);
+    readBlock(one, 8 + 5, got);
+    closeDisk(one);
+    if (memcmp(got, blk, BLOCKSIZE) != 0) {
+        printf("[FAIL] block 37 isn't at block 13 of the second image\n");
+        return 1;
+    }
+    memset(blk, 0, sizeof(blk));
+    vol = openDisk(VOLUME, 0);
+    writeBlock(vol, 8 * 4 + 5, blk);
+
+    // 3) a long run split over all three images reads back the same as
+    // block by block
+    char *run = malloc(500 * BLOCKSIZE), *single = malloc(500 * BLOCKSIZE);
+    for (int i = 0; i < 500 * BLOCKSIZE; i++) run[i] = (char)(i * 7);
+    if (check("writeBlocks", writeBlocks(vol, 1003, 500, run), 0)) return 1;
+    for (int i = 0; i < 500; i++) readBlock(vol, 1003 + i, single + i * BLOCKSIZE);
+    if (memcmp(run, single, 500 * BLOCKSIZE) != 0) {
+        printf("[FAIL] striped run differs from its single blocks\n");
+        return 1;
+    }
+    memset(single, 0, 500 * BLOCKSIZE);
+    if (check("readBlocks", readBlocks(vol, 1003, 500, single), 0)) return 1;
+    if (memcmp(run, single, 500 * BLOCKSIZE) != 0) {
+        printf("[FAIL] striped run reads back wrong\n");
+        return 1;
+    }
+    if (check("past the end", readBlocks(vol, 2990, 20, single), DISK_IO_ERR)) return 1;
+    free(run);
+    free(single);
+    closeDisk(vol);
+
+    // 4) a filesystem on it, mounted again from the descriptor
+    if (check("mkfs again", tfs_mkfs64(VOLUME, 3000 * BLOCKSIZE), TFS_SUCCESS)) return 1;
+    if (check("mount", tfs_mount(VOLUME), TFS_SUCCESS)) return 1;
+    fileDescriptor fd = tfs_openFile("big");
+    if (check("write", tfs_writeFile(fd, data, sizeof(data)), TFS_SUCCESS)) return 1;
+    tfs_unmount();
+    tfs_mount(VOLUME);
+    fd = tfs_openFile("big");
+    if (check("read", tfs_readFile(fd, back, sizeof(back)), sizeof(back))) return 1;
+    if (memcmp(back, data, sizeof(data)) != 0) {
+        printf("[FAIL] file on the volume reads back wrong\n");
+        return 1;
+    }
+    tfs_unmount();
+    if (check("fsck", tfs_fsck(VOLUME, 0, 2, NULL), 0)) return 1;
+
+    // 5) bad descriptors
+    if (check("no images", openDisk("stripe:8:", 0), OPEN_DISK_PARAM_ERR)) return 1;
+    if (check("no unit", openDisk("stripe:0:test_stripe0.img", 0), OPEN_DISK_PARAM_ERR)) return 1;
+    if (check("missing image", openDisk("stripe:8:test_stripe0.img,nothere.img", 0), OPEN_DISK_FILE_ERR)) return 1;
+
+    for (int i = 0; i < 3; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "test_stripe%d.img", i);
+        unlink(name);
+    }
+    printf("[PASS] striped volumes spread blocks over their images\n");
+    return 0;
+}
@@ -0,0 +1,166 @@
+// test_tfsd.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libTinyFS.h"
+#include "TinyFS_errno.h"
+#include "tfsClient.h"
+
+int main(void) {
+    const char *fsname = "test_tfsd.img";
+    const char *sock = "test_tfsd.sock";
+    int rc;
+
+    rc = tfs_mkfs((char *)fsname, 40 * BLOCKSIZE);
+    if (rc != TFS_SUCCESS) {
+        printf("tfs_mkfs failed: %d\n", rc);
+        return 1;
+    }
+    tfs_mount((char *)fsname);
+    tfs_mkdir("logs");
+    tfs_unmount();
+
+    pid_t server = fork();
+    if (server == 0) {
+        execl("./tfsd", "tfsd", sock, fsname, (char *)NULL);
+        perror("exec tfsd");
+        _exit(1);
+    }
+
+    // wait for the server to come up
+    tfsClient *a = NULL;
+    for (int i = 0; i < 50 && !a; i++) {
+        a = tfsc_connect(sock);
+        if (!a) usleep(20000);
+    }
+    tfsClient *b = tfsc_connect(sock);
+    if (!a || !b) {
+        printf("tfsc_connect failed\n");
+        kill(server, SIGTERM);
+        return 1;
+    }
+
+    // 1) plain calls, same semantics as libTinyFS
+    fileDescriptor fd = tfsc_openFile(a, "foo");
+    if (fd < 0) {
+        printf("tfsc_openFile failed: %d\n", fd);
+        goto fail;
+    }
+    const char *msg = "HelloTinyFS over a socket";
+    int len = (int)strlen(msg);
+    rc = tfsc_writeFile(a, fd, (char *)msg, len);
+    if (rc != TFS_SUCCESS) {
+        printf("tfsc_writeFile failed: %d\n", rc);
+        goto fail;
+    }
+    char buf[64] = {0};
+    rc = tfsc_readFile(a, fd, buf, sizeof(buf));
+    if (rc != len || strncmp(buf, msg, len) != 0) {
+        printf("tfsc_readFile got %d '%s'\n", rc, buf);
+        goto fail;
+    }
+    char c;
+    if (tfsc_readByte(a, fd, &c) != ERR_EOF) {
+        printf("expected EOF after reading the whole file\n");
+        goto fail;
+    }
+
+    // 2) a client can't use an fd it didn't open
+    if (tfsc_seek(b, fd, 0) != ERR_FD_INVALID) {
+        printf("client b was allowed to use client a's fd\n");
+        goto fail;
+    }
+
+    // 3) pipelined batch: seek + 3 byte reads + readdir in one round trip
+    char b0, b1, b2;
+    tfsFileInfo infos[4];
+    int rcs[5];
+    tfsc_batchBegin(a);
+    tfsc_seek(a, fd, 5);
+    tfsc_readByte(a, fd, &b0);
+    tfsc_readByte(a, fd, &b1);
+    tfsc_readByte(a, fd, &b2);
+    tfsc_readdirInfo(a, infos, 4);
+    rc = tfsc_batchEnd(a, rcs, 5);
+    if (rc != 5 || rcs[0] != TFS_SUCCESS || rcs[1] != 1 || rcs[4] != 2) {
+        printf("batch failed: rc=%d seek=%d read=%d readdir=%d\n", rc, rcs[0], rcs[1], rcs[4]);
+        goto fail;
+    }
+    if (b0 != 'T' || b1 != 'i' || b2 != 'n') {
+        printf("batch reads got '%c%c%c'\n", b0, b1, b2);
+        goto fail;
+    }
+    // the logs directory is listed too
+    int foo = strcmp(infos[0].name, "foo") == 0 ? 0 : 1;
+    if (strcmp(infos[foo].name, "foo") != 0 || infos[foo].size_B != len) {
+        printf("readdir got '%s' %lld bytes\n", infos[foo].name, (long long)infos[foo].size_B);
+        goto fail;
+    }
+
+    // 4) paths go over the wire whole. a delete reaches every fd on the
+    // file, however it was spelled and after a rename
+    fileDescriptor fa = tfsc_openFile(a, "logs/today");
+    fileDescriptor fb = tfsc_openFile(b, "/logs/today");
+    if (fa < 0 || fb < 0) {
+        printf("opening a path failed: %d %d\n", fa, fb);
+        goto fail;
+    }
+    tfsc_writeFile(a, fa, (char *)msg, len);
+    rc = tfsc_rename(a, fa, "logs/old");
+    if (rc != TFS_SUCCESS) {
+        printf("tfsc_rename to a path failed: %d\n", rc);
+        goto fail;
+    }
+    tfsc_seek(b, fb, 0);
+    memset(buf, 0, sizeof(buf));
+    if (tfsc_readFile(b, fb, buf, sizeof(buf)) != len || strncmp(buf, msg, len) != 0) {
+        printf("the other client's fd lost the file after the rename\n");
+        goto fail;
+    }
+    if (tfsc_deleteFile(b, fb) != TFS_SUCCESS || tfsc_seek(a, fa, 0) != ERR_FD_INVALID) {
+        printf("delete left the renamed file's other fd open\n");
+        goto fail;
+    }
+
+    // 5) a write too big for one message is refused before it is sent, and
+    // a batch whose replies outrun the socket still completes
+    static char big[6000];
+    memset(big, 'z', sizeof(big));
+    if (tfsc_writeFile(a, fd, big, 17 * 1024 * 1024) != ERR_FILE_TOO_BIG) {
+        printf("oversized write wasn't refused\n");
+        goto fail;
+    }
+    if (tfsc_writeFile(a, fd, big, sizeof(big)) != TFS_SUCCESS) {
+        printf("connection broken after an oversized write\n");
+        goto fail;
+    }
+    static char back[sizeof(big)];
+    static int many[20000];
+    tfsc_batchBegin(a);
+    for (int i = 0; i < 10000; i++) {
+        tfsc_seek(a, fd, 0);
+        tfsc_readFile(a, fd, back, sizeof(back));
+    }
+    rc = tfsc_batchEnd(a, many, 20000);
+    if (rc != 20000 || many[19999] != (int)sizeof(big) || memcmp(back, big, sizeof(big)) != 0) {
+        printf("big read batch failed: rc=%d last=%d\n", rc, many[19999]);
+        goto fail;
+    }
+
+    tfsc_closeFile(a, fd);
+    tfsc_disconnect(a);
+    tfsc_disconnect(b);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    printf("PASS: tfsd served open/write/read/readdir and a pipelined batch\n");
+    return 0;
+
+fail:
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return 1;
+}
@@ -0,0 +1,145 @@
+// test_upgrade.c
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+#include "test_util.h"
+
+static const char *fsname = "test_upgrade.img";
+static char data[60 * EX_E];
+
+static superblock_disk read_sb(void) {
+    superblock_disk sb;
+    int disk = openDisk((char *)fsname, 0);
+    readBlock(disk, SUPERBLOCK_BLOCK, &sb);
+    closeDisk(disk);
+    return sb;
+}
+
+static void write_sb(superblock_disk *sb) {
+    int disk = openDisk((char *)fsname, 0);
+    writeBlock(disk, SUPERBLOCK_BLOCK, sb);
+    closeDisk(disk);
+}
+
+int main(void) {
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 37 + i / 400);
+
+    // 1) a flat free chain image from before versions, with holes in the
+    // chain from deleted files
+    if (tfs_mkfs((char *)fsname, 3000 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    superblock_disk sb = read_sb();
+    sb.features = 0;
+    sb.version = 0;
+    write_sb(&sb);
+    int disk = openDisk((char *)fsname, 0);
+    inode_disk root;
+    readBlock(disk, ROOT_INODE_BLOCK, &root);
+    root.metaflags &= ~INODE_DIR;
+    writeBlock(disk, ROOT_INODE_BLOCK, &root);
+    closeDisk(disk);
+    tfs_mount((char *)fsname);
+    for (int i = 0; i < 20; i++) {
+        char name[9];
+        snprintf(name, sizeof(name), "f%d", i);
+        tfs_writeFile(tfs_openFile(name), data + i, (5 + i) * EX_E - i);
+    }
+    for (int i = 0; i < 20; i += 2) {
+        char name[9];
+        snprintf(name, sizeof(name), "f%d", i);
+        tfs_deleteFile(tfs_openFile(name));
+    }
+    tfsFileInfo f5;
+    tfs_readFileInfo(tfs_openFile("f5"), &f5);
+
+    // 2) not while anything is mounted
+    if (check("mounted", tfs_upgrade((char *)fsname, TFS_MKFS_BITMAP), ERR_ALREADY_MOUNTED)) return 1;
+    tfs_unmount();
+    disk = openDisk((char *)fsname, 0);
+    inode_disk in;
+    readBlock(disk, f5.inode_block, &in);
+    closeDisk(disk);
+    int f5Data = in.blk_start;
+
+    // 3) up to a 64 bit bitmap image in place: directory, bitmap, version,
+    // the files where they were
+    if (check("upgrade", tfs_upgrade((char *)fsname, TFS_MKFS_64 | TFS_MKFS_BITMAP), TFS_SUCCESS)) return 1;
+    sb = read_sb();
+    uint32_t want = TFS_FEAT_DIRS | TFS_FEAT_SIZE64 | TFS_FEAT_LAZYFREE | TFS_FEAT_BITMAP;
+    if (sb.features != want || sb.version != TFS_VERSION || sb.nblocks != 3000 ||
+            sb.bitmap_blocks != (3000 + BM_BITS - 1) / BM_BITS || sb.bitmap_start < 2) {
+        printf("[FAIL] upgraded superblock: features %x version %d, bitmap %d+%d\n",
+               sb.features, sb.version, sb.bitmap_start, sb.bitmap_blocks);
+        return 1;
+    }
+    if (check("fsck upgraded", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+    disk = openDisk((char *)fsname, 0);
+    readBlock(disk, f5.inode_block, &in);
+    closeDisk(disk);
+    if (check("f5 not moved", in.blk_start, f5Data)) return 1;
+    tfs_mount((char *)fsname);
+    if (check("root entries", tfs_readdirInfo(NULL, 0), 10)) return 1;
+    for (int i = 1; i < 20; i += 2) {
+        char name[9];
+        snprintf(name, sizeof(name), "f%d", i);
+        if (read_matches("upgraded", name, data + i, (5 + i) * EX_E - i)) return 1;
+    }
+
+    // 4) and it works like one made that way
+    if (check("policy", tfs_setAllocPolicy(TFS_ALLOC_BESTFIT), TFS_SUCCESS)) return 1;
+    tfs_writeFile(tfs_openFile("new"), data, 12 * EX_E);
+    tfs_deleteFile(tfs_openFile("f3"));
+    if (check("mkdir", tfs_mkdir("d"), TFS_SUCCESS)) return 1;
+    tfs_unmount();
+    if (check("fsck after use", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+    if (check("nothing left to do", tfs_upgrade((char *)fsname, TFS_MKFS_BITMAP), TFS_SUCCESS)) return 1;
+
+    // 5) on to the log
+    if (check("log", tfs_upgrade((char *)fsname, TFS_MKFS_LOG), TFS_SUCCESS)) return 1;
+    sb = read_sb();
+    if (!(sb.features & TFS_FEAT_LOG) || sb.log_head != sb.free_lazy) {
+        printf("[FAIL] log upgrade: features %x head %d free_lazy %d\n", sb.features, sb.log_head, sb.free_lazy);
+        return 1;
+    }
+    tfs_mount((char *)fsname);
+    tfs_writeFile(tfs_openFile("later"), data + 5, 7 * EX_E);
+    if (read_matches("log", "f7", data + 7, 12 * EX_E - 7)) return 1;
+    tfs_unmount();
+    if (check("fsck log", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // 6) a full chain image has nowhere to put the bitmap
+    if (tfs_mkfs((char *)fsname, 60 * BLOCKSIZE) != TFS_SUCCESS) return 1;
+    tfs_mount((char *)fsname);
+    tfs_writeFile(tfs_openFile("fill"), data, (60 - 4) * EX_E);
+    tfs_unmount();
+    if (check("full", tfs_upgrade((char *)fsname, TFS_MKFS_BITMAP), ERR_DISK_FULL)) return 1;
+    if (check("fsck full", tfs_fsck((char *)fsname, 0, 1, NULL), 0)) return 1;
+
+    // 7) newer versions and unknown incompatible features are refused,
+    // unknown compatible ones aren't
+    sb = read_sb();
+    sb.compat_features = 0x80000000;
+    write_sb(&sb);
+    if (check("unknown compat", tfs_mount((char *)fsname), TFS_SUCCESS)) return 1;
+    tfs_unmount();
+    sb.version = TFS_VERSION + 1;
+    write_sb(&sb);
+    if (check("newer version", tfs_mount((char *)fsname), ERR_FS_INVALID)) return 1;
+    if (tfs_fsck((char *)fsname, 0, 1, NULL) >= 0) {
+        printf("[FAIL] fsck took a newer version\n");
+        return 1;
+    }
+    sb.version = TFS_VERSION;
+    sb.features |= 0x40000000;
+    write_sb(&sb);
+    if (check("unknown feature", tfs_mount((char *)fsname), ERR_FS_INVALID)) return 1;
+    if (check("upgrade unknown", tfs_upgrade((char *)fsname, 0), ERR_FS_INVALID)) return 1;
+
+    printf("[PASS] old images upgrade in place and newer ones are refused\n");
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * test_util.h, helpers the test_*.c programs share. each prints a [FAIL]
+ * line and returns 1 when the check doesn't hold, 0 when it does.
+ */
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libTinyFS.h"
+
+static inline int check(const char *what, long long got, long long expected) {
+    if (got != expected) {
+        printf("[FAIL] %s: got %lld, expected %lld\n", what, got, expected);
+        return 1;
+    }
+    return 0;
+}
+
+// the file open as fd holds exactly size bytes of want
+static inline int read_matches_fd(const char *what, fileDescriptor fd, const char *want, int size) {
+    tfs_seek(fd, 0);
+    char *back = malloc(size + 1);
+    int rc = tfs_readFile(fd, back, size + 1);
+    int bad = rc != size || memcmp(back, want, size) != 0;
+    if (bad) printf("[FAIL] %s: reads back wrong (%d)\n", what, rc);
+    free(back);
+    return bad;
+}
+
+// same for the file at path, opened here
+static inline int read_matches(const char *what, const char *path, const char *want, int size) {
+    fileDescriptor fd = tfs_openFile((char *)path);
+    tfs_seek(fd, 0);
+    char *back = malloc(size + 1);
+    int rc = tfs_readFile(fd, back, size + 1);
+    int bad = rc != size || memcmp(back, want, size) != 0;
+    if (bad) printf("[FAIL] %s: %s reads back wrong (%d)\n", what, path, rc);
+    free(back);
+    return bad;
+}
+
+#endif
@@ -0,0 +1,131 @@
+// test_writeback.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libFsck.h"
+#include "TinyFS_errno.h"
+#include "blocktypes.h"
+#include "test_util.h"
+
+#define IMAGE "test_writeback.img"
+#define NBLOCKS 8000
+
+// block b as another open of the image sees it
+static int on_image(int b, char *out) {
+    int plain = openDisk(IMAGE, 0);
+    int rc = readBlock(plain, b, out);
+    closeDisk(plain);
+    return rc;
+}
+
+int main(void) {
+    static char data[40 * EX_E];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 13 + i / 900);
+    char blk[BLOCKSIZE], got[BLOCKSIZE], zero[BLOCKSIZE];
+    memset(zero, 0, sizeof(zero));
+
+    // 1) a write stays in memory: this open reads it, the image doesn't have it
+    unlink(IMAGE);
+    closeDisk(openDisk64(IMAGE, (int64_t)NBLOCKS * BLOCKSIZE));
+    int disk = openDiskEx(IMAGE, 0, DISK_WRITEBACK);
+    if (disk < 0) return 1;
+    memset(blk, 'a', sizeof(blk));
+    if (check("write", writeBlock(disk, 10, blk), 0)) return 1;
+    readBlock(disk, 10, got);
+    if (check("read back", memcmp(got, blk, BLOCKSIZE), 0)) return 1;
+    on_image(10, got);
+    if (check("held back", memcmp(got, zero, BLOCKSIZE), 0)) return 1;
+    if (check("dirty", diskDirtyBlocks(disk), 1)) return 1;
+
+    // 2) the flusher writes it once it has been dirty long enough
+    if (check("tune", diskWriteback(disk, 50, 0), 0)) return 1;
+    for (int i = 0; i < 200 && diskDirtyBlocks(disk) > 0; i++) usleep(10000);
+    if (check("expired", diskDirtyBlocks(disk), 0)) return 1;
+    on_image(10, got);
+    if (check("flushed", memcmp(got, blk, BLOCKSIZE), 0)) return 1;
+    int plain = openDisk(IMAGE, 0);
+    if (check("tune plain disk", diskWriteback(plain, 50, 0), OPEN_DISK_PARAM_ERR)) return 1;
+    closeDisk(plain);
+
+    // 3) a long run read sees dirty blocks over what the image holds, and a
+    // discarded one is dropped
+    diskWriteback(disk, 60000, 100);
+    memset(blk, 'b', sizeof(blk));
+    writeBlock(disk, 12, blk);
+    writeBlock(disk, 14, blk);
+    char *run = malloc((size_t)NBLOCKS * BLOCKSIZE), *image = malloc((size_t)NBLOCKS * BLOCKSIZE);
+    readBlocks(disk, 8, 8, run);
+    if (memcmp(run + 2 * BLOCKSIZE, "aaaa", 4) != 0 || memcmp(run + 4 * BLOCKSIZE, "bbbb", 4) != 0 ||
+            memcmp(run + 6 * BLOCKSIZE, "bbbb", 4) != 0 || memcmp(run + 5 * BLOCKSIZE, zero, BLOCKSIZE) != 0) {
+        printf("[FAIL] run read misses the dirty blocks\n");
+        return 1;
+    }
+    discardBlocks(disk, 14, 1);
+    if (check("discarded", diskDirtyBlocks(disk), 1)) return 1;
+
+    // 4) more blocks than the table holds, written out of order: writers
+    // flush it themselves when it fills, sync writes the rest
+    for (int i = 0; i < NBLOCKS * BLOCKSIZE; i++) run[i] = (char)(i * 7 + i / 5000);
+    for (int k = 0; k < NBLOCKS; k++) {
+        int b = (int)(((long long)k * 4999) % NBLOCKS);
+        if (writeBlock(disk, b, run + (size_t)b * BLOCKSIZE) != 0) {
+            printf("[FAIL] write %d of the table overflow\n", b);
+            return 1;
+        }
+    }
+    if (diskDirtyBlocks(disk) <= 0 || diskDirtyBlocks(disk) >= NBLOCKS) {
+        printf("[FAIL] %d dirty after overflowing the table\n", diskDirtyBlocks(disk));
+        return 1;
+    }
+    readBlocks(disk, 0, NBLOCKS, image);
+    if (check("whole read", memcmp(run, image, (size_t)NBLOCKS * BLOCKSIZE), 0)) return 1;
+    if (check("sync", diskSync(disk), 0)) return 1;
+    if (check("synced", diskDirtyBlocks(disk), 0)) return 1;
+    plain = openDisk(IMAGE, 0);
+    readBlocks(plain, 0, NBLOCKS, image);
+    closeDisk(plain);
+    if (check("image after sync", memcmp(run, image, (size_t)NBLOCKS * BLOCKSIZE), 0)) return 1;
+
+    // 5) close writes what is still dirty
+    writeBlock(disk, 77, zero);
+    if (check("close", closeDisk(disk), 0)) return 1;
+    on_image(77, got);
+    if (check("written at close", memcmp(got, zero, BLOCKSIZE), 0)) return 1;
+    free(run);
+    free(image);
+
+    // 6) a mount with it: files read back while held back, fsync and
+    // unmount leave a clean image
+    if (tfs_mkfsEx(IMAGE, 3000 * BLOCKSIZE, TFS_MKFS_BITMAP) != TFS_SUCCESS) return 1;
+    if (check("mount", tfs_mountEx(IMAGE, TFS_MOUNT_WRITEBACK), TFS_SUCCESS)) return 1;
+    fileDescriptor fd = tfs_openFile("big");
+    if (check("writeFile", tfs_writeFile(fd, data, sizeof(data)), TFS_SUCCESS)) return 1;
+    if (read_matches_fd("held back", fd, data, sizeof(data))) return 1;
+    tfs_writeFile(tfs_openFile("small"), data + 5, 300);
+    if (check("fsync", tfs_fsync(fd), TFS_SUCCESS)) return 1;
+    if (check("fsync bad fd", tfs_fsync(999), ERR_FD_INVALID)) return 1;
+    tfs_mkdir("logs");
+    fileDescriptor log = tfs_openFile("logs/today");
+    for (int i = 0; i < 20; i++) {
+        if (check("append", tfs_write(log, data + i * 100, 100), 100)) return 1;
+    }
+    if (check("sync", tfs_sync(), TFS_SUCCESS)) return 1;
+    if (check("unmount", tfs_unmount(), TFS_SUCCESS)) return 1;
+    if (check("fsck", tfs_fsck(IMAGE, 0, 1, NULL), 0)) return 1;
+    tfs_mount(IMAGE);
+    if (read_matches_fd("remounted", tfs_openFile("big"), data, sizeof(data))) return 1;
+    if (read_matches_fd("appended", tfs_openFile("logs/today"), data, 2000)) return 1;
+    tfs_unmount();
+
+    // 7) not with a shared mount, nothing to sync without a mount
+    if (check("shared", tfs_mountEx(IMAGE, TFS_MOUNT_SHARED | TFS_MOUNT_WRITEBACK), ERR_NOT_SUPPORTED)) return 1;
+    if (check("not mounted", tfs_sync(), ERR_NOT_MOUNTED)) return 1;
+
+    printf("[PASS] writeback holds block writes back and flushes them in order\n");
+    return 0;
+}
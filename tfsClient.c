@@ -0,0 +1,247 @@
+/*
+*
+* tfsClient.c : client side of the tfsd protocol
+*
+*/
+
+#define _GNU_SOURCE
+#include "tfsClient.h"
+#include "tfsProto.h"
+#include "TinyFS_errno.h"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//a request that has been queued but whose reply hasn't been read yet
+typedef struct pending {
+	uint32_t seq;
+	uint8_t op;
+	void *dst;		//where a READ/READDIR payload goes
+	int dstMax;
+} pending;
+
+struct tfsClient {
+	int sock;
+	uint32_t seq;
+	int batching;
+	char *out;		//requests not sent yet
+	size_t outLen, outCap;
+	pending *pend;
+	int npend, cappend;
+};
+
+static int grow(char **buf, size_t *cap, size_t need) {
+	if(need <= *cap) return 0;
+	size_t ncap = *cap ? *cap : 4096;
+	while(ncap < need) ncap *= 2;
+	char *nb = realloc(*buf, ncap);
+	if(!nb) return -1;
+	*buf = nb;
+	*cap = ncap;
+	return 0;
+}
+
+static int read_all(int sock, void *buf, size_t len) {
+	char *p = buf;
+	while(len > 0) {
+		ssize_t n = read(sock, p, len);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+tfsClient *tfsc_connect(const char *path) {
+	if(!path) return NULL;
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path)) return NULL;
+	strcpy(addr.sun_path, path);
+
+	int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(s < 0) return NULL;
+	if(connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(s);
+		return NULL;
+	}
+	tfsClient *c = calloc(1, sizeof(tfsClient));
+	if(!c) { close(s); return NULL; }
+	c->sock = s;
+	return c;
+}
+
+int tfsc_disconnect(tfsClient *c) {
+	if(!c) return ERR_FS_INVALID;
+	int rc = close(c->sock) == 0 ? TFS_SUCCESS : ERR_DISK_CLOSE;
+	free(c->out);
+	free(c->pend);
+	free(c);
+	return rc;
+}
+
+//reads the reply for p, copying any payload into p->dst
+static int recv_reply(tfsClient *c, pending *p) {
+	tfsp_resp resp;
+	if(read_all(c->sock, &resp, sizeof(resp)) < 0) return ERR_DISK_READ;
+	if(resp.magic != TFSP_MAGIC || resp.seq != p->seq) return ERR_FS_INVALID;
+
+	char *payload = NULL;
+	if(resp.len > 0) {
+		payload = malloc(resp.len);
+		if(!payload) return ERR_BUF;
+		if(read_all(c->sock, payload, resp.len) < 0) { free(payload); return ERR_DISK_READ; }
+	}
+	if(p->op == TFSP_READ && p->dst) {
+		memcpy(p->dst, payload, resp.len < (uint32_t)p->dstMax ? resp.len : (uint32_t)p->dstMax);
+	}
+	if(p->op == TFSP_READDIR && p->dst) {
+		tfsFileInfo *infos = p->dst;
+		tfsp_dirent *ents = (tfsp_dirent *)payload;
+		int n = resp.len / sizeof(tfsp_dirent);
+		for(int i = 0; i < n && i < p->dstMax; i++) {
+			memcpy(infos[i].name, ents[i].name, sizeof(infos[i].name));
+			infos[i].size_B = ents[i].size_B;
+			infos[i].inode_block = ents[i].inode_block;
+			infos[i].ctime = ents[i].ctime;
+			infos[i].mtime = ents[i].mtime;
+			infos[i].atime = ents[i].atime;
+		}
+	}
+	free(payload);
+	return resp.rc;
+}
+
+//reads reply i into rcs, 0 or the error that broke the stream
+static int take_reply(tfsClient *c, int i, int *rcs, int max) {
+	int rc = recv_reply(c, &c->pend[i]);
+	if(i < max) rcs[i] = rc;
+	//anything that isn't a libTinyFS return value means the stream is broken
+	return rc == ERR_DISK_READ || rc == ERR_FS_INVALID ? rc : 0;
+}
+
+//sends everything queued and collects the replies in order. replies are
+//taken while the batch is still going out, tfsd stops reading requests while
+//too many of them are waiting on us
+static int run_queue(tfsClient *c, int *rcs, int max) {
+	int n = c->npend, i = 0;
+	int err = 0;
+	size_t off = 0;
+	while(off < c->outLen && !err) {
+		struct pollfd pfd = { c->sock, POLLOUT | (i < n ? POLLIN : 0), 0 };
+		if(poll(&pfd, 1, -1) < 0) {
+			if(errno != EINTR) err = ERR_DISK_WRITE;
+			continue;
+		}
+		if(pfd.revents & POLLIN) {
+			err = take_reply(c, i++, rcs, max);
+		}else if(pfd.revents & POLLOUT) {
+			ssize_t w = send(c->sock, c->out + off, c->outLen - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(w >= 0) off += w;
+			else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) err = ERR_DISK_WRITE;
+		}else{
+			err = ERR_DISK_WRITE;
+		}
+	}
+	c->outLen = 0;
+	for(; i < n && !err; i++) err = take_reply(c, i, rcs, max);
+	c->npend = 0;
+	return err ? err : n;
+}
+
+static int call(tfsClient *c, uint8_t op, int fd, int arg, const void *payload, uint32_t len,
+		void *dst, int dstMax) {
+	if(!c) return ERR_FS_INVALID;
+	if(grow(&c->out, &c->outCap, c->outLen + sizeof(tfsp_req) + len) < 0) return ERR_BUF;
+	if(c->npend == c->cappend) {
+		int ncap = c->cappend ? c->cappend * 2 : 16;
+		pending *np = realloc(c->pend, ncap * sizeof(pending));
+		if(!np) return ERR_BUF;
+		c->pend = np;
+		c->cappend = ncap;
+	}
+	tfsp_req req = {0};
+	req.magic = TFSP_MAGIC;
+	req.op = op;
+	req.seq = c->seq++;
+	req.fd = fd;
+	req.arg = arg;
+	req.len = len;
+	memcpy(c->out + c->outLen, &req, sizeof(req));
+	if(len) memcpy(c->out + c->outLen + sizeof(req), payload, len);
+	c->outLen += sizeof(req) + len;
+
+	pending *p = &c->pend[c->npend++];
+	p->seq = req.seq;
+	p->op = op;
+	p->dst = dst;
+	p->dstMax = dstMax;
+
+	if(c->batching) return TFS_SUCCESS;
+	int rc = 0;
+	int n = run_queue(c, &rc, 1);
+	return n < 0 ? n : rc;
+}
+
+fileDescriptor tfsc_openFile(tfsClient *c, char *name) {
+	if(!name) return ERR_FILE_NAME;
+	if(strlen(name) == 0 || strlen(name) > TFSP_MAX_PATH) return ERR_FILE_NAME;
+	return call(c, TFSP_OPEN, -1, 0, name, strlen(name), NULL, 0);
+}
+
+int tfsc_closeFile(tfsClient *c, fileDescriptor FD) {
+	return call(c, TFSP_CLOSE, FD, 0, NULL, 0, NULL, 0);
+}
+
+int tfsc_writeFile(tfsClient *c, fileDescriptor FD, char *buffer, int size) {
+	if(size < 0 || (!buffer && size > 0)) return ERR_DISK_WRITE;
+	//one message carries the whole file, tfsd drops anything bigger
+	if(size > TFSP_MAX_PAYLOAD) return ERR_FILE_TOO_BIG;
+	return call(c, TFSP_WRITE, FD, 0, buffer, size, NULL, 0);
+}
+
+int tfsc_deleteFile(tfsClient *c, fileDescriptor FD) {
+	return call(c, TFSP_DELETE, FD, 0, NULL, 0, NULL, 0);
+}
+
+int tfsc_readByte(tfsClient *c, fileDescriptor FD, char *buffer) {
+	if(!buffer) return ERR_BUF;
+	int rc = call(c, TFSP_READ, FD, 1, NULL, 0, buffer, 1);
+	return rc == 1 ? TFS_SUCCESS : rc;
+}
+
+int tfsc_readFile(tfsClient *c, fileDescriptor FD, char *buffer, int size) {
+	if(!buffer || size < 0) return ERR_BUF;
+	return call(c, TFSP_READ, FD, size, NULL, 0, buffer, size);
+}
+
+int tfsc_seek(tfsClient *c, fileDescriptor FD, int offset) {
+	return call(c, TFSP_SEEK, FD, offset, NULL, 0, NULL, 0);
+}
+
+int tfsc_readdirInfo(tfsClient *c, tfsFileInfo *infos, int max) {
+	if(!infos && max > 0) return ERR_BUF;
+	return call(c, TFSP_READDIR, -1, max, NULL, 0, infos, max);
+}
+
+int tfsc_rename(tfsClient *c, fileDescriptor FD, char *newName) {
+	if(!newName) return ERR_FILE_NAME;
+	if(strlen(newName) == 0 || strlen(newName) > TFSP_MAX_PATH) return ERR_FILE_NAME;
+	return call(c, TFSP_RENAME, FD, 0, newName, strlen(newName), NULL, 0);
+}
+
+int tfsc_batchBegin(tfsClient *c) {
+	if(!c) return ERR_FS_INVALID;
+	c->batching = 1;
+	return TFS_SUCCESS;
+}
+
+int tfsc_batchEnd(tfsClient *c, int *rcs, int max) {
+	if(!c) return ERR_FS_INVALID;
+	if(!rcs) max = 0;
+	c->batching = 0;
+	return run_queue(c, rcs, max);
+}
@@ -0,0 +1,53 @@
+#ifndef TFSCLIENT_H
+#define TFSCLIENT_H
+/*
+ *
+ * tfsClient header, talks to a tfsd server instead of mounting the image
+ * in this process. calls mirror libTinyFS.h and return the same values
+ * and error codes, with the connection as an extra first argument.
+ *
+ */
+
+#include "libTinyFS.h"
+
+typedef struct tfsClient tfsClient;
+
+/* connects to the tfsd socket at path, NULL on failure */
+tfsClient *tfsc_connect(const char *path);
+
+/* closes the connection, the server closes any fds this client left open */
+int tfsc_disconnect(tfsClient *c);
+
+fileDescriptor tfsc_openFile(tfsClient *c, char *name);
+
+int tfsc_closeFile(tfsClient *c, fileDescriptor FD);
+
+/* the whole content goes in one message, more than TFSP_MAX_PAYLOAD (16 MB)
+is ERR_FILE_TOO_BIG */
+int tfsc_writeFile(tfsClient *c, fileDescriptor FD, char *buffer, int size);
+
+int tfsc_deleteFile(tfsClient *c, fileDescriptor FD);
+
+int tfsc_readByte(tfsClient *c, fileDescriptor FD, char *buffer);
+
+int tfsc_readFile(tfsClient *c, fileDescriptor FD, char *buffer, int size);
+
+int tfsc_seek(tfsClient *c, fileDescriptor FD, int offset);
+
+int tfsc_readdirInfo(tfsClient *c, tfsFileInfo *infos, int max);
+
+int tfsc_rename(tfsClient *c, fileDescriptor FD, char *newName);
+
+/* Pipelining. After tfsc_batchBegin() the calls above only queue their
+request and return TFS_SUCCESS right away; buffers passed to read calls
+must stay valid until the batch ends. tfsc_batchEnd() sends the whole
+batch in one write, waits for every reply, fills in the read buffers and
+stores each reply's rc in rcs[] (in call order, up to max). Reads report
+the byte count there, everything else the libTinyFS return value.
+It returns the number of calls in the batch or a negative error if the
+connection failed. */
+int tfsc_batchBegin(tfsClient *c);
+
+int tfsc_batchEnd(tfsClient *c, int *rcs, int max);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * tfsProto.h, wire protocol between tfsd and the client library (tfsClient.c)
+ *
+ * every message is a fixed header followed by len bytes of payload.
+ * integers are host order, the socket is a local unix socket so both
+ * ends are always the same machine.
+ *
+ * requests carry a seq number that is echoed back in the reply. the
+ * server answers requests strictly in the order it read them, so a client
+ * can write many requests back to back (pipelining) and match replies up
+ * by seq without waiting on each round trip.
+ */
+#ifndef TFSPROTO_H
+#define TFSPROTO_H
+#include <stdint.h>
+
+#define TFSP_MAGIC 0x54
+
+//max payload we accept in one message, guards against garbage lengths
+#define TFSP_MAX_PAYLOAD (16 * 1024 * 1024)
+//longest path an open or rename may carry
+#define TFSP_MAX_PATH 4096
+
+typedef enum {
+	TFSP_OPEN = 1,		//payload: path			rc: fd
+	TFSP_CLOSE = 2,		//fd				rc: status
+	TFSP_WRITE = 3,		//fd, payload: file content	rc: status
+	TFSP_READ = 4,		//fd, arg: max bytes		rc: bytes, payload: data
+	TFSP_SEEK = 5,		//fd, arg: offset		rc: status
+	TFSP_DELETE = 6,	//fd				rc: status
+	TFSP_READDIR = 7,	//arg: max entries		rc: count, payload: tfsp_dirent[]
+	TFSP_RENAME = 8		//fd, payload: new path		rc: status
+} tfsp_op;
+
+typedef struct tfsp_req {
+	uint8_t magic;		//TFSP_MAGIC
+	uint8_t op;		//tfsp_op
+	uint16_t reserved;
+	uint32_t seq;		//echoed in the reply
+	int32_t fd;
+	int32_t arg;
+	uint32_t len;		//payload bytes following this header
+} tfsp_req;
+
+typedef struct tfsp_resp {
+	uint8_t magic;		//TFSP_MAGIC
+	uint8_t op;		//op of the request this answers
+	uint16_t reserved;
+	uint32_t seq;
+	int32_t rc;		//same return value the libTinyFS call gave
+	uint32_t len;		//payload bytes following this header
+} tfsp_resp;
+
+typedef struct tfsp_dirent {
+	char name[9];
+	uint8_t reserved[7];
+	int64_t size_B;
+	int32_t inode_block;
+	int32_t ctime;
+	int32_t mtime;
+	int32_t atime;
+} tfsp_dirent;
+
+#endif
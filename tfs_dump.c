@@ -0,0 +1,46 @@
+/*
+ *
+ * tfs_dump.c : command line front end for tfs_dump()/tfs_restore()
+ *
+ * usage: tfs_dump [-c] <image> > stream     dump an unmounted image
+ *        tfs_dump -r <image> < stream       restore it
+ *   -c  add a checksum to the stream
+ *
+ * exit status: 0 ok, 1 error
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libDump.h"
+
+int main(int argc, char **argv) {
+	int flags = 0, restore = 0, opt;
+	while((opt = getopt(argc, argv, "cr")) != -1) {
+		switch(opt) {
+		case 'c': flags |= TFS_DUMP_CHECKSUM; break;
+		case 'r': restore = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-c] <image> > stream | %s -r <image> < stream\n", argv[0], argv[0]);
+			return 1;
+		}
+	}
+	if(optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-c] <image> > stream | %s -r <image> < stream\n", argv[0], argv[0]);
+		return 1;
+	}
+	if(!restore && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "tfs_dump: not writing a dump to a terminal\n");
+		return 1;
+	}
+	int rc = restore ? tfs_restore(STDIN_FILENO, argv[optind]) : tfs_dump(argv[optind], STDOUT_FILENO, flags);
+	if(rc < 0) {
+		fprintf(stderr, "tfs_dump: %s: %s failed (%d)\n", argv[optind], restore ? "restore" : "dump", rc);
+		return 1;
+	}
+	fprintf(stderr, "%s: %d blocks in use %s\n", argv[optind], rc, restore ? "restored" : "dumped");
+	return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ *
+ * tfs_fsck.c : command line front end for tfs_fsck()
+ *
+ * usage: tfs_fsck [-r] [-v] [-d] [-j threads] <image>
+ *   -r  repair what is found
+ *   -v  print every problem
+ *   -d  O_DIRECT reads, don't fill the page cache with the image
+ *   -j  scanner threads (default one per CPU)
+ *
+ * exit status: 0 clean, 1 problems repaired, 4 problems left, 8 error
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libFsck.h"
+
+int main(int argc, char **argv) {
+	int flags = 0, threads = 0, opt;
+	while((opt = getopt(argc, argv, "rvdj:")) != -1) {
+		switch(opt) {
+		case 'r': flags |= TFS_FSCK_REPAIR; break;
+		case 'v': flags |= TFS_FSCK_VERBOSE; break;
+		case 'd': flags |= TFS_FSCK_DIRECT; break;
+		case 'j': threads = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-r] [-v] [-d] [-j threads] <image>\n", argv[0]);
+			return 8;
+		}
+	}
+	if(optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-r] [-v] [-d] [-j threads] <image>\n", argv[0]);
+		return 8;
+	}
+
+	tfsFsckReport report;
+	int rc = tfs_fsck(argv[optind], flags, threads, &report);
+	if(rc < 0) {
+		fprintf(stderr, "tfs_fsck: %s: check failed (%d)\n", argv[optind], rc);
+		return 8;
+	}
+	if(rc == 0 || !(flags & TFS_FSCK_REPAIR)) {
+		printf("%s: %s\n", argv[optind], rc == 0 ? "clean" : "has problems");
+		tfs_fsckPrint(&report);
+		return rc == 0 ? 0 : 4;
+	}
+	//repair doesn't fix everything (broken directory trees stay), so check
+	//again and only call it repaired if nothing is left
+	tfsFsckReport after;
+	int left = tfs_fsck(argv[optind], flags & ~(TFS_FSCK_REPAIR | TFS_FSCK_VERBOSE), threads, &after);
+	if(left < 0) {
+		fprintf(stderr, "tfs_fsck: %s: check after repair failed (%d)\n", argv[optind], left);
+		return 8;
+	}
+	//repaired shows what was found, problems left what is still there
+	after.repaired = report.repaired;
+	printf("%s: %s\n", argv[optind], left == 0 ? "repaired" : "problems left");
+	tfs_fsckPrint(left == 0 ? &report : &after);
+	return left == 0 ? 1 : 4;
+}
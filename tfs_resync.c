@@ -0,0 +1,52 @@
+/*
+ *
+ * tfs_resync.c : rebuilds one image of a mirrored volume from the others
+ *
+ * usage: tfs_resync [-d] <mirror:image,image,...> <replica>
+ *   -d  O_DIRECT I/O on the images
+ *
+ * replica is the image's place in the descriptor, counting from 0. it is
+ * created if it is missing (a replaced device) and only the blocks that
+ * differ from the other images are written. run it on an unmounted volume.
+ *
+ * exit status: 0 ok, 1 error
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libDisk.h"
+
+int main(int argc, char **argv) {
+	int flags = 0, opt;
+	while((opt = getopt(argc, argv, "d")) != -1) {
+		switch(opt) {
+		case 'd': flags |= DISK_DIRECT; break;
+		default:
+			fprintf(stderr, "usage: %s [-d] <mirror:image,image,...> <replica>\n", argv[0]);
+			return 1;
+		}
+	}
+	if(optind != argc - 2 || strncmp(argv[optind], "mirror:", 7) != 0) {
+		fprintf(stderr, "usage: %s [-d] <mirror:image,image,...> <replica>\n", argv[0]);
+		return 1;
+	}
+	int disk = openDiskEx(argv[optind], 0, flags);
+	if(disk < 0) {
+		fprintf(stderr, "tfs_resync: can't open %s (%d)\n", argv[optind], disk);
+		return 1;
+	}
+	int replica = atoi(argv[optind + 1]);
+	int copied = diskResync(disk, replica);
+	if(closeDisk(disk) != 0 && copied >= 0) copied = DISK_CLOSE_ERR;
+	if(copied < 0) {
+		fprintf(stderr, "tfs_resync: resyncing replica %d failed (%d)\n", replica, copied);
+		return 1;
+	}
+	printf("replica %d: %d blocks copied\n", replica, copied);
+	return 0;
+}
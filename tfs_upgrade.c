@@ -0,0 +1,66 @@
+/*
+ *
+ * tfs_upgrade.c : brings an image made by an older version up to the
+ * current on disk format, in place
+ *
+ * usage: tfs_upgrade [-6] [-b] [-l] <image>
+ *   -6  64 bit file sizes (what tfs_mkfs64 makes)
+ *   -b  free space bitmap instead of the free chain
+ *   -l  log-structured allocation, implies -b
+ *
+ * without flags it only adds the root directory to flat images and records
+ * the format version. run it on an unmounted image, fsck it first.
+ *
+ * exit status: 0 ok, 1 error
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+
+//features and version out of the superblock, -1 if it can't be read
+static int read_sb(char *image, superblock_disk *sb) {
+	int disk = openDisk(image, 0);
+	if(disk < 0) return -1;
+	int rc = readBlock(disk, SUPERBLOCK_BLOCK, sb);
+	closeDisk(disk);
+	return rc != 0 || sb->magic != MAGIC || sb->blocktype != SUPERBLOCK ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+	int flags = 0, opt;
+	while((opt = getopt(argc, argv, "6bl")) != -1) {
+		switch(opt) {
+		case '6': flags |= TFS_MKFS_64; break;
+		case 'b': flags |= TFS_MKFS_BITMAP; break;
+		case 'l': flags |= TFS_MKFS_LOG; break;
+		default:
+			fprintf(stderr, "usage: %s [-6] [-b] [-l] <image>\n", argv[0]);
+			return 1;
+		}
+	}
+	if(optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-6] [-b] [-l] <image>\n", argv[0]);
+		return 1;
+	}
+	superblock_disk before, after;
+	if(read_sb(argv[optind], &before) != 0) {
+		fprintf(stderr, "tfs_upgrade: %s isn't a TinyFS image\n", argv[optind]);
+		return 1;
+	}
+	int rc = tfs_upgrade(argv[optind], flags);
+	if(rc < 0) {
+		fprintf(stderr, "tfs_upgrade: upgrading %s failed (%d)\n", argv[optind], rc);
+		return 1;
+	}
+	read_sb(argv[optind], &after);
+	printf("%s: version %d -> %d, features %#x -> %#x\n", argv[optind],
+	       before.version, after.version, before.features, after.features);
+	return 0;
+}
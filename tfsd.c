@@ -0,0 +1,449 @@
+/*
+ *
+ * tfsd.c : tinyFS server daemon
+ *
+ * mounts an image and serves it to other processes over a unix domain
+ * socket, so they share this process's mount instead of each linking
+ * libTinyFS and fighting over the image file.
+ *
+ * usage: tfsd [-d] <socket> <image> [<socket> <image> ...]
+ *   -d  mount the images O_DIRECT, so many of them don't crowd the page cache
+ *
+ * libTinyFS only mounts one disk per process, so every socket/image pair
+ * gets its own forked server process. each server is a single threaded
+ * epoll loop. all requests that arrive in one read are run back to back
+ * and their replies go out in a single write (see tfsProto.h). once no
+ * request has come in for a second the loop runs the segment cleaner of
+ * log-structured images a slice at a time, until it has nothing left to do.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "tinyFS.h"
+#include "tfsProto.h"
+
+#define MAX_EVENTS 64
+#define READ_CHUNK 65536
+//replies queued for one client before its requests stop being read, so a
+//client that pipelines reads and never drains its socket can't grow us
+#define OUT_MAX (4 * 1024 * 1024)
+//idle time before tfs_cleanLog runs, and how much one slice of it may do
+#define IDLE_MS 1000
+#define CLEAN_SEGMENTS 16
+#define CLEAN_MS 50
+
+typedef struct conn {
+	int sock;
+	char *in;		//bytes read but not yet parsed into requests
+	size_t inLen, inCap;
+	char *out;		//replies waiting to be written
+	size_t outLen, outCap, outOff;
+	int *fds;		//tinyFS fds this client opened
+	int nfds, capfds;
+	struct conn *next;
+} conn;
+
+static conn *conns = NULL;
+//who opened each tinyFS fd and which file it is. every open gets its own fd
+//(TFS_OPEN_NEWFD) so a client's file pointer is never moved by another one,
+//the inode block is what lets a delete reach the other clients' fds, however
+//they spelled the path and whatever it was renamed to since
+typedef struct fd_owner {
+	conn *c;
+	int inode;
+} fd_owner;
+static fd_owner *fdOwners = NULL;
+static int fdOwnersCap = 0;
+static volatile sig_atomic_t stopping = 0;
+static int mountFlags = 0;
+
+static void on_signal(int sig) {
+	(void)sig;
+	stopping = 1;
+}
+
+static int grow(char **buf, size_t *cap, size_t need) {
+	if(need <= *cap) return 0;
+	size_t ncap = *cap ? *cap : 4096;
+	while(ncap < need) ncap *= 2;
+	char *nb = realloc(*buf, ncap);
+	if(!nb) return -1;
+	*buf = nb;
+	*cap = ncap;
+	return 0;
+}
+
+static int conn_holds(conn *c, int fd) {
+	return fd >= 0 && fd < fdOwnersCap && fdOwners[fd].c == c;
+}
+
+static int conn_hold(conn *c, int fd) {
+	tfsFileInfo info;
+	if(tfs_readFileInfo(fd, &info) != TFS_SUCCESS) return -1;
+	if(fd >= fdOwnersCap) {
+		int ncap = fdOwnersCap ? fdOwnersCap : 32;
+		while(ncap <= fd) ncap *= 2;
+		fd_owner *no = realloc(fdOwners, ncap * sizeof(fd_owner));
+		if(!no) return -1;
+		memset(no + fdOwnersCap, 0, (ncap - fdOwnersCap) * sizeof(fd_owner));
+		fdOwners = no;
+		fdOwnersCap = ncap;
+	}
+	if(c->nfds == c->capfds) {
+		int ncap = c->capfds ? c->capfds * 2 : 8;
+		int *nf = realloc(c->fds, ncap * sizeof(int));
+		if(!nf) return -1;
+		c->fds = nf;
+		c->capfds = ncap;
+	}
+	c->fds[c->nfds++] = fd;
+	fdOwners[fd].c = c;
+	fdOwners[fd].inode = info.inode_block;
+	return 0;
+}
+
+//drops fd from c's list, the tinyFS side is up to the caller
+static void conn_forget(conn *c, int fd) {
+	for(int i = 0; i < c->nfds; i++) {
+		if(c->fds[i] != fd) continue;
+		c->fds[i] = c->fds[--c->nfds];
+		break;
+	}
+	fdOwners[fd].c = NULL;
+}
+
+static void conn_release(conn *c, int fd) {
+	conn_forget(c, fd);
+	tfs_closeFile(fd);
+}
+
+//after a delete every fd on the file is gone, not just the caller's
+static void forget_inode(int inode) {
+	for(int fd = 0; fd < fdOwnersCap; fd++) {
+		if(fdOwners[fd].c && fdOwners[fd].inode == inode) {
+			conn_forget(fdOwners[fd].c, fd);
+		}
+	}
+}
+
+//copies a non terminated wire path into name, -1 if too long. each part of
+//it is checked by libTinyFS
+static int wire_name(const char *payload, uint32_t len, char name[TFSP_MAX_PATH + 1]) {
+	if(len == 0 || len > TFSP_MAX_PATH) return -1;
+	memcpy(name, payload, len);
+	name[len] = '\0';
+	return 0;
+}
+
+//reserves room for a reply with len payload bytes and fills in the header
+static char *reply(conn *c, const tfsp_req *req, int32_t rc, uint32_t len) {
+	if(grow(&c->out, &c->outCap, c->outLen + sizeof(tfsp_resp) + len) < 0) return NULL;
+	tfsp_resp resp = {0};
+	resp.magic = TFSP_MAGIC;
+	resp.op = req->op;
+	resp.seq = req->seq;
+	resp.rc = rc;
+	resp.len = len;
+	memcpy(c->out + c->outLen, &resp, sizeof(resp));
+	c->outLen += sizeof(resp) + len;
+	return c->out + c->outLen - len;
+}
+
+static int dispatch(conn *c, const tfsp_req *req, const char *payload) {
+	char name[TFSP_MAX_PATH + 1];
+	int rc;
+
+	//everything but open and readdir acts on an fd this client owns
+	if(req->op != TFSP_OPEN && req->op != TFSP_READDIR && !conn_holds(c, req->fd)) {
+		return reply(c, req, ERR_FD_INVALID, 0) ? 0 : -1;
+	}
+
+	switch(req->op) {
+	case TFSP_OPEN:
+		if(wire_name(payload, req->len, name) < 0) {
+			rc = ERR_FILE_NAME;
+		}else{
+			rc = tfs_openFileEx(name, TFS_OPEN_NEWFD);
+			if(rc >= 0 && conn_hold(c, rc) < 0) {
+				tfs_closeFile(rc);
+				return -1;
+			}
+		}
+		break;
+	case TFSP_CLOSE:
+		conn_release(c, req->fd);
+		rc = TFS_SUCCESS;
+		break;
+	case TFSP_WRITE:
+		rc = tfs_writeFile(req->fd, (char *)payload, req->len);
+		break;
+	case TFSP_READ: {
+		int max = req->arg;
+		if(max < 0) max = 0;
+		if(max > TFSP_MAX_PAYLOAD) max = TFSP_MAX_PAYLOAD;
+		char *data = reply(c, req, 0, max);
+		if(!data) return -1;
+		rc = tfs_readFile(req->fd, data, max);
+		//shrink the reply down to what was actually read
+		tfsp_resp *resp = (tfsp_resp *)(data - sizeof(tfsp_resp));
+		resp->rc = rc;
+		resp->len = rc > 0 ? rc : 0;
+		c->outLen -= max - resp->len;
+		return 0;
+	}
+	case TFSP_SEEK:
+		rc = tfs_seek(req->fd, req->arg);
+		break;
+	case TFSP_DELETE: {
+		int inode = fdOwners[req->fd].inode;
+		rc = tfs_deleteFile(req->fd);
+		if(rc == TFS_SUCCESS) forget_inode(inode);
+		break;
+	}
+	case TFSP_READDIR: {
+		int max = req->arg;
+		if(max < 0) max = 0;
+		if(max > TFSP_MAX_PAYLOAD / (int)sizeof(tfsp_dirent)) {
+			max = TFSP_MAX_PAYLOAD / sizeof(tfsp_dirent);
+		}
+		tfsFileInfo *infos = malloc((max ? max : 1) * sizeof(tfsFileInfo));
+		if(!infos) return -1;
+		rc = tfs_readdirInfo(infos, max);
+		int n = rc < 0 ? 0 : (rc < max ? rc : max);
+		tfsp_dirent *ents = (tfsp_dirent *)reply(c, req, rc, n * sizeof(tfsp_dirent));
+		if(!ents) { free(infos); return -1; }
+		for(int i = 0; i < n; i++) {
+			memset(&ents[i], 0, sizeof(ents[i]));
+			memcpy(ents[i].name, infos[i].name, sizeof(ents[i].name));
+			ents[i].size_B = infos[i].size_B;
+			ents[i].inode_block = infos[i].inode_block;
+			ents[i].ctime = infos[i].ctime;
+			ents[i].mtime = infos[i].mtime;
+			ents[i].atime = infos[i].atime;
+		}
+		free(infos);
+		return 0;
+	}
+	case TFSP_RENAME:
+		if(wire_name(payload, req->len, name) < 0) {
+			rc = ERR_FILE_NAME;
+		}else{
+			rc = tfs_rename(req->fd, name);
+		}
+		break;
+	default:
+		rc = ERR_FS_INVALID;
+		break;
+	}
+	return reply(c, req, rc, 0) ? 0 : -1;
+}
+
+//runs every complete request sitting in the input buffer, stopping early once
+//OUT_MAX of replies are waiting. 1 = stopped there, 0 = all run
+static int process_input(conn *c) {
+	size_t off = 0;
+	int full = 0;
+	while(c->inLen - off >= sizeof(tfsp_req)) {
+		if(c->outLen >= OUT_MAX) { full = 1; break; }
+		tfsp_req req;
+		memcpy(&req, c->in + off, sizeof(req));
+		if(req.magic != TFSP_MAGIC || req.len > TFSP_MAX_PAYLOAD) return -1;
+		if(c->inLen - off - sizeof(req) < req.len) break; //payload still coming
+		if(dispatch(c, &req, c->in + off + sizeof(req)) < 0) return -1;
+		off += sizeof(req) + req.len;
+	}
+	memmove(c->in, c->in + off, c->inLen - off);
+	c->inLen -= off;
+	return full;
+}
+
+//writes as much queued output as the socket takes. 1 = drained, 0 = more left
+static int flush_output(conn *c) {
+	while(c->outOff < c->outLen) {
+		ssize_t n = write(c->sock, c->out + c->outOff, c->outLen - c->outOff);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		c->outOff += n;
+	}
+	c->outOff = c->outLen = 0;
+	return 1;
+}
+
+static void conn_close(int ep, conn *c) {
+	epoll_ctl(ep, EPOLL_CTL_DEL, c->sock, NULL);
+	close(c->sock);
+	while(c->nfds > 0) conn_release(c, c->fds[c->nfds - 1]);
+	for(conn **p = &conns; *p; p = &(*p)->next) {
+		if(*p == c) { *p = c->next; break; }
+	}
+	free(c->in);
+	free(c->out);
+	free(c->fds);
+	free(c);
+}
+
+static void conn_event(int ep, conn *c, uint32_t events) {
+	if(events & (EPOLLHUP | EPOLLERR)) {
+		conn_close(ep, c);
+		return;
+	}
+	if(events & EPOLLIN) {
+		if(grow(&c->in, &c->inCap, c->inLen + READ_CHUNK) < 0) { conn_close(ep, c); return; }
+		ssize_t n = read(c->sock, c->in + c->inLen, READ_CHUNK);
+		if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			conn_close(ep, c);
+			return;
+		}
+		if(n > 0) c->inLen += n;
+	}
+	//requests held back while the replies were full run as soon as they drain
+	int full, drained;
+	do {
+		full = process_input(c);
+		if(full < 0 || (drained = flush_output(c)) < 0) { conn_close(ep, c); return; }
+	} while(full && drained);
+	//with replies backed up only EPOLLOUT is asked for, reading resumes once
+	//the client has taken them
+	struct epoll_event ev = {0};
+	ev.events = (full ? 0 : EPOLLIN) | (drained ? 0 : EPOLLOUT);
+	ev.data.ptr = c;
+	epoll_ctl(ep, EPOLL_CTL_MOD, c->sock, &ev);
+}
+
+static int listen_on(const char *path) {
+	int s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(s < 0) return -1;
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path)) { close(s); return -1; }
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(s, 128) < 0) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static int serve(const char *path, char *image) {
+	int rc = tfs_mountEx(image, mountFlags);
+	if(rc < 0) {
+		fprintf(stderr, "tfsd: mount %s failed: %d\n", image, rc);
+		return 1;
+	}
+	int ls = listen_on(path);
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	if(ls < 0 || ep < 0) {
+		perror("tfsd: listen");
+		tfs_unmount();
+		return 1;
+	}
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; //NULL marks the listening socket
+	epoll_ctl(ep, EPOLL_CTL_ADD, ls, &ev);
+	printf("tfsd: serving %s on %s\n", image, path);
+
+	struct epoll_event events[MAX_EVENTS];
+	int idle = IDLE_MS;
+	while(!stopping) {
+		int n = epoll_wait(ep, events, MAX_EVENTS, idle);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+		if(n == 0) {
+			//0 on images that aren't log-structured too, the loop goes back to waiting
+			if(tfs_cleanLog(CLEAN_SEGMENTS, CLEAN_MS) <= 0) idle = -1;
+			continue;
+		}
+		idle = IDLE_MS;
+		for(int i = 0; i < n; i++) {
+			conn *c = events[i].data.ptr;
+			if(c) {
+				conn_event(ep, c, events[i].events);
+				continue;
+			}
+			int s;
+			while((s = accept4(ls, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				c = calloc(1, sizeof(conn));
+				if(!c) { close(s); continue; }
+				c->sock = s;
+				c->next = conns;
+				conns = c;
+				struct epoll_event cev = {0};
+				cev.events = EPOLLIN;
+				cev.data.ptr = c;
+				epoll_ctl(ep, EPOLL_CTL_ADD, s, &cev);
+			}
+		}
+	}
+	while(conns) conn_close(ep, conns);
+	close(ep);
+	close(ls);
+	unlink(path);
+	tfs_unmount();
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if(argc > 1 && strcmp(argv[1], "-d") == 0) {
+		mountFlags |= TFS_MOUNT_DIRECT;
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	}
+	if(argc < 3 || (argc - 1) % 2 != 0) {
+		fprintf(stderr, "usage: %s [-d] <socket> <image> [<socket> <image> ...]\n", argv[0]);
+		return 1;
+	}
+	struct sigaction sa = {0};
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	int pairs = (argc - 1) / 2;
+	if(pairs == 1) return serve(argv[1], argv[2]);
+
+	//one process per image, each with its own mount
+	pid_t *pids = calloc(pairs, sizeof(pid_t));
+	if(!pids) return 1;
+	for(int i = 0; i < pairs; i++) {
+		pids[i] = fork();
+		if(pids[i] < 0) { perror("tfsd: fork"); break; }
+		if(pids[i] == 0) return serve(argv[1 + 2 * i], argv[2 + 2 * i]);
+	}
+	int status = 0, failed = 0, forwarded = 0;
+	while(1) {
+		if(wait(&status) < 0) {
+			if(errno != EINTR) break;
+			//pass the shutdown on to every image server
+			if(stopping && !forwarded) {
+				for(int i = 0; i < pairs; i++) {
+					if(pids[i] > 0) kill(pids[i], SIGTERM);
+				}
+				forwarded = 1;
+			}
+			continue;
+		}
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+	}
+	free(pids);
+	return failed;
+}